@@ -0,0 +1,98 @@
+#pragma once
+
+#include <inttypes.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// ................................................................................ CoarseClock ....
+
+/**
+ * @class Millisecond clock kept by a ticker thread
+ *
+ * While started, a ticker thread wakes up every resolution and publishes the monotonic time, the
+ * wall time and a timestamp preformatted as the logger prints it (" %d/%m/%y %T ", local time).
+ * NowInMilliSec and WallInMilliSec are one load of a line only the ticker writes. Timestamp
+ * copies the string under a sequence lock, which changes once a second.
+ *
+ * NowInMilliSec is CLOCK_MONOTONIC, like Time::NowInMilliSec, and may lag it by up to the
+ * resolution (more if the ticker is not scheduled in time). While stopped, the calls read the
+ * clocks themselves.
+ */
+class CoarseClock
+{
+public:
+
+	static const uint32_t DEFAULT_RESOLUTION_MS = 1;
+	static const size_t STAMP_WORDS = 4;
+
+	/**
+	 * Start the ticker, false if it is running already.
+	 */
+	static bool Start(const uint32_t resolutionms = DEFAULT_RESOLUTION_MS);
+
+	/**
+	 * Stop the ticker and wait for it to exit.
+	 */
+	static void Stop();
+
+	static bool IsRunning()
+	{
+		return slot_.ms_.load(memory_order_relaxed);
+	}
+
+	static uint64_t NowInMilliSec()
+	{
+		const uint64_t ms = slot_.ms_.load(memory_order_relaxed);
+		return ms ? ms : Time::NowInMilliSec();
+	}
+
+	/**
+	 * Milliseconds since the epoch
+	 */
+	static uint64_t WallInMilliSec()
+	{
+		const uint64_t ms = slot_.wallms_.load(memory_order_relaxed);
+		return ms ? ms : ReadWallInMilliSec();
+	}
+
+	static time_t WallTime()
+	{
+		return WallInMilliSec() / 1000;
+	}
+
+	static string Timestamp();
+
+	/**
+	 * The timestamp of t as the ticker formats it
+	 */
+	static string FormatTimestamp(const time_t t);
+
+private:
+
+	/*
+	 * Written by the ticker only. The timestamp words are under seq_, odd while the ticker
+	 * writes them.
+	 */
+	struct alignas(64) Slot
+	{
+		atomic<uint64_t> ms_;
+		atomic<uint64_t> wallms_;
+		atomic<uint64_t> seq_;
+		atomic<uint64_t> stamp_[STAMP_WORDS];
+	};
+
+	static uint64_t ReadWallInMilliSec();
+	static void Publish(time_t & lastsec);
+	static void * Tick(void *);
+
+	static Slot slot_;
+};
+
+}
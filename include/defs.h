@@ -8,6 +8,8 @@
 
 #define ALIGNED(x) __attribute__((aligned(sizeof(x))))
 
+#define CACHELINE_SIZE 64
+
 #if defined(DEBUG_BUILD)
 #define DEBUG(path) LogMessage(Logger::LEVEL_DEBUG, path)
 #else
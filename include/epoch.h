@@ -0,0 +1,197 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <vector>
+
+#include "logger.h"
+#include "perfcounter.h"
+#include "thread-record.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// ................................................................................ EpochRecord ....
+
+/**
+ * Per thread epoch state.
+ *
+ * When a thread exits its record is released and the next thread to register adopts it along
+ * with any garbage still in limbo.
+ */
+struct EpochRecord : ThreadRecord<EpochRecord>
+{
+	typedef void (*deleter_t)(void *);
+
+	struct Garbage
+	{
+		void * ptr_;
+		deleter_t deleter_;
+	};
+
+	static const int NLIMBO = 3;
+
+	EpochRecord()
+		: state_(0)
+		, depth_(0)
+		, nretired_(0)
+		, size_(0)
+	{
+		for (int i = 0; i < NLIMBO; ++i) {
+			limboEpoch_[i] = 0;
+		}
+	}
+
+	/*
+	 * Shared state, read by threads trying to advance the epoch
+	 */
+	atomic<uint64_t> state_;	// (local epoch << 1) | ACTIVE
+
+	/*
+	 * Owner only state
+	 */
+	uint32_t depth_;
+	uint64_t nretired_;
+	size_t size_;
+	vector<Garbage> limbo_[NLIMBO];
+	uint64_t limboEpoch_[NLIMBO];
+
+	char pad_[CACHELINE_SIZE];
+};
+
+// ...................................................................................... Epoch ....
+
+/**
+ * @class Epoch based memory reclamation
+ *
+ * Readers bracket access to shared lock-free structures with Enter/Exit (or EpochGuard). Writers
+ * unlink nodes and hand them to Retire, which parks them in the limbo list of the current epoch.
+ * The global epoch advances only when every thread inside a critical region has observed it, so
+ * garbage retired in epoch e can be freed once the global epoch reaches e + 2.
+ *
+ * Threads are registered from ThreadCtx::Init and unregistered when they exit, cancelled ones
+ * too, which leaves any critical region they were in. Enter and Exit touch only the calling
+ * thread's record; scanning other threads happens on every RECLAIM_INTERVAL retires.
+ */
+class Epoch
+{
+public:
+
+	static const uint64_t ACTIVE = 0x1;
+	static const uint64_t RECLAIM_INTERVAL = 64;
+
+	static void Register();
+	static void Unregister();
+
+	static bool IsRegistered()
+	{
+		return rec_;
+	}
+
+	static void Enter()
+	{
+		EpochRecord * rec = rec_;
+		ASSERT(rec);
+
+		if (rec->depth_++) return;
+
+		rec->state_.store((epoch_.load(memory_order_relaxed) << 1) | ACTIVE,
+				  memory_order_relaxed);
+
+		/*
+		 * The local epoch has to be visible before we read any shared pointer, else a thread
+		 * advancing the epoch can miss us
+		 */
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+
+	static void Exit()
+	{
+		EpochRecord * rec = rec_;
+		ASSERT(rec);
+		ASSERT(rec->depth_);
+
+		if (--rec->depth_) return;
+
+		rec->state_.store(rec->state_.load(memory_order_relaxed) & ~ACTIVE,
+				  memory_order_release);
+	}
+
+	template<class T>
+	static void Retire(T * t)
+	{
+		Retire((void *) t, &Delete<T>);
+	}
+
+	static void Retire(void * ptr, EpochRecord::deleter_t deleter);
+
+	/**
+	 * Try to move the global epoch forward. Fails if any thread is still in a critical region
+	 * of an older epoch.
+	 */
+	static bool TryAdvance();
+
+	/**
+	 * Free the calling thread's garbage that is no longer visible to any reader.
+	 *
+	 * @returns	number of objects freed
+	 */
+	static size_t Reclaim();
+
+	static uint64_t Now()
+	{
+		return epoch_.load();
+	}
+
+	static size_t LimboSize()
+	{
+		ASSERT(rec_);
+		return rec_->size_;
+	}
+
+private:
+
+	template<class T>
+	static void Delete(void * ptr)
+	{
+		delete (T *) ptr;
+	}
+
+	static size_t Reclaim(EpochRecord * rec, const uint64_t epoch);
+	static size_t Free(EpochRecord * rec, const int idx);
+
+	typedef ThreadRecordList<EpochRecord> records_t;
+
+	static __thread EpochRecord * rec_;
+	static atomic<uint64_t> epoch_;
+
+	static string log_;
+
+	static PerfCounter statAdvance_;
+	static PerfCounter statLimbo_;
+};
+
+// ................................................................................. EpochGuard ....
+
+class EpochGuard
+{
+public:
+
+	EpochGuard()
+	{
+		Epoch::Enter();
+	}
+
+	~EpochGuard()
+	{
+		Epoch::Exit();
+	}
+
+private:
+
+	EpochGuard(const EpochGuard &);
+	EpochGuard & operator=(const EpochGuard &);
+};
+
+}
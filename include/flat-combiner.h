@@ -0,0 +1,203 @@
+#pragma once
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <atomic>
+#include <utility>
+
+#include "logger.h"
+#include "perfcounter.h"
+#include "sysconf.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// ............................................................................ FlatCombiner<T> ....
+
+/**
+ * @class Flat combining wrapper for a shared structure
+ *
+ * Instead of every thread taking a lock and touching the structure, threads publish their
+ * operation in a slot of a publication array. Whichever thread wins the combiner lock runs all the
+ * published operations in one pass and hands back the results, so the structure (and the lock)
+ * stay in the cache of a single core. Best suited for short critical sections with contention from
+ * every core.
+ *
+ * The operation is any callable taking T &. It runs on the combiner thread, and the calling thread
+ * is blocked until it completes, so capturing locals by reference is safe.
+ *
+ * Usage : FlatCombiner<priority_queue<int>> pq("/pending-io");
+ *         pq.Execute([&](priority_queue<int> & q) { q.push(10); });
+ */
+template<class T>
+class FlatCombiner
+{
+public:
+
+	/*
+	 * Number of passes over the publication array per combine. Operations published while
+	 * combining get picked up by the later passes.
+	 */
+	static const int NPASSES = 2;
+
+	/*
+	 * Spin before yielding the core while waiting for the combiner
+	 */
+	static const int SPIN_COUNT = 64;
+
+	template<class... Args>
+	explicit FlatCombiner(const string & name, Args && ... args)
+		: t_(forward<Args>(args)...)
+		, nslots_(2 * SysConf::NumCores())
+		, combining_(false)
+		, statBatch_("/flatcombiner" + name + "/batch", "ops", PerfCounter::COUNTER)
+	{
+		void * mem;
+		int status = posix_memalign(&mem, CACHELINE_SIZE, nslots_ * sizeof(Slot));
+		INVARIANT(!status);
+
+		slots_ = (Slot *) mem;
+		for (size_t i = 0; i < nslots_; ++i) {
+			new (&slots_[i]) Slot();
+		}
+	}
+
+	~FlatCombiner()
+	{
+		for (size_t i = 0; i < nslots_; ++i) {
+			INVARIANT(slots_[i].state_.load() == FREE);
+			slots_[i].~Slot();
+		}
+
+		::free(slots_);
+	}
+
+	/**
+	 * Run fn(T &) under mutual exclusion with every other operation on the structure.
+	 */
+	template<class Fn>
+	void Execute(Fn & fn)
+	{
+		Slot & slot = Publish(&Invoke<Fn>, &fn);
+
+		int spin = 0;
+		while (slot.state_.load(memory_order_acquire) != DONE) {
+			if (!combining_.load(memory_order_relaxed)
+			    && !combining_.exchange(true, memory_order_acquire)) {
+				Combine();
+				combining_.store(false, memory_order_release);
+				continue;
+			}
+
+			if (++spin < SPIN_COUNT) {
+				__builtin_ia32_pause();
+			} else {
+				spin = 0;
+				sched_yield();
+			}
+		}
+
+		slot.state_.store(FREE, memory_order_release);
+	}
+
+	template<class Fn>
+	void Execute(const Fn & fn)
+	{
+		Fn tmp(fn);
+		Execute(tmp);
+	}
+
+	/**
+	 * Direct access to the structure, only safe when there are no concurrent operations.
+	 */
+	T & Unsafe()
+	{
+		return t_;
+	}
+
+private:
+
+	typedef void (*op_t)(T &, void *);
+
+	enum
+	{
+		FREE = 0,
+		CLAIMED,
+		PENDING,
+		DONE,
+	};
+
+	struct Slot
+	{
+		Slot() : state_(FREE), op_(NULL), arg_(NULL) {}
+
+		atomic<int> state_;
+		op_t op_;
+		void * arg_;
+	} __attribute__((aligned(CACHELINE_SIZE)));
+
+	template<class Fn>
+	static void Invoke(T & t, void * arg)
+	{
+		(*(Fn *) arg)(t);
+	}
+
+	/*
+	 * Each thread starts its search for a free slot at its own offset, so slots are normally
+	 * claimed on the first attempt
+	 */
+	static size_t Hint()
+	{
+		static atomic<size_t> next(/*val=*/ 0);
+		static thread_local size_t hint = next.fetch_add(/*val=*/ 1);
+		return hint;
+	}
+
+	Slot & Publish(op_t op, void * arg)
+	{
+		for (size_t i = Hint();; ++i) {
+			Slot & slot = slots_[i % nslots_];
+
+			int state = FREE;
+			if (slot.state_.load(memory_order_relaxed) == FREE
+			    && slot.state_.compare_exchange_strong(state, CLAIMED,
+								   memory_order_relaxed)) {
+				slot.op_ = op;
+				slot.arg_ = arg;
+				slot.state_.store(PENDING, memory_order_release);
+				return slot;
+			}
+
+			if (i % nslots_ == nslots_ - 1) sched_yield();
+		}
+	}
+
+	void Combine()
+	{
+		uint32_t nops = 0;
+
+		for (int pass = 0; pass < NPASSES; ++pass) {
+			for (size_t i = 0; i < nslots_; ++i) {
+				Slot & slot = slots_[i];
+				if (slot.state_.load(memory_order_acquire) != PENDING) continue;
+
+				slot.op_(t_, slot.arg_);
+				slot.state_.store(DONE, memory_order_release);
+				++nops;
+			}
+		}
+
+		statBatch_.Update(nops);
+	}
+
+	T t_;
+	const size_t nslots_;
+	Slot * slots_;
+	char pad_[CACHELINE_SIZE];
+	atomic<bool> combining_;
+	PerfCounter statBatch_;
+};
+
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <vector>
+
+#include "logger.h"
+#include "perfcounter.h"
+#include "thread-record.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// ............................................................................... HazardRecord ....
+
+/**
+ * Per thread hazard pointer slots.
+ *
+ * An exiting thread clears its slots and releases the record; the next thread to register adopts
+ * it along with its pending retired list.
+ */
+struct HazardRecord : ThreadRecord<HazardRecord>
+{
+	typedef void (*deleter_t)(void *);
+
+	struct Garbage
+	{
+		void * ptr_;
+		deleter_t deleter_;
+	};
+
+	static const int NSLOTS = 4;
+
+	HazardRecord()
+	{
+		for (int i = 0; i < NSLOTS; ++i) {
+			slots_[i].store(NULL);
+		}
+	}
+
+	/*
+	 * Shared state, read by scanning threads
+	 */
+	atomic<void *> slots_[NSLOTS];
+
+	/*
+	 * Owner only state
+	 */
+	vector<Garbage> retired_;
+
+	char pad_[CACHELINE_SIZE];
+};
+
+// ..................................................................................... Hazard ....
+
+/**
+ * @class Hazard pointer based memory reclamation
+ *
+ * A reader publishes the pointer it is about to dereference in one of its hazard slots via
+ * Protect. Retired nodes are freed by Scan only if no thread has them published, so garbage is
+ * bounded by the number of slots irrespective of how long a reader holds on to a pointer (unlike
+ * Epoch, where one descheduled reader pins everything retired after it).
+ *
+ * Scan is amortized: it runs once the thread's retired list grows past twice the total number
+ * of hazard slots in the system.
+ */
+class Hazard
+{
+public:
+
+	static const int NSLOTS = HazardRecord::NSLOTS;
+	static const size_t SCAN_THRESHOLD_MIN = 64;
+
+	static void Register();
+	static void Unregister();
+
+	static bool IsRegistered()
+	{
+		return rec_;
+	}
+
+	/**
+	 * Load src and publish it in slot. The returned pointer is safe to dereference until the
+	 * slot is cleared or reused.
+	 */
+	template<class T>
+	static T * Protect(const int slot, const atomic<T *> & src)
+	{
+		HazardRecord * rec = rec_;
+		ASSERT(rec);
+		ASSERT(slot >= 0 && slot < NSLOTS);
+
+		T * ptr = src.load(memory_order_relaxed);
+		while (true) {
+			rec->slots_[slot].store((void *) ptr, memory_order_relaxed);
+
+			/*
+			 * Publish the hazard before validating, else a concurrent scan can miss it
+			 */
+			atomic_thread_fence(memory_order_seq_cst);
+
+			T * tmp = src.load(memory_order_acquire);
+			if (tmp == ptr) return ptr;
+			ptr = tmp;
+		}
+	}
+
+	static void Clear(const int slot)
+	{
+		ASSERT(rec_);
+		ASSERT(slot >= 0 && slot < NSLOTS);
+		rec_->slots_[slot].store(NULL, memory_order_release);
+	}
+
+	template<class T>
+	static void Retire(T * t)
+	{
+		Retire((void *) t, &Delete<T>);
+	}
+
+	static void Retire(void * ptr, HazardRecord::deleter_t deleter);
+
+	/**
+	 * Free the calling thread's retired objects that are not published by any thread.
+	 *
+	 * @returns	number of objects freed
+	 */
+	static size_t Scan();
+
+	static size_t RetiredSize()
+	{
+		ASSERT(rec_);
+		return rec_->retired_.size();
+	}
+
+private:
+
+	template<class T>
+	static void Delete(void * ptr)
+	{
+		delete (T *) ptr;
+	}
+
+	static size_t ScanThreshold()
+	{
+		const size_t nslots = NSLOTS * records_t::Size();
+		return 2 * nslots > SCAN_THRESHOLD_MIN ? 2 * nslots : SCAN_THRESHOLD_MIN;
+	}
+
+	typedef ThreadRecordList<HazardRecord> records_t;
+
+	static __thread HazardRecord * rec_;
+
+	static string log_;
+
+	static PerfCounter statScan_;
+	static PerfCounter statRetired_;
+};
+
+// ................................................................................ HazardGuard ....
+
+/**
+ * Scoped ownership of a hazard slot, cleared on destruction.
+ */
+class HazardGuard
+{
+public:
+
+	explicit HazardGuard(const int slot)
+		: slot_(slot)
+	{}
+
+	~HazardGuard()
+	{
+		Hazard::Clear(slot_);
+	}
+
+	template<class T>
+	T * Protect(const atomic<T *> & src)
+	{
+		return Hazard::Protect(slot_, src);
+	}
+
+private:
+
+	HazardGuard(const HazardGuard &);
+	HazardGuard & operator=(const HazardGuard &);
+
+	const int slot_;
+};
+
+}
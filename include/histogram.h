@@ -0,0 +1,263 @@
+#pragma once
+
+#include <inttypes.h>
+#include <math.h>
+#include <atomic>
+#include <memory>
+
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// .................................................................................. Histogram ....
+
+/**
+ * @class Log-linear (HDR style) histogram
+ *
+ * Values are kept with a fixed number of significant decimal digits over the whole range. The
+ * range is split in power of two buckets, each divided in the same number of linear sub buckets,
+ * so the relative error of any value is at most 10^-digits. Values below the sub bucket count
+ * are exact.
+ *
+ * Record is a handful of arithmetic instructions and a single relaxed add on the value's counter.
+ * RecordLocal is for histograms with a single writer, it does loads and stores only. Histograms
+ * can be merged across threads or time windows, into one of the same or a lower precision.
+ *
+ * Memory is (34 - log2(sub buckets)) * sub buckets / 2 counters, 26KB at 2 digits and 184KB at
+ * 3 digits for 32 bit values.
+ */
+class Histogram
+{
+public:
+
+	static const int DEFAULT_DIGITS = 2;
+	static const int MAX_DIGITS = 3;
+
+	/*
+	 * Largest trackable value is 2^MAX_VALUE_BITS - 1, larger values are clamped
+	 */
+	static const int MAX_VALUE_BITS = 32;
+
+	explicit Histogram(const int digits = DEFAULT_DIGITS)
+		: digits_(digits)
+		, subBits_(SubBucketBits(digits))
+		, subHalf_(1ULL << (subBits_ - 1))
+		, size_((MAX_VALUE_BITS + 2 - subBits_) * subHalf_)
+		, counts_(new atomic<uint64_t>[size_])
+	{
+		Reset();
+	}
+
+	Histogram(const Histogram & rhs)
+		: digits_(rhs.digits_)
+		, subBits_(rhs.subBits_)
+		, subHalf_(rhs.subHalf_)
+		, size_(rhs.size_)
+		, counts_(new atomic<uint64_t>[size_])
+	{
+		Reset();
+		Merge(rhs);
+	}
+
+	void Record(const uint64_t val)
+	{
+		counts_[Index(val)].fetch_add(/*val=*/ 1, memory_order_relaxed);
+		count_.fetch_add(/*val=*/ 1, memory_order_relaxed);
+		sum_.fetch_add(val, memory_order_relaxed);
+
+		uint64_t max = max_.load(memory_order_relaxed);
+		while (val > max && !max_.compare_exchange_weak(max, val, memory_order_relaxed));
+
+		uint64_t min = min_.load(memory_order_relaxed);
+		while (val < min && !min_.compare_exchange_weak(min, val, memory_order_relaxed));
+	}
+
+	/**
+	 * Record from the only thread writing to this histogram.
+	 */
+	void RecordLocal(const uint64_t val)
+	{
+		Add(counts_[Index(val)], /*val=*/ 1);
+		Add(count_, /*val=*/ 1);
+		Add(sum_, val);
+
+		if (val > max_.load(memory_order_relaxed)) max_.store(val, memory_order_relaxed);
+		if (val < min_.load(memory_order_relaxed)) min_.store(val, memory_order_relaxed);
+	}
+
+	/**
+	 * Add the counts of rhs, which must have the same or a higher precision.
+	 *
+	 * Counters of a higher precision are re-bucketed. Buckets are power of two aligned ranges, so
+	 * each of them falls entirely within one of ours.
+	 */
+	void Merge(const Histogram & rhs)
+	{
+		INVARIANT(rhs.digits_ >= digits_);
+
+		const bool isSame = rhs.digits_ == digits_;
+		for (size_t i = 0; i < rhs.size_; ++i) {
+			const uint64_t count = rhs.counts_[i].load(memory_order_relaxed);
+			if (!count) continue;
+
+			counts_[isSame ? i : Index(rhs.LowValue(i))].fetch_add(count,
+									       memory_order_relaxed);
+		}
+
+		count_.fetch_add(rhs.count_.load(memory_order_relaxed), memory_order_relaxed);
+		sum_.fetch_add(rhs.sum_.load(memory_order_relaxed), memory_order_relaxed);
+
+		const uint64_t rmax = rhs.max_.load(memory_order_relaxed);
+		uint64_t max = max_.load(memory_order_relaxed);
+		while (rmax > max && !max_.compare_exchange_weak(max, rmax));
+
+		const uint64_t rmin = rhs.min_.load(memory_order_relaxed);
+		uint64_t min = min_.load(memory_order_relaxed);
+		while (rmin < min && !min_.compare_exchange_weak(min, rmin));
+	}
+
+	void Reset()
+	{
+		for (size_t i = 0; i < size_; ++i) {
+			counts_[i].store(0, memory_order_relaxed);
+		}
+
+		count_.store(0, memory_order_relaxed);
+		sum_.store(0, memory_order_relaxed);
+		max_.store(0, memory_order_relaxed);
+		min_.store(UINT64_MAX, memory_order_relaxed);
+	}
+
+	/**
+	 * Value below which q percent of the recorded values fall, reported as the highest value
+	 * equivalent to the bucket it falls in (but never above the max).
+	 */
+	uint64_t Percentile(const double q) const
+	{
+		const uint64_t count = Count();
+		if (!count) return 0;
+
+		uint64_t target = ceil((q / 100) * count);
+		if (!target) target = 1;
+		if (target > count) target = count;
+
+		uint64_t seen = 0;
+		for (size_t i = 0; i < size_; ++i) {
+			seen += counts_[i].load(memory_order_relaxed);
+			if (seen >= target) {
+				const uint64_t high = HighValue(i);
+				return high < Max() ? high : Max();
+			}
+		}
+
+		return Max();
+	}
+
+	uint64_t Count() const
+	{
+		return count_.load(memory_order_relaxed);
+	}
+
+	uint64_t Sum() const
+	{
+		return sum_.load(memory_order_relaxed);
+	}
+
+	uint64_t Max() const
+	{
+		return max_.load(memory_order_relaxed);
+	}
+
+	uint64_t Min() const
+	{
+		return Count() ? min_.load(memory_order_relaxed) : 0;
+	}
+
+	double Mean() const
+	{
+		return Count() ? Sum() / (double) Count() : 0;
+	}
+
+	int Digits() const
+	{
+		return digits_;
+	}
+
+	/**
+	 * Counter index of a value. Values below the sub bucket count map to themselves, above
+	 * that the shift drops the bits beyond the precision.
+	 */
+	size_t Index(uint64_t val) const
+	{
+		const uint64_t maxval = (1ULL << MAX_VALUE_BITS) - 1;
+		if (val > maxval) val = maxval;
+
+		const int msb = 63 - __builtin_clzll(val | ((1ULL << subBits_) - 1));
+		const int shift = msb - (subBits_ - 1);
+		return shift * subHalf_ + (val >> shift);
+	}
+
+	/**
+	 * Range of values sharing the counter at idx.
+	 */
+	uint64_t LowValue(const size_t idx) const
+	{
+		const int shift = Shift(idx);
+		return (idx - shift * subHalf_) << shift;
+	}
+
+	uint64_t HighValue(const size_t idx) const
+	{
+		const int shift = Shift(idx);
+		return ((idx - shift * subHalf_ + 1) << shift) - 1;
+	}
+
+	size_t Size() const
+	{
+		return size_;
+	}
+
+	uint64_t CountAt(const size_t idx) const
+	{
+		return counts_[idx].load(memory_order_relaxed);
+	}
+
+private:
+
+	/*
+	 * Sub buckets needed for the precision, 2 * 10^digits rounded up to a power of two
+	 */
+	static int SubBucketBits(const int digits)
+	{
+		INVARIANT(digits >= 1 && digits <= MAX_DIGITS);
+
+		const uint64_t n = 2 * pow(10, digits);
+		return 64 - __builtin_clzll(n - 1);
+	}
+
+	int Shift(const size_t idx) const
+	{
+		return idx < (1ULL << subBits_) ? 0 : idx / subHalf_ - 1;
+	}
+
+	static void Add(atomic<uint64_t> & v, const uint64_t val)
+	{
+		v.store(v.load(memory_order_relaxed) + val, memory_order_relaxed);
+	}
+
+	Histogram & operator=(const Histogram &);
+
+	const int digits_;
+	const int subBits_;
+	const uint64_t subHalf_;
+	const size_t size_;
+	unique_ptr<atomic<uint64_t>[]> counts_;
+	atomic<uint64_t> count_;
+	atomic<uint64_t> sum_;
+	atomic<uint64_t> max_;
+	atomic<uint64_t> min_;
+};
+
+}
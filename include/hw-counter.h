@@ -0,0 +1,212 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <string>
+
+#include "perfcounter.h"
+
+struct perf_event_mmap_page;
+
+namespace bblocks {
+
+using namespace std;
+
+// ................................................................................. HwCounters ....
+
+/**
+ * @class Per thread group of performance monitoring counters
+ *
+ * Counts cycles, instructions, cache misses and branch misses of the calling thread, in user
+ * mode, as one perf_event_open group so that they are scheduled on the PMU together. When the
+ * kernel allows it (cap_user_rdpmc) the counters are read with rdpmc from user space, without
+ * a system call, otherwise with a read of the group.
+ *
+ * If the hardware events are not available (no PMU, virtualized, perf_event_paranoid) the group
+ * falls back to the software events task clock, page faults, context switches and migrations.
+ * If even those are denied the counters read as zero.
+ */
+class HwCounters
+{
+public:
+
+	enum Mode
+	{
+		NONE = 0,
+		SOFTWARE,
+		HARDWARE,
+	};
+
+	static const int NEVENTS = 4;
+
+	struct Values
+	{
+		Values()
+		{
+			for (int i = 0; i < NEVENTS; ++i) {
+				v_[i] = 0;
+			}
+		}
+
+		uint64_t v_[NEVENTS];
+	};
+
+	~HwCounters();
+
+	/**
+	 * Counters of the calling thread, opened on first use and closed on thread exit.
+	 */
+	static HwCounters & Get();
+
+	/**
+	 * Mode the threads of this process get, probed once.
+	 */
+	static Mode GetMode();
+
+	/**
+	 * Names and units of the events counted in the mode.
+	 */
+	static const char * EventName(const Mode mode, const int event);
+	static const char * EventUnits(const Mode mode, const int event);
+
+	/**
+	 * Read the counters of the calling thread.
+	 *
+	 * @returns false if they could not be read, values are then zero
+	 */
+	bool Read(Values & values);
+
+	Mode GetThreadMode() const
+	{
+		return mode_;
+	}
+
+	bool UsesRdpmc() const
+	{
+		return rdpmc_;
+	}
+
+private:
+
+	explicit HwCounters(const Mode mode);
+
+	bool Open(const Mode mode);
+	bool OpenGroup(const Mode mode, const bool excludeKernel);
+	void Close();
+	bool ReadRdpmc(Values & values);
+	bool ReadGroup(Values & values);
+
+	Mode mode_;
+	bool rdpmc_;
+	int fd_[NEVENTS];
+	perf_event_mmap_page * page_[NEVENTS];
+};
+
+// ................................................................................... HwRegion ....
+
+/**
+ * @class Counters of a code region
+ *
+ * Aggregates HwCounterScope measurements of the region over every thread into one PerfCounter
+ * per event, /<name>/<event>, and derives instructions per cycle and misses per thousand
+ * instructions when printed.
+ */
+class HwRegion
+{
+public:
+
+	HwRegion(const string & name, const uint32_t flags = PerfCounter::SHARDED);
+
+	void Update(const HwCounters::Values & delta);
+
+	const string & Name() const
+	{
+		return name_;
+	}
+
+	HwCounters::Mode GetMode() const
+	{
+		return mode_;
+	}
+
+	const PerfCounter & Counter(const int event) const
+	{
+		return *counters_[event];
+	}
+
+	/**
+	 * Event deltas that did not fit a PerfCounter value and were recorded as UINT32_MAX.
+	 */
+	uint64_t Saturated() const
+	{
+		return nsaturated_.load(memory_order_relaxed);
+	}
+
+	friend ostream & operator<<(ostream & os, const HwRegion & region);
+
+private:
+
+	HwRegion(const HwRegion &);
+	HwRegion & operator=(const HwRegion &);
+
+	const string name_;
+	const HwCounters::Mode mode_;
+	unique_ptr<PerfCounter> counters_[HwCounters::NEVENTS];
+	atomic<uint64_t> nsaturated_;
+};
+
+// ............................................................................. HwCounterScope ....
+
+/**
+ * @class Measures the scope into an HwRegion
+ *
+ * {
+ *	HwCounterScope scope(region);
+ *	...
+ * }
+ *
+ * Scopes can nest, each one is charged with everything that ran inside it.
+ *
+ * Each event of a scope is recorded as a 32 bit value. Scopes longer than that, about a second
+ * of cycles, record UINT32_MAX and count in HwRegion::Saturated.
+ */
+class HwCounterScope
+{
+public:
+
+	HwCounterScope(HwRegion & region)
+		: region_(region)
+		, counters_(HwCounters::Get())
+		, valid_(counters_.Read(start_))
+	{}
+
+	~HwCounterScope()
+	{
+		/*
+		 * A failed read at either end would make a bogus delta, the scope is not counted
+		 */
+		HwCounters::Values end;
+		if (!valid_ || !counters_.Read(end)) return;
+
+		HwCounters::Values delta;
+		for (int i = 0; i < HwCounters::NEVENTS; ++i) {
+			delta.v_[i] = end.v_[i] - start_.v_[i];
+		}
+
+		region_.Update(delta);
+	}
+
+private:
+
+	HwCounterScope(const HwCounterScope &);
+	HwCounterScope & operator=(const HwCounterScope &);
+
+	HwRegion & region_;
+	HwCounters & counters_;
+	HwCounters::Values start_;
+	const bool valid_;
+};
+
+}
@@ -2,6 +2,12 @@
 
 #include "util.h"
 #include "lock.h"
+#include "rcu.h"
+#include "trace.h"
+#include "wait-profiler.h"
+#include "thread-stats.h"
+#include "queue-stats.h"
+#include "usdt.h"
 
 namespace bblocks {
 
@@ -15,10 +21,11 @@ namespace bblocks {
 template<class T>
 struct InListElement
 {
-	InListElement() : next_(NULL), prev_(NULL) {}
+	InListElement() : next_(NULL), prev_(NULL), tsc_(0) {}
 
 	T * next_;
 	T * prev_;
+	uint64_t tsc_;		// push time, stamped by InQueue while QueueStats are enabled
 };
 
 //................................................................................... Inlist<T> ....
@@ -116,6 +123,9 @@ private:
  * inlist, but provide the interface for a queue.
  *
  * This is meant to be a fast queue, so we employ adaptive spinning.
+ *
+ * While QueueStats are enabled the queue keeps its push and pop rates, depth and the time
+ * elements wait in it, under its name /q/<name>.
  */
 template<class T>
 class InQueue
@@ -124,15 +134,26 @@ public:
 
 	static const unsigned int MAX_SPIN = 10000;
 
-	InQueue(const string & name) : log_("/q/" + name), maxSpin_(1000) {}
+	InQueue(const string & name) : log_("/q/" + name), size_(0), maxSpin_(1000) {}
 
 	inline void Push(T * t)
 	{
+		QueueStats * stats = QueueStats::IsEnabled() ? stats_.Get(log_) : NULL;
+		t->tsc_ = stats ? Rdtsc::rdtsc() : 0;
+
 		lock_.Lock();
 		q_.Push(t);
+		const size_t depth = ++size_;
 		lock_.Unlock();
 
-		conditionEmpty_.Signal();
+		IOCORE_PROBE3(queue_push, this, t, depth);
+		Trace::Counter(TRACE_QUEUE_DEPTH, depth, (uint64_t) this);
+		if (stats) stats->Pushed(depth);
+
+		/*
+		 * Free unless a consumer is asleep
+		 */
+		notEmpty_.Notify();
 	}
 
 	inline T * Pop()
@@ -147,20 +168,28 @@ public:
 		/*
 		 * Timeout.
 		 *
-		 * No objects were received while spinning. Apply traditional lock and wait
-		 * algorithm
+		 * No objects were received while spinning. Sleep until a producer notifies us.
 		 */
-		lock_.Lock();
-
-		while (q_.IsEmpty()) {
-			conditionEmpty_.Wait(&lock_);
-		}
+		for (;;) {
+			const EventCount::key_t key = notEmpty_.PrepareWait();
 
-		t = q_.Pop();
-
-		lock_.Unlock();
+			t = LockedPop();
+			if (t) {
+				notEmpty_.CancelWait();
+				return t;
+			}
 
-		return t;
+			Trace::Begin(TRACE_QUEUE_WAIT);
+			{
+				WaitScope _(WAIT_QUEUE, log_);
+				IdleScope idle;
+				RcuOfflineScope offline;
+				IOCORE_PROBE1(queue_wait_start, this);
+				notEmpty_.CommitWait(key);
+				IOCORE_PROBE1(queue_wait_end, this);
+			}
+			Trace::End(TRACE_QUEUE_WAIT);
+		}
 	}
 
 	inline T * Pop(const uint32_t ms)
@@ -175,30 +204,41 @@ public:
 		/*
 		 * Timeout.
 		 *
-		 * No objects were received while spinning. Apply traditional lock and wait
-		 * algorithm
+		 * No objects were received while spinning. Sleep until a producer notifies us or
+		 * the time runs out.
 		 */
-		if (!lock_.Lock(ms))
-			/*
-			 * Timeout
-			 */
-			return NULL;
-
-		while (q_.IsEmpty()) {
-			if (!conditionEmpty_.Wait(&lock_, ms)) {
+		const uint64_t deadline = Time::NowInMilliSec() + ms;
+
+		for (;;) {
+			const EventCount::key_t key = notEmpty_.PrepareWait();
+
+			t = LockedPop();
+			if (t) {
+				notEmpty_.CancelWait();
+				return t;
+			}
+
+			const uint64_t now = Time::NowInMilliSec();
+			const uint32_t left = now < deadline ? deadline - now : 0;
+			bool notified;
+			Trace::Begin(TRACE_QUEUE_WAIT);
+			{
+				WaitScope _(WAIT_QUEUE, log_);
+				IdleScope idle;
+				RcuOfflineScope offline;
+				IOCORE_PROBE1(queue_wait_start, this);
+				notified = notEmpty_.CommitWait(key, left);
+				IOCORE_PROBE1(queue_wait_end, this);
+			}
+			Trace::End(TRACE_QUEUE_WAIT);
+
+			if (!notified) {
 				/*
 				 * Timeout waiting for object
 				 */
-				lock_.Unlock();
-				return NULL;
+				return LockedPop();
 			}
 		}
-
-		t = q_.Pop();
-
-		lock_.Unlock();
-
-		return t;
 	}
 
 	inline bool IsEmpty() const
@@ -210,6 +250,23 @@ public:
 		return ret;
 	}
 
+	size_t Size() const
+	{
+		lock_.Lock();
+		const size_t size = size_;
+		lock_.Unlock();
+
+		return size;
+	}
+
+	/**
+	 * NULL unless the queue was used while QueueStats were enabled.
+	 */
+	const QueueStats * Stats() const
+	{
+		return stats_.Peek();
+	}
+
 private:
 
 	inline T * TryPop()
@@ -223,8 +280,9 @@ private:
 			lock_.Lock();
 			if (!q_.IsEmpty()) {
 				T * t = q_.Pop();
+				const size_t depth = --size_;
 				lock_.Unlock();
-				return t;
+				return Popped(t, depth);
 			}
 			lock_.Unlock();
 			sched_yield();
@@ -233,13 +291,33 @@ private:
 		return NULL;
     }
 
+	inline T * LockedPop()
+	{
+		lock_.Lock();
+		T * t = q_.IsEmpty() ? NULL : q_.Pop();
+		const size_t depth = t ? --size_ : size_;
+		lock_.Unlock();
+
+		return t ? Popped(t, depth) : NULL;
+	}
+
+	inline T * Popped(T * t, const size_t depth)
+	{
+		IOCORE_PROBE2(queue_pop, this, t);
+		Trace::Counter(TRACE_QUEUE_DEPTH, depth, (uint64_t) this);
+		if (QueueStats::IsEnabled()) stats_.Get(log_)->Popped(t->tsc_);
+		return t;
+	}
+
 	InQueue();
 
 	string log_;
 	mutable PThreadMutex lock_;
-	WaitCondition conditionEmpty_;
+	EventCount notEmpty_;
 	InList<T> q_;
+	size_t size_;
 	unsigned int maxSpin_;
+	QueueStatsPtr stats_;
 };
 
 // ............................................................... Queue<T> ....
@@ -247,6 +325,8 @@ private:
 /**
  * Typical thread safe queue which uses blocking lock. You would use this queue
  * for general purpose programming.
+ *
+ * Keeps the same QueueStats as InQueue.
  */
 template<class T>
 class Queue
@@ -260,25 +340,64 @@ public:
 
     inline void Push(const T & t)
     {
+        QueueStats * stats = QueueStats::IsEnabled() ? stats_.Get(log_) : NULL;
+
         lock_.Lock();
-        q_.push(t);
+        q_.push(Entry{t, stats ? Rdtsc::rdtsc() : 0});
+        const size_t depth = q_.size();
         lock_.Unlock();
 
-        conditionEmpty_.Signal();
+        IOCORE_PROBE3(queue_push, this, &t, depth);
+        Trace::Counter(TRACE_QUEUE_DEPTH, depth, (uint64_t) this);
+        if (stats) stats->Pushed(depth);
+
+        notEmpty_.Notify();
     }
 
     inline T Pop()
     {
         lock_.Lock();
+
         while (q_.empty()) {
-            conditionEmpty_.Wait(&lock_);
+            lock_.Unlock();
+
+            /*
+             * Announce ourselves before checking again, a push after the check is
+             * guaranteed to wake us up
+             */
+            const EventCount::key_t key = notEmpty_.PrepareWait();
+
+            lock_.Lock();
+            if (!q_.empty()) {
+                notEmpty_.CancelWait();
+                break;
+            }
+            lock_.Unlock();
+
+            Trace::Begin(TRACE_QUEUE_WAIT);
+            {
+                WaitScope _(WAIT_QUEUE, log_);
+                IdleScope idle;
+                RcuOfflineScope offline;
+                IOCORE_PROBE1(queue_wait_start, this);
+                notEmpty_.CommitWait(key);
+                IOCORE_PROBE1(queue_wait_end, this);
+            }
+            Trace::End(TRACE_QUEUE_WAIT);
+
+            lock_.Lock();
         }
 
-        T t = q_.front();
+        Entry e = q_.front();
         q_.pop();
+        const size_t depth = q_.size();
         lock_.Unlock();
 
-        return t;
+        IOCORE_PROBE2(queue_pop, this, &e.t_);
+        Trace::Counter(TRACE_QUEUE_DEPTH, depth, (uint64_t) this);
+        if (QueueStats::IsEnabled()) stats_.Get(log_)->Popped(e.tsc_);
+
+        return e.t_;
     }
 
 	bool IsEmpty() const
@@ -290,14 +409,38 @@ public:
 		return result;
 	}
 
+    size_t Size() const
+    {
+        lock_.Lock();
+        const size_t size = q_.size();
+        lock_.Unlock();
+
+        return size;
+    }
+
+    /**
+     * NULL unless the queue was used while QueueStats were enabled.
+     */
+    const QueueStats * Stats() const
+    {
+        return stats_.Peek();
+    }
+
 private:
 
+    struct Entry
+    {
+        T t_;
+        uint64_t tsc_;      // push time, zero unless QueueStats were enabled
+    };
+
     Queue();
 
     const string log_;
     mutable PThreadMutex lock_;
-    WaitCondition conditionEmpty_;
-    queue<T> q_;
+    EventCount notEmpty_;
+    queue<Entry> q_;
+    QueueStatsPtr stats_;
 };
 
 
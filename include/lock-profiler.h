@@ -0,0 +1,233 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+class LockProfile;
+
+// ................................................................................... LockStat ....
+
+/**
+ * Contention statistics for one (lock name, call site) pair. Times are in TSC cycles.
+ */
+struct LockStat
+{
+	LockStat(const string & name, void * site)
+		: name_(name)
+		, site_(site)
+		, nacquired_(0)
+		, ncontended_(0)
+		, waitCycles_(0)
+		, maxWaitCycles_(0)
+		, holdCycles_(0)
+	{}
+
+	void Acquired(const uint64_t waitCycles, const bool contended)
+	{
+		nacquired_.fetch_add(/*val=*/ 1, memory_order_relaxed);
+
+		if (!contended) return;
+
+		ncontended_.fetch_add(/*val=*/ 1, memory_order_relaxed);
+		waitCycles_.fetch_add(waitCycles, memory_order_relaxed);
+
+		uint64_t max = maxWaitCycles_.load(memory_order_relaxed);
+		while (waitCycles > max
+		       && !maxWaitCycles_.compare_exchange_weak(max, waitCycles));
+	}
+
+	void Reset()
+	{
+		nacquired_ = ncontended_ = waitCycles_ = maxWaitCycles_ = holdCycles_ = 0;
+	}
+
+	const string name_;
+	void * const site_;
+	atomic<uint64_t> nacquired_;
+	atomic<uint64_t> ncontended_;
+	atomic<uint64_t> waitCycles_;
+	atomic<uint64_t> maxWaitCycles_;
+	atomic<uint64_t> holdCycles_;
+};
+
+// ............................................................................... LockProfiler ....
+
+/**
+ * @class Opt-in lock contention profiler
+ *
+ * Every Mutex and RWLock implementation reports acquisitions here while the profiler is enabled.
+ * Statistics are kept per lock name and per call site (the return address of Lock), so locks
+ * sharing a name are aggregated. When disabled the only cost on the lock path is a relaxed load.
+ */
+class LockProfiler
+{
+public:
+
+	struct Summary
+	{
+		Summary(const string & name = string(), void * site = NULL)
+			: name_(name), site_(site), nacquired_(0), ncontended_(0)
+			, waitCycles_(0), maxWaitCycles_(0), holdCycles_(0)
+		{}
+
+		void Add(const LockStat & stat);
+
+		string name_;
+		void * site_;
+		uint64_t nacquired_;
+		uint64_t ncontended_;
+		uint64_t waitCycles_;
+		uint64_t maxWaitCycles_;
+		uint64_t holdCycles_;
+	};
+
+	static void Enable()
+	{
+		enabled_.store(true);
+	}
+
+	static void Disable()
+	{
+		enabled_.store(false);
+	}
+
+	static bool IsEnabled()
+	{
+		return enabled_.load(memory_order_relaxed);
+	}
+
+	/**
+	 * Find or create the statistics for the given lock and call site.
+	 */
+	static LockStat * Get(const LockProfile & profile, void * site);
+
+	/**
+	 * Aggregated statistics of all locks with the given name.
+	 */
+	static Summary GetSummary(const string & name);
+
+	/**
+	 * Print the top offenders, by total wait time, per lock name and per call site.
+	 */
+	static void Dump(ostream & os, const size_t top = 10);
+
+	static void Reset();
+
+	static string SiteName(void * site);
+
+private:
+
+	static vector<LockStat *> Snapshot();
+
+	static atomic<bool> enabled_;
+};
+
+// ................................................................................ LockProfile ....
+
+/**
+ * Profiling state embedded in every lock.
+ *
+ * Hold time is tracked for exclusive acquisitions only. Acquired and Released are called with
+ * the lock held exclusively, so the hold state needs no synchronization.
+ */
+class LockProfile
+{
+public:
+
+	explicit LockProfile(const string & name)
+		: id_(nextId_.fetch_add(/*val=*/ 1))
+		, gen_(0)
+		, name_(name)
+		, holdStat_(NULL)
+		, holdStart_(0)
+		, depth_(0)
+	{}
+
+	/**
+	 * Statistics are kept by name, acquisitions after a rename go to the new name.
+	 */
+	void SetName(const string & name)
+	{
+		name_ = name;
+		gen_.fetch_add(/*val=*/ 1, memory_order_release);
+	}
+
+	const string & Name() const
+	{
+		return name_;
+	}
+
+	uint64_t Id() const
+	{
+		return id_;
+	}
+
+	/**
+	 * Bumped on every rename, statistics cached for an older generation are stale.
+	 */
+	uint32_t Gen() const
+	{
+		return gen_.load(memory_order_acquire);
+	}
+
+	void Acquired(void * site, const uint64_t waitCycles, const bool contended)
+	{
+		LockStat * stat = LockProfiler::Get(*this, site);
+		stat->Acquired(waitCycles, contended);
+
+		if (!depth_++) {
+			holdStat_ = stat;
+			holdStart_ = Rdtsc::rdtsc();
+		}
+	}
+
+	/**
+	 * Lock handed back after a condition wait. Restarts hold tracking without counting an
+	 * acquisition.
+	 */
+	void Reacquired(void * site)
+	{
+		if (!depth_++) {
+			holdStat_ = LockProfiler::Get(*this, site);
+			holdStart_ = Rdtsc::rdtsc();
+		}
+	}
+
+	void AcquiredShared(void * site, const uint64_t waitCycles, const bool contended)
+	{
+		LockProfiler::Get(*this, site)->Acquired(waitCycles, contended);
+	}
+
+	void Released()
+	{
+		/*
+		 * depth_ is zero if the lock was acquired while profiling was disabled
+		 */
+		if (!depth_ || --depth_) return;
+
+		holdStat_->holdCycles_.fetch_add(Rdtsc::rdtsc() - holdStart_, memory_order_relaxed);
+		holdStat_ = NULL;
+	}
+
+private:
+
+	static atomic<uint64_t> nextId_;
+
+	const uint64_t id_;
+	atomic<uint32_t> gen_;
+	string name_;
+	LockStat * holdStat_;
+	uint64_t holdStart_;
+	uint32_t depth_;
+};
+
+}
@@ -2,9 +2,19 @@
 #define _CORE_LOCK_H_
 
 #include <inttypes.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <algorithm>
+#include <atomic>
 
 #include "perfcounter.h"
 #include "logger.h"
+#include "lock-profiler.h"
+#include "trace.h"
+#include "wait-profiler.h"
+#include "usdt.h"
 
 namespace bblocks {
 
@@ -24,7 +34,24 @@ public:
 
     virtual bool IsOwner() = 0;
 
+    /**
+     * Name under which contention statistics are aggregated when the LockProfiler is enabled
+     */
+    void SetName(const string & name)
+    {
+        profile_.SetName(name);
+    }
+
     virtual ~Mutex() {}
+
+protected:
+
+    explicit Mutex(const string & name = "/mutex")
+        : profile_(name)
+    {
+    }
+
+    LockProfile profile_;
 };
 
 // ................................................................................... AutoLock ....
@@ -33,7 +60,10 @@ class AutoLock
 {
 public:
 
-    explicit AutoLock(Mutex * mutex)
+    /*
+     * Inlined so that the lock profiler attributes the acquisition to the caller
+     */
+    explicit AutoLock(Mutex * mutex) __attribute__((always_inline))
         : mutex_(mutex)
     {
         ASSERT(mutex_);
@@ -96,7 +126,8 @@ public:
     friend class WaitCondition;
 
     PThreadMutex(bool isRecursive = true)
-        : isRecursive_(isRecursive)
+        : Mutex("/pthreadmutex")
+        , isRecursive_(isRecursive)
     {
         pthread_mutexattr_t attr;
         int status;
@@ -121,27 +152,84 @@ public:
 
     bool TryLock()
     {
-        return pthread_mutex_trylock(&mutex_) == 0;
+        if (pthread_mutex_trylock(&mutex_)) return false;
+
+        if (LockProfiler::IsEnabled()) {
+            profile_.Acquired(__builtin_return_address(0), /*waitCycles=*/ 0,
+                              /*contended=*/ false);
+        }
+
+        return true;
     }
 
     virtual void Lock() override
     {
+        if (LockProfiler::IsEnabled() || WaitProfiler::IsEnabled()) {
+            ProfiledLock(__builtin_return_address(0));
+            return;
+        }
+
+        /*
+         * Uncontended, the try costs the same as the lock. Otherwise tell the tracers.
+         */
+        if (!pthread_mutex_trylock(&mutex_)) return;
+
+        Trace::Begin(TRACE_LOCK_WAIT);
+        IOCORE_PROBE1(lock_contended, this);
+
         int status = pthread_mutex_lock(&mutex_);
         (void) status;
         ASSERT(status == 0);
+
+        IOCORE_PROBE1(lock_acquired, this);
+        Trace::End(TRACE_LOCK_WAIT);
     }
 
     virtual bool Lock(const uint32_t ms)
     {
         ASSERT(ms);
+
+        const bool profile = LockProfiler::IsEnabled();
+        const bool waitProfile = WaitProfiler::IsEnabled();
+        if (!pthread_mutex_trylock(&mutex_)) {
+            if (profile) {
+                profile_.Acquired(__builtin_return_address(0), /*waitCycles=*/ 0,
+                                  /*contended=*/ false);
+            }
+
+            return true;
+        }
+
+        const uint64_t start = profile || waitProfile ? Rdtsc::rdtsc() : 0;
+
+        Trace::Begin(TRACE_LOCK_WAIT);
+        IOCORE_PROBE1(lock_contended, this);
+
         auto t = Time::GetTimeSpec(ms);
         int status = pthread_mutex_timedlock(&mutex_, &t);
         INVARIANT(status == 0 || status == ETIMEDOUT);
+
+        if (status == 0) IOCORE_PROBE1(lock_acquired, this);
+        Trace::End(TRACE_LOCK_WAIT);
+
+        if (start) {
+            const uint64_t cycles = Rdtsc::rdtsc() - start;
+
+            if (profile && status == 0) {
+                profile_.Acquired(__builtin_return_address(0), cycles, /*contended=*/ true);
+            }
+
+            WaitProfiler::Record(WAIT_LOCK, profile_.Name(), __builtin_return_address(0),
+                                 cycles);
+        }
+
         return status == 0;
     }
 
     virtual void Unlock() override
     {
+        profile_.Released();
+
         int status = pthread_mutex_unlock(&mutex_);
         (void) status;
         ASSERT(status == 0);
@@ -160,6 +248,33 @@ public:
 
     private:
 
+    void ProfiledLock(void * site)
+    {
+        const bool profile = LockProfiler::IsEnabled();
+
+        if (!pthread_mutex_trylock(&mutex_)) {
+            if (profile) profile_.Acquired(site, /*waitCycles=*/ 0, /*contended=*/ false);
+            return;
+        }
+
+        const uint64_t start = Rdtsc::rdtsc();
+
+        Trace::Begin(TRACE_LOCK_WAIT);
+        IOCORE_PROBE1(lock_contended, this);
+
+        int status = pthread_mutex_lock(&mutex_);
+        (void) status;
+        ASSERT(status == 0);
+
+        IOCORE_PROBE1(lock_acquired, this);
+        Trace::End(TRACE_LOCK_WAIT);
+
+        const uint64_t cycles = Rdtsc::rdtsc() - start;
+
+        if (profile) profile_.Acquired(site, cycles, /*contended=*/ true);
+        WaitProfiler::Record(WAIT_LOCK, profile_.Name(), site, cycles);
+    }
+
     const bool isRecursive_;
     pthread_mutex_t mutex_;
 };
@@ -186,17 +301,44 @@ public:
 
     void Wait(PThreadMutex * lock)
     {
+        lock->profile_.Released();
+
+        const uint64_t start = WaitProfiler::IsEnabled() ? Rdtsc::rdtsc() : 0;
+
         int status = pthread_cond_wait(&cond_, &lock->mutex_);
         (void) status;
         ASSERT(status == 0);
+
+        if (start) {
+            WaitProfiler::Record(WAIT_COND, lock->profile_.Name(), __builtin_return_address(0),
+                                 Rdtsc::rdtsc() - start);
+        }
+
+        if (LockProfiler::IsEnabled()) {
+            lock->profile_.Reacquired(__builtin_return_address(0));
+        }
     }
 
     bool Wait(PThreadMutex * lock, const uint32_t ms)
     {
+        lock->profile_.Released();
+
+        const uint64_t start = WaitProfiler::IsEnabled() ? Rdtsc::rdtsc() : 0;
+
         auto t = Time::GetTimeSpec(ms);
         int status = pthread_cond_timedwait(&cond_, &lock->mutex_, &t);
         (void) status;
         ASSERT(status == 0 || status == ETIMEDOUT);
+
+        if (start) {
+            WaitProfiler::Record(WAIT_COND, lock->profile_.Name(), __builtin_return_address(0),
+                                 Rdtsc::rdtsc() - start);
+        }
+
+        if (LockProfiler::IsEnabled()) {
+            lock->profile_.Reacquired(__builtin_return_address(0));
+        }
+
         return status == 0;
     }
 
@@ -231,8 +373,9 @@ public:
         CLOSED = 0x11
     };
 
-    explicit SpinMutex(const string & name)
-        : name_("/spinmutex" + name)
+    explicit SpinMutex(const string & name = string())
+        : Mutex("/spinmutex" + name)
+        , name_("/spinmutex" + name)
         , mutex_(OPEN)
         , statSpinTime_(name_ + "/spin-time", "microsec", PerfCounter::TIME)
     {
@@ -246,32 +389,53 @@ public:
 
     bool TryLock()
     {
-        int status = __sync_bool_compare_and_swap(&mutex_, OPEN, CLOSED);
+        if (!Acquire()) return false;
 
-        if (status) {
-            ASSERT(Is(CLOSED));
-            owner_ = pthread_self();
-            return true;
+        if (LockProfiler::IsEnabled()) {
+            profile_.Acquired(__builtin_return_address(0), /*waitCycles=*/ 0,
+                              /*contended=*/ false);
         }
 
-        return false;
-
+        return true;
     }
 
     virtual void Lock()
     {
         INVARIANT(Is(OPEN) || !IsOwner());
 
+        const bool profile = LockProfiler::IsEnabled();
+        const uint64_t start = profile ? Rdtsc::rdtsc() : 0;
+
         uint64_t startInMicroSec = Rdtsc::NowInMicroSec();
 
-        while (!TryLock()) pthread_yield();
+        bool contended = false;
+        while (!Acquire()) {
+            if (!contended) {
+                Trace::Begin(TRACE_LOCK_WAIT);
+                IOCORE_PROBE1(lock_contended, this);
+            }
+
+            contended = true;
+            pthread_yield();
+        }
+
+        if (contended) {
+            IOCORE_PROBE1(lock_acquired, this);
+            Trace::End(TRACE_LOCK_WAIT);
+        }
 
         statSpinTime_.Update(Rdtsc::ElapsedInMicroSec(startInMicroSec));
+
+        if (profile) {
+            profile_.Acquired(__builtin_return_address(0),
+                              contended ? Rdtsc::rdtsc() - start : 0, contended);
+        }
     }
 
     virtual void Unlock()
     {
         ASSERT(IsOwner());
+        profile_.Released();
         owner_ = 0;
         bool status = __sync_bool_compare_and_swap(&mutex_, CLOSED, OPEN);
         (void) status;
@@ -290,6 +454,19 @@ public:
 
 protected:
 
+    bool Acquire()
+    {
+        int status = __sync_bool_compare_and_swap(&mutex_, OPEN, CLOSED);
+
+        if (status) {
+            ASSERT(Is(CLOSED));
+            owner_ = pthread_self();
+            return true;
+        }
+
+        return false;
+    }
+
     const string name_;
     pthread_t owner_;
     volatile _Atomic_word mutex_;
@@ -297,6 +474,546 @@ protected:
     PerfCounter statSpinTime_;
 };
 
+// ...................................................................................... Futex ....
+
+/**
+ * Thin wrapper over the futex system call. Only process private futexes are used.
+ */
+class Futex
+{
+public:
+
+    /**
+     * Sleep as long as *addr == val.
+     *
+     * @param   timeout     Relative timeout, NULL to wait for ever
+     * @returns 0 when woken up, -1 otherwise (errno is EAGAIN, EINTR or ETIMEDOUT)
+     */
+    static long Wait(void * addr, const int val, const timespec * timeout = NULL)
+    {
+        return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout,
+                       /*addr2=*/ NULL, /*val3=*/ 0);
+    }
+
+    /**
+     * Wake up to n waiters sleeping on addr.
+     *
+     * @returns number of waiters woken up
+     */
+    static long Wake(void * addr, const int n)
+    {
+        return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, /*timeout=*/ NULL,
+                       /*addr2=*/ NULL, /*val3=*/ 0);
+    }
+
+    static timespec ToTimeSpec(const uint32_t ms)
+    {
+        timespec t;
+        t.tv_sec = ms / 1000;
+        t.tv_nsec = MSEC_TO_NSEC(ms % 1000);
+        return t;
+    }
+};
+
+// ................................................................................. FutexMutex ....
+
+/**
+ * Non recursive mutex built directly on a futex (mutex3 from Drepper's "Futexes are tricky").
+ *
+ * Lock and Unlock are a single atomic operation when uncontended. Contended lockers spin for a
+ * little while before going to sleep in the kernel, and Unlock makes a system call only if there
+ * may be sleepers.
+ */
+class FutexMutex : public Mutex
+{
+public:
+
+    enum
+    {
+        UNLOCKED = 0,
+        LOCKED,
+        CONTENDED,      // locked, possibly with sleepers
+    };
+
+    static const int SPIN_COUNT = 100;
+
+    explicit FutexMutex(const string & name = string())
+        : Mutex("/futexmutex" + name)
+        , state_(UNLOCKED)
+        , owner_(0)
+    {
+    }
+
+    bool TryLock()
+    {
+        int state = UNLOCKED;
+        if (!state_.compare_exchange_strong(state, LOCKED, memory_order_acquire)) {
+            return false;
+        }
+
+        owner_.store(pthread_self(), memory_order_relaxed);
+
+        if (LockProfiler::IsEnabled()) {
+            profile_.Acquired(__builtin_return_address(0), /*waitCycles=*/ 0,
+                              /*contended=*/ false);
+        }
+
+        return true;
+    }
+
+    virtual void Lock() override
+    {
+        const bool profile = LockProfiler::IsEnabled();
+
+        int state = UNLOCKED;
+        if (state_.compare_exchange_strong(state, LOCKED, memory_order_acquire)) {
+            owner_.store(pthread_self(), memory_order_relaxed);
+
+            if (profile) {
+                profile_.Acquired(__builtin_return_address(0), /*waitCycles=*/ 0,
+                                  /*contended=*/ false);
+            }
+
+            return;
+        }
+
+        /*
+         * We are about to spin or sleep, the clock is cheap in comparison
+         */
+        const uint64_t start = Rdtsc::rdtsc();
+
+        Trace::Begin(TRACE_LOCK_WAIT);
+        IOCORE_PROBE1(lock_contended, this);
+        LockContended(state);
+        IOCORE_PROBE1(lock_acquired, this);
+        Trace::End(TRACE_LOCK_WAIT);
+
+        owner_.store(pthread_self(), memory_order_relaxed);
+
+        const uint64_t cycles = Rdtsc::rdtsc() - start;
+
+        if (profile) {
+            profile_.Acquired(__builtin_return_address(0), cycles, /*contended=*/ true);
+        }
+
+        WaitProfiler::Record(WAIT_LOCK, profile_.Name(), __builtin_return_address(0), cycles);
+    }
+
+    virtual void Unlock() override
+    {
+        ASSERT(IsOwner());
+
+        profile_.Released();
+        owner_.store(0, memory_order_relaxed);
+
+        if (state_.fetch_sub(1, memory_order_release) != LOCKED) {
+            /*
+             * There may be sleepers
+             */
+            state_.store(UNLOCKED, memory_order_release);
+            Futex::Wake(&state_, /*n=*/ 1);
+        }
+    }
+
+    virtual bool IsOwner() override
+    {
+        return state_.load() != UNLOCKED
+               && pthread_equal(owner_.load(memory_order_relaxed), pthread_self());
+    }
+
+private:
+
+    void LockContended(int state)
+    {
+        for (int i = 0; i < SPIN_COUNT; ++i) {
+            __builtin_ia32_pause();
+
+            state = UNLOCKED;
+            if (state_.compare_exchange_weak(state, LOCKED, memory_order_acquire)) {
+                return;
+            }
+        }
+
+        /*
+         * Mark the lock contended before sleeping, so that the owner wakes us up. Whoever
+         * gets the lock from here on leaves it marked contended, since there may be other
+         * sleepers.
+         */
+        if (state != CONTENDED) {
+            state = state_.exchange(CONTENDED, memory_order_acquire);
+        }
+
+        while (state != UNLOCKED) {
+            Futex::Wait(&state_, CONTENDED);
+            state = state_.exchange(CONTENDED, memory_order_acquire);
+        }
+    }
+
+    atomic<int> state_;
+    atomic<pthread_t> owner_;
+};
+
+// ................................................................................. EventCount ....
+
+/**
+ * Futex based event count, a condition variable that needs no mutex and costs the notifier a
+ * memory fence and a load when nobody is waiting.
+ *
+ * The waiter announces itself before checking its condition, and sleeps only if no notification
+ * came in between:
+ *
+ *      for (;;) {
+ *          if (condition) break;
+ *          auto key = ec.PrepareWait();
+ *          if (condition) { ec.CancelWait(); break; }
+ *          ec.CommitWait(key);
+ *      }
+ *
+ * The notifier makes the condition true and then calls Notify. The upper 32 bits of the state are
+ * the notification epoch the waiters sleep on, the lower 32 bits count the waiters.
+ */
+class EventCount
+{
+public:
+
+    typedef uint32_t key_t;
+
+    EventCount()
+        : state_(0)
+    {
+    }
+
+    ~EventCount()
+    {
+        INVARIANT(!(state_.load() & WAITER_MASK));
+    }
+
+    key_t PrepareWait()
+    {
+        /*
+         * Sequentially consistent, so that the waiter count is visible before the caller
+         * checks its condition
+         */
+        return state_.fetch_add(WAITER, memory_order_seq_cst) >> EPOCH_SHIFT;
+    }
+
+    void CancelWait()
+    {
+        const uint64_t prev = state_.fetch_sub(WAITER, memory_order_relaxed);
+        ASSERT(prev & WAITER_MASK);
+        (void) prev;
+    }
+
+    void CommitWait(const key_t key)
+    {
+        while (Epoch() == key) {
+            Futex::Wait(EpochAddr(), (int) key);
+        }
+
+        CancelWait();
+    }
+
+    /**
+     * Wait for a notification after key, for at most ms.
+     *
+     * @returns false on timeout
+     */
+    bool CommitWait(const key_t key, const uint32_t ms)
+    {
+        const uint64_t deadline = Time::NowInMilliSec() + ms;
+
+        while (Epoch() == key) {
+            const uint64_t now = Time::NowInMilliSec();
+            if (now >= deadline) {
+                CancelWait();
+                return false;
+            }
+
+            const timespec timeout = Futex::ToTimeSpec(deadline - now);
+            Futex::Wait(EpochAddr(), (int) key, &timeout);
+        }
+
+        CancelWait();
+        return true;
+    }
+
+    /**
+     * Wake up one waiter. No system call is made if there are no waiters.
+     */
+    void Notify()
+    {
+        DoNotify(/*n=*/ 1);
+    }
+
+    void NotifyAll()
+    {
+        DoNotify(/*n=*/ INT_MAX);
+    }
+
+    uint32_t NumWaiters() const
+    {
+        return state_.load() & WAITER_MASK;
+    }
+
+private:
+
+    static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+                  "EventCount assumes the epoch is the upper half of the state word");
+
+    static const int EPOCH_SHIFT = 32;
+    static const uint64_t WAITER = 1;
+    static const uint64_t WAITER_MASK = (1ULL << EPOCH_SHIFT) - 1;
+    static const uint64_t EPOCH = 1ULL << EPOCH_SHIFT;
+
+    void DoNotify(const int n)
+    {
+        /*
+         * Pairs with the fence in PrepareWait, either we see the waiter or the waiter sees
+         * the condition the caller made true
+         */
+        atomic_thread_fence(memory_order_seq_cst);
+
+        if (!(state_.load(memory_order_relaxed) & WAITER_MASK)) return;
+
+        state_.fetch_add(EPOCH, memory_order_release);
+        Futex::Wake(EpochAddr(), n);
+    }
+
+    key_t Epoch() const
+    {
+        return state_.load(memory_order_acquire) >> EPOCH_SHIFT;
+    }
+
+    int * EpochAddr()
+    {
+        return reinterpret_cast<int *>(&state_) + 1;
+    }
+
+    atomic<uint64_t> state_;
+};
+
+// ...................................................................................... Latch ....
+
+/**
+ * Single use count down latch. Threads block in Wait until the count reaches zero.
+ *
+ * CountDown is a single atomic op, except for the one call that releases the latch.
+ */
+class Latch
+{
+public:
+
+    explicit Latch(const int count)
+        : count_(count)
+    {
+        INVARIANT(count >= 0);
+    }
+
+    void CountDown(const int n = 1)
+    {
+        const int prev = count_.fetch_sub(n, memory_order_release);
+        INVARIANT(prev >= n);
+
+        if (prev == n) {
+            Futex::Wake(&count_, /*n=*/ INT_MAX);
+        }
+    }
+
+    bool TryWait() const
+    {
+        return !count_.load(memory_order_acquire);
+    }
+
+    void Wait()
+    {
+        int count;
+        while ((count = count_.load(memory_order_acquire))) {
+            Futex::Wait(&count_, count);
+        }
+    }
+
+    void ArriveAndWait()
+    {
+        CountDown();
+        Wait();
+    }
+
+private:
+
+    Latch(const Latch &);
+    Latch & operator=(const Latch &);
+
+    atomic<int> count_;
+};
+
+// .................................................................................... Barrier ....
+
+/**
+ * Reusable barrier for a fixed number of threads.
+ *
+ * The sense is a phase counter rather than a flag, so that threads need no local sense and the
+ * futex word never returns to a value a sleeper is waiting on. Arriving threads spin on the phase
+ * for a little while before sleeping, which is cheap when the phases are short and the threads
+ * have cores of their own.
+ */
+class Barrier
+{
+public:
+
+    static const int SPIN_COUNT = 1000;
+
+    explicit Barrier(const int nthreads)
+        : nthreads_(nthreads)
+        , remaining_(nthreads)
+        , phase_(0)
+        , sleepers_(0)
+    {
+        INVARIANT(nthreads > 0);
+    }
+
+    /**
+     * Wait for all the threads to arrive.
+     *
+     * @returns true for exactly one thread per phase, the last one to arrive
+     */
+    bool ArriveAndWait()
+    {
+        const int phase = phase_.load(memory_order_acquire);
+
+        if (remaining_.fetch_sub(1, memory_order_acq_rel) == 1) {
+            /*
+             * Last one in, reset the count for the next phase before releasing the others
+             */
+            remaining_.store(nthreads_, memory_order_relaxed);
+            phase_.store(int(unsigned(phase) + 1), memory_order_seq_cst);
+
+            if (sleepers_.load(memory_order_seq_cst)) {
+                Futex::Wake(&phase_, /*n=*/ INT_MAX);
+            }
+
+            return true;
+        }
+
+        for (int i = 0; i < SPIN_COUNT; ++i) {
+            if (phase_.load(memory_order_acquire) != phase) return false;
+            __builtin_ia32_pause();
+        }
+
+        sleepers_.fetch_add(1, memory_order_seq_cst);
+        while (phase_.load(memory_order_seq_cst) == phase) {
+            Futex::Wait(&phase_, phase);
+        }
+        sleepers_.fetch_sub(1, memory_order_relaxed);
+
+        return false;
+    }
+
+    int Phase() const
+    {
+        return phase_.load(memory_order_acquire);
+    }
+
+private:
+
+    Barrier(const Barrier &);
+    Barrier & operator=(const Barrier &);
+
+    const int nthreads_;
+    atomic<int> remaining_;
+    atomic<int> phase_;
+    atomic<int> sleepers_;
+};
+
+// .......................................................................... CountingSemaphore ....
+
+/**
+ * Counting semaphore, for bounding the concurrency of a section of code.
+ *
+ * Acquire and Release are a single atomic op each while there are permits to go around. Release
+ * makes a system call only if there are sleepers.
+ */
+class CountingSemaphore
+{
+public:
+
+    explicit CountingSemaphore(const int count)
+        : count_(count)
+        , waiters_(0)
+    {
+        INVARIANT(count >= 0);
+    }
+
+    bool TryAcquire()
+    {
+        int count = count_.load(memory_order_relaxed);
+        while (count > 0) {
+            if (count_.compare_exchange_weak(count, count - 1, memory_order_acquire)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void Acquire()
+    {
+        if (TryAcquire()) return;
+
+        waiters_.fetch_add(1, memory_order_seq_cst);
+        while (!TryAcquire()) {
+            Futex::Wait(&count_, /*val=*/ 0);
+        }
+        waiters_.fetch_sub(1, memory_order_relaxed);
+    }
+
+    /**
+     * Acquire a permit, waiting for at most ms.
+     *
+     * @returns false on timeout
+     */
+    bool Acquire(const uint32_t ms)
+    {
+        if (TryAcquire()) return true;
+
+        const uint64_t deadline = Time::NowInMilliSec() + ms;
+        bool acquired;
+
+        waiters_.fetch_add(1, memory_order_seq_cst);
+        while (!(acquired = TryAcquire())) {
+            const uint64_t now = Time::NowInMilliSec();
+            if (now >= deadline) break;
+
+            const timespec timeout = Futex::ToTimeSpec(deadline - now);
+            Futex::Wait(&count_, /*val=*/ 0, &timeout);
+        }
+        waiters_.fetch_sub(1, memory_order_relaxed);
+
+        return acquired;
+    }
+
+    void Release(const int n = 1)
+    {
+        count_.fetch_add(n, memory_order_seq_cst);
+
+        if (waiters_.load(memory_order_seq_cst)) {
+            Futex::Wake(&count_, n);
+        }
+    }
+
+    int Count() const
+    {
+        return count_.load(memory_order_relaxed);
+    }
+
+private:
+
+    CountingSemaphore(const CountingSemaphore &);
+    CountingSemaphore & operator=(const CountingSemaphore &);
+
+    atomic<int> count_;
+    atomic<int> waiters_;
+};
+
 // ..................................................................................... RWLock ....
 
 class RWLock
@@ -306,6 +1023,25 @@ public:
     virtual void ReadLock() = 0;
     virtual void WriteLock() = 0;
     virtual void Unlock() = 0;
+
+    /**
+     * Name under which contention statistics are aggregated when the LockProfiler is enabled
+     */
+    void SetName(const string & name)
+    {
+        profile_.SetName(name);
+    }
+
+    virtual ~RWLock() {}
+
+protected:
+
+    explicit RWLock(const string & name = "/rwlock")
+        : profile_(name)
+    {
+    }
+
+    LockProfile profile_;
 };
 
 // .............................................................................. PThreadRWLock ....
@@ -315,6 +1051,7 @@ class PThreadRWLock : public RWLock
 public:
 
     PThreadRWLock()
+        : RWLock("/pthreadrwlock")
     {
         int status = pthread_rwlock_init(&rwlock_,  /*attr=*/ NULL);
         (void) status;
@@ -330,13 +1067,49 @@ public:
 
     void ReadLock()
     {
+        if (LockProfiler::IsEnabled() || WaitProfiler::IsEnabled()) {
+            const bool profile = LockProfiler::IsEnabled();
+            void * site = __builtin_return_address(0);
+
+            if (!pthread_rwlock_tryrdlock(&rwlock_)) {
+                if (profile) profile_.AcquiredShared(site, /*waitCycles=*/ 0, /*contended=*/ false);
+                return;
+            }
+
+            const uint64_t start = Rdtsc::rdtsc();
+
+            Trace::Begin(TRACE_LOCK_WAIT);
+            int status = pthread_rwlock_rdlock(&rwlock_);
+            (void) status;
+            ASSERT(status == 0);
+            Trace::End(TRACE_LOCK_WAIT);
+
+            const uint64_t cycles = Rdtsc::rdtsc() - start;
+
+            if (profile) profile_.AcquiredShared(site, cycles, /*contended=*/ true);
+            WaitProfiler::Record(WAIT_LOCK, profile_.Name(), site, cycles);
+            return;
+        }
+
+        /*
+         * Uncontended, the try costs the same as the lock. Otherwise tell the tracer.
+         */
+        if (!pthread_rwlock_tryrdlock(&rwlock_)) return;
+
+        Trace::Begin(TRACE_LOCK_WAIT);
         int status = pthread_rwlock_rdlock(&rwlock_);
         (void) status;
         ASSERT(status == 0);
+        Trace::End(TRACE_LOCK_WAIT);
     }
 
     void Unlock()
     {
+        /*
+         * Hold time is tracked for writers only, this is a no-op for readers
+         */
+        profile_.Released();
+
         int status = pthread_rwlock_unlock(&rwlock_);
         (void) status;
         ASSERT(status == 0);
@@ -344,9 +1117,37 @@ public:
 
     void WriteLock()
     {
-        int status = pthread_rwlock_rdlock(&rwlock_);
+        if (LockProfiler::IsEnabled() || WaitProfiler::IsEnabled()) {
+            const bool profile = LockProfiler::IsEnabled();
+            void * site = __builtin_return_address(0);
+
+            if (!pthread_rwlock_trywrlock(&rwlock_)) {
+                if (profile) profile_.Acquired(site, /*waitCycles=*/ 0, /*contended=*/ false);
+                return;
+            }
+
+            const uint64_t start = Rdtsc::rdtsc();
+
+            Trace::Begin(TRACE_LOCK_WAIT);
+            int status = pthread_rwlock_wrlock(&rwlock_);
+            (void) status;
+            ASSERT(status == 0);
+            Trace::End(TRACE_LOCK_WAIT);
+
+            const uint64_t cycles = Rdtsc::rdtsc() - start;
+
+            if (profile) profile_.Acquired(site, cycles, /*contended=*/ true);
+            WaitProfiler::Record(WAIT_LOCK, profile_.Name(), site, cycles);
+            return;
+        }
+
+        if (!pthread_rwlock_trywrlock(&rwlock_)) return;
+
+        Trace::Begin(TRACE_LOCK_WAIT);
+        int status = pthread_rwlock_wrlock(&rwlock_);
         (void) status;
         ASSERT(status == 0);
+        Trace::End(TRACE_LOCK_WAIT);
     }
 
 protected:
@@ -360,7 +1161,7 @@ class AutoReadLock
 {
 public:
 
-    explicit AutoReadLock(RWLock * rwlock)
+    explicit AutoReadLock(RWLock * rwlock) __attribute__((always_inline))
         : rwlock_(rwlock)
     {
         ASSERT(rwlock_);
@@ -394,7 +1195,7 @@ class AutoWriteLock
 {
 public:
 
-    explicit AutoWriteLock(RWLock * rwlock)
+    explicit AutoWriteLock(RWLock * rwlock) __attribute__((always_inline))
         : rwlock_(rwlock)
     {
         ASSERT(rwlock_);
@@ -422,6 +1223,151 @@ private:
     RWLock * rwlock_;
 };
 
+
+// .......................................................................... StripedLock<M, N> ....
+
+/**
+ * Fixed table of N locks of type M, selected by hash of a key.
+ *
+ * Stripes are cache line aligned so that adjacent locks do not false share. Several keys can be
+ * locked at once with LockMany, which takes the stripes in index order and is therefore free of
+ * deadlocks between callers. M can be any Mutex (PThreadMutex, SpinMutex, FutexMutex); the
+ * constructor arguments are forwarded to every stripe.
+ *
+ * Usage : StripedLock<FutexMutex, 64> locks("/conn");
+ *         AutoLock _(&locks.Get(connId));
+ */
+template<class M, size_t N = 64>
+class StripedLock
+{
+public:
+
+    static_assert(N && N <= (1ULL << 32) && !(N & (N - 1)),
+                  "Number of stripes must be a power of two");
+
+    template<class... Args>
+    explicit StripedLock(const Args & ... args)
+    {
+        void * mem;
+        int status = posix_memalign(&mem, CACHELINE_SIZE, N * sizeof(Stripe));
+        INVARIANT(!status);
+
+        stripes_ = (Stripe *) mem;
+        for (size_t i = 0; i < N; ++i) {
+            new (&stripes_[i]) Stripe(args...);
+        }
+    }
+
+    ~StripedLock()
+    {
+        for (size_t i = 0; i < N; ++i) {
+            stripes_[i].~Stripe();
+        }
+
+        ::free(stripes_);
+    }
+
+    template<class K>
+    size_t Index(const K & key) const
+    {
+        /*
+         * std::hash is the identity for integers, use the high bits of a fibonacci hash so
+         * that sequential keys are spread out
+         */
+        const uint64_t h = hash<K>()(key) * 0x9E3779B97F4A7C15ULL;
+        return (h >> 32) & (N - 1);
+    }
+
+    template<class K>
+    M & Get(const K & key)
+    {
+        return stripes_[Index(key)].lock_;
+    }
+
+    M & At(const size_t idx)
+    {
+        ASSERT(idx < N);
+        return stripes_[idx].lock_;
+    }
+
+    template<class K>
+    void Lock(const K & key)
+    {
+        Get(key).Lock();
+    }
+
+    template<class K>
+    void Unlock(const K & key)
+    {
+        Get(key).Unlock();
+    }
+
+    /**
+     * Lock the stripes of all the keys. Keys sharing a stripe lock it once.
+     */
+    template<class... K>
+    void LockMany(const K & ... keys)
+    {
+        size_t idx[] = { Index(keys)... };
+        const size_t n = SortUnique(idx, sizeof...(K));
+
+        for (size_t i = 0; i < n; ++i) {
+            stripes_[idx[i]].lock_.Lock();
+        }
+    }
+
+    template<class... K>
+    void UnlockMany(const K & ... keys)
+    {
+        size_t idx[] = { Index(keys)... };
+        const size_t n = SortUnique(idx, sizeof...(K));
+
+        for (size_t i = n; i > 0; --i) {
+            stripes_[idx[i - 1]].lock_.Unlock();
+        }
+    }
+
+    void LockAll()
+    {
+        for (size_t i = 0; i < N; ++i) {
+            stripes_[i].lock_.Lock();
+        }
+    }
+
+    void UnlockAll()
+    {
+        for (size_t i = N; i > 0; --i) {
+            stripes_[i - 1].lock_.Unlock();
+        }
+    }
+
+    static constexpr size_t Size()
+    {
+        return N;
+    }
+
+private:
+
+    struct Stripe
+    {
+        template<class... Args>
+        explicit Stripe(const Args & ... args) : lock_(args...) {}
+
+        M lock_;
+    } __attribute__((aligned(CACHELINE_SIZE)));
+
+    static size_t SortUnique(size_t * idx, const size_t n)
+    {
+        sort(idx, idx + n);
+        return unique(idx, idx + n) - idx;
+    }
+
+    StripedLock(const StripedLock &);
+    StripedLock & operator=(const StripedLock &);
+
+    Stripe * stripes_;
+};
+
 }
 
 #endif
@@ -11,6 +11,8 @@
 #include <atomic>
 
 #include "util.h"
+#include "usdt.h"
+#include "coarse-clock.h"
 
 /**
  TODO:
@@ -76,6 +78,8 @@ public:
 							   : LogWriter::DEFAULT;
 
         writer_->Append(msg, p);
+
+        IOCORE_PROBE2(log_flush, type, msg.size());
     }
 
 private:
@@ -167,13 +171,12 @@ public:
 
 protected:
 
+    /*
+     * Formatted once a second while the CoarseClock runs
+     */
     const string Timestamp()
     {
-        time_t secondsSinceEpoch = time(NULL);
-        tm* brokenTime = localtime(&secondsSinceEpoch);
-        char buf[80];
-        strftime(buf, sizeof(buf), " %d/%m/%y %T ", brokenTime);
-        return string(buf);
+        return CoarseClock::Timestamp();
     }
 
     typedef list<string> StringListType;
@@ -5,9 +5,44 @@
 #include <atomic>
 #include <iomanip>
 #include <unordered_map>
+#include <functional>
+
+#include "thread-index.h"
+#include "histogram.h"
+#include "rate-counter.h"
+#include "stats-segment.h"
 
 namespace bblocks {
 
+class PerfCounter;
+
+// ........................................................................ PerfCounterRegistry ....
+
+/**
+ * @class Process wide registry of live PerfCounters
+ *
+ * Every PerfCounter joins on construction and leaves on destruction, so exporters can find all
+ * the counters by their /path names. Several counters can share a name, readers are expected to
+ * merge them.
+ */
+class PerfCounterRegistry
+{
+public:
+
+	static void Register(PerfCounter * pc);
+	static void Unregister(PerfCounter * pc);
+
+	/**
+	 * Call fn on every registered counter in name order. The counters are collected under the
+	 * lock and visited outside it, so creating and destroying counters is never held up by a
+	 * slow fn. A counter being destroyed waits for fn to be done with it, fn must not destroy
+	 * counters itself.
+	 */
+	static void ForEach(const function<void (const PerfCounter &)> & fn);
+
+	static size_t Size();
+};
+
 // ................................................................................ PerfCounter ....
 
 /**
@@ -16,11 +51,30 @@ namespace bblocks {
  * PerfCounter is general purpose implementation and can be used to capture stats as a counter of
  * items, bytes or time. It also includes a bucket stat which can capture data distribution
  * statistics.
+ *
+ * Counters updated from every core can be created SHARDED. Each thread then updates a cache line
+ * aligned slot of its own with plain stores, and the slots are merged only when the counter is
+ * read or printed.
+ *
+ * Counters created with HISTOGRAM also keep a log-linear histogram of the values with the given
+ * number of significant digits, and report percentiles.
+ *
+ * Counters created with WINDOWED also track recent rates, ops and value per second over the last
+ * seconds and as 1/5/15 minute moving averages, plus a histogram of the last minute when combined
+ * with HISTOGRAM. Averages since start hide what happened in the last minute of a long running
+ * process, these do not. A SHARDED counter keeps the rates and the recent histogram per thread
+ * too, and merges them on read.
+ *
+ * While a StatsSegment is open the values live in a slot of the shared memory segment, where
+ * tools like iocore-stat read them from outside the process. Histograms and rates stay in the
+ * process.
  */
 class PerfCounter
 {
 public:
 
+	friend class PerfCounterRegistry;
+
 	enum Type
 	{
 		COUNTER = 0,
@@ -28,74 +82,340 @@ public:
 		TIME,
 	};
 
-	PerfCounter(const string & name, const string & units, const Type & type)
+	enum Flags
+	{
+		NONE = 0,
+		SHARDED = 1 << 0,
+		HISTOGRAM = 1 << 1,
+		WINDOWED = 1 << 2,
+	};
+
+	static const int NBUCKETS = StatCell::NBUCKETS;
+
+	/**
+	 * Merged view of the counter
+	 */
+	struct Snapshot
+	{
+		Snapshot() : val_(0), count_(0), min_(UINT32_MAX), max_(0)
+		{
+			for (int i = 0; i < NBUCKETS; ++i) {
+				bucket_[i] = 0;
+			}
+		}
+
+		uint64_t val_;
+		uint64_t count_;
+		uint64_t min_;
+		uint64_t max_;
+		uint64_t bucket_[NBUCKETS];
+		SharedPtr<Histogram> hist_;	// NULL unless HISTOGRAM
+
+		/*
+		 * Aggregate with a counter of the same name
+		 */
+		void Merge(const Snapshot & rhs)
+		{
+			val_ += rhs.val_;
+			count_ += rhs.count_;
+			min_ = rhs.min_ < min_ ? rhs.min_ : min_;
+			max_ = rhs.max_ > max_ ? rhs.max_ : max_;
+
+			for (int i = 0; i < NBUCKETS; ++i) {
+				bucket_[i] += rhs.bucket_[i];
+			}
+
+			if (!rhs.hist_) return;
+
+			if (!hist_) {
+				hist_.reset(new Histogram(*rhs.hist_));
+			} else if (hist_->Digits() <= rhs.hist_->Digits()) {
+				hist_->Merge(*rhs.hist_);
+			} else {
+				/*
+				 * Counters of the same name may differ in precision, keep the lower one
+				 */
+				SharedPtr<Histogram> hist(new Histogram(rhs.hist_->Digits()));
+				hist->Merge(*hist_);
+				hist->Merge(*rhs.hist_);
+				hist_ = hist;
+			}
+		}
+	};
+
+	PerfCounter(const string & name, const string & units, const Type & type,
+		    const uint32_t flags = NONE, const int digits = Histogram::DEFAULT_DIGITS)
 		: name_(name)
 		, units_(units)
 		, type_(type)
-		, val_(0)
-		, count_(0)
-		, min_(UINT32_MAX)
-		, max_(0)
+		, seg_(StatsSegment::Get())
+		, slot_(seg_ ? seg_->AllocSlot(name, units, type) : NULL)
+		, cell_(slot_ ? &slot_->cell_ : &local_)
 		, startms_(Rdtsc::NowInMilliSec())
+		, digits_((flags & HISTOGRAM) ? digits : 0)
+		, shards_(NULL)
+		, readers_(0)
 	{
-		InitBucket();
+		local_.Init();
+
+		if (digits_) {
+			hist_.reset(new Histogram(digits_));
+		}
+
+		if (flags & WINDOWED) {
+			rates_.reset(new RateCounter());
+			if (digits_) whist_.reset(new WindowedHistogram(digits_));
+		}
+
+		if (flags & SHARDED) {
+			shards_ = new atomic<Shard *>[ThreadIndex::MAX_THREADS];
+			for (uint32_t i = 0; i < ThreadIndex::MAX_THREADS; ++i) {
+				shards_[i].store(NULL, memory_order_relaxed);
+			}
+		}
+
+		PerfCounterRegistry::Register(this);
 	}
 
-	virtual ~PerfCounter() {}
+	virtual ~PerfCounter()
+	{
+		PerfCounterRegistry::Unregister(this);
+
+		if (slot_) seg_->FreeSlot(slot_);
+
+		if (!shards_) return;
+
+		for (uint32_t i = 0; i < ThreadIndex::MAX_THREADS; ++i) {
+			Shard * shard = shards_[i].load();
+			if (!shard) continue;
+
+			shard->~Shard();
+			::free(shard);
+		}
+
+		delete[] shards_;
+	}
 
 	void Update(const uint32_t val)
 	{
-		val_.fetch_add(val);
-		count_.fetch_add(/*val=*/ 1);
+		if (shards_) {
+			const uint32_t idx = ThreadIndex::Get();
+			if (idx < ThreadIndex::MAX_THREADS) {
+				GetShard(idx)->Update(val, BucketIndex(val));
+				return;
+			}
+		}
+
+		if (rates_) UpdateRates(rates_.get(), whist_.get(), val);
+
+		cell_->val_.fetch_add(val);
+		cell_->count_.fetch_add(/*val=*/ 1);
 
-		uint64_t minCount = min_.load();
+		if (hist_) hist_->Record(val);
+
+		uint64_t minCount = cell_->min_.load();
 		while (val < minCount) {
-			min_.compare_exchange_strong(minCount, val);
-			minCount = min_.load();
+			cell_->min_.compare_exchange_strong(minCount, val);
+			minCount = cell_->min_.load();
 		}
 
-		uint64_t maxCount = max_.load();
+		uint64_t maxCount = cell_->max_.load();
 		while (val > maxCount) {
-			max_.compare_exchange_strong(maxCount, val);
-			maxCount = max_.load();
+			cell_->max_.compare_exchange_strong(maxCount, val);
+			maxCount = cell_->max_.load();
 		}
 
 		UpdateBucket(val);
 	}
 
+	/**
+	 * Merge the shared and per thread values.
+	 */
+	Snapshot Read() const
+	{
+		Snapshot snap;
+
+		snap.val_ = cell_->val_.load();
+		snap.count_ = cell_->count_.load();
+		snap.min_ = cell_->min_.load();
+		snap.max_ = cell_->max_.load();
+
+		for (int i = 0; i < NBUCKETS; ++i) {
+			snap.bucket_[i] = cell_->bucket_[i].load();
+		}
+
+		if (hist_) snap.hist_.reset(new Histogram(*hist_));
+
+		ForEachShard([&snap](const Shard & shard) { shard.MergeTo(snap); });
+
+		return snap;
+	}
+
+	const string & Name() const
+	{
+		return name_;
+	}
+
+	const string & Units() const
+	{
+		return units_;
+	}
+
+	Type GetType() const
+	{
+		return type_;
+	}
+
+	bool HasRates() const
+	{
+		return rates_.get();
+	}
+
+	/*
+	 * Value and Count read the cells directly, Read would copy the histogram too
+	 */
+	uint64_t Value() const
+	{
+		return Sum(&StatCell::val_);
+	}
+
+	uint64_t Count() const
+	{
+		return Sum(&StatCell::count_);
+	}
+
+	/**
+	 * 1, 5 and 15 minute moving averages, only for counters created with WINDOWED.
+	 */
+	RateCounter::Rates GetRates() const
+	{
+		INVARIANT(rates_);
+
+		const uint64_t nowms = RateCounter::NowMs();
+
+		RateCounter::Rates rates = rates_->GetRates(nowms);
+		ForEachShard([&rates, nowms](const Shard & shard) {
+			rates.Merge(shard.rates_->GetRates(nowms));
+		});
+
+		return rates;
+	}
+
+	/**
+	 * Ops per second over the last seconds, only for counters created with WINDOWED.
+	 */
+	double OpsRate(const uint64_t seconds) const
+	{
+		INVARIANT(rates_);
+
+		const uint64_t nowms = RateCounter::NowMs();
+
+		double rate = rates_->OpsRate(seconds, nowms);
+		ForEachShard([&rate, seconds, nowms](const Shard & shard) {
+			rate += shard.rates_->OpsRate(seconds, nowms);
+		});
+
+		return rate;
+	}
+
+	/**
+	 * Histogram of the last minute, only for counters created with WINDOWED | HISTOGRAM.
+	 */
+	Histogram RecentHistogram() const
+	{
+		INVARIANT(whist_);
+
+		const uint64_t nowms = RateCounter::NowMs();
+
+		Histogram h = whist_->Snapshot(nowms);
+		ForEachShard([&h, nowms](const Shard & shard) {
+			h.Merge(shard.whist_->Snapshot(nowms));
+		});
+
+		return h;
+	}
+
+	/**
+	 * Percentile of the recorded values, only for counters created with HISTOGRAM.
+	 */
+	uint64_t Percentile(const double q) const
+	{
+		INVARIANT(digits_);
+		return Read().hist_->Percentile(q);
+	}
+
 	friend ostream & operator<<(ostream & os, const PerfCounter & pc)
 	{
 		os << "Perfcoutner: " << pc.name_ << endl;
 
-		if (!pc.count_) return os;
+		const Snapshot snap = pc.Read();
+
+		if (!snap.count_) return os;
 
 		kvs_t kv;
 
-		kv["Aggregate-value"] = STR(pc.val_.load());
-		kv["Count"] = STR(pc.count_.load());
+		kv["Aggregate-value"] = STR(snap.val_);
+		kv["Count"] = STR(snap.count_);
 		kv["Time"] = STR(pc.ElapsedSec()) + " s";
-		kv["Max"] = STR(pc.max_.load()) + " " + pc.units_;
-		kv["Min"] = STR(pc.min_.load()) + " " + pc.units_;
-		kv["Avg"] = STR(to_h(pc.Avg())) + " " + pc.units_;
+		kv["Max"] = STR(snap.max_) + " " + pc.units_;
+		kv["Min"] = STR(snap.min_) + " " + pc.units_;
+		kv["Avg"] = STR(to_h(Avg(snap))) + " " + pc.units_;
 
 		if (pc.type_ == BYTES) {
-			kv[pc.units_ + "-per-sec"] = STR(to_h(pc.val_.load() / pc.ElapsedSec()));
-			kv["ops-per-sec"] = STR(to_h((pc.count_.load() / pc.ElapsedSec())));
+			kv[pc.units_ + "-per-sec"] = STR(to_h(snap.val_ / pc.ElapsedSec()));
+			kv["ops-per-sec"] = STR(to_h((snap.count_ / pc.ElapsedSec())));
 		}
 
 		Print(os, kv);
 
-		if (pc.count_.load()) {
-			for (int i = 0; i < 32; ++i) {
-				if (!pc.bucket_[i].load()) continue;
+		for (int i = 0; i < NBUCKETS; ++i) {
+			if (!snap.bucket_[i]) continue;
 
-				auto k = to_h(i ? pow(2, i) : 0) + "-" + to_h(pow(2, i + 1));
-				PrintKeyValue(os, k, to_h(pc.bucket_[i].load()));
-			}
+			auto k = to_h(i ? pow(2, i) : 0) + "-" + to_h(pow(2, i + 1));
+			PrintKeyValue(os, k, to_h(snap.bucket_[i]));
 		}
 
 		DrawLine(os);
 
+		if (snap.hist_) {
+			static const pair<const char *, double> percentiles[] = {
+				{ "p50", 50 }, { "p90", 90 }, { "p99", 99 }, { "p99.9", 99.9 },
+			};
+
+			for (auto & p : percentiles) {
+				PrintKeyValue(os, p.first,
+					      STR(snap.hist_->Percentile(p.second)) + " " + pc.units_);
+			}
+
+			PrintKeyValue(os, "max", STR(snap.hist_->Max()) + " " + pc.units_);
+			DrawLine(os);
+		}
+
+		if (pc.rates_) {
+			const RateCounter::Rates rates = pc.GetRates();
+			static const char * windows[] = { "1m", "5m", "15m" };
+
+			PrintKeyValue(os, "ops-per-sec-10s", to_h(pc.OpsRate(/*seconds=*/ 10)));
+			for (int i = 0; i < RateCounter::NWINDOWS; ++i) {
+				PrintKeyValue(os, string("ops-per-sec-") + windows[i], to_h(rates.ops_[i]));
+			}
+
+			if (pc.type_ == BYTES) {
+				for (int i = 0; i < RateCounter::NWINDOWS; ++i) {
+					PrintKeyValue(os, pc.units_ + "-per-sec-" + windows[i],
+						      to_h(rates.vals_[i]));
+				}
+			}
+
+			if (pc.whist_) {
+				const Histogram h = pc.RecentHistogram();
+				PrintKeyValue(os, "p99-1m", STR(h.Percentile(99)) + " " + pc.units_);
+				PrintKeyValue(os, "max-1m", STR(h.Max()) + " " + pc.units_);
+			}
+
+			DrawLine(os);
+		}
+
 		return os;
 	}
 
@@ -134,35 +454,140 @@ protected:
 		return Rdtsc::ElapsedInMilliSec(startms_) / 1000;
 	}
 
-	double Avg() const
+	static double Avg(const Snapshot & snap)
 	{
-		return count_.load() ? (val_.load() / (double) count_.load()) : 0;
+		return snap.count_ ? (snap.val_ / (double) snap.count_) : 0;
 	}
 
-	void InitBucket()
-	{
-		for (int i = 0; i < 32; ++i) {
-			bucket_[i].exchange(0);
-		}
-	}
-
-	void UpdateBucket(const uint32_t val)
+	static int BucketIndex(const uint32_t val)
 	{
 		// the bucket contains value 2^idx - 2^(idx+1)
 		// bucket 0 : 0 - 2
 		// bucket 1 : 2 - 4
 		// bucket 2 : 4 - 8
 		// etc
-		uint32_t tmp = val;
-		uint32_t count = 0;
-		for (int i = 0; i < 32; ++i) {
-			tmp >>= 1;
-			if (!tmp) break;
-			++count;
+		return val > 1 ? 31 - __builtin_clz(val) : 0;
+	}
+
+	void UpdateBucket(const uint32_t val)
+	{
+		cell_->bucket_[BucketIndex(val)].fetch_add(/*val=*/ 1);
+	}
+
+	static void UpdateRates(RateCounter * rates, WindowedHistogram * whist, const uint32_t val)
+	{
+		const uint64_t nowms = RateCounter::NowMs();
+		rates->Update(val, nowms);
+		if (whist) whist->Record(val, nowms);
+	}
+
+	/*
+	 * Per thread slot. Only the owning thread writes, so updates are relaxed loads and stores
+	 * with no read-modify-write. The values are in a cell of the stats segment if there is
+	 * room, in the shard itself otherwise. The rates of a windowed counter are per thread too,
+	 * else every update would bounce the line of the current second between the cores
+	 */
+	struct Shard
+	{
+		Shard(const int digits, StatCell * cell, const bool windowed)
+			: cell_(cell ? cell : &local_)
+			, hist_(digits ? new Histogram(digits) : NULL)
+			, rates_(windowed ? new RateCounter() : NULL)
+			, whist_(windowed && digits ? new WindowedHistogram(digits) : NULL)
+		{
+			local_.Init();
+		}
+
+		void Update(const uint32_t val, const int bucket)
+		{
+			Add(cell_->val_, val);
+			Add(cell_->count_, /*val=*/ 1);
+
+			if (val < cell_->min_.load(memory_order_relaxed)) {
+				cell_->min_.store(val, memory_order_relaxed);
+			}
+
+			if (val > cell_->max_.load(memory_order_relaxed)) {
+				cell_->max_.store(val, memory_order_relaxed);
+			}
+
+			atomic<uint32_t> & b = cell_->bucket_[bucket];
+			b.store(b.load(memory_order_relaxed) + 1, memory_order_relaxed);
+
+			if (hist_) hist_->RecordLocal(val);
+			if (rates_) UpdateRates(rates_.get(), whist_.get(), val);
+		}
+
+		void MergeTo(Snapshot & snap) const
+		{
+			snap.val_ += cell_->val_.load(memory_order_relaxed);
+			snap.count_ += cell_->count_.load(memory_order_relaxed);
+
+			const uint64_t min = cell_->min_.load(memory_order_relaxed);
+			if (min < snap.min_) snap.min_ = min;
+
+			const uint64_t max = cell_->max_.load(memory_order_relaxed);
+			if (max > snap.max_) snap.max_ = max;
+
+			for (int i = 0; i < NBUCKETS; ++i) {
+				snap.bucket_[i] += cell_->bucket_[i].load(memory_order_relaxed);
+			}
+
+			if (hist_) snap.hist_->Merge(*hist_);
+		}
+
+		static void Add(atomic<uint64_t> & v, const uint64_t val)
+		{
+			v.store(v.load(memory_order_relaxed) + val, memory_order_relaxed);
+		}
+
+		StatCell local_;
+		StatCell * const cell_;
+		unique_ptr<Histogram> hist_;
+		unique_ptr<RateCounter> rates_;
+		unique_ptr<WindowedHistogram> whist_;
+	} __attribute__((aligned(CACHELINE_SIZE)));
+
+	uint64_t Sum(atomic<uint64_t> StatCell::* field) const
+	{
+		uint64_t sum = (cell_->*field).load();
+		ForEachShard([&sum, field](const Shard & shard) {
+			sum += (shard.cell_->*field).load(memory_order_relaxed);
+		});
+
+		return sum;
+	}
+
+	template<class Fn>
+	void ForEachShard(const Fn & fn) const
+	{
+		if (!shards_) return;
+
+		const uint32_t highWater = ThreadIndex::HighWater();
+		for (uint32_t i = 0; i < highWater; ++i) {
+			const Shard * shard = shards_[i].load(memory_order_acquire);
+			if (shard) fn(*shard);
 		}
+	}
+
+	Shard * GetShard(const uint32_t idx)
+	{
+		Shard * shard = shards_[idx].load(memory_order_relaxed);
+		if (shard) return shard;
+
+		/*
+		 * First update from this thread index. Slots are never freed while the counter
+		 * lives, a thread reusing the index keeps adding to it
+		 */
+		void * mem;
+		int status = posix_memalign(&mem, CACHELINE_SIZE, sizeof(Shard));
+		INVARIANT(!status);
 
-		INVARIANT(count < 32);
-		bucket_[count].fetch_add(/*val=*/ 1);
+		shard = new (mem) Shard(digits_, slot_ ? seg_->AllocCell(slot_) : NULL,
+					(bool) rates_);
+		shards_[idx].store(shard, memory_order_release);
+
+		return shard;
 	}
 
 	template<class T>
@@ -180,12 +605,17 @@ protected:
 	const string name_;
 	const string units_;
 	const Type type_;
-	atomic<uint64_t> val_;
-	atomic<uint64_t> count_;
-	atomic<uint64_t> min_;
-	atomic<uint64_t> max_;
-	atomic<uint32_t> bucket_[32];
+	StatCell local_;
+	StatsSegment * const seg_;
+	StatSlot * const slot_;
+	StatCell * const cell_;
 	uint64_t startms_;
+	const int digits_;
+	unique_ptr<Histogram> hist_;
+	unique_ptr<RateCounter> rates_;
+	unique_ptr<WindowedHistogram> whist_;
+	atomic<Shard *> * shards_;
+	atomic<uint32_t> readers_;	// PerfCounterRegistry::ForEach visits in progress
 };
 
 // ............................................................................. TimeCounter<T> ....
@@ -194,43 +624,149 @@ protected:
  * @class TimeCounter<T>
  *
  * General purpose time keeper. It can be used to track time take by individual pieces of code
- * marked by the enum passed as T.
+ * marked by the enum passed as T, which must print with operator<< and have less than
+ * MAX_PHASES values.
+ *
+ * Time is kept in raw TSC cycles in per thread accumulators, updated with plain stores, and is
+ * converted to microseconds only when reported. Phases are normally timed with ScopedPhase
+ * guards, which nest: a phase reports both its total time and its self time, which excludes
+ * the phases timed inside it. EndRequest counts a unit of work (a request) on the calling
+ * thread, the report then breaks the time of every phase down per request, for the process
+ * and for each thread.
  */
 template<class T>
 class TimeCounter
 {
 public:
 
+	static const int MAX_PHASES = 32;
+
+	/**
+	 * Accumulated time of every phase, in cycles
+	 */
+	struct Totals
+	{
+		Totals() : requests_(0)
+		{
+			for (int i = 0; i < MAX_PHASES; ++i) {
+				cycles_[i] = self_[i] = count_[i] = 0;
+			}
+		}
+
+		uint64_t cycles_[MAX_PHASES];
+		uint64_t self_[MAX_PHASES];
+		uint64_t count_[MAX_PHASES];
+		uint64_t requests_;
+	};
+
 	TimeCounter(const string & name)
 		: name_(name)
-		, startms_(Rdtsc::NowInMilliSec())
-		, refms_(Rdtsc::NowInMilliSec())
+		, start_(Rdtsc::rdtsc())
+		, shards_(new atomic<Shard *>[ThreadIndex::MAX_THREADS])
+		, overflow_(NewShard())
 	{
-		for (int i = 0; i < sizeof(timer_); ++i) {
-			timer_[i].store(/*val=*/ 0);
+		for (uint32_t i = 0; i < ThreadIndex::MAX_THREADS; ++i) {
+			shards_[i].store(NULL, memory_order_relaxed);
 		}
 	}
 
+	~TimeCounter()
+	{
+		FreeShard(overflow_);
+
+		for (uint32_t i = 0; i < ThreadIndex::MAX_THREADS; ++i) {
+			Shard * shard = shards_[i].load();
+			if (shard) FreeShard(shard);
+		}
+
+		delete[] shards_;
+	}
+
+	/**
+	 * Charge the time since the previous ClockIn on this thread (or since the first call) to
+	 * phase t. For code that moves from phase to phase without nesting.
+	 */
 	void ClockIn(const T & t)
 	{
-		INVARIANT(t < 32);
-		timer_[t] += Rdtsc::ElapsedInMilliSec(refms_);
-		refms_ = Rdtsc::NowInMilliSec();
+		const uint64_t now = Rdtsc::rdtsc();
+
+		const uint64_t ref = SwapRef(now);
+		if (ref) {
+			Add(t, now - ref, now - ref);
+		}
+	}
+
+	/**
+	 * Charge cycles to phase t, self being the part not spent in nested phases.
+	 */
+	void Add(const T & t, const uint64_t cycles, const uint64_t self)
+	{
+		INVARIANT(uint32_t(t) < MAX_PHASES);
+
+		Shard * shard = GetShard();
+		if (!shard) {
+			overflow_->AddShared(uint32_t(t), cycles, self);
+			return;
+		}
+
+		shard->AddLocal(uint32_t(t), cycles, self);
+	}
+
+	/**
+	 * Count a request completed by the calling thread.
+	 */
+	void EndRequest()
+	{
+		Shard * shard = GetShard();
+		if (!shard) {
+			overflow_->requests_.fetch_add(/*val=*/ 1, memory_order_relaxed);
+			return;
+		}
+
+		Shard::Inc(shard->requests_, /*val=*/ 1);
+	}
+
+	/**
+	 * Totals over all the threads.
+	 */
+	Totals Read() const
+	{
+		Totals totals;
+		overflow_->MergeTo(totals);
+
+		const uint32_t highWater = ThreadIndex::HighWater();
+		for (uint32_t i = 0; i < highWater; ++i) {
+			const Shard * shard = shards_[i].load(memory_order_acquire);
+			if (shard) shard->MergeTo(totals);
+		}
+
+		return totals;
+	}
+
+	static double ToMicroSec(const uint64_t cycles)
+	{
+		return cycles / (System::GetHz() / 1e6);
 	}
 
 	friend ostream & operator<<(ostream & os, const TimeCounter<T> & v)
 	{
-		const uint64_t elapsed_ms = Rdtsc::ElapsedInMilliSec(v.startms_);
+		const double elapsedus = ToMicroSec(Rdtsc::rdtsc() - v.start_);
 
 		os << "TimeCounter : " << v.name_ << endl
-		   << " Elapsed: " << elapsed_ms << " ms" << endl;
+		   << " Elapsed: " << uint64_t(elapsedus) << " us" << endl;
 
-		for (int i = 0; i < 32; ++i) {
-			if (!v.timer[i]) continue;
+		PrintTotals(os, v.Read(), elapsedus);
 
-			os << T(i) << " " << v.timer_[i]
-			   << " ms ( " << (v.timer_[i] * 100 / elapsed_ms) << "% )"
-			   << endl;
+		const uint32_t highWater = ThreadIndex::HighWater();
+		for (uint32_t i = 0; i < highWater; ++i) {
+			const Shard * shard = v.shards_[i].load(memory_order_acquire);
+			if (!shard) continue;
+
+			Totals totals;
+			shard->MergeTo(totals);
+
+			os << " Thread " << i << endl;
+			PrintTotals(os, totals, elapsedus);
 		}
 
 		return os;
@@ -238,10 +774,255 @@ public:
 
 private:
 
+	/*
+	 * Per thread accumulators. Only the owning thread writes, except for the overflow shard
+	 * shared by the threads beyond ThreadIndex::MAX_THREADS
+	 */
+	struct Shard
+	{
+		Shard() : ref_(0), owner_(0), requests_(0)
+		{
+			for (int i = 0; i < MAX_PHASES; ++i) {
+				cycles_[i].store(0, memory_order_relaxed);
+				self_[i].store(0, memory_order_relaxed);
+				count_[i].store(0, memory_order_relaxed);
+			}
+		}
+
+		void AddLocal(const uint32_t t, const uint64_t cycles, const uint64_t self)
+		{
+			Inc(cycles_[t], cycles);
+			Inc(self_[t], self);
+			Inc(count_[t], /*val=*/ 1);
+		}
+
+		void AddShared(const uint32_t t, const uint64_t cycles, const uint64_t self)
+		{
+			cycles_[t].fetch_add(cycles, memory_order_relaxed);
+			self_[t].fetch_add(self, memory_order_relaxed);
+			count_[t].fetch_add(/*val=*/ 1, memory_order_relaxed);
+		}
+
+		void MergeTo(Totals & totals) const
+		{
+			for (int i = 0; i < MAX_PHASES; ++i) {
+				totals.cycles_[i] += cycles_[i].load(memory_order_relaxed);
+				totals.self_[i] += self_[i].load(memory_order_relaxed);
+				totals.count_[i] += count_[i].load(memory_order_relaxed);
+			}
+
+			totals.requests_ += requests_.load(memory_order_relaxed);
+		}
+
+		static void Inc(atomic<uint64_t> & v, const uint64_t val)
+		{
+			v.store(v.load(memory_order_relaxed) + val, memory_order_relaxed);
+		}
+
+		atomic<uint64_t> cycles_[MAX_PHASES];
+		atomic<uint64_t> self_[MAX_PHASES];
+		atomic<uint64_t> count_[MAX_PHASES];
+		atomic<uint64_t> ref_;
+		atomic<uint64_t> owner_;	// ThreadIndex::Serial of the thread that set ref_
+		atomic<uint64_t> requests_;
+	} __attribute__((aligned(CACHELINE_SIZE)));
+
+	/*
+	 * ClockIn reference of a thread without an index. One per thread, a thread clocking in on
+	 * several counters in turn starts afresh on each.
+	 */
+	struct OverflowRef
+	{
+		const TimeCounter * counter_;
+		uint64_t start_;
+		uint64_t ref_;
+	};
+
+	/*
+	 * Time of the previous ClockIn of the calling thread, 0 if none, set to now
+	 */
+	uint64_t SwapRef(const uint64_t now)
+	{
+		Shard * shard = GetShard();
+
+		if (!shard) {
+			/*
+			 * start_ tells apart a counter created where a destroyed one was
+			 */
+			OverflowRef & o = overflowRef_;
+			const uint64_t ref = o.counter_ == this && o.start_ == start_ ? o.ref_ : 0;
+
+			o.counter_ = this;
+			o.start_ = start_;
+			o.ref_ = now;
+
+			return ref;
+		}
+
+		/*
+		 * A thread that took over the index of one that exited starts afresh
+		 */
+		const uint64_t serial = ThreadIndex::Serial();
+		uint64_t ref = shard->ref_.load(memory_order_relaxed);
+
+		if (shard->owner_.load(memory_order_relaxed) != serial) {
+			shard->owner_.store(serial, memory_order_relaxed);
+			ref = 0;
+		}
+
+		shard->ref_.store(now, memory_order_relaxed);
+
+		return ref;
+	}
+
+	/*
+	 * Shard of the calling thread, NULL if the thread has no index
+	 */
+	Shard * GetShard()
+	{
+		const uint32_t idx = ThreadIndex::Get();
+		if (idx >= ThreadIndex::MAX_THREADS) return NULL;
+
+		Shard * shard = shards_[idx].load(memory_order_relaxed);
+		if (shard) return shard;
+
+		shard = NewShard();
+		shards_[idx].store(shard, memory_order_release);
+
+		return shard;
+	}
+
+	static Shard * NewShard()
+	{
+		void * mem;
+		int status = posix_memalign(&mem, CACHELINE_SIZE, sizeof(Shard));
+		INVARIANT(!status);
+
+		return new (mem) Shard();
+	}
+
+	static void FreeShard(Shard * shard)
+	{
+		shard->~Shard();
+		::free(shard);
+	}
+
+	static void PrintTotals(ostream & os, const Totals & totals, const double elapsedus)
+	{
+		if (totals.requests_) {
+			os << "  Requests: " << totals.requests_ << endl;
+		}
+
+		for (int i = 0; i < MAX_PHASES; ++i) {
+			if (!totals.count_[i]) continue;
+
+			const double us = ToMicroSec(totals.cycles_[i]);
+			const double selfus = ToMicroSec(totals.self_[i]);
+
+			os << "  " << T(i) << " " << uint64_t(us) << " us"
+			   << " ( " << uint64_t(us * 100 / elapsedus) << "% )"
+			   << " self " << uint64_t(selfus) << " us"
+			   << " count " << totals.count_[i]
+			   << " avg " << (us / totals.count_[i]) << " us";
+
+			if (totals.requests_) {
+				os << " per-request " << (us / totals.requests_) << " us";
+			}
+
+			os << endl;
+		}
+	}
+
+	TimeCounter(const TimeCounter &);
+	TimeCounter & operator=(const TimeCounter &);
+
 	const string name_;
-	const uint64_t startms_;
-	uint64_t refms_;
-	atomic<uint32_t> timer_[32];
+	const uint64_t start_;
+	atomic<Shard *> * shards_;
+	Shard * const overflow_;
+
+	static __thread OverflowRef overflowRef_;
+};
+
+template<class T>
+__thread typename TimeCounter<T>::OverflowRef TimeCounter<T>::overflowRef_;
+
+// ............................................................................ ScopedPhaseBase ....
+
+/**
+ * @class ScopedPhaseBase
+ *
+ * Stack of the phases being timed on the thread, so that a phase can exclude the time of the
+ * phases nested in it.
+ */
+class ScopedPhaseBase
+{
+protected:
+
+	ScopedPhaseBase()
+		: parent_(current_)
+		, children_(0)
+		, start_(Rdtsc::rdtsc())
+	{
+		current_ = this;
+	}
+
+	/*
+	 * Pop the phase, returns the cycles since it started
+	 */
+	uint64_t Stop()
+	{
+		const uint64_t elapsed = Rdtsc::rdtsc() - start_;
+
+		INVARIANT(current_ == this);
+		current_ = parent_;
+
+		if (parent_) parent_->children_ += elapsed;
+
+		return elapsed;
+	}
+
+	static __thread ScopedPhaseBase * current_;
+
+	ScopedPhaseBase * const parent_;
+	uint64_t children_;
+	const uint64_t start_;
+};
+
+// ............................................................................. ScopedPhase<T> ....
+
+/**
+ * @class ScopedPhase<T>
+ *
+ * Times its scope as phase t of a TimeCounter<T>.
+ *
+ * {
+ *	ScopedPhase<Phase> p(timer, Phase::PARSE);
+ *	...
+ * }
+ */
+template<class T>
+class ScopedPhase : public ScopedPhaseBase
+{
+public:
+
+	ScopedPhase(TimeCounter<T> & timer, const T & t)
+		: timer_(timer), t_(t)
+	{}
+
+	~ScopedPhase()
+	{
+		const uint64_t elapsed = Stop();
+		timer_.Add(t_, elapsed, elapsed > children_ ? elapsed - children_ : 0);
+	}
+
+private:
+
+	ScopedPhase(const ScopedPhase &);
+	ScopedPhase & operator=(const ScopedPhase &);
+
+	TimeCounter<T> & timer_;
+	const T t_;
 };
 
 }
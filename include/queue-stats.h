@@ -0,0 +1,162 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <string>
+
+#include "util.h"
+#include "perfcounter.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// ................................................................................. QueueStats ....
+
+/**
+ * @class Queueing statistics of a named queue
+ *
+ * While enabled, InQueue and Queue stamp elements with the TSC when pushed, and on pop record the
+ * time the element spent in the queue. Per queue, as /q/<name>/...:
+ *
+ *	push, pop	operations, WINDOWED for the push and pop rates
+ *	depth		depth after every push, the max is the high water mark
+ *	sojourn		microsec from push to pop, HISTOGRAM | WINDOWED
+ *
+ * Elements pushed while disabled carry no stamp and are counted without a sojourn time. A queue
+ * creates its counters the first time it is used while enabled. When disabled, queues pay a
+ * relaxed load and a store of a zero stamp per push and a relaxed load per pop.
+ */
+class QueueStats
+{
+public:
+
+	static void Enable();
+
+	static void Disable()
+	{
+		enabled_.store(false);
+	}
+
+	static bool IsEnabled()
+	{
+		return enabled_.load(memory_order_relaxed);
+	}
+
+	explicit QueueStats(const string & name);
+
+	void Pushed(const uint64_t depth)
+	{
+		push_.Update(/*val=*/ 1);
+		depth_.Update(depth > UINT32_MAX ? UINT32_MAX : depth);
+	}
+
+	/**
+	 * @param	tsc	stamp of the element, zero if it has none
+	 */
+	void Popped(const uint64_t tsc)
+	{
+		pop_.Update(/*val=*/ 1);
+
+		if (!tsc) return;
+
+		const uint64_t now = Rdtsc::rdtsc();
+		if (now > tsc) sojourn_.Update(ToMicroSec(now - tsc));
+	}
+
+	uint64_t HighWater() const
+	{
+		return depth_.Read().max_;
+	}
+
+	const PerfCounter & Push() const
+	{
+		return push_;
+	}
+
+	const PerfCounter & Pop() const
+	{
+		return pop_;
+	}
+
+	const PerfCounter & Depth() const
+	{
+		return depth_;
+	}
+
+	const PerfCounter & Sojourn() const
+	{
+		return sojourn_;
+	}
+
+private:
+
+	QueueStats(const QueueStats &);
+	QueueStats & operator=(const QueueStats &);
+
+	static uint32_t ToMicroSec(const uint64_t cycles)
+	{
+		const uint64_t us = Rdtsc::ToMicroSec(cycles);
+		return us > UINT32_MAX ? UINT32_MAX : us;
+	}
+
+	static atomic<bool> enabled_;
+
+	PerfCounter push_;
+	PerfCounter pop_;
+	PerfCounter depth_;
+	PerfCounter sojourn_;
+};
+
+// ............................................................................. QueueStatsPtr ....
+
+/**
+ * Stats of a queue, created on first use.
+ */
+class QueueStatsPtr
+{
+public:
+
+	QueueStatsPtr() : stats_(NULL) {}
+
+	~QueueStatsPtr()
+	{
+		delete stats_.load();
+	}
+
+	QueueStats * Get(const string & name)
+	{
+		QueueStats * stats = stats_.load(memory_order_acquire);
+		if (stats) return stats;
+
+		stats = new QueueStats(name);
+
+		QueueStats * expected = NULL;
+		if (!stats_.compare_exchange_strong(expected, stats)) {
+			/*
+			 * Lost the race
+			 */
+			delete stats;
+			return expected;
+		}
+
+		return stats;
+	}
+
+	/**
+	 * NULL if the queue was never used while enabled.
+	 */
+	QueueStats * Peek() const
+	{
+		return stats_.load(memory_order_acquire);
+	}
+
+private:
+
+	QueueStatsPtr(const QueueStatsPtr &);
+	QueueStatsPtr & operator=(const QueueStatsPtr &);
+
+	atomic<QueueStats *> stats_;
+};
+
+}
@@ -0,0 +1,354 @@
+#pragma once
+
+#include <inttypes.h>
+#include <math.h>
+#include <atomic>
+#include <memory>
+
+#include "util.h"
+#include "histogram.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// ................................................................................ RateCounter ....
+
+/**
+ * @class Windowed ops and value rates
+ *
+ * Keeps a ring of per second buckets of operation count and value sum (bytes, items) covering the
+ * last minute, and exponentially weighted moving averages over 1, 5 and 15 minutes like the unix
+ * load average. Nothing is reset by reading.
+ *
+ * The averages advance every TICK_SEC seconds from the ring, by whichever thread updates or reads
+ * first after the tick is due. Time can be passed in explicitly, it defaults to the TSC clock.
+ */
+class RateCounter
+{
+public:
+
+	static const uint64_t NSECONDS = 64;
+	static const uint64_t TICK_SEC = 5;
+
+	enum Window
+	{
+		M1 = 0,
+		M5,
+		M15,
+		NWINDOWS,
+	};
+
+	struct Rates
+	{
+		Rates()
+		{
+			for (int i = 0; i < NWINDOWS; ++i) {
+				ops_[i] = vals_[i] = 0;
+			}
+		}
+
+		/*
+		 * The averages are linear, the rates of a sum are the sum of the rates
+		 */
+		void Merge(const Rates & rhs)
+		{
+			for (int i = 0; i < NWINDOWS; ++i) {
+				ops_[i] += rhs.ops_[i];
+				vals_[i] += rhs.vals_[i];
+			}
+		}
+
+		double ops_[NWINDOWS];		// per second
+		double vals_[NWINDOWS];		// per second
+	};
+
+	explicit RateCounter(const uint64_t nowms = NowMs())
+		: ring_(new Second[NSECONDS])
+		, lastTick_(ToSec(nowms) - ToSec(nowms) % TICK_SEC)
+	{
+		for (uint64_t i = 0; i < NSECONDS; ++i) {
+			ring_[i].sec_.store(0, memory_order_relaxed);
+			ring_[i].count_.store(0, memory_order_relaxed);
+			ring_[i].sum_.store(0, memory_order_relaxed);
+		}
+
+		for (int i = 0; i < NWINDOWS; ++i) {
+			ops_[i].store(0, memory_order_relaxed);
+			vals_[i].store(0, memory_order_relaxed);
+		}
+	}
+
+	void Update(const uint64_t val, const uint64_t nowms = NowMs())
+	{
+		const uint64_t sec = ToSec(nowms);
+
+		Second & s = At(sec);
+		s.count_.fetch_add(/*val=*/ 1, memory_order_relaxed);
+		s.sum_.fetch_add(val, memory_order_relaxed);
+
+		if (sec >= lastTick_.load(memory_order_relaxed) + TICK_SEC) Tick(sec);
+	}
+
+	/**
+	 * Ops per second over the last (complete) seconds, up to a minute.
+	 */
+	double OpsRate(const uint64_t seconds, const uint64_t nowms = NowMs()) const
+	{
+		return Sum(seconds, ToSec(nowms), &Second::count_) / (double) seconds;
+	}
+
+	/**
+	 * Value per second over the last (complete) seconds, up to a minute.
+	 */
+	double ValueRate(const uint64_t seconds, const uint64_t nowms = NowMs()) const
+	{
+		return Sum(seconds, ToSec(nowms), &Second::sum_) / (double) seconds;
+	}
+
+	/**
+	 * 1, 5 and 15 minute moving averages.
+	 */
+	Rates GetRates(const uint64_t nowms = NowMs())
+	{
+		Tick(ToSec(nowms));
+
+		/*
+		 * Pairs with the release in Tick, the averages are complete up to the last tick
+		 */
+		while (lastTick_.load(memory_order_acquire) & BUSY) {
+			__builtin_ia32_pause();
+		}
+
+		Rates rates;
+		for (int i = 0; i < NWINDOWS; ++i) {
+			rates.ops_[i] = ops_[i].load(memory_order_relaxed);
+			rates.vals_[i] = vals_[i].load(memory_order_relaxed);
+		}
+
+		return rates;
+	}
+
+	static uint64_t NowMs()
+	{
+		return Rdtsc::NowInMilliSec();
+	}
+
+private:
+
+	struct Second
+	{
+		atomic<uint64_t> sec_;
+		atomic<uint64_t> count_;
+		atomic<uint64_t> sum_;
+	};
+
+	/*
+	 * Set in sec_ while a bucket is being recycled, and in lastTick_ while the averages are
+	 * being updated
+	 */
+	static const uint64_t BUSY = 1ULL << 63;
+
+	static uint64_t ToSec(const uint64_t ms)
+	{
+		return ms / 1000;
+	}
+
+	/*
+	 * Bucket for the second, recycled if it still holds a second from a minute ago
+	 */
+	Second & At(const uint64_t sec)
+	{
+		Second & s = ring_[sec % NSECONDS];
+
+		for (;;) {
+			uint64_t cur = s.sec_.load(memory_order_acquire);
+			if (cur == sec) break;
+
+			if (cur & BUSY) {
+				__builtin_ia32_pause();
+				continue;
+			}
+
+			/*
+			 * A thread that read the clock late, count it in the newer second
+			 */
+			if (cur > sec) break;
+
+			if (s.sec_.compare_exchange_weak(cur, sec | BUSY, memory_order_acquire)) {
+				s.count_.store(0, memory_order_relaxed);
+				s.sum_.store(0, memory_order_relaxed);
+				s.sec_.store(sec, memory_order_release);
+				break;
+			}
+		}
+
+		return s;
+	}
+
+	/*
+	 * Sum of the field over the seconds [end - n, end)
+	 */
+	uint64_t Sum(const uint64_t n, const uint64_t end, atomic<uint64_t> Second::* field) const
+	{
+		INVARIANT(n && n < NSECONDS);
+
+		uint64_t sum = 0;
+		for (uint64_t sec = end - n; sec < end; ++sec) {
+			const Second & s = ring_[sec % NSECONDS];
+			if (s.sec_.load(memory_order_acquire) == sec) sum += (s.*field).load();
+		}
+
+		return sum;
+	}
+
+	void Tick(const uint64_t sec)
+	{
+		const uint64_t target = sec - sec % TICK_SEC;
+
+		uint64_t last = lastTick_.load(memory_order_relaxed);
+		if (last >= target) return;
+
+		if (!lastTick_.compare_exchange_strong(last, last | BUSY, memory_order_acquire)) {
+			/*
+			 * Somebody else is ticking
+			 */
+			return;
+		}
+
+		/*
+		 * Seconds that fell out of the ring read as zero, each tick then only decays the
+		 * averages. Beyond 15 minutes of that all of them are close to zero anyway.
+		 */
+		static const uint64_t MAX_TICKS = 15 * 60 / TICK_SEC;
+		if ((target - last) / TICK_SEC > MAX_TICKS) last = target - MAX_TICKS * TICK_SEC;
+
+		static const double minutes[NWINDOWS] = { 1, 5, 15 };
+
+		for (uint64_t t = last + TICK_SEC; t <= target; t += TICK_SEC) {
+			const double ops = Sum(TICK_SEC, t, &Second::count_);
+			const double vals = Sum(TICK_SEC, t, &Second::sum_);
+
+			for (int i = 0; i < NWINDOWS; ++i) {
+				const double alpha = exp(-(double) TICK_SEC / (60 * minutes[i]));
+				Decay(ops_[i], alpha, ops / TICK_SEC);
+				Decay(vals_[i], alpha, vals / TICK_SEC);
+			}
+		}
+
+		/*
+		 * Published last, readers that see the tick see the averages it produced
+		 */
+		lastTick_.store(target, memory_order_release);
+	}
+
+	static void Decay(atomic<double> & ewma, const double alpha, const double rate)
+	{
+		const double prev = ewma.load(memory_order_relaxed);
+		ewma.store(prev * alpha + rate * (1 - alpha), memory_order_relaxed);
+	}
+
+	RateCounter(const RateCounter &);
+	RateCounter & operator=(const RateCounter &);
+
+	unique_ptr<Second[]> ring_;
+	atomic<uint64_t> lastTick_;
+	atomic<double> ops_[NWINDOWS];
+	atomic<double> vals_[NWINDOWS];
+};
+
+// .......................................................................... WindowedHistogram ....
+
+/**
+ * @class Histogram over a sliding window
+ *
+ * The window is divided in NSLOTS slots of a few seconds, each with its own Histogram which is
+ * recycled once it falls out of the window. Snapshot merges the live slots, so the window slides
+ * in steps of a slot.
+ */
+class WindowedHistogram
+{
+public:
+
+	static const uint64_t NSLOTS = 6;
+
+	explicit WindowedHistogram(const int digits = Histogram::DEFAULT_DIGITS,
+				   const uint64_t windowSec = 60)
+		: digits_(digits)
+		, slotSec_(windowSec / NSLOTS ? windowSec / NSLOTS : 1)
+		, slots_(new Slot[NSLOTS])
+	{
+		for (uint64_t i = 0; i < NSLOTS; ++i) {
+			slots_[i].id_.store(0, memory_order_relaxed);
+			slots_[i].hist_.reset(new Histogram(digits));
+		}
+	}
+
+	void Record(const uint64_t val, const uint64_t nowms = RateCounter::NowMs())
+	{
+		At(nowms / 1000 / slotSec_).Record(val);
+	}
+
+	/**
+	 * Merged histogram of the last window.
+	 */
+	Histogram Snapshot(const uint64_t nowms = RateCounter::NowMs()) const
+	{
+		const uint64_t cur = nowms / 1000 / slotSec_;
+
+		Histogram h(digits_);
+		for (uint64_t i = 0; i < NSLOTS; ++i) {
+			const uint64_t id = slots_[i].id_.load(memory_order_acquire);
+			if (id <= cur && id + NSLOTS > cur) h.Merge(*slots_[i].hist_);
+		}
+
+		return h;
+	}
+
+	uint64_t WindowSec() const
+	{
+		return slotSec_ * NSLOTS;
+	}
+
+private:
+
+	struct Slot
+	{
+		atomic<uint64_t> id_;
+		unique_ptr<Histogram> hist_;
+	};
+
+	static const uint64_t BUSY = 1ULL << 63;
+
+	Histogram & At(const uint64_t id)
+	{
+		Slot & slot = slots_[id % NSLOTS];
+
+		for (;;) {
+			uint64_t cur = slot.id_.load(memory_order_acquire);
+			if (cur == id || (!(cur & BUSY) && cur > id)) break;
+
+			if (cur & BUSY) {
+				__builtin_ia32_pause();
+				continue;
+			}
+
+			if (slot.id_.compare_exchange_weak(cur, id | BUSY, memory_order_acquire)) {
+				slot.hist_->Reset();
+				slot.id_.store(id, memory_order_release);
+				break;
+			}
+		}
+
+		return *slot.hist_;
+	}
+
+	WindowedHistogram(const WindowedHistogram &);
+	WindowedHistogram & operator=(const WindowedHistogram &);
+
+	const int digits_;
+	const uint64_t slotSec_;
+	unique_ptr<Slot[]> slots_;
+};
+
+}
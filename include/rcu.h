@@ -0,0 +1,300 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <list>
+
+#include "logger.h"
+#include "lock.h"
+#include "perfcounter.h"
+#include "thread-record.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// .................................................................................. RcuRecord ....
+
+/**
+ * Per thread quiescent state counter. Zero means the thread is offline and does not hold up
+ * grace periods.
+ */
+struct RcuRecord : ThreadRecord<RcuRecord>
+{
+	RcuRecord() : ctr_(0) {}
+
+	atomic<uint64_t> ctr_;
+
+	char pad_[CACHELINE_SIZE];
+};
+
+// ........................................................................................ Rcu ....
+
+/**
+ * @class Quiescent state based read-copy-update
+ *
+ * Readers do not announce anything when they read. Instead every online thread periodically
+ * declares a quiescent state, a point where it holds no reference to RCU protected data, by
+ * calling QuiescentState (ThreadCtx::GarbageCollect does this). A grace period is over once every
+ * online thread has declared a quiescent state after it began, at which point objects replaced
+ * before the grace period can be destroyed.
+ *
+ * Threads are registered offline, and only a thread that reads RCU protected data goes Online,
+ * taking on the duty to call QuiescentState from its loop. Online threads that block for long
+ * should go offline for the wait (RcuOfflineScope, the queue waits do this), else they hold up
+ * reclamation until they wake up.
+ *
+ * When the kernel supports MEMBARRIER_CMD_PRIVATE_EXPEDITED, updaters issue the memory barrier on
+ * behalf of readers, and Online becomes fence free.
+ */
+class Rcu
+{
+public:
+
+	typedef void (*deleter_t)(void *);
+
+	static void Register();
+	static void Unregister();
+
+	static bool IsRegistered()
+	{
+		return rec_;
+	}
+
+	static void QuiescentState()
+	{
+		RcuRecord * rec = rec_;
+		ASSERT(rec);
+
+		/*
+		 * The release store orders all our prior reads before the announcement, which is
+		 * all the updater needs
+		 */
+		const uint64_t gp = gp_.load(memory_order_acquire);
+		const uint64_t ctr = rec->ctr_.load(memory_order_relaxed);
+		if (!ctr || ctr == gp) return;
+
+		rec->ctr_.store(gp, memory_order_release);
+	}
+
+	static bool IsOnline()
+	{
+		return rec_ && rec_->ctr_.load(memory_order_relaxed);
+	}
+
+	static void Offline()
+	{
+		ASSERT(rec_);
+		rec_->ctr_.store(/*ctr=*/ 0, memory_order_release);
+	}
+
+	static void Online()
+	{
+		ASSERT(rec_);
+		rec_->ctr_.store(gp_.load(memory_order_acquire), memory_order_relaxed);
+
+		/*
+		 * The counter has to be visible before we read any protected pointer, else an updater
+		 * can consider us offline
+		 */
+		if (UseMembarrier()) {
+			atomic_signal_fence(memory_order_seq_cst);
+		} else {
+			atomic_thread_fence(memory_order_seq_cst);
+		}
+	}
+
+	/**
+	 * Deferred objects gathered before a grace period is started for them
+	 */
+	static const size_t BATCH_SIZE = 64;
+
+	/**
+	 * Wait for a full grace period and destroy everything deferred before it. Must not be
+	 * called from a read side critical section.
+	 */
+	static void Synchronize();
+
+	/**
+	 * Destroy ptr once a grace period has elapsed after the call.
+	 *
+	 * Objects are batched, and every BATCH_SIZE of them the deferring thread starts one grace
+	 * period for the batch and reclaims the earlier batches. Reclaim and Synchronize start one
+	 * for a partial batch.
+	 */
+	template<class T>
+	static void Defer(T * t)
+	{
+		Defer((void *) t, &Delete<T>);
+	}
+
+	static void Defer(void * ptr, deleter_t deleter);
+
+	/**
+	 * Start a grace period for the pending batch, and destroy deferred objects whose grace
+	 * period has elapsed.
+	 *
+	 * @returns	number of objects destroyed
+	 */
+	static size_t Reclaim();
+
+	static bool UseMembarrier()
+	{
+		static const bool useMembarrier = InitMembarrier();
+		return useMembarrier;
+	}
+
+private:
+
+	struct Deferred
+	{
+		uint64_t gp_;
+		void * ptr_;
+		deleter_t deleter_;
+	};
+
+	typedef ThreadRecordList<RcuRecord> records_t;
+
+	template<class T>
+	static void Delete(void * ptr)
+	{
+		delete (T *) ptr;
+	}
+
+	static bool InitMembarrier();
+	static void Barrier();
+	static uint64_t MinOnlineCounter();
+
+	/*
+	 * With lock_ held
+	 */
+	static uint64_t StartGracePeriod();
+	static void Collect(const uint64_t gp, list<Deferred> & done);
+
+	static size_t Destroy(list<Deferred> & done);
+
+	static __thread RcuRecord * rec_;
+	static atomic<uint64_t> gp_;
+
+	static PThreadMutex lock_;
+	static list<Deferred> pending_;		// no grace period started for them yet
+	static list<Deferred> deferred_;	// waiting for their grace period
+
+	static string log_;
+
+	static PerfCounter statSync_;
+	static PerfCounter statDeferred_;
+};
+
+// ............................................................................ RcuOfflineScope ....
+
+/**
+ * @class The calling thread, if online, is offline for the scope. For blocking waits.
+ */
+class RcuOfflineScope
+{
+public:
+
+	RcuOfflineScope()
+		: online_(Rcu::IsOnline())
+	{
+		if (online_) Rcu::Offline();
+	}
+
+	~RcuOfflineScope()
+	{
+		if (online_) Rcu::Online();
+	}
+
+private:
+
+	RcuOfflineScope(const RcuOfflineScope &);
+	RcuOfflineScope & operator=(const RcuOfflineScope &);
+
+	const bool online_;
+};
+
+// ............................................................................... RcuReader<T> ....
+
+/**
+ * Read side reference to an RCU protected object. It is nothing more than the pointer; it stays
+ * valid until the reading thread's next quiescent state.
+ */
+template<class T>
+class RcuReader
+{
+public:
+
+	explicit RcuReader(const T * t) : t_(t) {}
+
+	const T * operator->() const
+	{
+		ASSERT(t_);
+		return t_;
+	}
+
+	const T & operator*() const
+	{
+		ASSERT(t_);
+		return *t_;
+	}
+
+	const T * Get() const
+	{
+		return t_;
+	}
+
+	operator bool() const
+	{
+		return t_;
+	}
+
+private:
+
+	const T * t_;
+};
+
+// .................................................................................. RcuPtr<T> ....
+
+/**
+ * RCU protected pointer, for data that is read very often and replaced wholesale rarely (routing
+ * tables, connection maps).
+ */
+template<class T>
+class RcuPtr
+{
+public:
+
+	explicit RcuPtr(T * t = NULL) : ptr_(t) {}
+
+	/*
+	 * There is blanket assumption here that there are no readers left
+	 */
+	~RcuPtr()
+	{
+		delete ptr_.load();
+	}
+
+	RcuReader<T> Read() const
+	{
+		return RcuReader<T>(ptr_.load(memory_order_acquire));
+	}
+
+	/**
+	 * Publish t and destroy the old object once all readers are done with it.
+	 */
+	void Update(T * t)
+	{
+		T * old = ptr_.exchange(t, memory_order_acq_rel);
+		if (old) Rcu::Defer(old);
+	}
+
+private:
+
+	RcuPtr(const RcuPtr &);
+	RcuPtr & operator=(const RcuPtr &);
+
+	atomic<T *> ptr_;
+};
+
+}
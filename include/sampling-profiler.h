@@ -0,0 +1,74 @@
+#pragma once
+
+#include <inttypes.h>
+#include <ostream>
+
+namespace bblocks {
+
+using namespace std;
+
+// ........................................................................... SamplingProfiler ....
+
+/**
+ * @class In process sampling CPU profiler
+ *
+ * While running, every registered thread gets a timer on its own CPU time clock which raises
+ * SIGPROF every 1/hz seconds of CPU the thread consumes. The signal handler captures the stack
+ * of the interrupted thread into a single producer ring of the thread, with no locks or
+ * allocation. The rings are drained into an aggregate of stacks on Collect, and written out in
+ * folded stack format, one "root;...;leaf count" line per stack, ready for flamegraph.pl or
+ * speedscope.
+ *
+ * Threads started through Thread register themselves, other threads (main) must call
+ * RegisterThread. Profiling can be started and stopped at any time. When it is stopped there
+ * are no timers and no signals, the only cost left is registering threads as they start.
+ *
+ * Frames are named through dladdr, functions of the executable need it linked with -rdynamic
+ * (ENABLE_EXPORTS). Unresolved frames show as module+offset.
+ */
+class SamplingProfiler
+{
+public:
+
+	static const uint32_t DEFAULT_HZ = 99;
+	static const uint32_t MAX_DEPTH = 48;
+	static const uint32_t NSAMPLES = 2048;		// per thread, between collections
+
+	/**
+	 * Start sampling the registered threads.
+	 */
+	static bool Start(const uint32_t hz = DEFAULT_HZ);
+
+	/**
+	 * Stop sampling, and collect what was sampled.
+	 */
+	static void Stop();
+
+	static bool IsRunning();
+
+	static void RegisterThread();
+	static void UnregisterThread();
+
+	static size_t NumThreads();
+
+	/**
+	 * Move the samples of the thread rings to the aggregate. Rings hold NSAMPLES samples, a
+	 * long running profile should collect before they fill up (about 20s of CPU per thread at
+	 * the default rate).
+	 */
+	static void Collect();
+
+	/**
+	 * Collect and write the aggregate in folded stack format, then clear it.
+	 *
+	 * @returns number of samples written
+	 */
+	static uint64_t WriteFolded(ostream & os);
+
+	/**
+	 * Samples lost to full rings.
+	 */
+	static uint64_t NumDropped();
+};
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <ostream>
+#include <string>
+
+#include "thread.h"
+#include "lock.h"
+#include "perfcounter.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// .............................................................................. StatsExporter ....
+
+/**
+ * @class Background exporter of all registered PerfCounters
+ *
+ * Every interval the exporter thread writes a snapshot of the PerfCounterRegistry, in Prometheus
+ * text format or JSON, to a file or to a unix socket. Counters sharing a name are merged. Names
+ * that make the same Prometheus metric name (/q/a-b and /q/a_b) are exported as one metric with
+ * the counter name as a label. Files are replaced atomically (written aside and renamed), so a
+ * scraper never reads half a snapshot. A target of the form unix:<path> connects to a listening
+ * stream socket at path and writes the snapshot to it. The thread counters (ThreadStats) are
+ * sampled before every export.
+ *
+ * Usage : StatsExporter exporter("/var/run/iocore.prom", StatsExporter::PROMETHEUS);
+ *         exporter.Start();
+ *         ...
+ *         exporter.Stop();
+ */
+class StatsExporter : public Thread
+{
+public:
+
+	enum Format
+	{
+		PROMETHEUS = 0,
+		JSON,
+	};
+
+	StatsExporter(const string & target, const Format format, const uint32_t intervalms = 1000)
+		: Thread("/statsexporter")
+		, target_(target)
+		, format_(format)
+		, intervalms_(intervalms)
+		, stop_(false)
+		, nexports_(0)
+	{}
+
+	/**
+	 * Stop the exporter thread and wait for it to exit, after a last export.
+	 */
+	void Stop();
+
+	/**
+	 * Write a snapshot to the target now, from the calling thread.
+	 */
+	bool Export();
+
+	uint64_t NumExports() const
+	{
+		return nexports_.load();
+	}
+
+	static void WritePrometheus(ostream & os);
+	static void WriteJson(ostream & os);
+
+protected:
+
+	void * ThreadMain() override;
+
+private:
+
+	bool WriteFile(const string & path, const string & data);
+	bool WriteSocket(const string & path, const string & data);
+
+	const string target_;
+	const Format format_;
+	const uint32_t intervalms_;
+	atomic<bool> stop_;
+	EventCount wakeup_;
+	atomic<uint64_t> nexports_;
+};
+
+}
@@ -0,0 +1,383 @@
+#pragma once
+
+#include <inttypes.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+/*
+ * Layout of the shared memory stats segment. This header is shared with the external readers
+ * (iocore-stat), keep it free of other iocore dependencies. Any change to the layout must bump
+ * STAT_VERSION.
+ */
+
+namespace bblocks {
+
+using namespace std;
+
+static const uint64_t STAT_MAGIC = 0x54534552434f4349ULL;	// "IOCOREST"
+static const uint32_t STAT_VERSION = 1;
+
+// ................................................................................... StatCell ....
+
+/**
+ * Values of a PerfCounter, or of one thread's shard of a sharded PerfCounter. Sized to whole
+ * cache lines, so cells laid out in an array do not false share.
+ */
+struct StatCell
+{
+	static const int NBUCKETS = 32;
+
+	void Init()
+	{
+		val_.store(0, memory_order_relaxed);
+		count_.store(0, memory_order_relaxed);
+		min_.store(UINT32_MAX, memory_order_relaxed);
+		max_.store(0, memory_order_relaxed);
+
+		for (int i = 0; i < NBUCKETS; ++i) {
+			bucket_[i].store(0, memory_order_relaxed);
+		}
+
+		next_.store(0, memory_order_relaxed);
+	}
+
+	atomic<uint64_t> val_;
+	atomic<uint64_t> count_;
+	atomic<uint64_t> min_;
+	atomic<uint64_t> max_;
+	atomic<uint32_t> bucket_[NBUCKETS];
+	atomic<uint32_t> next_;		// next shard cell of the counter (index + 1), 0 at the end
+	char pad_[192 - 4 * 8 - NBUCKETS * 4 - 4];
+};
+
+static_assert(sizeof(StatCell) == 192, "StatCell is part of the segment layout");
+
+// ................................................................................... StatSlot ....
+
+/**
+ * One counter in the segment.
+ *
+ * A slot is reused once its counter is destroyed. gen_ is bumped when the slot is taken and when
+ * it is freed, readers check it before and after reading the slot to detect reuse.
+ */
+struct StatSlot
+{
+	enum State
+	{
+		FREE = 0,
+		BUSY,
+		LIVE,
+	};
+
+	static const int NAME_SIZE = 96;
+	static const int UNITS_SIZE = 16;
+
+	atomic<uint32_t> state_;
+	atomic<uint32_t> gen_;
+	uint32_t type_;
+	atomic<uint32_t> shards_;	// first shard cell (index + 1), 0 if none
+	char name_[NAME_SIZE];
+	char units_[UNITS_SIZE];
+	StatCell cell_;
+};
+
+static_assert(sizeof(StatSlot) == 320, "StatSlot is part of the segment layout");
+
+// ................................................................................. StatHeader ....
+
+/**
+ * Segment header, followed by nslots_ slots at slotsOffset_ and ncells_ cells at cellsOffset_.
+ * magic_ is written last, a reader seeing it can trust the rest of the header.
+ */
+struct StatHeader
+{
+	atomic<uint64_t> magic_;
+	uint32_t version_;
+	uint32_t headerSize_;
+	uint32_t slotSize_;
+	uint32_t cellSize_;
+	uint32_t nslots_;
+	uint32_t ncells_;
+	uint64_t slotsOffset_;
+	uint64_t cellsOffset_;
+	uint64_t size_;
+	uint64_t pid_;
+	uint64_t startms_;		// wall clock
+	atomic<uint32_t> nslotsUsed_;	// high water of slots ever used
+	atomic<uint32_t> ncellsUsed_;	// high water of cells ever used
+};
+
+static_assert(sizeof(StatHeader) <= 4096, "StatHeader must fit the first page");
+
+// ............................................................................... StatsSegment ....
+
+/**
+ * @class Shared memory segment publishing PerfCounter values
+ *
+ * While a segment is open, PerfCounters created from then on keep their values in a slot of the
+ * segment instead of in the process heap. External readers map the segment read only and read
+ * the live values directly, without any system call in or cooperation from the process. Sharded
+ * counters carve their per thread cells out of the segment as well.
+ *
+ * Counters are mostly static objects, constructed before main. Setting IOCORE_STATS_SHM=<name>
+ * in the environment opens the segment when the first counter is created, which covers them.
+ * Otherwise Open must be called before the counters of interest are created.
+ */
+class StatsSegment
+{
+public:
+
+	static const uint32_t DEFAULT_NSLOTS = 4096;
+	static const uint32_t DEFAULT_NCELLS = 16384;
+
+	/**
+	 * Create the segment /dev/shm/<name> and make it the process segment.
+	 */
+	static bool Open(const string & name, const uint32_t nslots = DEFAULT_NSLOTS,
+			 const uint32_t ncells = DEFAULT_NCELLS);
+
+	/**
+	 * Detach the process segment and remove it. Must not be called while counters created
+	 * with the segment are still alive.
+	 */
+	static void Close();
+
+	/**
+	 * The process segment, opened from the environment on the first call. NULL if there is
+	 * none.
+	 */
+	static StatsSegment * Get()
+	{
+		StatsSegment * seg = instance_.load(memory_order_acquire);
+		return seg ? seg : OpenFromEnv();
+	}
+
+	StatSlot * AllocSlot(const string & name, const string & units, const uint32_t type);
+
+	/**
+	 * Free the slot, and the shard cells chained to it
+	 */
+	void FreeSlot(StatSlot * slot);
+
+	/**
+	 * Allocate a shard cell for the slot, freed with the slot.
+	 */
+	StatCell * AllocCell(StatSlot * slot);
+
+	const string & Name() const
+	{
+		return name_;
+	}
+
+private:
+
+	StatsSegment(const string & name, uint8_t * base, const size_t size)
+		: name_(name), base_(base), size_(size)
+	{
+		pthread_mutex_init(&lock_, /*attr=*/ NULL);
+	}
+
+	~StatsSegment()
+	{
+		pthread_mutex_destroy(&lock_);
+	}
+
+	static bool Create(const string & name, const uint32_t nslots, const uint32_t ncells);
+	static StatsSegment * OpenFromEnv();
+
+	StatHeader * Header() const
+	{
+		return (StatHeader *) base_;
+	}
+
+	StatSlot * Slots() const
+	{
+		return (StatSlot *) (base_ + Header()->slotsOffset_);
+	}
+
+	StatCell * Cells() const
+	{
+		return (StatCell *) (base_ + Header()->cellsOffset_);
+	}
+
+	static atomic<StatsSegment *> instance_;
+
+	const string name_;
+	uint8_t * const base_;
+	const size_t size_;
+
+	pthread_mutex_t lock_;
+	vector<uint32_t> freeCells_;	// cells of freed slots, under the lock
+};
+
+// ......................................................................... StatsSegmentReader ....
+
+/**
+ * Read only view of a stats segment, for use from another process.
+ */
+class StatsSegmentReader
+{
+public:
+
+	struct Counter
+	{
+		uint32_t slot_;
+		uint32_t gen_;
+		uint32_t type_;
+		string name_;
+		string units_;
+		uint64_t val_;
+		uint64_t count_;
+		uint64_t min_;
+		uint64_t max_;
+		uint64_t bucket_[StatCell::NBUCKETS];
+	};
+
+	StatsSegmentReader() : base_(NULL), size_(0) {}
+
+	~StatsSegmentReader()
+	{
+		Close();
+	}
+
+	/**
+	 * Map the segment /dev/shm/<name>.
+	 *
+	 * @returns empty string on success, the reason otherwise
+	 */
+	string Open(const string & name)
+	{
+		Close();
+
+		const int fd = shm_open(name.c_str(), O_RDONLY, /*mode=*/ 0);
+		if (fd < 0) return "unable to open " + name + ": " + strerror(errno);
+
+		struct stat st;
+		if (fstat(fd, &st) || (size_t) st.st_size < sizeof(StatHeader)) {
+			close(fd);
+			return "segment " + name + " is truncated";
+		}
+
+		void * base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, /*off=*/ 0);
+		close(fd);
+
+		if (base == MAP_FAILED) return "unable to map " + name + ": " + strerror(errno);
+
+		base_ = (const uint8_t *) base;
+		size_ = st.st_size;
+
+		const StatHeader * h = Header();
+		if (h->magic_.load(memory_order_acquire) != STAT_MAGIC) {
+			Close();
+			return "segment " + name + " is not a stats segment";
+		}
+
+		if (h->version_ != STAT_VERSION || h->slotSize_ != sizeof(StatSlot)
+		    || h->cellSize_ != sizeof(StatCell) || h->size_ > size_) {
+			Close();
+			return "segment " + name + " has an unsupported layout version";
+		}
+
+		return string();
+	}
+
+	void Close()
+	{
+		if (base_) munmap((void *) base_, size_);
+		base_ = NULL;
+		size_ = 0;
+	}
+
+	const StatHeader * Header() const
+	{
+		return (const StatHeader *) base_;
+	}
+
+	/**
+	 * Snapshot of the live counters, in slot order. Shard cells are merged.
+	 */
+	vector<Counter> Read() const
+	{
+		vector<Counter> counters;
+
+		const StatHeader * h = Header();
+		const uint32_t nslots = h->nslotsUsed_.load(memory_order_acquire);
+		const StatSlot * slots = (const StatSlot *) (base_ + h->slotsOffset_);
+
+		for (uint32_t i = 0; i < nslots && i < h->nslots_; ++i) {
+			Counter c;
+			if (ReadSlot(slots[i], i, c)) counters.push_back(c);
+		}
+
+		return counters;
+	}
+
+private:
+
+	bool ReadSlot(const StatSlot & slot, const uint32_t idx, Counter & c) const
+	{
+		c.gen_ = slot.gen_.load(memory_order_acquire);
+		if (slot.state_.load(memory_order_acquire) != StatSlot::LIVE) return false;
+
+		c.slot_ = idx;
+		c.type_ = slot.type_;
+		c.name_ = string(slot.name_, strnlen(slot.name_, StatSlot::NAME_SIZE));
+		c.units_ = string(slot.units_, strnlen(slot.units_, StatSlot::UNITS_SIZE));
+		c.val_ = c.count_ = c.max_ = 0;
+		c.min_ = UINT32_MAX;
+
+		for (int i = 0; i < StatCell::NBUCKETS; ++i) {
+			c.bucket_[i] = 0;
+		}
+
+		Merge(slot.cell_, c);
+
+		const StatHeader * h = Header();
+		const StatCell * cells = (const StatCell *) (base_ + h->cellsOffset_);
+
+		uint32_t next = slot.shards_.load(memory_order_acquire);
+		for (uint32_t n = 0; next && next <= h->ncells_ && n < h->ncells_; ++n) {
+			const StatCell & cell = cells[next - 1];
+			Merge(cell, c);
+			next = cell.next_.load(memory_order_acquire);
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+
+		/*
+		 * The slot was freed or reused under us
+		 */
+		return slot.gen_.load(memory_order_relaxed) == c.gen_;
+	}
+
+	static void Merge(const StatCell & cell, Counter & c)
+	{
+		c.val_ += cell.val_.load(memory_order_relaxed);
+		c.count_ += cell.count_.load(memory_order_relaxed);
+
+		const uint64_t min = cell.min_.load(memory_order_relaxed);
+		if (min < c.min_) c.min_ = min;
+
+		const uint64_t max = cell.max_.load(memory_order_relaxed);
+		if (max > c.max_) c.max_ = max;
+
+		for (int i = 0; i < StatCell::NBUCKETS; ++i) {
+			c.bucket_[i] += cell.bucket_[i].load(memory_order_relaxed);
+		}
+	}
+
+	StatsSegmentReader(const StatsSegmentReader &);
+	StatsSegmentReader & operator=(const StatsSegmentReader &);
+
+	const uint8_t * base_;
+	size_t size_;
+};
+
+}
@@ -6,6 +6,10 @@
 #include "thread.h"
 #include "perfcounter.h"
 #include "sysconf.h"
+#include "epoch.h"
+#include "hazard.h"
+#include "rcu.h"
+#include "usdt.h"
 
 namespace bblocks {
 
@@ -50,6 +54,10 @@ struct ThreadCtx
 		if (tinst_) {
 			tinst_->ctx_pool_ = pool_;
 		}
+
+		Epoch::Register();
+		Hazard::Register();
+		Rcu::Register();
 	}
 
 	static void Cleanup()
@@ -67,6 +75,13 @@ struct ThreadCtx
 			printstat = false;
 		}
 
+		/*
+		 * Thread::ThFn lets go of them first
+		 */
+		if (Rcu::IsRegistered()) Rcu::Unregister();
+		if (Hazard::IsRegistered()) Hazard::Unregister();
+		if (Epoch::IsRegistered()) Epoch::Unregister();
+
 		if (tinst_) {
 			tinst_->ctx_pool_ = NULL;
 			tinst_ = NULL;
@@ -96,6 +111,11 @@ struct ThreadCtx
 		INVARIANT(ThreadCtx::tinst_);
 		INVARIANT(ThreadCtx::pool_);
 
+		/*
+		 * Thread loops call us between requests, which is a quiescent state by definition
+		 */
+		Rcu::QuiescentState();
+
 		static __thread uint64_t lastInMilliSec = Rdtsc::NowInMilliSec();
 
 		uint64_t nowInMilliSec = Rdtsc::NowInMilliSec();
@@ -119,6 +139,7 @@ struct ThreadCtx
 			}
 
 			statGC_.Update(bytes);
+			IOCORE_PROBE1(threadctx_gc, bytes);
 
 			lastInMilliSec = nowInMilliSec;
 
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// ................................................................................ ThreadIndex ....
+
+/**
+ * Small, dense index for the calling thread, for indexing per thread slots in arrays.
+ *
+ * Indexes are handed out lowest first and recycled when a thread exits, so arrays of MAX_THREADS
+ * slots stay densely used. A thread that finds all the indexes taken, or uses Get after its index
+ * was released on exit, gets MAX_THREADS and is expected to fall back to a shared slot.
+ */
+class ThreadIndex
+{
+public:
+
+	static const uint32_t MAX_THREADS = 256;
+
+	static uint32_t Get()
+	{
+		/*
+		 * index_ is biased by one, so that zero means not assigned yet
+		 */
+		const uint32_t idx = index_;
+		return idx ? idx - 1 : Assign();
+	}
+
+	/**
+	 * Unique to this thread's hold of its index, tells apart the threads that held the same
+	 * index over time. 0 for a thread without an index.
+	 */
+	static uint64_t Serial()
+	{
+		Get();
+		return serial_;
+	}
+
+	/**
+	 * Upper bound of the indexes handed out so far, for scanning the slots in use.
+	 */
+	static uint32_t HighWater()
+	{
+		return highWater_.load(memory_order_acquire);
+	}
+
+	/**
+	 * Number of threads currently holding an index.
+	 */
+	static uint32_t Count();
+
+private:
+
+	struct Holder
+	{
+		Holder();
+		~Holder();
+
+		uint32_t idx_;
+		uint64_t serial_;
+	};
+
+	static uint32_t Assign();
+
+	static __thread uint32_t index_;
+	static __thread uint64_t serial_;
+	static atomic<uint32_t> highWater_;
+	static atomic<uint64_t> nextSerial_;
+};
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+
+#include "util.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// ............................................................................ ThreadRecord<T> ....
+
+/**
+ * Base class for per thread records that other threads need to scan (epochs, hazard slots,
+ * quiescent state counters).
+ *
+ * Usage : struct X : public ThreadRecord<X> {}
+ */
+template<class T>
+struct ThreadRecord
+{
+	ThreadRecord() : next_(NULL), inuse_(false) {}
+
+	T * next_;		// immutable once published
+	atomic<bool> inuse_;
+};
+
+// ........................................................................ ThreadRecordList<T> ....
+
+/**
+ * Global, grow only list of thread records.
+ *
+ * Records are never freed, which is what makes it safe to scan the list without a lock. A thread
+ * releasing its record leaves it on the list and the next thread to acquire one adopts it, along
+ * with whatever owner state the previous thread left behind.
+ */
+template<class T>
+class ThreadRecordList
+{
+public:
+
+	static T * Acquire()
+	{
+		for (T * rec = Head(); rec; rec = rec->next_) {
+			bool inuse = false;
+			if (!rec->inuse_.load(memory_order_relaxed)
+			    && rec->inuse_.compare_exchange_strong(inuse, true)) {
+				return rec;
+			}
+		}
+
+		T * rec = new T();
+		rec->inuse_.store(true);
+
+		T * head = head_.load();
+		do {
+			rec->next_ = head;
+		} while (!head_.compare_exchange_weak(head, rec));
+
+		size_.fetch_add(/*val=*/ 1);
+
+		return rec;
+	}
+
+	static void Release(T * rec)
+	{
+		ASSERT(rec->inuse_.load());
+		rec->inuse_.store(false, memory_order_release);
+	}
+
+	static T * Head()
+	{
+		return head_.load(memory_order_acquire);
+	}
+
+	static size_t Size()
+	{
+		return size_.load(memory_order_relaxed);
+	}
+
+private:
+
+	static atomic<T *> head_;
+	static atomic<size_t> size_;
+};
+
+template<class T>
+atomic<T *> ThreadRecordList<T>::head_(/*head=*/ NULL);
+
+template<class T>
+atomic<size_t> ThreadRecordList<T>::size_(/*size=*/ 0);
+
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <inttypes.h>
+#include <time.h>
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "util.h"
+#include "perfcounter.h"
+
+namespace bblocks {
+
+using namespace std;
+
+// ................................................................................ ThreadStats ....
+
+/**
+ * @class CPU, busy and idle time of a thread
+ *
+ * A thread is idle while it sleeps in a queue pop (InQueue, Queue) waiting for work, and busy the
+ * rest of the time, whether it runs or blocks on anything else. The thread keeps its idle time
+ * itself, a TSC read and a few stores per sleep. Sample turns it into busy and idle time, reads the
+ * CPU time clock of the thread and adds the deltas to the counters of the thread:
+ *
+ *	<name>/busy-time, <name>/idle-time, <name>/cpu-time	microsec, WINDOWED
+ *	<name>/ctx-switches/voluntary, <name>/ctx-switches/involuntary
+ *	<name>/utilization					percent busy over the window
+ *
+ * The value rates of busy-time are microseconds busy per second, so rate / 10^4 is the percentage
+ * busy over 1, 5 and 15 minutes. Threads sharing a name share counters.
+ *
+ * Context switches are only readable by the thread itself (getrusage(RUSAGE_THREAD)), it refreshes
+ * them when going idle at most every RUSAGE_INTERVAL_MS, and on exit.
+ *
+ * Every Thread has a ThreadStats, which the StatsExporter samples on every export. Without an
+ * exporter, call SampleAll periodically.
+ */
+class ThreadStats
+{
+public:
+
+	static const uint32_t DEFAULT_WINDOW_MS = 10 * 1000;
+	static const uint32_t RUSAGE_INTERVAL_MS = 10;
+	static const uint32_t NSAMPLES = 64;
+
+	/**
+	 * Totals since the thread started.
+	 */
+	struct Times
+	{
+		uint64_t busyus_;
+		uint64_t idleus_;
+		uint64_t cpuus_;
+		uint64_t nvcsw_;		// voluntary context switches
+		uint64_t nivcsw_;		// involuntary context switches
+	};
+
+	explicit ThreadStats(const string & name, const uint32_t windowms = DEFAULT_WINDOW_MS);
+	~ThreadStats();
+
+	/**
+	 * Start and stop accounting, from the thread.
+	 */
+	void Attach();
+	void Detach();
+
+	/**
+	 * Stats of the calling thread, NULL if it is not attached.
+	 */
+	static ThreadStats * Current()
+	{
+		return current_;
+	}
+
+	void BeginIdle()
+	{
+		const uint64_t now = Rdtsc::rdtsc();
+
+		BeginUpdate();
+		idleSince_.store(now, memory_order_relaxed);
+		EndUpdate();
+
+		if (now - lastRusage_ >= rusageCycles_) ReadRusage(now);
+	}
+
+	void EndIdle()
+	{
+		const uint64_t now = Rdtsc::rdtsc();
+		const uint64_t since = idleSince_.load(memory_order_relaxed);
+
+		BeginUpdate();
+		idleCycles_.store(idleCycles_.load(memory_order_relaxed) + now - since,
+				  memory_order_relaxed);
+		idleSince_.store(0, memory_order_relaxed);
+		EndUpdate();
+	}
+
+	/**
+	 * Totals as of now.
+	 */
+	Times Read() const;
+
+	/**
+	 * Add what changed since the last sample to the counters.
+	 */
+	void Sample();
+
+	static void SampleAll();
+
+	/**
+	 * Percent of the time the thread was busy over the window, as of the last sample.
+	 */
+	double Utilization() const;
+
+	const string & Name() const
+	{
+		return name_;
+	}
+
+private:
+
+	struct Point
+	{
+		uint64_t tsc_;
+		uint64_t busy_;		// cycles
+	};
+
+	ThreadStats(const ThreadStats &);
+	ThreadStats & operator=(const ThreadStats &);
+
+	/*
+	 * Only the thread updates the idle state, readers retry while the sequence is odd or
+	 * changed under them
+	 */
+	void BeginUpdate()
+	{
+		seq_.store(seq_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+	}
+
+	void EndUpdate()
+	{
+		seq_.store(seq_.load(memory_order_relaxed) + 1, memory_order_release);
+	}
+
+	void ReadRusage(const uint64_t now);
+
+	/*
+	 * Under the lock of the samplers
+	 */
+	Times DoRead(const uint64_t now, uint64_t & end, uint64_t & busy) const;
+	void DoSample();
+
+	static __thread ThreadStats * current_;
+
+	const string name_;
+	const uint64_t windowCycles_;
+	const uint64_t rusageCycles_;
+
+	/*
+	 * Written by the thread
+	 */
+	atomic<uint64_t> seq_;
+	atomic<uint64_t> startTsc_;
+	atomic<uint64_t> exitTsc_;
+	atomic<uint64_t> idleCycles_;
+	atomic<uint64_t> idleSince_;
+	atomic<uint64_t> nvcsw_;
+	atomic<uint64_t> nivcsw_;
+	atomic<uint64_t> exitCpuUs_;
+	uint64_t lastRusage_;
+
+	/*
+	 * The CPU clock of the thread, readable by others while it runs, under the lock of the
+	 * samplers
+	 */
+	bool hasClock_;
+	clockid_t clock_;
+
+	/*
+	 * Sampler state, under the lock of the samplers
+	 */
+	Times last_;
+	Point points_[NSAMPLES];
+	uint64_t npoints_;
+	atomic<uint64_t> utilization_;		// percent * 100
+
+	PerfCounter busyTime_;
+	PerfCounter idleTime_;
+	PerfCounter cpuTime_;
+	PerfCounter voluntary_;
+	PerfCounter involuntary_;
+	PerfCounter utilizationStat_;
+};
+
+// .................................................................................. IdleScope ....
+
+/**
+ * @class The calling thread is idle for the scope, waiting for work
+ */
+class IdleScope
+{
+public:
+
+	IdleScope()
+		: stats_(ThreadStats::Current())
+	{
+		if (stats_) stats_->BeginIdle();
+	}
+
+	~IdleScope()
+	{
+		if (stats_) stats_->EndIdle();
+	}
+
+private:
+
+	IdleScope(const IdleScope &);
+	IdleScope & operator=(const IdleScope &);
+
+	ThreadStats * const stats_;
+};
+
+}
@@ -11,6 +11,8 @@ namespace bblocks {
 
 using namespace std;
 
+class ThreadStats;
+
 //...................................................................................... Thread ....
 
 class Thread
@@ -24,17 +26,12 @@ public:
 		: log_(logPath)
 		, tid_(-1)
 		, ctx_pool_(NULL)
+		, stats_(NULL)
 	{}
 
 	virtual ~Thread();
 
-	void Start()
-	{
-		int ok = pthread_create(&tid_, /*attr=*/ NULL, ThFn, (void *)this);
-		INVARIANT(!ok);
-
-		INFO(log_) << "Thread " << tid_ << " created.";
-	}
+	void Start();
 
 	void EnableThreadCancellation()
 	{
@@ -85,6 +82,14 @@ public:
 
 	void Destroy();
 
+	/**
+	 * CPU, busy and idle time of the thread, NULL until it is started.
+	 */
+	ThreadStats * Stats() const
+	{
+		return stats_;
+	}
+
 	static void * ThFn(void * args);
 
 protected:
@@ -105,6 +110,11 @@ protected:
 	string log_;
 	pthread_t tid_;
 	pool_t * ctx_pool_;
+	ThreadStats * stats_;
+
+private:
+
+	static void Exiting(void * args);
 };
 
 }
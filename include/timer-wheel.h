@@ -0,0 +1,239 @@
+#pragma once
+
+#include <inttypes.h>
+
+#include "util.h"
+#include "inlist.hpp"
+
+namespace bblocks {
+
+using namespace std;
+
+class TimerWheel;
+
+// ...................................................................................... Timer ....
+
+/**
+ * @class A timeout, linked into a TimerWheel
+ *
+ * Embed or derive, and implement Expired. A pending timer must be cancelled before it is
+ * destroyed.
+ *
+ * Usage : struct Conn : Timer { void Expired() override { Close(); } };
+ *         wheel.Add(conn, 30 * 1000);		// idle timeout
+ *         ...
+ *         wheel.Add(conn, 30 * 1000);		// activity, push it out
+ */
+class Timer : public InListElement<Timer>
+{
+public:
+
+	friend class TimerWheel;
+
+	Timer() : expires_(0), list_(NULL) {}
+
+	virtual ~Timer()
+	{
+		INVARIANT(!list_);
+	}
+
+	/**
+	 * Called from TimerWheel::Advance on the owner thread, the timer is no longer pending.
+	 * It may add or cancel timers, itself included.
+	 */
+	virtual void Expired() = 0;
+
+	bool IsPending() const
+	{
+		return list_;
+	}
+
+private:
+
+	uint64_t expires_;		// tick
+	InList<Timer> * list_;		// slot, NULL unless pending
+};
+
+// ................................................................................. TimerWheel ....
+
+/**
+ * @class Hierarchical timing wheel
+ *
+ * NLEVELS wheels of NSLOTS lists each. A timer due in less than NSLOTS ticks sits in the slot of
+ * its tick in level 0, one due in less than NSLOTS^2 ticks in the slot of its tick / NSLOTS in
+ * level 1, and so on. Every NSLOTS ticks the next slot of level 1 is redistributed over level 0
+ * (and every NSLOTS^2 ticks the next slot of level 2 over level 1...), so a timer moves at most
+ * NLEVELS - 1 times before it expires. Timers beyond NSLOTS^NLEVELS ticks wait in the last level
+ * until they come in range.
+ *
+ * Add and Cancel are O(1), a tick costs the timers it expires or moves. Timers fire in the first
+ * Advance at or after their deadline, never early. A wheel belongs to one thread and is not
+ * thread safe.
+ *
+ * The owner drives the wheel from its loop, either calling Advance between requests, waiting at
+ * most until NextExpiry, or polling Fd (a timerfd armed for the next tick that has work) and
+ * calling OnFdReadable when it fires.
+ *
+ * Times are CLOCK_MONOTONIC milliseconds, as Time::NowInMilliSec and CoarseClock.
+ */
+class TimerWheel
+{
+public:
+
+	static const uint32_t LEVEL_BITS = 8;
+	static const uint32_t NSLOTS = 1 << LEVEL_BITS;
+	static const uint32_t NLEVELS = 4;
+	static const uint64_t MAX_TICKS = 1ULL << (LEVEL_BITS * NLEVELS);
+
+	static const uint64_t NONE = UINT64_MAX;
+
+	explicit TimerWheel(const uint32_t resolutionms = 1);
+	~TimerWheel();
+
+	/**
+	 * Expire the timer delayms from the time of the wheel, the last Advance. A pending timer
+	 * is moved.
+	 */
+	void Add(Timer * t, const uint64_t delayms)
+	{
+		AddAt(t, nowms_ + delayms);
+	}
+
+	/**
+	 * Expire the timer at or after the deadline in ms
+	 */
+	void AddAt(Timer * t, const uint64_t deadlinems)
+	{
+		ASSERT(t);
+
+		if (t->list_) Cancel(t);
+
+		t->expires_ = (deadlinems + resolutionms_ - 1) / resolutionms_;
+		Place(t);
+		++size_;
+
+		if (fd_ >= 0 && t->expires_ < armed_) Arm();
+	}
+
+	void Cancel(Timer * t)
+	{
+		ASSERT(t);
+
+		if (!t->list_) return;
+
+		Unlink(t);
+		--size_;
+	}
+
+	/**
+	 * Run the timers due by nowms, the number run
+	 */
+	size_t Advance(const uint64_t nowms);
+
+	/**
+	 * Advance to the time of the CoarseClock
+	 */
+	size_t Advance();
+
+	/**
+	 * The earliest time in ms the next Advance has work, NONE if nothing is pending. It is a
+	 * slot with timers, or when the next slot of a higher level moves down.
+	 */
+	uint64_t NextExpiry() const;
+
+	/**
+	 * A timerfd the wheel keeps armed for NextExpiry, created on first use
+	 */
+	int Fd();
+
+	/**
+	 * Drain the timerfd and advance to the current time, the number of timers run
+	 */
+	size_t OnFdReadable();
+
+	size_t Size() const
+	{
+		return size_;
+	}
+
+	uint64_t NowInMilliSec() const
+	{
+		return nowms_;
+	}
+
+	uint32_t Resolution() const
+	{
+		return resolutionms_;
+	}
+
+private:
+
+	TimerWheel(const TimerWheel &);
+	TimerWheel & operator=(const TimerWheel &);
+
+	/*
+	 * Link into the slot of its expiry, relative to next_. Late timers go to the next tick.
+	 */
+	void Place(Timer * t)
+	{
+		uint32_t level = 0;
+		uint64_t tick = next_;
+
+		if (t->expires_ > next_) {
+			uint64_t delta = t->expires_ - next_;
+			if (delta >= MAX_TICKS) delta = MAX_TICKS - 1;
+
+			tick = next_ + delta;
+			level = delta < NSLOTS ? 0 : (63 - __builtin_clzll(delta)) / LEVEL_BITS;
+		}
+
+		const uint32_t slot = (tick >> (LEVEL_BITS * level)) & (NSLOTS - 1);
+
+		InList<Timer> & list = slots_[level][slot];
+		list.Push(t);
+		t->list_ = &list;
+
+		if (!level) occupied_[slot / 64] |= 1ULL << (slot % 64);
+	}
+
+	void Unlink(Timer * t)
+	{
+		InList<Timer> * list = t->list_;
+		list->Unlink(t);
+		t->list_ = NULL;
+
+		/*
+		 * Level 0, not the list of a tick being run
+		 */
+		const uintptr_t p = (uintptr_t) list;
+		const uintptr_t base = (uintptr_t) slots_[0];
+		if (p >= base && p < base + sizeof(slots_[0]) && list->IsEmpty()) {
+			const size_t slot = list - slots_[0];
+			occupied_[slot / 64] &= ~(1ULL << (slot % 64));
+		}
+	}
+
+	/*
+	 * The next tick at or after next_ with timers in level 0, or the start of the next round
+	 * of level 0
+	 */
+	uint64_t NextTick() const;
+
+	size_t RunTick();
+	uint32_t Cascade(const uint32_t level);
+	void Arm();
+
+	const uint32_t resolutionms_;
+	uint64_t nowms_;
+	uint64_t next_;			// the next tick to run
+	size_t size_;
+	bool running_;
+
+	InList<Timer> slots_[NLEVELS][NSLOTS];
+	uint64_t occupied_[NSLOTS / 64];	// level 0 slots with timers
+
+	int fd_;
+	uint64_t armed_;		// tick the timerfd is armed for, NONE if disarmed
+};
+
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <istream>
+#include <ostream>
+#include <string>
+
+#include "util.h"
+#include "thread-index.h"
+
+namespace bblocks {
+
+using namespace std;
+
+/*
+ * Built in trace events, id and name. Applications number their own events from TRACE_USER and
+ * name them with Trace::SetName.
+ */
+#define IOCORE_TRACE_EVENTS(X)				\
+	X(TRACE_THREAD, "thread")			\
+	X(TRACE_QUEUE_WAIT, "queue-wait")		\
+	X(TRACE_LOCK_WAIT, "lock-wait")			\
+	X(TRACE_IO, "io")				\
+	X(TRACE_QUEUE_DEPTH, "queue-depth")
+
+#define IOCORE_TRACE_ENUM(id, name) id,
+
+enum TraceId : uint16_t
+{
+	TRACE_NONE = 0,
+	IOCORE_TRACE_EVENTS(IOCORE_TRACE_ENUM)
+	TRACE_USER = 256,
+	TRACE_MAX_ID = 1024,
+};
+
+#undef IOCORE_TRACE_ENUM
+
+// ................................................................................. TraceEvent ....
+
+/**
+ * Fixed size binary trace record, as kept in the rings and written to trace files.
+ */
+struct TraceEvent
+{
+	enum Type : uint8_t
+	{
+		BEGIN = 0,
+		END,
+		INSTANT,
+		COUNTER,
+	};
+
+	uint64_t tsc_;
+	uint32_t tid_;
+	uint16_t id_;
+	uint8_t type_;
+	uint8_t pad_;
+	uint64_t args_[2];
+};
+
+static_assert(sizeof(TraceEvent) == 32, "TraceEvent is part of the trace file format");
+
+// ...................................................................................... Trace ....
+
+/**
+ * @class Per thread binary event tracing
+ *
+ * Every thread records into a ring of its own, a flight recorder which keeps the last events
+ * and overwrites the oldest ones. Recording is a few stores and a release store of the ring
+ * head, with no lock or read-modify-write. When tracing is disabled it is a single relaxed load.
+ *
+ * Rings are per ThreadIndex and outlive their threads, a thread taking over the index of an
+ * exited one continues in its ring. Threads without an index are not traced.
+ *
+ * Dump writes the rings to a binary trace file, which TraceFile (and the iocore-trace tool)
+ * converts to Chrome trace_event JSON for chrome://tracing or Perfetto.
+ */
+class Trace
+{
+public:
+
+	static const uint32_t DEFAULT_NEVENTS = 16 * 1024;
+
+	/**
+	 * Start recording, rings get nevents events (a power of two) when first used.
+	 */
+	static void Enable(const uint32_t nevents = DEFAULT_NEVENTS);
+	static void Disable();
+
+	static bool IsEnabled()
+	{
+		return enabled_.load(memory_order_relaxed);
+	}
+
+	static void Begin(const uint16_t id, const uint64_t arg0 = 0, const uint64_t arg1 = 0)
+	{
+		if (IsEnabled()) Record(TraceEvent::BEGIN, id, arg0, arg1);
+	}
+
+	static void End(const uint16_t id, const uint64_t arg0 = 0, const uint64_t arg1 = 0)
+	{
+		if (IsEnabled()) Record(TraceEvent::END, id, arg0, arg1);
+	}
+
+	static void Instant(const uint16_t id, const uint64_t arg0 = 0, const uint64_t arg1 = 0)
+	{
+		if (IsEnabled()) Record(TraceEvent::INSTANT, id, arg0, arg1);
+	}
+
+	/**
+	 * Counter value, series (if not zero) tells apart the counters of different sources under
+	 * the same id, like the depths of the queues.
+	 */
+	static void Counter(const uint16_t id, const uint64_t val, const uint64_t series = 0)
+	{
+		if (IsEnabled()) Record(TraceEvent::COUNTER, id, val, series);
+	}
+
+	/**
+	 * Name an application event id, at or above TRACE_USER.
+	 */
+	static void SetName(const uint16_t id, const string & name);
+	static string GetName(const uint16_t id);
+
+	/**
+	 * Name the calling thread in the trace.
+	 */
+	static void SetThreadName(const string & name);
+
+	/**
+	 * Write the events of all the rings to a binary trace file. Can be called while threads
+	 * are recording, events overwritten during the dump are dropped.
+	 *
+	 * @returns number of events written, or -1 on error
+	 */
+	static int64_t Dump(const string & path);
+
+	/**
+	 * Discard the recorded events.
+	 */
+	static void Clear();
+
+private:
+
+	friend class TraceScope;
+
+	struct Ring;
+
+	static void Record(const uint8_t type, const uint16_t id, const uint64_t arg0,
+			   const uint64_t arg1);
+	static Ring * Attach(const uint32_t idx);
+
+	static atomic<bool> enabled_;
+
+	/*
+	 * Rings are never freed, a thread recording into one must not see it go away
+	 */
+	static atomic<Ring *> rings_[ThreadIndex::MAX_THREADS];
+};
+
+// ................................................................................. TraceScope ....
+
+/**
+ * @class Begin and end event around a scope
+ */
+class TraceScope
+{
+public:
+
+	TraceScope(const uint16_t id, const uint64_t arg0 = 0, const uint64_t arg1 = 0)
+		: id_(Trace::IsEnabled() ? id : TRACE_NONE)
+	{
+		if (id_) Trace::Begin(id_, arg0, arg1);
+	}
+
+	~TraceScope()
+	{
+		/*
+		 * Ends what was begun, even if tracing was disabled in between
+		 */
+		if (id_) Trace::Record(TraceEvent::END, id_, /*arg0=*/ 0, /*arg1=*/ 0);
+	}
+
+private:
+
+	TraceScope(const TraceScope &);
+	TraceScope & operator=(const TraceScope &);
+
+	const uint16_t id_;
+};
+
+// .................................................................................. TraceFile ....
+
+/**
+ * @class Binary trace file, as written by Trace::Dump
+ *
+ * Layout: Header, nnames_ EventName records, nthreads_ ThreadName records, nevents_ TraceEvents
+ * in the order recorded by each thread.
+ */
+class TraceFile
+{
+public:
+
+	static const uint64_t MAGIC = 0x4543415254434f49ULL;	// "IOCTRACE"
+	static const uint32_t VERSION = 1;
+
+	struct Header
+	{
+		uint64_t magic_;
+		uint32_t version_;
+		uint32_t eventSize_;
+		uint64_t hz_;
+		uint64_t pid_;
+		uint32_t nnames_;
+		uint32_t nthreads_;
+		uint64_t nevents_;
+	};
+
+	struct EventName
+	{
+		uint32_t id_;
+		char name_[60];
+	};
+
+	struct ThreadName
+	{
+		uint32_t tid_;
+		char name_[28];
+	};
+
+	/**
+	 * Convert a trace file to Chrome trace_event JSON.
+	 *
+	 * @returns empty string on success, the reason otherwise
+	 */
+	static string ToChromeJson(istream & in, ostream & out);
+};
+
+}
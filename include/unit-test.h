@@ -1,9 +1,12 @@
 #pragma once
 
+#include <list>
+#include <string>
 #include <gtest/gtest.h>
 
 #include "logger.h"
 #include "sysconf.h"
+#include "thread.h"
 
 namespace bblocks {
 
@@ -12,6 +15,11 @@ class UnitTest : public ::testing::Test
 public:
 protected:
 
+	/*
+	 * Threads started by the test log to threadLog
+	 */
+	explicit UnitTest(const std::string & threadLog = "/unittest") : threadLog_(threadLog) {}
+
 	void SetUp() override
 	{
 		LogHelper::InitConsoleLogger();
@@ -23,7 +31,67 @@ protected:
 		RRCpuId::Destroy();
 		LogHelper::DestroyLogger();
 	}
+
+	template<class Fn>
+	struct TestThread : Thread
+	{
+		TestThread(const std::string & log, const Fn & fn) : Thread(log), fn_(fn) {}
+
+		void * ThreadMain() override
+		{
+			fn_();
+			return nullptr;
+		}
+
+		Fn fn_;
+	};
+
+	/*
+	 * Start fn on nthreads threads, added to threads
+	 */
+	template<class Fn>
+	void StartThreads(std::list<Thread *> & threads, const Fn & fn, const size_t nthreads = 1)
+	{
+		for (size_t i = 0; i < nthreads; ++i) {
+			auto th = new TestThread<Fn>(threadLog_, fn);
+			th->Start();
+			threads.push_back(th);
+		}
+	}
+
+	/*
+	 * Wait for the threads to finish and delete them
+	 */
+	static void JoinThreads(std::list<Thread *> & threads)
+	{
+		for (auto th : threads) {
+			th->Join();
+			delete th;
+		}
+
+		threads.clear();
+	}
+
+	/*
+	 * Run fn on nthreads threads and wait for them to finish
+	 */
+	template<class Fn>
+	void Run(const Fn & fn, const size_t nthreads = NumThreads())
+	{
+		std::list<Thread *> threads;
+		StartThreads(threads, fn, nthreads);
+		JoinThreads(threads);
+	}
+
+	/*
+	 * One more than the cores, so threads get preempted
+	 */
+	static uint64_t NumThreads()
+	{
+		return SysConf::NumCores() + 1;
+	}
+
+	const std::string threadLog_;
 };
 
 }
-
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <inttypes.h>
+
+/**
+ * USDT (user level statically defined tracing) probes, in the SystemTap SDT format that perf,
+ * bpftrace and bcc read:
+ *
+ *	bpftrace -e 'usdt:/path/to/binary:iocore:queue_wait_start { @[tid] = nsecs; }'
+ *	perf buildid-cache --add /path/to/binary; perf record -e sdt_iocore:lock_contended
+ *
+ * A probe is a single nop in the code, and a .note.stapsdt ELF note naming it and telling where
+ * its arguments are (registers, stack or constants). Tracers attach by replacing the nop with a
+ * breakpoint, so an unattached probe costs the nop and having the arguments at hand, keep them to
+ * values the caller already has. The provider is always iocore, arguments are passed as 64 bit
+ * unsigned values.
+ *
+ * Probes compile to nothing on other architectures than x86-64, or with IOCORE_NO_USDT defined.
+ *
+ * Probes defined in iocore:
+ *
+ *	thread_start, thread_exit	Thread *
+ *	queue_push			queue, element, depth
+ *	queue_pop			queue, element
+ *	queue_wait_start, _end		queue
+ *	lock_contended, lock_acquired	mutex
+ *	threadctx_gc			bytes reclaimed
+ *	log_flush			level, bytes
+ */
+
+#if defined(__x86_64__) && !defined(IOCORE_NO_USDT)
+
+/*
+ * The note refers to the probe address and to _.stapsdt.base, from which tools compute how far
+ * the binary was relocated (prelink). "?" puts the note in the section group of the code, so that
+ * the note goes away with the code of a discarded inline function.
+ */
+#define IOCORE_SDT_NOTE(name, args)						\
+	"990:	nop\n"								\
+	"	.pushsection .note.stapsdt,\"?\",\"note\"\n"			\
+	"	.balign 4\n"							\
+	"	.4byte 992f-991f, 994f-993f, 3\n"				\
+	"991:	.asciz \"stapsdt\"\n"						\
+	"992:	.balign 4\n"							\
+	"993:	.8byte 990b\n"							\
+	"	.8byte _.stapsdt.base\n"					\
+	"	.8byte 0\n"							\
+	"	.asciz \"iocore\"\n"						\
+	"	.asciz \"" name "\"\n"						\
+	"	.asciz \"" args "\"\n"						\
+	"994:	.balign 4\n"							\
+	"	.popsection\n"							\
+	"	.ifndef _.stapsdt.base\n"					\
+	"	.pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	"	.weak _.stapsdt.base\n"						\
+	"	.hidden _.stapsdt.base\n"					\
+	"_.stapsdt.base: .space 1\n"						\
+	"	.size _.stapsdt.base, 1\n"					\
+	"	.popsection\n"							\
+	"	.endif\n"
+
+#define IOCORE_SDT_ARG(n, x) [a##n] "nor" ((uint64_t) (x))
+
+#define IOCORE_PROBE(name)							\
+	__asm__ __volatile__(IOCORE_SDT_NOTE(#name, "") :: )
+
+#define IOCORE_PROBE1(name, x1)							\
+	__asm__ __volatile__(IOCORE_SDT_NOTE(#name, "8@%[a1]")			\
+			     :: IOCORE_SDT_ARG(1, x1))
+
+#define IOCORE_PROBE2(name, x1, x2)						\
+	__asm__ __volatile__(IOCORE_SDT_NOTE(#name, "8@%[a1] 8@%[a2]")		\
+			     :: IOCORE_SDT_ARG(1, x1), IOCORE_SDT_ARG(2, x2))
+
+#define IOCORE_PROBE3(name, x1, x2, x3)						\
+	__asm__ __volatile__(IOCORE_SDT_NOTE(#name, "8@%[a1] 8@%[a2] 8@%[a3]")	\
+			     :: IOCORE_SDT_ARG(1, x1), IOCORE_SDT_ARG(2, x2),	\
+				IOCORE_SDT_ARG(3, x3))
+
+#else
+
+#define IOCORE_PROBE(name) ((void) 0)
+#define IOCORE_PROBE1(name, x1) ((void) 0)
+#define IOCORE_PROBE2(name, x1, x2) ((void) 0)
+#define IOCORE_PROBE3(name, x1, x2, x3) ((void) 0)
+
+#endif
@@ -5,13 +5,14 @@
 #include <sstream>
 #include <memory>
 #include <inttypes.h>
+#include <stdio.h>
 #include <rpc/xdr.h>
 #include <zlib.h>
 #include <fstream>
 #include <atomic>
+#include <time.h>
 
 #include <tr1/memory>
-#include <boost/regex.hpp>
 
 #include "defs.h"
 
@@ -50,40 +51,71 @@ public:
 	}
 };
 
+// ................................................................................. SystemInfo ....
+
+/**
+ * What System probes once about the machine.
+ */
+struct SystemInfo
+{
+	uint64_t tscHz_;		// calibrated TSC ticks per second
+	bool invariantTsc_;		// the TSC runs at a constant rate in all states
+	uint64_t cpuHz_;		// cpu MHz of /proc/cpuinfo, moves with frequency scaling
+	uint32_t ncpus_;		// logical CPUs
+	uint32_t ncores_;		// physical cores
+	uint32_t nsockets_;
+	uint32_t cacheLine_;		// bytes
+	uint64_t l1d_;			// cache sizes per core or package, bytes
+	uint64_t l1i_;
+	uint64_t l2_;
+	uint64_t l3_;
+};
+
 // ..................................................................................... System ....
 
+/**
+ * @class The machine we run on
+ *
+ * The first caller probes the machine, others wait for it and then read the cached result. The
+ * probe parses /proc/cpuinfo and the CPU cache entries in sysfs and calibrates the TSC against
+ * CLOCK_MONOTONIC_RAW, which takes Rdtsc::CALIBRATION_MS.
+ *
+ * If IOCORE_SYSTEM_SNAPSHOT names a file, the result is written there and later processes
+ * started since the same boot read it back instead of probing.
+ */
 class System
 {
 public:
-	static uint64_t GetHz()
-	{
-		static uint64_t hz = 0;
 
-		if (hz) return hz;
+	static const SystemInfo & Info();
 
-		/*
-		 * Load hz from /proc/cpuinfo
-		 */
-		ifstream file("/proc/cpuinfo");
-		if (file.is_open()) {
-			string line;
-			while (getline(file, line)) {
-				boost::regex ex("[ \t]*cpu MHz[ \t]*:[ \t]*([0-9.]+)[ \t]*");
-				boost::smatch match;
-				if (boost::regex_match(line, match, ex)) {
-					INVARIANT(match.size() == 2);
-				        const double MHz = atof(match[1].str().c_str());
-					hz = MHz * 1000 * 1000;
-				}
-			}
-		}
+	/**
+	 * TSC ticks per second
+	 */
+	static uint64_t GetHz()
+	{
+		return Info().tscHz_;
+	}
 
-		INVARIANT(hz);
+	/**
+	 * The clock of the CPU as /proc/cpuinfo reported it. It moves with frequency scaling and
+	 * is no measure of the TSC, only a fallback if the TSC cannot be calibrated.
+	 */
+	static uint64_t GetCpuInfoHz()
+	{
+		return Info().cpuHz_;
+	}
 
-		file.close();
+	/**
+	 * Probe now, regardless of the cached info and snapshot.
+	 */
+	static SystemInfo Probe();
 
-		return hz;
-	}
+	/**
+	 * The snapshot is valid only since the boot it was written in.
+	 */
+	static bool LoadSnapshot(const string & path, SystemInfo & info);
+	static bool SaveSnapshot(const string & path, const SystemInfo & info);
 };
 
 // ...................................................................................... Rdtsc ....
@@ -108,16 +140,84 @@ public:
 	}
 #endif
 
+	/**
+	 * Fixed point conversion of ticks to a unit, (ticks * mult_) >> shift_
+	 */
+	struct Scale
+	{
+		uint64_t mult_;
+		uint32_t shift_;
+
+		inline uint64_t Apply(const uint64_t ticks) const
+		{
+			return ((unsigned __int128) ticks * mult_) >> shift_;
+		}
+	};
+
+	/**
+	 * TSC frequency and conversions, from System::Info.
+	 *
+	 * If the CPU does not report an invariant TSC (CPUID 0x80000007 EDX bit 8), the TSC may
+	 * stop or change rate with the core, and the Now functions read CLOCK_MONOTONIC_RAW
+	 * instead. Cycle counts are still converted with the calibrated rate.
+	 */
+	struct Calibration
+	{
+		bool invariant_;
+		uint64_t hz_;
+		Scale ns_;
+		Scale us_;
+		Scale ms_;
+	};
+
+	static const uint32_t CALIBRATION_MS = 20;
+
+	static inline const Calibration & Calibrated()
+	{
+		/*
+		 * Thread safe one time initialization
+		 */
+		static const Calibration c = MakeCalibration(System::Info());
+		return c;
+	}
+
+	static inline bool IsInvariant()
+	{
+		return Calibrated().invariant_;
+	}
+
+	static inline uint64_t Hz()
+	{
+		return Calibrated().hz_;
+	}
+
+	static inline uint64_t ToNanoSec(const uint64_t cycles)
+	{
+		return Calibrated().ns_.Apply(cycles);
+	}
+
+	static inline uint64_t ToMicroSec(const uint64_t cycles)
+	{
+		return Calibrated().us_.Apply(cycles);
+	}
+
+	static inline uint64_t ToMilliSec(const uint64_t cycles)
+	{
+		return Calibrated().ms_.Apply(cycles);
+	}
+
 	static inline uint64_t NowInMicroSec()
 	{
-		const uint64_t now = rdtsc();
-		return now / (double)(System::GetHz() / double(1000 * 1000));
+		const Calibration & c = Calibrated();
+		if (c.invariant_) return c.us_.Apply(rdtsc());
+		return RawNanoSec() / 1000;
 	}
 
 	static inline uint64_t NowInMilliSec()
 	{
-		const uint64_t now = rdtsc();
-		return now / (double)(System::GetHz() / double(1000));
+		const Calibration & c = Calibrated();
+		if (c.invariant_) return c.ms_.Apply(rdtsc());
+		return RawNanoSec() / (1000 * 1000);
 	}
 
 	static inline uint64_t ElapsedInMilliSec(const uint64_t startInMilliSec)
@@ -136,6 +236,42 @@ public:
 	{
 		return end > start ? (end - start) : 0;
 	}
+
+private:
+
+	static uint64_t RawNanoSec()
+	{
+		timespec t;
+		int status = clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+		INVARIANT(status == 0);
+
+		return t.tv_sec * 1000ULL * 1000 * 1000 + t.tv_nsec;
+	}
+
+	/*
+	 * The largest shift that keeps the multiplier within 63 bits, for the most precision
+	 */
+	static Scale MakeScale(const uint64_t perSec, const uint64_t hz)
+	{
+		uint32_t shift = 63;
+		while (shift && (((unsigned __int128) perSec << shift) / hz) >> 63) --shift;
+
+		return Scale{uint64_t(((unsigned __int128) perSec << shift) / hz), shift};
+	}
+
+	static Calibration MakeCalibration(const SystemInfo & info)
+	{
+		INVARIANT(info.tscHz_);
+
+		Calibration c;
+		c.invariant_ = info.invariantTsc_;
+		c.hz_ = info.tscHz_;
+		c.ns_ = MakeScale(1000 * 1000 * 1000, c.hz_);
+		c.us_ = MakeScale(1000 * 1000, c.hz_);
+		c.ms_ = MakeScale(1000, c.hz_);
+
+		return c;
+	}
 };
 
 //........................................................................................ Time ....
@@ -202,6 +338,36 @@ public:
 	}
 };
 
+//........................................................................................ Json ....
+
+class Json
+{
+public:
+
+	/**
+	 * s as a JSON string literal, quotes, backslashes and control characters escaped
+	 */
+	static string Quote(const string & s)
+	{
+		string out("\"");
+
+		for (auto c : s) {
+			if (c == '"' || c == '\\') {
+				out += '\\';
+				out += c;
+			} else if ((unsigned char) c < 0x20) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char) c);
+				out += buf;
+			} else {
+				out += c;
+			}
+		}
+
+		return out + "\"";
+	}
+};
+
 //..................................................................................... Adler32 ....
 
 /**
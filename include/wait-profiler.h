@@ -0,0 +1,164 @@
+#pragma once
+
+#include <inttypes.h>
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "histogram.h"
+
+namespace bblocks {
+
+using namespace std;
+
+/*
+ * What a thread was blocked on
+ */
+enum WaitKind
+{
+	WAIT_QUEUE = 0,		// InQueue, Queue pops
+	WAIT_LOCK,		// contended mutex and rwlock acquisitions
+	WAIT_COND,		// WaitCondition
+	WAIT_IO,		// application I/O, through WaitScope
+	WAIT_OTHER,
+	WAIT_NKINDS,
+};
+
+// ................................................................................... WaitStat ....
+
+/**
+ * Blocked time of one thread at one wait site, a (kind, name, call site) triple. The histogram
+ * is in microseconds.
+ */
+struct WaitStat
+{
+	static const int DIGITS = 1;
+
+	WaitStat(const WaitKind kind, const string & name, void * site, const uint32_t tid,
+		 const string & thread)
+		: kind_(kind)
+		, name_(name)
+		, site_(site)
+		, tid_(tid)
+		, thread_(thread)
+		, hist_(DIGITS)
+	{}
+
+	const WaitKind kind_;
+	const string name_;
+	void * const site_;
+	const uint32_t tid_;
+	const string thread_;
+	Histogram hist_;
+};
+
+// ............................................................................... WaitProfiler ....
+
+/**
+ * @class Opt-in off-CPU (blocking) time profiler
+ *
+ * Queues, locks and condition variables report the time their callers spent blocked while the
+ * profiler is enabled, applications report their own waits (I/O) through WaitScope. Waits are
+ * recorded into a histogram per wait site and per thread, a site being the kind of wait, the name
+ * of the queue or lock and the call site. Spinning before blocking is on-CPU and not counted.
+ *
+ * When disabled the only cost on the wait paths is a relaxed load.
+ */
+class WaitProfiler
+{
+public:
+
+	static void Enable();
+
+	static void Disable()
+	{
+		enabled_.store(false);
+	}
+
+	static bool IsEnabled()
+	{
+		return enabled_.load(memory_order_relaxed);
+	}
+
+	/**
+	 * Account a wait of the calling thread.
+	 */
+	static void Record(const WaitKind kind, const string & name, void * site,
+			   const uint64_t cycles)
+	{
+		if (IsEnabled()) Add(kind, name, site, cycles);
+	}
+
+	/**
+	 * Name the calling thread in the report, waits recorded before keep the old name.
+	 */
+	static void SetThreadName(const string & name);
+
+	/**
+	 * Merged histogram (microseconds) of the waits of the kind, optionally only those on the
+	 * named queue or lock and of the named threads.
+	 */
+	static Histogram GetHistogram(const WaitKind kind, const string & name = string(),
+				      const string & thread = string());
+
+	/**
+	 * Print the blocked time by kind, the top wait sites and the top threads.
+	 */
+	static void Dump(ostream & os, const size_t top = 10);
+
+	static void Reset();
+
+	static const char * KindName(const WaitKind kind);
+
+private:
+
+	static void Add(const WaitKind kind, const string & name, void * site,
+			const uint64_t cycles);
+	static vector<WaitStat *> Snapshot();
+
+	static atomic<bool> enabled_;
+};
+
+// .................................................................................. WaitScope ....
+
+/**
+ * @class Accounts the scope as a wait
+ *
+ * {
+ *	WaitScope _(WAIT_IO, log_);
+ *	read(fd, buf, len);
+ * }
+ *
+ * The name is referenced, not copied, and must outlive the scope. The call site is the caller of
+ * the function the scope is in.
+ */
+class WaitScope
+{
+public:
+
+	WaitScope(const WaitKind kind, const string & name) __attribute__((always_inline))
+		: kind_(kind)
+		, name_(name)
+		, site_(__builtin_return_address(0))
+		, start_(WaitProfiler::IsEnabled() ? Rdtsc::rdtsc() : 0)
+	{}
+
+	~WaitScope()
+	{
+		if (start_) WaitProfiler::Record(kind_, name_, site_, Rdtsc::rdtsc() - start_);
+	}
+
+private:
+
+	WaitScope(const WaitScope &);
+	WaitScope & operator=(const WaitScope &);
+
+	const WaitKind kind_;
+	const string & name_;
+	void * const site_;
+	const uint64_t start_;
+};
+
+}
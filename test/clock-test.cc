@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <fstream>
+#include <thread>
+#include <vector>
+
+#include "unit-test.h"
+#include "util.h"
+#include "coarse-clock.h"
+
+using namespace std;
+using namespace bblocks;
+
+class RdtscTest : public UnitTest
+{
+public:
+
+	RdtscTest() : log_("/rdtsctest") {}
+
+protected:
+
+	static uint64_t RawMicroSec()
+	{
+		timespec t;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+		return t.tv_sec * 1000ULL * 1000 + t.tv_nsec / 1000;
+	}
+
+	const string log_;
+};
+
+TEST_F(RdtscTest, testCalibration)
+{
+	ASSERT_EQ(System::GetHz(), Rdtsc::Hz());
+	ASSERT_GT(Rdtsc::Hz(), 0u);
+
+	INFO(log_) << "TSC " << Rdtsc::Hz() << " Hz, invariant " << Rdtsc::IsInvariant()
+		   << ", cpuinfo " << System::GetCpuInfoHz() << " Hz";
+
+	/*
+	 * Over 200ms the TSC must agree with the raw clock within 1%
+	 */
+	const uint64_t tsc = Rdtsc::rdtsc();
+	const uint64_t start = RawMicroSec();
+	usleep(200 * 1000);
+	const uint64_t cycles = Rdtsc::rdtsc() - tsc;
+	const uint64_t elapsed = RawMicroSec() - start;
+
+	const uint64_t us = Rdtsc::ToMicroSec(cycles);
+	ASSERT_GE(us, elapsed - elapsed / 100);
+	ASSERT_LE(us, elapsed + elapsed / 100);
+}
+
+TEST_F(RdtscTest, testScale)
+{
+	const uint64_t hz = Rdtsc::Hz();
+
+	/*
+	 * The fixed point conversions are exact to a few parts per billion
+	 */
+	ASSERT_NEAR(Rdtsc::ToNanoSec(hz), 1000 * 1000 * 1000, 10);
+	ASSERT_NEAR(Rdtsc::ToMicroSec(hz * 3600), 3600ULL * 1000 * 1000, 10);
+	ASSERT_NEAR(Rdtsc::ToMilliSec(hz * 3600 * 24), 3600ULL * 24 * 1000, 1);
+
+	ASSERT_EQ(Rdtsc::ToMicroSec(0), 0u);
+
+	/*
+	 * No overflow at TSC values of years of uptime
+	 */
+	const uint64_t years = hz * 3600 * 24 * 365 * 10;
+	ASSERT_NEAR(Rdtsc::ToMilliSec(years), 3600ULL * 24 * 365 * 10 * 1000, 100);
+}
+
+TEST_F(RdtscTest, testNow)
+{
+	uint64_t lastus = Rdtsc::NowInMicroSec();
+	uint64_t lastms = Rdtsc::NowInMilliSec();
+
+	for (int i = 0; i < 100 * 1000; ++i) {
+		const uint64_t us = Rdtsc::NowInMicroSec();
+		const uint64_t ms = Rdtsc::NowInMilliSec();
+
+		ASSERT_GE(us, lastus);
+		ASSERT_GE(ms, lastms);
+
+		lastus = us;
+		lastms = ms;
+	}
+
+	const uint64_t start = Rdtsc::NowInMilliSec();
+	usleep(50 * 1000);
+	const uint64_t elapsed = Rdtsc::ElapsedInMilliSec(start);
+	ASSERT_GE(elapsed, 49u);
+	ASSERT_LE(elapsed, 1000u);
+}
+
+class SystemTest : public UnitTest
+{
+public:
+
+	SystemTest() : log_("/systemtest") {}
+
+protected:
+
+	const string log_;
+};
+
+TEST_F(SystemTest, testInfo)
+{
+	/*
+	 * Everyone gets the one probe
+	 */
+	vector<const SystemInfo *> infos(4, NULL);
+	vector<thread> threads;
+	for (size_t i = 0; i < infos.size(); ++i) {
+		threads.push_back(thread([&infos, i]() { infos[i] = &System::Info(); }));
+	}
+
+	for (auto & th : threads) th.join();
+
+	const SystemInfo & info = System::Info();
+	for (auto p : infos) ASSERT_EQ(p, &info);
+
+	INFO(log_) << "cpus " << info.ncpus_ << " cores " << info.ncores_
+		   << " sockets " << info.nsockets_ << " line " << info.cacheLine_
+		   << " l1d " << info.l1d_ << " l2 " << info.l2_ << " l3 " << info.l3_;
+
+	ASSERT_EQ(System::GetHz(), info.tscHz_);
+	ASSERT_GE(info.ncpus_, 1u);
+	ASSERT_GE(info.ncores_, 1u);
+	ASSERT_GE(info.nsockets_, 1u);
+	ASSERT_LE(info.ncores_, info.ncpus_);
+	ASSERT_LE(info.nsockets_, info.ncores_);
+	ASSERT_EQ(info.ncpus_, SysConf::NumCores());
+	ASSERT_GT(info.cacheLine_, 0u);
+	ASSERT_EQ(info.cacheLine_ & (info.cacheLine_ - 1), 0u);
+}
+
+TEST_F(SystemTest, testSnapshot)
+{
+	const string path = "/tmp/iocore-systemtest." + to_string(getpid());
+	const SystemInfo & info = System::Info();
+
+	SystemInfo loaded;
+	ASSERT_FALSE(System::LoadSnapshot(path, loaded));
+
+	ASSERT_TRUE(System::SaveSnapshot(path, info));
+	ASSERT_TRUE(System::LoadSnapshot(path, loaded));
+
+	ASSERT_EQ(loaded.tscHz_, info.tscHz_);
+	ASSERT_EQ(loaded.invariantTsc_, info.invariantTsc_);
+	ASSERT_EQ(loaded.cpuHz_, info.cpuHz_);
+	ASSERT_EQ(loaded.ncpus_, info.ncpus_);
+	ASSERT_EQ(loaded.ncores_, info.ncores_);
+	ASSERT_EQ(loaded.nsockets_, info.nsockets_);
+	ASSERT_EQ(loaded.cacheLine_, info.cacheLine_);
+	ASSERT_EQ(loaded.l1d_, info.l1d_);
+	ASSERT_EQ(loaded.l1i_, info.l1i_);
+	ASSERT_EQ(loaded.l2_, info.l2_);
+	ASSERT_EQ(loaded.l3_, info.l3_);
+
+	/*
+	 * A snapshot of another boot is ignored
+	 */
+	{
+		ofstream file(path, ios::app);
+		file << "boot_id 00000000-0000-0000-0000-000000000000" << endl;
+	}
+
+	ASSERT_FALSE(System::LoadSnapshot(path, loaded));
+
+	unlink(path.c_str());
+}
+
+class CoarseClockTest : public UnitTest
+{
+public:
+
+	CoarseClockTest() {}
+
+protected:
+
+	void TearDown() override
+	{
+		CoarseClock::Stop();
+		UnitTest::TearDown();
+	}
+
+	/*
+	 * " dd/mm/yy hh:mm:ss "
+	 */
+	static bool IsStamp(const string & s)
+	{
+		return s.size() == 19 && s[0] == ' ' && s[3] == '/' && s[6] == '/' && s[12] == ':'
+		       && s[15] == ':' && s[18] == ' ';
+	}
+
+	static uint64_t WallMs()
+	{
+		timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		return t.tv_sec * 1000ULL + t.tv_nsec / (1000 * 1000);
+	}
+};
+
+TEST_F(CoarseClockTest, testStopped)
+{
+	ASSERT_FALSE(CoarseClock::IsRunning());
+
+	/*
+	 * The clocks are read directly
+	 */
+	const uint64_t now = Time::NowInMilliSec();
+	ASSERT_GE(CoarseClock::NowInMilliSec(), now);
+	ASSERT_LE(CoarseClock::NowInMilliSec(), now + 10);
+
+	const uint64_t wall = WallMs();
+	ASSERT_GE(CoarseClock::WallInMilliSec(), wall);
+	ASSERT_LE(CoarseClock::WallInMilliSec(), wall + 10);
+
+	ASSERT_TRUE(IsStamp(CoarseClock::Timestamp()));
+}
+
+TEST_F(CoarseClockTest, testTicker)
+{
+	ASSERT_TRUE(CoarseClock::Start());
+	ASSERT_FALSE(CoarseClock::Start());
+	ASSERT_TRUE(CoarseClock::IsRunning());
+
+	const uint64_t start = CoarseClock::NowInMilliSec();
+	ASSERT_LE(start, Time::NowInMilliSec());
+
+	usleep(100 * 1000);
+
+	/*
+	 * The ticker follows, within scheduling delays
+	 */
+	const uint64_t now = Time::NowInMilliSec();
+	const uint64_t coarse = CoarseClock::NowInMilliSec();
+	ASSERT_LE(coarse, now);
+	ASSERT_GE(coarse, now - 50);
+	ASSERT_GE(coarse - start, 90u);
+
+	const uint64_t wall = WallMs();
+	ASSERT_LE(CoarseClock::WallInMilliSec(), wall);
+	ASSERT_GE(CoarseClock::WallInMilliSec(), wall - 50);
+
+	const string stamp = CoarseClock::Timestamp();
+	ASSERT_TRUE(IsStamp(stamp));
+
+	const time_t sec = CoarseClock::WallTime();
+	ASSERT_TRUE(stamp == CoarseClock::FormatTimestamp(sec)
+		    || stamp == CoarseClock::FormatTimestamp(sec - 1));
+
+	CoarseClock::Stop();
+	ASSERT_FALSE(CoarseClock::IsRunning());
+
+	/*
+	 * Restartable
+	 */
+	ASSERT_TRUE(CoarseClock::Start(/*resolutionms=*/ 5));
+	ASSERT_TRUE(CoarseClock::IsRunning());
+}
+
+TEST_F(CoarseClockTest, testReaders)
+{
+	CoarseClock::Start();
+
+	atomic<bool> stop(false);
+	atomic<uint64_t> bad(0);
+
+	vector<thread> threads;
+	for (int i = 0; i < 2; ++i) {
+		threads.push_back(thread([&stop, &bad]() {
+			uint64_t last = 0;
+			while (!stop.load()) {
+				if (!IsStamp(CoarseClock::Timestamp())) ++bad;
+
+				const uint64_t now = CoarseClock::NowInMilliSec();
+				if (now < last) ++bad;
+				last = now;
+			}
+		}));
+	}
+
+	/*
+	 * Across a second or two, for the string to change under the readers
+	 */
+	usleep(1500 * 1000);
+	stop.store(true);
+
+	for (auto & th : threads) th.join();
+
+	ASSERT_EQ(bad.load(), 0u);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,125 @@
+#include <unistd.h>
+#include <list>
+
+#include "reclaim-test.h"
+#include "epoch.h"
+
+using namespace std;
+using namespace bblocks;
+
+class EpochTest : public ReclaimTest
+{
+public:
+
+	EpochTest() : ReclaimTest("/epochtest") {}
+
+protected:
+
+	void Drain()
+	{
+		for (int i = 0; i < 3; ++i) {
+			Epoch::TryAdvance();
+		}
+
+		Epoch::Reclaim();
+	}
+};
+
+TEST_F(EpochTest, testReclaim)
+{
+	for (int i = 0; i < 1000; ++i) {
+		Epoch::Retire(new Node(i));
+	}
+
+	ASSERT_GT(Node::Count(), 0);
+
+	Drain();
+
+	ASSERT_EQ(Node::Count(), 0);
+	ASSERT_EQ(Epoch::LimboSize(), 0u);
+}
+
+TEST_F(EpochTest, testPinnedReader)
+{
+	Pinned th("/epochtest/pinned", []() { Epoch::Enter(); }, []() { Epoch::Exit(); });
+	th.Start();
+	th.WaitPinned();
+
+	Epoch::Retire(new Node(/*val=*/ 0));
+	Drain();
+
+	/*
+	 * The reader entered before the retire, the node cannot be freed
+	 */
+	ASSERT_EQ(Node::Count(), 1);
+
+	th.run_ = false;
+	th.Join();
+
+	Drain();
+
+	ASSERT_EQ(Node::Count(), 0);
+}
+
+TEST_F(EpochTest, testConcurrentReaders)
+{
+	atomic<Node *> head(new Node(/*val=*/ 0));
+
+	list<Reader *> readers;
+	StartReaders(readers, [&head]() {
+		EpochGuard _;
+		INVARIANT(head.load()->IsValid());
+	});
+
+	for (uint64_t i = 1; i < 10000; ++i) {
+		Node * old = head.exchange(new Node(i));
+		Epoch::Retire(old);
+
+		if (i % 100 == 0) sched_yield();
+	}
+
+	StopReaders(readers);
+
+	Drain();
+
+	ASSERT_EQ(Node::Count(), 1);
+	delete head.load();
+}
+
+TEST_F(EpochTest, testCancelledReader)
+{
+	atomic<bool> pinned(false);
+
+	list<Thread *> threads;
+	StartThreads(threads, [&pinned]() {
+		Epoch::Enter();
+		pinned = true;
+		for (;;) usleep(1000);
+	});
+
+	while (!pinned) {
+		sched_yield();
+	}
+
+	Epoch::Retire(new Node(/*val=*/ 0));
+	Drain();
+
+	ASSERT_EQ(Node::Count(), 1);
+
+	/*
+	 * Cancelled inside its critical region, the reader no longer holds up the epoch
+	 */
+	threads.front()->Cancel();
+	JoinThreads(threads);
+
+	Drain();
+
+	ASSERT_EQ(Node::Count(), 0);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
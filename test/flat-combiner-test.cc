@@ -0,0 +1,136 @@
+#include <atomic>
+#include <queue>
+#include <vector>
+
+#include "unit-test.h"
+#include "thread.h"
+#include "lock.h"
+#include "flat-combiner.h"
+
+using namespace std;
+using namespace bblocks;
+
+class FlatCombinerTest : public UnitTest
+{
+public:
+
+	FlatCombinerTest() : UnitTest("/flatcombinertest") {}
+
+protected:
+
+	static const uint64_t NITER = 10000;
+
+	typedef priority_queue<uint64_t> pq_t;
+
+	/*
+	 * Run fn(id) on (cores + 1) threads and return the aggregate ops per second
+	 */
+	template<class Fn>
+	double Run(const Fn & fn)
+	{
+		const uint64_t startms = Rdtsc::NowInMilliSec();
+
+		atomic<uint64_t> nextId(0);
+		UnitTest::Run([&fn, &nextId]() { fn(nextId++); });
+
+		const double ms = Rdtsc::ElapsedInMilliSec(startms);
+		return (NITER * NumThreads()) / ((ms ? ms : 1) / 1000);
+	}
+
+	/*
+	 * Every thread does two pushes for each pop. A pop always follows a push of the same
+	 * thread, so it never finds the queue empty.
+	 */
+	template<class Fn>
+	static void PushPop(const Fn & apply, const uint64_t id)
+	{
+		for (uint64_t i = 0; i < NITER; ++i) {
+			if (i % 3 != 2) {
+				const uint64_t val = id * NITER + i;
+				apply([val](pq_t & q) { q.push(val); });
+			} else {
+				apply([](pq_t & q) { INVARIANT(!q.empty()); q.pop(); });
+			}
+		}
+	}
+
+	/*
+	 * Benchmark a lock based priority queue
+	 */
+	template<class M>
+	double RunLocked(M & lock, pq_t & q)
+	{
+		auto apply = [&lock, &q](const function<void (pq_t &)> & fn) {
+			AutoLock _(&lock);
+			fn(q);
+		};
+
+		return Run([&apply](const uint64_t id) { PushPop(apply, id); });
+	}
+};
+
+TEST_F(FlatCombinerTest, testExecute)
+{
+	FlatCombiner<vector<uint64_t>> v("/test");
+
+	uint64_t size = 0;
+	v.Execute([](vector<uint64_t> & v) { v.push_back(10); });
+	v.Execute([&size](vector<uint64_t> & v) { size = v.size(); });
+
+	ASSERT_EQ(size, 1u);
+	ASSERT_EQ(v.Unsafe()[0], 10u);
+}
+
+TEST_F(FlatCombinerTest, testConcurrent)
+{
+	FlatCombiner<vector<uint64_t>> v("/test");
+
+	Run([&v](const uint64_t id) {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			const uint64_t val = id * NITER + i;
+			v.Execute([val](vector<uint64_t> & v) { v.push_back(val); });
+		}
+	});
+
+	auto & values = v.Unsafe();
+	ASSERT_EQ(values.size(), NITER * NumThreads());
+
+	sort(values.begin(), values.end());
+	for (uint64_t i = 0; i < values.size(); ++i) {
+		ASSERT_EQ(values[i], i);
+	}
+}
+
+TEST_F(FlatCombinerTest, testPriorityQueueBenchmark)
+{
+	pq_t mutexq;
+	PThreadMutex mutex;
+	const double mutexOps = RunLocked(mutex, mutexq);
+
+	pq_t spinq;
+	SpinMutex spin("/flatcombinertest");
+	const double spinOps = RunLocked(spin, spinq);
+
+	FlatCombiner<pq_t> fcq("/flatcombinertest");
+	auto apply = [&fcq](const function<void (pq_t &)> & fn) {
+		fcq.Execute([&fn](pq_t & q) { fn(q); });
+	};
+	const double fcOps = Run([&apply](const uint64_t id) { PushPop(apply, id); });
+
+	const uint64_t size = (NITER - NITER / 3) - NITER / 3;
+	ASSERT_EQ(mutexq.size(), size * NumThreads());
+	ASSERT_EQ(spinq.size(), size * NumThreads());
+	ASSERT_EQ(fcq.Unsafe().size(), size * NumThreads());
+
+	INFO(threadLog_) << "priority_queue ops/s with " << NumThreads() << " threads:"
+		   << " PThreadMutex " << uint64_t(mutexOps)
+		   << " SpinMutex " << uint64_t(spinOps)
+		   << " FlatCombiner " << uint64_t(fcOps);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,133 @@
+#include <unistd.h>
+#include <list>
+
+#include "reclaim-test.h"
+#include "hazard.h"
+
+using namespace std;
+using namespace bblocks;
+
+class HazardTest : public ReclaimTest
+{
+public:
+
+	HazardTest() : ReclaimTest("/hazardtest") {}
+};
+
+TEST_F(HazardTest, testReclaim)
+{
+	atomic<Node *> head(new Node(/*val=*/ 0));
+
+	Node * n = Hazard::Protect(/*slot=*/ 0, head);
+	Hazard::Retire(head.exchange(NULL));
+
+	Hazard::Scan();
+	ASSERT_EQ(Node::Count(), 1);
+	ASSERT_TRUE(n->IsValid());
+
+	Hazard::Clear(/*slot=*/ 0);
+	Hazard::Scan();
+
+	ASSERT_EQ(Node::Count(), 0);
+	ASSERT_EQ(Hazard::RetiredSize(), 0u);
+}
+
+TEST_F(HazardTest, testBoundedGarbage)
+{
+	atomic<Node *> head(new Node(/*val=*/ 0));
+
+	Node * pinned = NULL;
+	Pinned th("/hazardtest/pinned", [&head, &pinned]() {
+		pinned = Hazard::Protect(/*slot=*/ 0, head);
+	}, [&pinned]() {
+		INVARIANT(pinned->IsValid());
+		Hazard::Clear(/*slot=*/ 0);
+	});
+
+	th.Start();
+	th.WaitPinned();
+
+	/*
+	 * A stalled reader only holds back the node it has published
+	 */
+	for (uint64_t i = 1; i < 1000; ++i) {
+		Hazard::Retire(head.exchange(new Node(i)));
+	}
+
+	Hazard::Scan();
+
+	ASSERT_EQ(Hazard::RetiredSize(), 1u);
+	ASSERT_EQ(Node::Count(), 2);
+
+	th.run_ = false;
+	th.Join();
+
+	Hazard::Scan();
+
+	ASSERT_EQ(Node::Count(), 1);
+	delete head.load();
+}
+
+TEST_F(HazardTest, testConcurrentReaders)
+{
+	atomic<Node *> head(new Node(/*val=*/ 0));
+
+	list<Reader *> readers;
+	StartReaders(readers, [&head]() {
+		HazardGuard h(/*slot=*/ 0);
+		INVARIANT(h.Protect(head)->IsValid());
+	});
+
+	for (uint64_t i = 1; i < 10000; ++i) {
+		Hazard::Retire(head.exchange(new Node(i)));
+
+		if (i % 100 == 0) sched_yield();
+	}
+
+	StopReaders(readers);
+
+	Hazard::Scan();
+
+	ASSERT_EQ(Node::Count(), 1);
+	delete head.load();
+}
+
+TEST_F(HazardTest, testCancelledReader)
+{
+	atomic<Node *> head(new Node(/*val=*/ 0));
+	atomic<bool> pinned(false);
+
+	list<Thread *> threads;
+	StartThreads(threads, [&head, &pinned]() {
+		Hazard::Protect(/*slot=*/ 0, head);
+		pinned = true;
+		for (;;) usleep(1000);
+	});
+
+	while (!pinned) {
+		sched_yield();
+	}
+
+	Hazard::Retire(head.exchange(NULL));
+	Hazard::Scan();
+
+	ASSERT_EQ(Node::Count(), 1);
+
+	/*
+	 * The cancelled reader's slots are cleared with its record
+	 */
+	threads.front()->Cancel();
+	JoinThreads(threads);
+
+	Hazard::Scan();
+
+	ASSERT_EQ(Node::Count(), 0);
+	ASSERT_EQ(Hazard::RetiredSize(), 0u);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,149 @@
+#include <unistd.h>
+#include <sstream>
+
+#include "unit-test.h"
+#include "thread.h"
+#include "hw-counter.h"
+
+using namespace std;
+using namespace bblocks;
+
+class HwCounterTest : public UnitTest
+{
+public:
+
+	HwCounterTest() : UnitTest("/hwcountertest") {}
+
+protected:
+
+	/*
+	 * Something for the counters to count
+	 */
+	static uint64_t Work(const uint64_t n)
+	{
+		volatile uint64_t sum = 0;
+		for (uint64_t i = 0; i < n; ++i) {
+			sum += i * i;
+		}
+
+		return sum;
+	}
+};
+
+TEST_F(HwCounterTest, testCounters)
+{
+	HwCounters & hw = HwCounters::Get();
+	ASSERT_EQ(hw.GetThreadMode(), HwCounters::GetMode());
+
+	INFO(threadLog_) << "Mode " << HwCounters::GetMode() << " rdpmc " << hw.UsesRdpmc();
+
+	if (HwCounters::GetMode() == HwCounters::NONE) return;
+
+	/*
+	 * Counters only go up, and the first event (cycles or task clock) moves with any work
+	 */
+	HwCounters::Values start, end;
+	ASSERT_TRUE(hw.Read(start));
+	Work(/*n=*/ 1000 * 1000);
+	ASSERT_TRUE(hw.Read(end));
+
+	for (int i = 0; i < HwCounters::NEVENTS; ++i) {
+		ASSERT_GE(end.v_[i], start.v_[i]);
+	}
+
+	ASSERT_GT(end.v_[0], start.v_[0]);
+
+	if (HwCounters::GetMode() == HwCounters::HARDWARE) {
+		ASSERT_GT(end.v_[1] - start.v_[1], 1000u * 1000u);
+	}
+}
+
+TEST_F(HwCounterTest, testScope)
+{
+	static const uint64_t NSCOPES = 100;
+
+	HwRegion region("/hwcountertest/loop");
+
+	Run([&region]() {
+		for (uint64_t i = 0; i < NSCOPES; ++i) {
+			HwCounterScope scope(region);
+			Work(/*n=*/ 10000);
+		}
+	});
+
+	for (int i = 0; i < HwCounters::NEVENTS; ++i) {
+		ASSERT_EQ(region.Counter(i).Count(), NSCOPES * NumThreads());
+	}
+
+	if (region.GetMode() != HwCounters::NONE) {
+		ASSERT_GT(region.Counter(0).Value(), 0u);
+	}
+
+	ostringstream os;
+	os << region;
+	ASSERT_NE(os.str().find("/hwcountertest/loop/"), string::npos);
+
+	INFO(threadLog_) << os.str();
+}
+
+TEST_F(HwCounterTest, testNestedScope)
+{
+	HwRegion outer("/hwcountertest/outer");
+	HwRegion inner("/hwcountertest/inner");
+
+	{
+		HwCounterScope o(outer);
+		Work(/*n=*/ 100000);
+
+		HwCounterScope i(inner);
+		Work(/*n=*/ 100000);
+	}
+
+	ASSERT_EQ(outer.Counter(0).Count(), 1u);
+	ASSERT_EQ(inner.Counter(0).Count(), 1u);
+	ASSERT_GE(outer.Counter(0).Value(), inner.Counter(0).Value());
+}
+
+TEST_F(HwCounterTest, testSoftwareSwitches)
+{
+	if (HwCounters::GetMode() != HwCounters::SOFTWARE) return;
+
+	HwRegion region("/hwcountertest/sleep");
+
+	/*
+	 * Every sleep switches the thread out, which the kernel records
+	 */
+	{
+		HwCounterScope scope(region);
+		for (int i = 0; i < 20; ++i) {
+			usleep(1000);
+		}
+	}
+
+	ASSERT_EQ(region.Counter(2).Count(), 1u);
+	ASSERT_GT(region.Counter(2).Value(), 0u);
+}
+
+TEST_F(HwCounterTest, testSaturated)
+{
+	HwRegion region("/hwcountertest/long");
+
+	HwCounters::Values delta;
+	delta.v_[0] = 10ULL * UINT32_MAX;
+	region.Update(delta);
+
+	ASSERT_EQ(region.Saturated(), 1u);
+	ASSERT_EQ(region.Counter(0).Value(), uint64_t(UINT32_MAX));
+	ASSERT_EQ(region.Counter(1).Value(), 0u);
+
+	ostringstream os;
+	os << region;
+	ASSERT_NE(os.str().find(" saturated 1"), string::npos);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
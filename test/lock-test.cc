@@ -0,0 +1,429 @@
+#include <list>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "unit-test.h"
+#include "thread.h"
+#include "lock.h"
+
+using namespace std;
+using namespace bblocks;
+
+class LockTest : public UnitTest
+{
+public:
+
+	LockTest() : UnitTest("/locktest") {}
+
+protected:
+
+	static const uint64_t NITER = 1000;
+
+	void TearDown() override
+	{
+		LockProfiler::Disable();
+		LockProfiler::Reset();
+
+		UnitTest::TearDown();
+	}
+};
+
+TEST_F(LockTest, testProfilerDisabled)
+{
+	PThreadMutex lock;
+	lock.SetName("/locktest/disabled");
+
+	for (uint64_t i = 0; i < NITER; ++i) {
+		AutoLock _(&lock);
+	}
+
+	ASSERT_EQ(LockProfiler::GetSummary("/locktest/disabled").nacquired_, 0u);
+}
+
+TEST_F(LockTest, testProfileMutex)
+{
+	LockProfiler::Enable();
+
+	PThreadMutex lock;
+	lock.SetName("/locktest/mutex");
+
+	uint64_t count = 0;
+
+	Run([&lock, &count]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			AutoLock _(&lock);
+			++count;
+			if (i % 10 == 0) sched_yield();
+		}
+	});
+
+	ASSERT_EQ(count, NITER * NumThreads());
+
+	auto summary = LockProfiler::GetSummary("/locktest/mutex");
+	ASSERT_EQ(summary.nacquired_, NITER * NumThreads());
+	ASSERT_GT(summary.holdCycles_, 0u);
+	ASSERT_GE(summary.waitCycles_, summary.maxWaitCycles_);
+
+	ostringstream os;
+	LockProfiler::Dump(os);
+	ASSERT_NE(os.str().find("/locktest/mutex"), string::npos);
+}
+
+TEST_F(LockTest, testProfileSpinMutex)
+{
+	LockProfiler::Enable();
+
+	SpinMutex lock("/locktest");
+
+	Run([&lock]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			AutoLock _(&lock);
+		}
+	});
+
+	auto summary = LockProfiler::GetSummary("/spinmutex/locktest");
+	ASSERT_EQ(summary.nacquired_, NITER * NumThreads());
+}
+
+TEST_F(LockTest, testProfileRename)
+{
+	LockProfiler::Enable();
+
+	PThreadMutex lock;
+	lock.SetName("/locktest/before");
+
+	for (uint64_t i = 0; i < NITER; ++i) {
+		AutoLock _(&lock);
+	}
+
+	/*
+	 * Same lock and call site, the cached statistics are of the old name
+	 */
+	lock.SetName("/locktest/after");
+
+	for (uint64_t i = 0; i < NITER; ++i) {
+		AutoLock _(&lock);
+	}
+
+	ASSERT_EQ(LockProfiler::GetSummary("/locktest/before").nacquired_, uint64_t(NITER));
+	ASSERT_EQ(LockProfiler::GetSummary("/locktest/after").nacquired_, uint64_t(NITER));
+}
+
+TEST_F(LockTest, testProfileRWLock)
+{
+	LockProfiler::Enable();
+
+	PThreadRWLock lock;
+	lock.SetName("/locktest/rwlock");
+
+	uint64_t count = 0;
+
+	Run([&lock, &count]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			{
+				AutoWriteLock _(&lock);
+				/*
+				 * Not atomic, only correct if the write lock is exclusive
+				 */
+				const uint64_t tmp = count;
+				if (i % 10 == 0) sched_yield();
+				count = tmp + 1;
+			}
+
+			AutoReadLock _(&lock);
+		}
+	});
+
+	ASSERT_EQ(count, NITER * NumThreads());
+
+	auto summary = LockProfiler::GetSummary("/locktest/rwlock");
+	ASSERT_EQ(summary.nacquired_, 2 * NITER * NumThreads());
+}
+
+TEST_F(LockTest, testFutexMutex)
+{
+	LockProfiler::Enable();
+
+	FutexMutex lock("/locktest");
+
+	uint64_t count = 0;
+
+	Run([&lock, &count]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			AutoLock _(&lock);
+			/*
+			 * Not atomic, only correct if the lock is exclusive
+			 */
+			const uint64_t tmp = count;
+			if (i % 10 == 0) sched_yield();
+			count = tmp + 1;
+		}
+	});
+
+	ASSERT_EQ(count, NITER * NumThreads());
+	ASSERT_FALSE(lock.IsOwner());
+	ASSERT_TRUE(lock.TryLock());
+	ASSERT_TRUE(lock.IsOwner());
+	lock.Unlock();
+
+	auto summary = LockProfiler::GetSummary("/futexmutex/locktest");
+	ASSERT_EQ(summary.nacquired_, NITER * NumThreads() + 1);
+}
+
+/*
+ * Move money between random accounts, each account guarded by its stripe. The total is
+ * conserved only if LockMany locks every account involved, and the test hangs if it deadlocks.
+ */
+template<class M>
+static void
+TestStripedTransfer(const uint64_t niter, const size_t nthreads)
+{
+	static const size_t NACCOUNTS = 256;
+	static const int64_t BALANCE = 1000;
+
+	StripedLock<M, /*N=*/ 16> locks;
+	vector<int64_t> accounts(NACCOUNTS, BALANCE);
+
+	auto fn = [&]() {
+		unsigned int seed = (unsigned int) pthread_self();
+		for (uint64_t i = 0; i < niter; ++i) {
+			const size_t from = rand_r(&seed) % NACCOUNTS;
+			const size_t to = rand_r(&seed) % NACCOUNTS;
+			const size_t fee = rand_r(&seed) % NACCOUNTS;
+
+			locks.LockMany(from, to, fee);
+			accounts[from] -= 2;
+			if (i % 10 == 0) sched_yield();
+			accounts[to] += 1;
+			accounts[fee] += 1;
+			locks.UnlockMany(from, to, fee);
+		}
+	};
+
+	list<thread> threads;
+	for (size_t i = 0; i < nthreads; ++i) {
+		threads.push_back(thread(fn));
+	}
+
+	for (auto & th : threads) {
+		th.join();
+	}
+
+	int64_t total = 0;
+	for (auto balance : accounts) {
+		total += balance;
+	}
+
+	ASSERT_EQ(total, int64_t(NACCOUNTS) * BALANCE);
+
+	locks.LockAll();
+	locks.UnlockAll();
+}
+
+TEST_F(LockTest, testStripedLock)
+{
+	StripedLock<SpinMutex, /*N=*/ 8> locks("/locktest");
+
+	for (uint64_t key = 0; key < 1024; ++key) {
+		ASSERT_LT(locks.Index(key), 8u);
+		ASSERT_EQ(&locks.Get(key), &locks.At(locks.Index(key)));
+	}
+
+	/*
+	 * Stripes must not share cache lines
+	 */
+	for (size_t i = 1; i < locks.Size(); ++i) {
+		const uintptr_t prev = (uintptr_t) &locks.At(i - 1);
+		const uintptr_t cur = (uintptr_t) &locks.At(i);
+		ASSERT_EQ((cur - prev) % CACHELINE_SIZE, 0u);
+		ASSERT_EQ(cur % CACHELINE_SIZE, 0u);
+	}
+
+	/*
+	 * Keys on the same stripe are locked once
+	 */
+	locks.LockMany(7, 7, 7);
+	ASSERT_TRUE(locks.Get(7).IsOwner());
+	locks.UnlockMany(7, 7, 7);
+	ASSERT_FALSE(locks.Get(7).IsOwner());
+
+	StripedLock<FutexMutex, /*N=*/ 1> one;
+	one.LockMany(string("a"), string("b"));
+	ASSERT_TRUE(one.At(0).IsOwner());
+	one.UnlockMany(string("a"), string("b"));
+}
+
+TEST_F(LockTest, testStripedLockMany)
+{
+	TestStripedTransfer<PThreadMutex>(NITER, NumThreads());
+	TestStripedTransfer<SpinMutex>(NITER, NumThreads());
+	TestStripedTransfer<FutexMutex>(NITER, NumThreads());
+}
+
+TEST_F(LockTest, testEventCount)
+{
+	EventCount ec;
+
+	/*
+	 * Notify without waiters is a no op, a prepared wait is not lost
+	 */
+	ec.Notify();
+
+	auto key = ec.PrepareWait();
+	ASSERT_EQ(ec.NumWaiters(), 1u);
+	ec.Notify();
+	ec.CommitWait(key);
+	ASSERT_EQ(ec.NumWaiters(), 0u);
+
+	key = ec.PrepareWait();
+	ASSERT_FALSE(ec.CommitWait(key, /*ms=*/ 10));
+	ASSERT_EQ(ec.NumWaiters(), 0u);
+}
+
+TEST_F(LockTest, testEventCountHandoff)
+{
+	EventCount ec;
+	atomic<uint64_t> produced(0);
+	atomic<uint64_t> consumed(0);
+
+	/*
+	 * Consumers sleep until there is something to consume, a lost wakeup hangs the test
+	 */
+	auto consumer = [&]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			for (;;) {
+				uint64_t n = consumed.load();
+				if (n < produced.load()) {
+					if (consumed.compare_exchange_strong(n, n + 1)) break;
+					continue;
+				}
+
+				auto key = ec.PrepareWait();
+				if (consumed.load() < produced.load()) {
+					ec.CancelWait();
+					continue;
+				}
+
+				ec.CommitWait(key);
+			}
+		}
+	};
+
+	list<thread> threads;
+	for (size_t i = 0; i < NumThreads(); ++i) {
+		threads.push_back(thread(consumer));
+	}
+
+	for (uint64_t i = 0; i < NITER * NumThreads(); ++i) {
+		produced.fetch_add(1);
+		ec.Notify();
+		if (i % 10 == 0) sched_yield();
+	}
+
+	for (auto & th : threads) {
+		th.join();
+	}
+
+	ASSERT_EQ(consumed.load(), NITER * NumThreads());
+	ASSERT_EQ(ec.NumWaiters(), 0u);
+}
+
+TEST_F(LockTest, testLatch)
+{
+	Latch latch(NumThreads());
+	atomic<uint64_t> arrived(0);
+
+	ASSERT_FALSE(latch.TryWait());
+
+	Run([&latch, &arrived]() {
+		++arrived;
+		latch.ArriveAndWait();
+		INVARIANT(arrived.load() == NumThreads());
+	});
+
+	ASSERT_TRUE(latch.TryWait());
+	latch.Wait();
+}
+
+/*
+ * Every phase each thread publishes the phase in its own slot, and after the barrier checks that
+ * everybody has. A second barrier keeps the fast threads from overwriting their slots before the
+ * slow threads have checked them.
+ */
+TEST_F(LockTest, testBarrier)
+{
+	static const int NPHASES = 100;
+
+	Barrier barrier(NumThreads());
+	vector<atomic<int>> slots(NumThreads());
+	atomic<uint64_t> nextId(0);
+	atomic<int> nserial(0);
+
+	for (auto & slot : slots) {
+		slot = -1;
+	}
+
+	Run([&]() {
+		const uint64_t id = nextId++;
+
+		for (int phase = 0; phase < NPHASES; ++phase) {
+			slots[id] = phase;
+			if (phase % 10 == 0) sched_yield();
+
+			if (barrier.ArriveAndWait()) ++nserial;
+
+			for (auto & slot : slots) {
+				INVARIANT(slot.load() == phase);
+			}
+
+			barrier.ArriveAndWait();
+		}
+	});
+
+	ASSERT_EQ(nserial.load(), NPHASES);
+	ASSERT_EQ(barrier.Phase(), 2 * NPHASES);
+}
+
+TEST_F(LockTest, testCountingSemaphore)
+{
+	static const int NPERMITS = 2;
+
+	CountingSemaphore sem(NPERMITS);
+	atomic<int> inside(0);
+	atomic<int> maxInside(0);
+
+	Run([&]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			sem.Acquire();
+
+			const int n = ++inside;
+			INVARIANT(n <= NPERMITS);
+
+			int max = maxInside.load();
+			while (n > max && !maxInside.compare_exchange_weak(max, n));
+
+			if (i % 10 == 0) sched_yield();
+
+			--inside;
+			sem.Release();
+		}
+	});
+
+	ASSERT_EQ(sem.Count(), NPERMITS);
+	ASSERT_GE(maxInside.load(), 1);
+
+	ASSERT_TRUE(sem.TryAcquire());
+	ASSERT_TRUE(sem.Acquire(/*ms=*/ 10));
+	ASSERT_FALSE(sem.TryAcquire());
+	ASSERT_FALSE(sem.Acquire(/*ms=*/ 10));
+	sem.Release(/*n=*/ 2);
+	ASSERT_EQ(sem.Count(), NPERMITS);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,464 @@
+#include <sstream>
+
+#include "unit-test.h"
+#include "thread.h"
+#include "perfcounter.h"
+
+using namespace std;
+using namespace bblocks;
+
+enum Phase
+{
+	PARSE = 0,
+	QUEUE,
+	EXEC,
+	IO,
+};
+
+static ostream &
+operator<<(ostream & os, const Phase & phase)
+{
+	static const char * names[] = { "parse", "queue", "exec", "io" };
+	return os << names[phase];
+}
+
+class PerfCounterTest : public UnitTest
+{
+public:
+
+	PerfCounterTest() : UnitTest("/perfcountertest") {}
+
+protected:
+
+	static const uint64_t NITER = 100000;
+
+	/*
+	 * Average cost of an update in nanoseconds, with every thread updating the counter
+	 */
+	double UpdateCost(PerfCounter & pc)
+	{
+		const uint64_t start = Rdtsc::rdtsc();
+
+		Run([&pc]() {
+			for (uint64_t i = 0; i < NITER; ++i) {
+				pc.Update(i % 1024);
+			}
+		});
+
+		const double cycles = Rdtsc::rdtsc() - start;
+		return cycles / (System::GetHz() / 1e9) / (NITER * NumThreads());
+	}
+
+	static void Spin(const uint64_t cycles)
+	{
+		const uint64_t start = Rdtsc::rdtsc();
+		while (Rdtsc::rdtsc() - start < cycles);
+	}
+};
+
+TEST_F(PerfCounterTest, testUpdate)
+{
+	for (auto flags : { PerfCounter::NONE, PerfCounter::SHARDED }) {
+		PerfCounter pc("/perfcountertest", "units", PerfCounter::COUNTER, flags);
+
+		pc.Update(1);
+		pc.Update(5);
+		pc.Update(100);
+
+		auto snap = pc.Read();
+		ASSERT_EQ(snap.count_, 3u);
+		ASSERT_EQ(snap.val_, 106u);
+		ASSERT_EQ(snap.min_, 1u);
+		ASSERT_EQ(snap.max_, 100u);
+		ASSERT_EQ(snap.bucket_[0], 1u);
+		ASSERT_EQ(snap.bucket_[2], 1u);
+		ASSERT_EQ(snap.bucket_[6], 1u);
+
+		ostringstream os;
+		os << pc;
+		ASSERT_NE(os.str().find("/perfcountertest"), string::npos);
+		ASSERT_NE(os.str().find("106"), string::npos);
+	}
+}
+
+TEST_F(PerfCounterTest, testSharded)
+{
+	PerfCounter pc("/perfcountertest", "units", PerfCounter::COUNTER, PerfCounter::SHARDED);
+
+	Run([&pc]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			pc.Update(/*val=*/ 2);
+		}
+	});
+
+	auto snap = pc.Read();
+	ASSERT_EQ(snap.count_, NITER * NumThreads());
+	ASSERT_EQ(snap.val_, 2 * NITER * NumThreads());
+	ASSERT_EQ(snap.bucket_[1], NITER * NumThreads());
+	ASSERT_EQ(snap.min_, 2u);
+	ASSERT_EQ(snap.max_, 2u);
+}
+
+TEST_F(PerfCounterTest, testShardedThreadExit)
+{
+	PerfCounter pc("/perfcountertest", "units", PerfCounter::COUNTER, PerfCounter::SHARDED);
+
+	/*
+	 * More threads than thread indexes over time, values of exited threads must not be lost
+	 */
+	const uint32_t nthreads = ThreadIndex::MAX_THREADS + 10;
+	const uint32_t count = ThreadIndex::Count();
+
+	for (uint32_t i = 0; i < nthreads; ++i) {
+		Run([&pc]() { pc.Update(/*val=*/ 1); }, /*nthreads=*/ 1);
+	}
+
+	ASSERT_EQ(pc.Count(), nthreads);
+	ASSERT_EQ(pc.Value(), nthreads);
+	ASSERT_EQ(ThreadIndex::Count(), count);
+	ASSERT_TRUE(ThreadIndex::HighWater() < ThreadIndex::MAX_THREADS);
+}
+
+TEST_F(PerfCounterTest, testShardedCost)
+{
+	PerfCounter shared("/perfcountertest/shared", "units", PerfCounter::COUNTER);
+	PerfCounter sharded("/perfcountertest/sharded", "units", PerfCounter::COUNTER,
+			    PerfCounter::SHARDED);
+
+	const double sharedns = UpdateCost(shared);
+	const double shardedns = UpdateCost(sharded);
+
+	ASSERT_EQ(shared.Count(), sharded.Count());
+	ASSERT_EQ(shared.Value(), sharded.Value());
+
+	INFO(threadLog_) << "PerfCounter::Update with " << NumThreads() << " threads:"
+		   << " shared " << sharedns << " ns"
+		   << " sharded " << shardedns << " ns";
+}
+
+TEST_F(PerfCounterTest, testHistogramPrecision)
+{
+	for (int digits = 1; digits <= Histogram::MAX_DIGITS; ++digits) {
+		Histogram h(digits);
+		const double error = pow(10, -digits);
+
+		/*
+		 * Every value falls in its own bucket, buckets are contiguous and within the
+		 * precision
+		 */
+		for (size_t i = 1; i < h.Size(); ++i) {
+			ASSERT_EQ(h.LowValue(i), h.HighValue(i - 1) + 1);
+		}
+
+		ASSERT_EQ(h.HighValue(h.Size() - 1), UINT32_MAX);
+
+		unsigned int seed = digits;
+		for (int i = 0; i < 10000; ++i) {
+			const uint64_t val = rand_r(&seed) >> (rand_r(&seed) % 31);
+			const size_t idx = h.Index(val);
+
+			ASSERT_LE(h.LowValue(idx), val);
+			ASSERT_GE(h.HighValue(idx), val);
+			ASSERT_LE(h.HighValue(idx) - h.LowValue(idx), val * error);
+		}
+	}
+}
+
+TEST_F(PerfCounterTest, testHistogramPercentiles)
+{
+	Histogram h(/*digits=*/ 3);
+
+	for (uint64_t val = 1; val <= 100000; ++val) {
+		h.Record(val);
+	}
+
+	ASSERT_EQ(h.Count(), 100000u);
+	ASSERT_EQ(h.Min(), 1u);
+	ASSERT_EQ(h.Max(), 100000u);
+	ASSERT_EQ(h.Percentile(100), 100000u);
+
+	for (auto q : { 50.0, 90.0, 99.0, 99.9 }) {
+		const double expected = q * 1000;
+		ASSERT_NEAR(h.Percentile(q), expected, expected / 1000);
+	}
+}
+
+TEST_F(PerfCounterTest, testHistogramMerge)
+{
+	Histogram low, high, all;
+
+	for (uint64_t val = 0; val < 1000; ++val) {
+		low.RecordLocal(val);
+		high.RecordLocal(val + 1000);
+		all.Record(val);
+		all.Record(val + 1000);
+	}
+
+	Histogram merged(low);
+	merged.Merge(high);
+
+	ASSERT_EQ(merged.Count(), all.Count());
+	ASSERT_EQ(merged.Sum(), all.Sum());
+	ASSERT_EQ(merged.Min(), 0u);
+	ASSERT_EQ(merged.Max(), 1999u);
+
+	for (size_t i = 0; i < merged.Size(); ++i) {
+		ASSERT_EQ(merged.CountAt(i), all.CountAt(i));
+	}
+}
+
+TEST_F(PerfCounterTest, testHistogramMergePrecision)
+{
+	Histogram fine(/*digits=*/ 3), coarse(/*digits=*/ 1), expected(/*digits=*/ 1);
+
+	for (uint64_t val = 0; val < 100 * 1000; val += 7) {
+		fine.RecordLocal(val);
+		expected.RecordLocal(val);
+	}
+
+	coarse.Merge(fine);
+
+	ASSERT_EQ(coarse.Count(), expected.Count());
+	ASSERT_EQ(coarse.Sum(), expected.Sum());
+	ASSERT_EQ(coarse.Max(), expected.Max());
+
+	for (size_t i = 0; i < coarse.Size(); ++i) {
+		ASSERT_EQ(coarse.CountAt(i), expected.CountAt(i));
+	}
+
+	/*
+	 * Snapshots of counters of the same name keep the lower precision, in either order
+	 */
+	PerfCounter a("/perfcountertest/precision", "microsec", PerfCounter::TIME,
+		      PerfCounter::HISTOGRAM, /*digits=*/ 3);
+	PerfCounter b("/perfcountertest/precision", "microsec", PerfCounter::TIME,
+		      PerfCounter::HISTOGRAM, /*digits=*/ 1);
+	a.Update(/*val=*/ 100);
+	b.Update(/*val=*/ 200);
+
+	PerfCounter::Snapshot ab, ba;
+	ab.Merge(a.Read());
+	ab.Merge(b.Read());
+	ba.Merge(b.Read());
+	ba.Merge(a.Read());
+
+	for (auto snap : { &ab, &ba }) {
+		ASSERT_EQ(snap->hist_->Digits(), 1);
+		ASSERT_EQ(snap->hist_->Count(), 2u);
+		ASSERT_EQ(snap->hist_->Sum(), 300u);
+	}
+}
+
+TEST_F(PerfCounterTest, testPerfCounterHistogram)
+{
+	PerfCounter pc("/perfcountertest", "microsec", PerfCounter::TIME,
+		       PerfCounter::SHARDED | PerfCounter::HISTOGRAM);
+
+	Run([&pc]() {
+		for (uint64_t i = 0; i < 1000; ++i) {
+			pc.Update(i < 990 ? 100 : 2000);
+		}
+	});
+
+	ASSERT_EQ(pc.Percentile(50), 100u);
+	ASSERT_EQ(pc.Percentile(99), 100u);
+	ASSERT_EQ(pc.Percentile(99.9), 2000u);
+
+	/*
+	 * Read without the histogram
+	 */
+	const PerfCounter::Snapshot snap = pc.Read();
+	ASSERT_EQ(pc.Count(), 1000 * NumThreads());
+	ASSERT_EQ(pc.Count(), snap.count_);
+	ASSERT_EQ(pc.Value(), snap.val_);
+
+	ostringstream os;
+	os << pc;
+	ASSERT_NE(os.str().find("p99.9"), string::npos);
+}
+
+TEST_F(PerfCounterTest, testRateCounter)
+{
+	/*
+	 * Time is passed in explicitly, starting on a tick boundary
+	 */
+	const uint64_t start = 1000 * 1000 * 1000;
+	RateCounter rc(start);
+
+	/*
+	 * 100 ops of 10 bytes every second for 10 minutes
+	 */
+	for (uint64_t sec = 0; sec < 600; ++sec) {
+		for (int i = 0; i < 100; ++i) {
+			rc.Update(/*val=*/ 10, start + sec * 1000 + i);
+		}
+	}
+
+	const uint64_t now = start + 600 * 1000;
+	ASSERT_DOUBLE_EQ(rc.OpsRate(/*seconds=*/ 10, now), 100);
+	ASSERT_DOUBLE_EQ(rc.ValueRate(/*seconds=*/ 60 - 1, now), 1000);
+
+	/*
+	 * Reads do not reset anything
+	 */
+	ASSERT_DOUBLE_EQ(rc.OpsRate(/*seconds=*/ 10, now), 100);
+
+	auto rates = rc.GetRates(now);
+	ASSERT_NEAR(rates.ops_[RateCounter::M1], 100, 1);
+	ASSERT_NEAR(rates.vals_[RateCounter::M1], 1000, 10);
+
+	/*
+	 * 10 minutes into a steady rate the 5m average is close, the 15m one is still catching up
+	 */
+	ASSERT_NEAR(rates.ops_[RateCounter::M5], 100, 15);
+	ASSERT_LT(rates.ops_[RateCounter::M15], rates.ops_[RateCounter::M5]);
+
+	/*
+	 * A minute of silence, the window empties and the 1m average collapses while the 15m one
+	 * barely moves
+	 */
+	const uint64_t later = now + 60 * 1000;
+	ASSERT_DOUBLE_EQ(rc.OpsRate(/*seconds=*/ 10, later), 0);
+
+	rates = rc.GetRates(later);
+	ASSERT_LT(rates.ops_[RateCounter::M1], 100 * exp(-0.9));
+	ASSERT_GT(rates.ops_[RateCounter::M15], rates.ops_[RateCounter::M1]);
+}
+
+TEST_F(PerfCounterTest, testWindowedHistogram)
+{
+	const uint64_t start = 1000 * 1000 * 1000;
+	WindowedHistogram wh(/*digits=*/ 2, /*windowSec=*/ 60);
+
+	for (uint64_t sec = 0; sec < 60; ++sec) {
+		wh.Record(/*val=*/ 1000, start + sec * 1000);
+	}
+
+	for (uint64_t sec = 60; sec < 120; ++sec) {
+		wh.Record(/*val=*/ 10, start + sec * 1000);
+	}
+
+	/*
+	 * The slow minute has slid out of the window
+	 */
+	Histogram h = wh.Snapshot(start + 119 * 1000);
+	ASSERT_EQ(h.Count(), 60u);
+	ASSERT_EQ(h.Max(), 10u);
+}
+
+TEST_F(PerfCounterTest, testPerfCounterWindowed)
+{
+	PerfCounter pc("/perfcountertest", "B", PerfCounter::BYTES,
+		       PerfCounter::SHARDED | PerfCounter::HISTOGRAM | PerfCounter::WINDOWED);
+
+	for (int i = 0; i < 100; ++i) {
+		pc.Update(/*val=*/ 4096);
+	}
+
+	ASSERT_EQ(pc.RecentHistogram().Count(), 100u);
+	ASSERT_EQ(pc.Percentile(99), 4096u);
+
+	/*
+	 * Every thread keeps its own rates and recent histogram, merged on read
+	 */
+	Run([&pc]() {
+		for (int i = 0; i < 100; ++i) {
+			pc.Update(/*val=*/ 4096);
+		}
+	});
+
+	ASSERT_EQ(pc.RecentHistogram().Count(), 100 * (NumThreads() + 1));
+
+	ostringstream os;
+	os << pc;
+	ASSERT_NE(os.str().find("ops-per-sec-15m"), string::npos);
+	ASSERT_NE(os.str().find("B-per-sec-1m"), string::npos);
+	ASSERT_NE(os.str().find("p99-1m"), string::npos);
+}
+
+TEST_F(PerfCounterTest, testScopedPhase)
+{
+	static const uint64_t NREQUESTS = 10;
+	static const uint64_t CYCLES = 100 * 1000;
+
+	TimeCounter<Phase> timer("/perfcountertest/phases");
+
+	Run([&timer]() {
+		for (uint64_t i = 0; i < NREQUESTS; ++i) {
+			{
+				ScopedPhase<Phase> p(timer, PARSE);
+				Spin(CYCLES);
+			}
+
+			{
+				ScopedPhase<Phase> p(timer, EXEC);
+				Spin(CYCLES);
+
+				ScopedPhase<Phase> io(timer, IO);
+				Spin(2 * CYCLES);
+			}
+
+			timer.EndRequest();
+		}
+	});
+
+	auto totals = timer.Read();
+	const uint64_t n = NREQUESTS * NumThreads();
+
+	ASSERT_EQ(totals.requests_, n);
+	ASSERT_EQ(totals.count_[PARSE], n);
+	ASSERT_EQ(totals.count_[EXEC], n);
+	ASSERT_EQ(totals.count_[IO], n);
+	ASSERT_EQ(totals.count_[QUEUE], 0u);
+
+	/*
+	 * exec includes the nested io, its self time does not
+	 */
+	ASSERT_GE(totals.cycles_[PARSE], n * CYCLES);
+	ASSERT_GE(totals.cycles_[IO], 2 * n * CYCLES);
+	ASSERT_GE(totals.cycles_[EXEC], totals.cycles_[IO] + n * CYCLES);
+	ASSERT_GE(totals.self_[EXEC], n * CYCLES);
+	ASSERT_EQ(totals.self_[EXEC], totals.cycles_[EXEC] - totals.cycles_[IO]);
+	ASSERT_EQ(totals.self_[IO], totals.cycles_[IO]);
+
+	ostringstream os;
+	os << timer;
+	ASSERT_NE(os.str().find("exec "), string::npos);
+	ASSERT_NE(os.str().find("per-request"), string::npos);
+	ASSERT_EQ(os.str().find("queue "), string::npos);
+
+	INFO(threadLog_) << os.str();
+}
+
+TEST_F(PerfCounterTest, testClockIn)
+{
+	TimeCounter<Phase> timer("/perfcountertest/clockin");
+
+	timer.ClockIn(PARSE);
+	Spin(/*cycles=*/ 1000);
+	timer.ClockIn(QUEUE);
+	Spin(/*cycles=*/ 1000);
+	timer.ClockIn(EXEC);
+
+	auto totals = timer.Read();
+	ASSERT_EQ(totals.count_[PARSE], 0u);
+	ASSERT_EQ(totals.count_[QUEUE], 1u);
+	ASSERT_EQ(totals.count_[EXEC], 1u);
+	ASSERT_GE(totals.cycles_[QUEUE], 1000u);
+	ASSERT_GE(totals.cycles_[EXEC], 1000u);
+
+	/*
+	 * A thread that inherits the index of one that exited does not get charged its gap
+	 */
+	Run([&timer]() { timer.ClockIn(IO); }, /*nthreads=*/ 1);
+	Run([&timer]() { timer.ClockIn(IO); }, /*nthreads=*/ 1);
+
+	ASSERT_EQ(timer.Read().count_[IO], 0u);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,178 @@
+#include <list>
+#include <vector>
+
+#include "unit-test.h"
+#include "thread.h"
+#include "inlist.hpp"
+
+using namespace std;
+using namespace bblocks;
+
+class QueueTest : public UnitTest
+{
+public:
+
+	QueueTest() : UnitTest("/queuetest") {}
+
+protected:
+
+	static const uint64_t NITER = 10000;
+
+	struct Msg : InListElement<Msg>
+	{
+		Msg(const uint64_t val) : val_(val) {}
+
+		const uint64_t val_;
+	};
+
+	/*
+	 * Run producer and consumer on (cores + 1) threads each and wait for them to finish
+	 */
+	template<class Producer, class Consumer>
+	void Run(const Producer & producer, const Consumer & consumer)
+	{
+		list<Thread *> threads;
+		StartThreads(threads, consumer, NumThreads());
+		StartThreads(threads, producer, NumThreads());
+		JoinThreads(threads);
+	}
+};
+
+TEST_F(QueueTest, testInQueue)
+{
+	InQueue<Msg> q("/queuetest");
+	atomic<uint64_t> sum(0);
+
+	Run([&q]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			q.Push(new Msg(i));
+		}
+	}, [&q, &sum]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			Msg * msg = q.Pop();
+			sum += msg->val_;
+			delete msg;
+		}
+	});
+
+	ASSERT_TRUE(q.IsEmpty());
+	ASSERT_EQ(sum.load(), NumThreads() * (NITER * (NITER - 1) / 2));
+}
+
+TEST_F(QueueTest, testInQueueTimedPop)
+{
+	InQueue<Msg> q("/queuetest");
+
+	ASSERT_FALSE(q.Pop(/*ms=*/ 10));
+
+	Msg msg(/*val=*/ 10);
+	q.Push(&msg);
+	ASSERT_EQ(q.Pop(/*ms=*/ 10), &msg);
+	ASSERT_TRUE(q.IsEmpty());
+}
+
+TEST_F(QueueTest, testQueue)
+{
+	Queue<uint64_t> q("/queuetest");
+	atomic<uint64_t> sum(0);
+
+	Run([&q]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			q.Push(i);
+		}
+	}, [&q, &sum]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			sum += q.Pop();
+		}
+	});
+
+	ASSERT_TRUE(q.IsEmpty());
+	ASSERT_EQ(sum.load(), NumThreads() * (NITER * (NITER - 1) / 2));
+}
+
+TEST_F(QueueTest, testInQueueStats)
+{
+	InQueue<Msg> q("queuetest/stats");
+
+	/*
+	 * Pushed before the stats are enabled, counted when popped but without a sojourn time
+	 */
+	Msg early(/*val=*/ 0);
+	q.Push(&early);
+	ASSERT_FALSE(q.Stats());
+
+	QueueStats::Enable();
+
+	vector<Msg> msgs;
+	for (uint64_t i = 0; i < 10; ++i) {
+		msgs.push_back(Msg(i));
+	}
+
+	for (auto & msg : msgs) {
+		q.Push(&msg);
+	}
+
+	ASSERT_EQ(q.Size(), 11u);
+	usleep(20 * 1000);
+
+	ASSERT_EQ(q.Pop(), &early);
+	for (auto & msg : msgs) {
+		ASSERT_EQ(q.Pop(), &msg);
+	}
+
+	QueueStats::Disable();
+
+	/*
+	 * Not counted
+	 */
+	q.Push(&early);
+	ASSERT_EQ(q.Pop(), &early);
+
+	const QueueStats * stats = q.Stats();
+	ASSERT_TRUE(stats);
+	ASSERT_EQ(stats->HighWater(), 11u);
+	ASSERT_EQ(stats->Push().Count(), 10u);
+	ASSERT_EQ(stats->Pop().Count(), 11u);
+	ASSERT_EQ(stats->Sojourn().Count(), 10u);
+	ASSERT_GE(stats->Sojourn().Read().min_, 15 * 1000u);
+	ASSERT_EQ(stats->Sojourn().Name(), "/q/queuetest/stats/sojourn");
+	ASSERT_TRUE(q.IsEmpty());
+}
+
+TEST_F(QueueTest, testQueueStats)
+{
+	QueueStats::Enable();
+
+	Queue<uint64_t> q("queuetest/stats");
+	atomic<uint64_t> sum(0);
+
+	Run([&q]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			q.Push(i);
+		}
+	}, [&q, &sum]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			sum += q.Pop();
+		}
+	});
+
+	QueueStats::Disable();
+
+	ASSERT_EQ(sum.load(), NumThreads() * (NITER * (NITER - 1) / 2));
+
+	const QueueStats * stats = q.Stats();
+	ASSERT_TRUE(stats);
+	ASSERT_EQ(stats->Push().Count(), NumThreads() * NITER);
+	ASSERT_EQ(stats->Pop().Count(), NumThreads() * NITER);
+	ASSERT_EQ(stats->Sojourn().Count(), NumThreads() * NITER);
+	ASSERT_GE(stats->HighWater(), 1u);
+	ASSERT_LE(stats->HighWater(), NumThreads() * NITER);
+	ASSERT_EQ(q.Size(), 0u);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,268 @@
+#include <list>
+
+#include "reclaim-test.h"
+#include "rcu.h"
+#include "inlist.hpp"
+
+using namespace std;
+using namespace bblocks;
+
+class RcuTest : public ReclaimTest
+{
+public:
+
+	RcuTest() : ReclaimTest("/rcutest") {}
+
+protected:
+
+	void SetUp() override
+	{
+		ReclaimTest::SetUp();
+		Rcu::Online();
+	}
+
+	/*
+	 * Read the table as an online reader, keeping what was read while hold is set
+	 */
+	static function<void ()> ReadTable(RcuPtr<Node> & table, atomic<bool> & hold,
+					   atomic<bool> & holding)
+	{
+		return [&table, &hold, &holding]() {
+			if (!Rcu::IsOnline()) Rcu::Online();
+
+			auto t = table.Read();
+			INVARIANT(t->IsValid());
+
+			while (hold) {
+				holding = true;
+				sched_yield();
+				INVARIANT(t->IsValid());
+			}
+
+			holding = false;
+
+			ThreadCtx::GarbageCollect();
+		};
+	}
+};
+
+TEST_F(RcuTest, testDefer)
+{
+	RcuPtr<Node> table(new Node(/*val=*/ 0));
+
+	table.Update(new Node(/*val=*/ 1));
+
+	/*
+	 * We have not been through a quiescent state, we may still hold version 0
+	 */
+	Rcu::Reclaim();
+	ASSERT_EQ(Node::Count(), 2);
+
+	/*
+	 * A quiescent state only publishes the counter, the updater reclaims
+	 */
+	Rcu::QuiescentState();
+	ASSERT_EQ(Node::Count(), 2);
+
+	Rcu::Reclaim();
+	ASSERT_EQ(Node::Count(), 1);
+	ASSERT_EQ(table.Read()->val_, 1u);
+}
+
+TEST_F(RcuTest, testOffline)
+{
+	RcuPtr<Node> table(new Node(/*val=*/ 0));
+
+	Rcu::Offline();
+	table.Update(new Node(/*val=*/ 1));
+	Rcu::Reclaim();
+	Rcu::Online();
+
+	ASSERT_EQ(Node::Count(), 1);
+}
+
+TEST_F(RcuTest, testSynchronize)
+{
+	RcuPtr<Node> table(new Node(/*val=*/ 0));
+
+	atomic<bool> hold(true), holding(false);
+	Reader th("/rcutest/reader", ReadTable(table, hold, holding));
+	th.Start();
+
+	while (!holding) {
+		sched_yield();
+	}
+
+	table.Update(new Node(/*val=*/ 1));
+	Rcu::QuiescentState();
+	Rcu::Reclaim();
+
+	/*
+	 * The reader is holding on to version 0
+	 */
+	ASSERT_EQ(Node::Count(), 2);
+
+	hold = false;
+	Rcu::Synchronize();
+
+	ASSERT_EQ(Node::Count(), 1);
+
+	th.run_ = false;
+	th.Join();
+}
+
+TEST_F(RcuTest, testConcurrentReaders)
+{
+	RcuPtr<Node> table(new Node(/*val=*/ 0));
+
+	atomic<bool> hold(false), holding(false);
+	list<Reader *> readers;
+	StartReaders(readers, ReadTable(table, hold, holding));
+
+	for (uint64_t i = 1; i < 1000; ++i) {
+		table.Update(new Node(i));
+		Rcu::QuiescentState();
+
+		if (i % 100 == 0) Rcu::Synchronize();
+	}
+
+	StopReaders(readers);
+
+	Rcu::Synchronize();
+
+	ASSERT_EQ(Node::Count(), 1);
+}
+
+TEST_F(RcuTest, testRegisteredOffline)
+{
+	Rcu::Offline();
+	ASSERT_FALSE(Rcu::IsOnline());
+
+	/*
+	 * A quiescent state does not bring an offline thread online
+	 */
+	Rcu::QuiescentState();
+	ASSERT_FALSE(Rcu::IsOnline());
+
+	{
+		RcuOfflineScope offline;
+		ASSERT_FALSE(Rcu::IsOnline());
+	}
+
+	ASSERT_FALSE(Rcu::IsOnline());
+
+	Rcu::Online();
+
+	{
+		RcuOfflineScope offline;
+		ASSERT_FALSE(Rcu::IsOnline());
+	}
+
+	ASSERT_TRUE(Rcu::IsOnline());
+}
+
+TEST_F(RcuTest, testDeferBatch)
+{
+	RcuPtr<Node> table(new Node(/*val=*/ 0));
+
+	/*
+	 * A full batch starts its grace period, the quiescent states declare it over, and the next
+	 * full batch destroys it
+	 */
+	uint64_t val = 0;
+	for (uint64_t i = 0; i < Rcu::BATCH_SIZE; ++i) {
+		table.Update(new Node(++val));
+		Rcu::QuiescentState();
+	}
+
+	ASSERT_EQ(Node::Count(), int64_t(Rcu::BATCH_SIZE) + 1);
+
+	for (uint64_t i = 0; i < Rcu::BATCH_SIZE; ++i) {
+		table.Update(new Node(++val));
+		Rcu::QuiescentState();
+	}
+
+	ASSERT_EQ(Node::Count(), int64_t(Rcu::BATCH_SIZE) + 1);
+
+	Rcu::Synchronize();
+	ASSERT_EQ(Node::Count(), 1);
+}
+
+TEST_F(RcuTest, testBlockedThreads)
+{
+	struct Msg : InListElement<Msg>
+	{
+	};
+
+	/*
+	 * Online readers, one waiting on a queue and one cancelled in a sleep
+	 */
+	struct Waiter : Thread
+	{
+		Waiter(InQueue<Msg> & q) : Thread("/rcutest/waiter"), q_(q), waiting_(false) {}
+
+		void * ThreadMain() override
+		{
+			Rcu::Online();
+			waiting_ = true;
+			q_.Pop();
+			return nullptr;
+		}
+
+		InQueue<Msg> & q_;
+		atomic<bool> waiting_;
+	};
+
+	struct Sleeper : Thread
+	{
+		Sleeper() : Thread("/rcutest/sleeper"), sleeping_(false) {}
+
+		void * ThreadMain() override
+		{
+			Rcu::Online();
+			sleeping_ = true;
+			for (;;) usleep(1000);
+			return nullptr;
+		}
+
+		atomic<bool> sleeping_;
+	};
+
+	InQueue<Msg> q("/rcutest");
+	Waiter waiter(q);
+	Sleeper sleeper;
+
+	waiter.Start();
+	sleeper.Start();
+
+	while (!waiter.waiting_ || !sleeper.sleeping_) {
+		sched_yield();
+	}
+
+	sleeper.Cancel();
+	sleeper.Join();
+
+	/*
+	 * Neither holds up a grace period
+	 */
+	Rcu::Synchronize();
+
+	RcuPtr<Node> table(new Node(/*val=*/ 0));
+	Rcu::Offline();
+	table.Update(new Node(/*val=*/ 1));
+	Rcu::Reclaim();
+	Rcu::Online();
+
+	ASSERT_EQ(Node::Count(), 1);
+
+	Msg msg;
+	q.Push(&msg);
+	waiter.Join();
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <sched.h>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <string>
+
+#include "unit-test.h"
+#include "thread.h"
+#include "thread-ctx.h"
+
+namespace bblocks {
+
+/**
+ * @class Fixture shared by the tests of the memory reclamation schemes
+ *
+ * Nodes count themselves and are scribbled over when destroyed, a reader that checks the magic
+ * of what it reads catches a node freed under it.
+ */
+class ReclaimTest : public UnitTest
+{
+protected:
+
+	explicit ReclaimTest(const std::string & threadLog) : UnitTest(threadLog) {}
+
+	struct Node
+	{
+		static const uint32_t MAGIC = 0xfeedbeef;
+
+		Node(const uint64_t val) : magic_(MAGIC), val_(val)
+		{
+			++Count();
+		}
+
+		~Node()
+		{
+			magic_ = 0;
+			--Count();
+		}
+
+		bool IsValid() const
+		{
+			return magic_ == MAGIC;
+		}
+
+		/*
+		 * Nodes alive
+		 */
+		static std::atomic<int64_t> & Count()
+		{
+			static std::atomic<int64_t> count(0);
+			return count;
+		}
+
+		uint32_t magic_;
+		uint64_t val_;
+	};
+
+	/*
+	 * Runs read in a loop until stopped
+	 */
+	struct Reader : Thread
+	{
+		Reader(const std::string & log, const std::function<void ()> & read)
+			: Thread(log), read_(read), run_(true), nreads_(0)
+		{}
+
+		void * ThreadMain() override
+		{
+			while (run_) {
+				read_();
+				++nreads_;
+
+				sched_yield();
+			}
+
+			return nullptr;
+		}
+
+		const std::function<void ()> read_;
+		std::atomic<bool> run_;
+		std::atomic<uint64_t> nreads_;
+	};
+
+	/*
+	 * A stalled reader, holds what pin protected until stopped
+	 */
+	struct Pinned : Thread
+	{
+		Pinned(const std::string & log, const std::function<void ()> & pin,
+		       const std::function<void ()> & unpin)
+			: Thread(log), pin_(pin), unpin_(unpin), pinned_(false), run_(true)
+		{}
+
+		void * ThreadMain() override
+		{
+			pin_();
+			pinned_ = true;
+
+			while (run_) {
+				sched_yield();
+			}
+
+			unpin_();
+			return nullptr;
+		}
+
+		/*
+		 * Wait until the reference is taken
+		 */
+		void WaitPinned()
+		{
+			while (!pinned_) {
+				sched_yield();
+			}
+		}
+
+		const std::function<void ()> pin_;
+		const std::function<void ()> unpin_;
+		std::atomic<bool> pinned_;
+		std::atomic<bool> run_;
+	};
+
+	void SetUp() override
+	{
+		UnitTest::SetUp();
+		ThreadCtx::Init(/*tinst=*/ NULL);
+		Node::Count() = 0;
+	}
+
+	void TearDown() override
+	{
+		ThreadCtx::Cleanup();
+		UnitTest::TearDown();
+	}
+
+	/*
+	 * Start NumThreads() readers running read
+	 */
+	void StartReaders(std::list<Reader *> & readers, const std::function<void ()> & read)
+	{
+		for (size_t i = 0; i < NumThreads(); ++i) {
+			auto th = new Reader(threadLog_ + "/reader", read);
+			th->Start();
+			readers.push_back(th);
+		}
+	}
+
+	static void StopReaders(std::list<Reader *> & readers)
+	{
+		for (auto th : readers) {
+			th->run_ = false;
+			th->Join();
+			delete th;
+		}
+
+		readers.clear();
+	}
+};
+
+}
@@ -0,0 +1,177 @@
+#include <time.h>
+#include <unistd.h>
+#include <set>
+#include <sstream>
+
+#include "unit-test.h"
+#include "thread.h"
+#include "sampling-profiler.h"
+
+using namespace std;
+using namespace bblocks;
+
+/*
+ * Exported (the test links with ENABLE_EXPORTS) and not inlined, so that it shows up by name
+ */
+__attribute__((noinline)) uint64_t
+SamplingProfilerTestBurn(const uint64_t ms)
+{
+	timespec start, now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+
+	volatile uint64_t sum = 0;
+	do {
+		for (int i = 0; i < 10000; ++i) {
+			sum += i * i;
+		}
+
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000
+		 < (long) ms);
+
+	return sum;
+}
+
+class SamplingProfilerTest : public UnitTest
+{
+public:
+
+	SamplingProfilerTest() : UnitTest("/samplingprofilertest") {}
+
+protected:
+
+	void SetUp() override
+	{
+		UnitTest::SetUp();
+		SamplingProfiler::RegisterThread();
+	}
+
+	void TearDown() override
+	{
+		SamplingProfiler::UnregisterThread();
+		UnitTest::TearDown();
+	}
+
+	/*
+	 * Samples of the stacks containing the frame
+	 */
+	static uint64_t Samples(const string & folded, const string & frame)
+	{
+		uint64_t n = 0;
+
+		istringstream in(folded);
+		string line;
+		while (getline(in, line)) {
+			if (line.find(frame) == string::npos) continue;
+			n += strtoull(line.substr(line.rfind(' ') + 1).c_str(), NULL, 10);
+		}
+
+		return n;
+	}
+};
+
+TEST_F(SamplingProfilerTest, testProfile)
+{
+	ASSERT_TRUE(SamplingProfiler::Start(/*hz=*/ 1000));
+	ASSERT_TRUE(SamplingProfiler::IsRunning());
+	ASSERT_FALSE(SamplingProfiler::Start());
+
+	SamplingProfilerTestBurn(/*ms=*/ 300);
+	SamplingProfiler::Stop();
+
+	ostringstream os;
+	const uint64_t n = SamplingProfiler::WriteFolded(os);
+
+	INFO(threadLog_) << n << " samples, " << SamplingProfiler::NumDropped() << " dropped";
+
+	/*
+	 * Timers tick at the kernel's CPU time accounting granularity, which may be as coarse as
+	 * a few milliseconds
+	 */
+	ASSERT_GT(n, 20u);
+	ASSERT_GT(Samples(os.str(), "SamplingProfilerTestBurn"), n / 2);
+
+	/*
+	 * Every line is a folded stack and a count
+	 */
+	ASSERT_EQ(os.str().back(), '\n');
+	ASSERT_NE(os.str().find(";SamplingProfilerTestBurn(unsigned long) "), string::npos);
+
+	/*
+	 * Once each
+	 */
+	set<string> stacks;
+	istringstream in(os.str());
+	string line;
+	while (getline(in, line)) {
+		ASSERT_TRUE(stacks.insert(line.substr(0, line.rfind(' '))).second);
+	}
+}
+
+TEST_F(SamplingProfilerTest, testThreads)
+{
+	ASSERT_TRUE(SamplingProfiler::Start(/*hz=*/ 1000));
+
+	Run([]() { SamplingProfilerTestBurn(/*ms=*/ 100); }, /*nthreads=*/ 2);
+
+	SamplingProfiler::Stop();
+
+	ostringstream os;
+	SamplingProfiler::WriteFolded(os);
+
+	/*
+	 * Threads started through Thread are sampled, and their samples outlive them
+	 */
+	ASSERT_GT(Samples(os.str(), "Thread::ThFn"), 10u);
+	ASSERT_GT(Samples(os.str(), "SamplingProfilerTestBurn"), 10u);
+}
+
+TEST_F(SamplingProfilerTest, testCancel)
+{
+	struct SleepThread : Thread
+	{
+		SleepThread() : Thread("/samplingprofilertest/sleep") {}
+
+		void * ThreadMain() override
+		{
+			for (;;) usleep(1000);
+			return nullptr;
+		}
+	};
+
+	const size_t nthreads = SamplingProfiler::NumThreads();
+
+	SleepThread th;
+	th.Start();
+
+	while (SamplingProfiler::NumThreads() == nthreads) {
+		usleep(1000);
+	}
+
+	th.Cancel();
+	th.Join();
+
+	/*
+	 * A cancelled thread is not left behind for the next profile to arm a timer at
+	 */
+	ASSERT_EQ(SamplingProfiler::NumThreads(), nthreads);
+
+	ASSERT_TRUE(SamplingProfiler::Start(/*hz=*/ 1000));
+	SamplingProfiler::Stop();
+}
+
+TEST_F(SamplingProfilerTest, testOff)
+{
+	SamplingProfilerTestBurn(/*ms=*/ 50);
+
+	ostringstream os;
+	ASSERT_EQ(SamplingProfiler::WriteFolded(os), 0u);
+	ASSERT_TRUE(os.str().empty());
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,223 @@
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "unit-test.h"
+#include "stats-exporter.h"
+
+using namespace std;
+using namespace bblocks;
+
+class StatsExporterTest : public UnitTest
+{
+public:
+
+	StatsExporterTest() {}
+
+protected:
+
+	static string Read(const string & path)
+	{
+		ifstream in(path.c_str());
+		stringstream ss;
+		ss << in.rdbuf();
+		return ss.str();
+	}
+
+	static string TmpPath(const string & name)
+	{
+		return "/tmp/stats-exporter-test." + STR(getpid()) + "." + name;
+	}
+};
+
+TEST_F(StatsExporterTest, testRegistry)
+{
+	const size_t size = PerfCounterRegistry::Size();
+
+	{
+		PerfCounter a("/statstest/a", "ops", PerfCounter::COUNTER);
+		PerfCounter b("/statstest/a", "ops", PerfCounter::COUNTER);
+		ASSERT_EQ(PerfCounterRegistry::Size(), size + 2);
+
+		size_t n = 0;
+		PerfCounterRegistry::ForEach([&n](const PerfCounter & pc) {
+			if (pc.Name() == "/statstest/a") ++n;
+		});
+
+		ASSERT_EQ(n, 2u);
+
+		/*
+		 * Counters come and go on other threads while the registry is being walked
+		 */
+		bool once = false;
+		PerfCounterRegistry::ForEach([&once](const PerfCounter & pc) {
+			if (once) return;
+			once = true;
+
+			thread th([]() { PerfCounter c("/statstest/c", "ops", PerfCounter::COUNTER); });
+			th.join();
+		});
+
+		ASSERT_TRUE(once);
+	}
+
+	ASSERT_EQ(PerfCounterRegistry::Size(), size);
+}
+
+TEST_F(StatsExporterTest, testPrometheus)
+{
+	PerfCounter a("/statstest/latency", "microsec", PerfCounter::TIME,
+		      PerfCounter::HISTOGRAM | PerfCounter::WINDOWED);
+	PerfCounter b("/statstest/latency", "microsec", PerfCounter::TIME,
+		      PerfCounter::HISTOGRAM);
+
+	for (uint32_t i = 1; i <= 100; ++i) {
+		a.Update(i);
+		b.Update(i);
+	}
+
+	ostringstream os;
+	StatsExporter::WritePrometheus(os);
+	const string out = os.str();
+
+	/*
+	 * Counters sharing a name are merged
+	 */
+	ASSERT_NE(out.find("# TYPE iocore_statstest_latency summary\n"), string::npos);
+	ASSERT_NE(out.find("iocore_statstest_latency_count 200\n"), string::npos);
+	ASSERT_NE(out.find("iocore_statstest_latency_sum 10100\n"), string::npos);
+	ASSERT_NE(out.find("iocore_statstest_latency_min 1\n"), string::npos);
+	ASSERT_NE(out.find("iocore_statstest_latency_max 100\n"), string::npos);
+	ASSERT_NE(out.find("iocore_statstest_latency{quantile=\"0.5\"} 50\n"), string::npos);
+	ASSERT_NE(out.find("iocore_statstest_latency_ops_rate{window=\"1m\"}"), string::npos);
+}
+
+TEST_F(StatsExporterTest, testPrometheusSharedMetric)
+{
+	PerfCounter a("/statstest/a-b", "ops", PerfCounter::COUNTER);
+	PerfCounter b("/statstest/a_b", "ops", PerfCounter::COUNTER);
+	a.Update(/*val=*/ 1);
+	b.Update(/*val=*/ 2);
+	b.Update(/*val=*/ 2);
+
+	ostringstream os;
+	StatsExporter::WritePrometheus(os);
+	const string out = os.str();
+
+	/*
+	 * Both map to the same metric, declared once and told apart by the name label
+	 */
+	for (auto & decl : { "# HELP iocore_statstest_a_b ",
+			     "# TYPE iocore_statstest_a_b summary\n",
+			     "# TYPE iocore_statstest_a_b_min gauge\n",
+			     "# TYPE iocore_statstest_a_b_max gauge\n" }) {
+		ASSERT_NE(out.find(decl), string::npos);
+		ASSERT_EQ(out.find(decl), out.rfind(decl));
+	}
+
+	ASSERT_NE(out.find(" /statstest/a-b (ops), /statstest/a_b (ops)\n"), string::npos);
+	ASSERT_NE(out.find("_a_b_count{name=\"/statstest/a-b\"} 1\n"), string::npos);
+	ASSERT_NE(out.find("_a_b_count{name=\"/statstest/a_b\"} 2\n"), string::npos);
+	ASSERT_NE(out.find("_a_b_sum{name=\"/statstest/a_b\"} 4\n"), string::npos);
+	ASSERT_NE(out.find("_a_b_max{name=\"/statstest/a-b\"} 1\n"), string::npos);
+}
+
+TEST_F(StatsExporterTest, testJson)
+{
+	PerfCounter a("/statstest/\"json\"", "B", PerfCounter::BYTES);
+	a.Update(/*val=*/ 4096);
+
+	PerfCounter b("/statstest/tab\tname", "B", PerfCounter::BYTES);
+
+	ostringstream os;
+	StatsExporter::WriteJson(os);
+	const string out = os.str();
+
+	ASSERT_EQ(out.find("{\"timestamp_ms\":"), 0u);
+	ASSERT_NE(out.find("{\"name\":\"/statstest/\\\"json\\\"\",\"units\":\"B\",\"count\":1,"
+			   "\"sum\":4096,\"min\":4096,\"max\":4096}"), string::npos);
+
+	/*
+	 * Control characters are escaped
+	 */
+	ASSERT_NE(out.find("{\"name\":\"/statstest/tab\\u0009name\""), string::npos);
+}
+
+TEST_F(StatsExporterTest, testExportFile)
+{
+	const string path = TmpPath("prom");
+	PerfCounter a("/statstest/file", "ops", PerfCounter::COUNTER);
+	a.Update(/*val=*/ 7);
+
+	StatsExporter exporter(path, StatsExporter::PROMETHEUS, /*intervalms=*/ 10);
+	exporter.Start();
+
+	while (exporter.NumExports() < 2) {
+		usleep(1000);
+	}
+
+	a.Update(/*val=*/ 3);
+	exporter.Stop();
+
+	/*
+	 * Stop leaves the final values behind
+	 */
+	ASSERT_NE(Read(path).find("iocore_statstest_file_sum 10\n"), string::npos);
+	ASSERT_FALSE(access((path + ".tmp").c_str(), F_OK) == 0);
+
+	unlink(path.c_str());
+
+	/*
+	 * Stop is idempotent, and fine on an exporter that never started
+	 */
+	exporter.Stop();
+
+	StatsExporter idle(path, StatsExporter::PROMETHEUS);
+	idle.Stop();
+}
+
+TEST_F(StatsExporterTest, testExportSocket)
+{
+	const string path = TmpPath("sock");
+	PerfCounter a("/statstest/socket", "ops", PerfCounter::COUNTER);
+	a.Update(/*val=*/ 7);
+
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	fd_t fd = socket(AF_UNIX, SOCK_STREAM, /*protocol=*/ 0);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(bind(fd, (sockaddr *) &addr, sizeof(addr)), 0);
+	ASSERT_EQ(listen(fd, /*backlog=*/ 4), 0);
+
+	StatsExporter exporter("unix:" + path, StatsExporter::JSON, /*intervalms=*/ 10);
+	ASSERT_TRUE(exporter.Export());
+
+	fd_t conn = accept(fd, NULL, NULL);
+	ASSERT_GE(conn, 0);
+
+	string out;
+	char buf[4096];
+	ssize_t n;
+	while ((n = read(conn, buf, sizeof(buf))) > 0) {
+		out.append(buf, n);
+	}
+
+	ASSERT_NE(out.find("\"name\":\"/statstest/socket\""), string::npos);
+
+	close(conn);
+	close(fd);
+	unlink(path.c_str());
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,182 @@
+#include "unit-test.h"
+#include "thread.h"
+#include "perfcounter.h"
+#include "stats-segment.h"
+
+using namespace std;
+using namespace bblocks;
+
+class StatsSegmentTest : public UnitTest
+{
+public:
+
+	StatsSegmentTest() : UnitTest("/statssegmenttest") {}
+
+	static void SetUpTestCase()
+	{
+		ASSERT_TRUE(StatsSegment::Open(Name(), /*nslots=*/ 64, /*ncells=*/ 256));
+	}
+
+	static void TearDownTestCase()
+	{
+		StatsSegment::Close();
+	}
+
+protected:
+
+	static string Name()
+	{
+		return "/iocore-stats-test." + STR(getpid());
+	}
+
+	/*
+	 * Read the counter the way an external reader does
+	 */
+	static bool Find(const string & name, StatsSegmentReader::Counter & counter)
+	{
+		StatsSegmentReader reader;
+		if (!reader.Open(Name()).empty()) return false;
+
+		for (auto & c : reader.Read()) {
+			if (c.name_ == name) {
+				counter = c;
+				return true;
+			}
+		}
+
+		return false;
+	}
+};
+
+TEST_F(StatsSegmentTest, testRead)
+{
+	PerfCounter pc("/statssegmenttest/read", "B", PerfCounter::BYTES);
+
+	pc.Update(/*val=*/ 1);
+	pc.Update(/*val=*/ 5);
+	pc.Update(/*val=*/ 100);
+
+	StatsSegmentReader::Counter c;
+	ASSERT_TRUE(Find("/statssegmenttest/read", c));
+	ASSERT_EQ(c.units_, "B");
+	ASSERT_EQ(c.type_, (uint32_t) PerfCounter::BYTES);
+	ASSERT_EQ(c.count_, 3u);
+	ASSERT_EQ(c.val_, 106u);
+	ASSERT_EQ(c.min_, 1u);
+	ASSERT_EQ(c.max_, 100u);
+	ASSERT_EQ(c.bucket_[0], 1u);
+	ASSERT_EQ(c.bucket_[2], 1u);
+	ASSERT_EQ(c.bucket_[6], 1u);
+
+	/*
+	 * The process view is the same
+	 */
+	ASSERT_EQ(pc.Value(), 106u);
+}
+
+TEST_F(StatsSegmentTest, testSharded)
+{
+	static const uint64_t NITER = 10000;
+
+	PerfCounter pc("/statssegmenttest/sharded", "ops", PerfCounter::COUNTER,
+		       PerfCounter::SHARDED);
+
+	pc.Update(/*val=*/ 1);
+
+	Run([&pc]() {
+		for (uint64_t i = 0; i < NITER; ++i) {
+			pc.Update(/*val=*/ 2);
+		}
+	});
+
+	StatsSegmentReader::Counter c;
+	ASSERT_TRUE(Find("/statssegmenttest/sharded", c));
+	ASSERT_EQ(c.count_, NITER * NumThreads() + 1);
+	ASSERT_EQ(c.val_, 2 * NITER * NumThreads() + 1);
+	ASSERT_EQ(c.min_, 1u);
+	ASSERT_EQ(c.max_, 2u);
+	ASSERT_EQ(c.count_, pc.Count());
+}
+
+TEST_F(StatsSegmentTest, testSlotReuse)
+{
+	StatsSegmentReader::Counter first;
+
+	{
+		PerfCounter pc("/statssegmenttest/first", "ops", PerfCounter::COUNTER);
+		pc.Update(/*val=*/ 1);
+		ASSERT_TRUE(Find("/statssegmenttest/first", first));
+	}
+
+	StatsSegmentReader::Counter c;
+	ASSERT_FALSE(Find("/statssegmenttest/first", c));
+
+	/*
+	 * The slot goes to the next counter, with a new generation so readers do not mix the two
+	 */
+	PerfCounter pc("/statssegmenttest/second", "ops", PerfCounter::COUNTER);
+	ASSERT_TRUE(Find("/statssegmenttest/second", c));
+	ASSERT_EQ(c.slot_, first.slot_);
+	ASSERT_NE(c.gen_, first.gen_);
+	ASSERT_EQ(c.count_, 0u);
+}
+
+TEST_F(StatsSegmentTest, testCellReuse)
+{
+	/*
+	 * Far more shard cells over time than the segment has, the cells of a destroyed counter
+	 * go to the next
+	 */
+	for (int i = 0; i < 300; ++i) {
+		PerfCounter pc("/statssegmenttest/cells", "ops", PerfCounter::COUNTER,
+			       PerfCounter::SHARDED);
+
+		Run([&pc]() { pc.Update(/*val=*/ 1); });
+
+		StatsSegmentReader::Counter c;
+		ASSERT_TRUE(Find("/statssegmenttest/cells", c));
+		ASSERT_EQ(c.count_, NumThreads());
+	}
+
+	StatsSegmentReader reader;
+	ASSERT_EQ(reader.Open(Name()), "");
+	ASSERT_LE(reader.Header()->ncellsUsed_.load(), 2 * NumThreads());
+}
+
+TEST_F(StatsSegmentTest, testOpenErrors)
+{
+	StatsSegmentReader reader;
+	ASSERT_FALSE(reader.Open(Name() + ".missing").empty());
+
+	/*
+	 * Not a stats segment
+	 */
+	const string name = Name() + ".bad";
+	const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+	ASSERT_GE(fd, 0);
+	ASSERT_EQ(ftruncate(fd, 8192), 0);
+	close(fd);
+
+	ASSERT_NE(reader.Open(name).find("not a stats segment"), string::npos);
+	shm_unlink(name.c_str());
+
+	/*
+	 * A second segment per process is refused
+	 */
+	ASSERT_FALSE(StatsSegment::Open(Name() + ".second"));
+	ASSERT_EQ(reader.Open(Name()), "");
+
+	/*
+	 * Nor is the name of the live one taken away
+	 */
+	ASSERT_FALSE(StatsSegment::Open(Name()));
+	ASSERT_EQ(reader.Open(Name()), "");
+	ASSERT_EQ(reader.Header()->pid_, (uint64_t) getpid());
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -2,6 +2,8 @@
 
 #include "unit-test.h"
 #include "thread.h"
+#include "thread-stats.h"
+#include "inlist.hpp"
 
 using namespace std;
 using namespace bblocks;
@@ -83,6 +85,148 @@ TEST_F(ThreadTest, testCancel)
 	CancelMain();
 }
 
+class ThreadStatsTest : public UnitTest
+{
+public:
+
+	ThreadStatsTest() {}
+
+protected:
+
+	struct Msg : InListElement<Msg>
+	{
+	};
+
+	/*
+	 * Burns CPU, then waits for a message
+	 */
+	struct MyThread : Thread
+	{
+		MyThread(InQueue<Msg> & q) : Thread("/threadstatstest"), q_(q) {}
+
+		void * ThreadMain() override
+		{
+			Burn(/*ms=*/ 100);
+			q_.Pop();
+			return nullptr;
+		}
+
+		InQueue<Msg> & q_;
+	};
+
+	/*
+	 * Burns CPU, then sleeps until cancelled
+	 */
+	struct SleepThread : Thread
+	{
+		SleepThread() : Thread("/threadstatstest/sleep") {}
+
+		void * ThreadMain() override
+		{
+			Burn(/*ms=*/ 100);
+
+			for (;;) {
+				usleep(1000);
+			}
+
+			return nullptr;
+		}
+	};
+
+	static void Burn(const uint64_t ms)
+	{
+		const uint64_t start = Time::NowInMilliSec();
+
+		volatile uint64_t sum = 0;
+		while (Time::NowInMilliSec() - start < ms) {
+			sum += 1;
+		}
+	}
+
+	static const PerfCounter * Find(const string & name)
+	{
+		const PerfCounter * found = NULL;
+
+		PerfCounterRegistry::ForEach([&found, &name](const PerfCounter & pc) {
+			if (pc.Name() == name) found = &pc;
+		});
+
+		return found;
+	}
+};
+
+TEST_F(ThreadStatsTest, testBusyIdle)
+{
+	InQueue<Msg> q("threadstatstest");
+	Msg msg;
+
+	MyThread th(q);
+	ASSERT_FALSE(th.Stats());
+
+	th.Start();
+	ASSERT_TRUE(th.Stats());
+
+	usleep(200 * 1000);
+	th.Stats()->Sample();
+
+	/*
+	 * Still waiting for the message
+	 */
+	const ThreadStats::Times t = th.Stats()->Read();
+	ASSERT_GE(t.busyus_, 90 * 1000u);
+	ASSERT_GE(t.idleus_, 50 * 1000u);
+	ASSERT_GE(t.cpuus_, 50 * 1000u);
+	ASSERT_LE(t.cpuus_, t.busyus_ + 10 * 1000);
+
+	q.Push(&msg);
+	th.Join();
+
+	/*
+	 * The totals stop at the exit of the thread
+	 */
+	const ThreadStats::Times end = th.Stats()->Read();
+	usleep(10 * 1000);
+	ASSERT_EQ(th.Stats()->Read().busyus_, end.busyus_);
+	ASSERT_GE(end.idleus_, t.idleus_);
+	ASSERT_GE(end.nvcsw_, 1u);
+
+	ThreadStats::SampleAll();
+
+	const double pct = th.Stats()->Utilization();
+	ASSERT_GT(pct, 20);
+	ASSERT_LT(pct, 80);
+
+	/*
+	 * The counters carry the totals
+	 */
+	const PerfCounter * busy = Find("/threadstatstest/busy-time");
+	ASSERT_TRUE(busy);
+	ASSERT_EQ(busy->Value(), end.busyus_);
+	ASSERT_EQ(Find("/threadstatstest/idle-time")->Value(), end.idleus_);
+	ASSERT_EQ(Find("/threadstatstest/cpu-time")->Value(), end.cpuus_);
+	ASSERT_EQ(Find("/threadstatstest/ctx-switches/voluntary")->Value(), end.nvcsw_);
+	ASSERT_EQ(Find("/threadstatstest/utilization")->Count(), 2u);
+}
+
+TEST_F(ThreadStatsTest, testCancel)
+{
+	SleepThread th;
+	th.Start();
+	usleep(150 * 1000);
+
+	th.Cancel();
+	th.Join();
+
+	/*
+	 * The stats let go of the thread anyway
+	 */
+	const ThreadStats::Times end = th.Stats()->Read();
+	ASSERT_GE(end.cpuus_, 50 * 1000u);
+
+	usleep(10 * 1000);
+	ASSERT_EQ(th.Stats()->Read().busyus_, end.busyus_);
+}
+
 int
 main(int argc, char ** argv)
 {
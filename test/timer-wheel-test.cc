@@ -0,0 +1,292 @@
+#include <poll.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "unit-test.h"
+#include "timer-wheel.h"
+
+using namespace std;
+using namespace bblocks;
+
+class TimerWheelTest : public UnitTest
+{
+public:
+
+	TimerWheelTest() : log_("/timerwheeltest") {}
+
+protected:
+
+	/*
+	 * Remembers when it fired, by the time of its wheel
+	 */
+	struct MyTimer : Timer
+	{
+		MyTimer() : wheel_(NULL), deadline_(0), fired_(0), firedms_(0) {}
+
+		void Expired() override
+		{
+			++fired_;
+			firedms_ = wheel_->NowInMilliSec();
+		}
+
+		TimerWheel * wheel_;
+		uint64_t deadline_;
+		uint32_t fired_;
+		uint64_t firedms_;
+	};
+
+	/*
+	 * Add with a delay from the time of the wheel
+	 */
+	static void Add(TimerWheel & wheel, MyTimer & t, const uint64_t delayms)
+	{
+		t.wheel_ = &wheel;
+		t.deadline_ = wheel.NowInMilliSec() + delayms;
+		wheel.Add(&t, delayms);
+	}
+
+	const string log_;
+};
+
+TEST_F(TimerWheelTest, testExpiry)
+{
+	TimerWheel wheel;
+	const uint64_t start = wheel.NowInMilliSec();
+
+	/*
+	 * Across the levels, and at their edges
+	 */
+	const uint64_t delays[] = { 0, 1, 2, 5, 255, 256, 257, 300, 1000, 65535, 65536, 65537,
+				    100 * 1000, 300 * 1000 };
+	const size_t n = sizeof(delays) / sizeof(delays[0]);
+
+	vector<MyTimer> timers(n);
+	for (size_t i = 0; i < n; ++i) Add(wheel, timers[i], delays[i]);
+
+	ASSERT_EQ(wheel.Size(), n);
+
+	size_t fired = 0;
+	for (uint64_t now = start; now <= start + delays[n - 1]; ++now) {
+		fired += wheel.Advance(now);
+
+		for (auto & t : timers) {
+			/*
+			 * On time to the tick, never early
+			 */
+			ASSERT_EQ(t.fired_, now >= t.deadline_ ? 1u : 0u);
+			if (t.fired_) {
+				ASSERT_EQ(t.firedms_, t.deadline_);
+			}
+		}
+	}
+
+	ASSERT_EQ(fired, n);
+	ASSERT_EQ(wheel.Size(), 0u);
+	ASSERT_EQ(wheel.NextExpiry(), uint64_t(TimerWheel::NONE));
+}
+
+TEST_F(TimerWheelTest, testJump)
+{
+	TimerWheel wheel(/*resolutionms=*/ 10);
+	const uint64_t start = wheel.NowInMilliSec();
+
+	/*
+	 * Up in level 3, and beyond the range of the wheel
+	 */
+	MyTimer far, farther, late;
+	Add(wheel, far, 10ULL * (1 << 24) + 50);
+	Add(wheel, farther, 10 * TimerWheel::MAX_TICKS + 70);
+	Add(wheel, late, 5);
+
+	/*
+	 * Late by a few ticks, the timer runs once
+	 */
+	ASSERT_EQ(wheel.Advance(start + 100), 1u);
+	ASSERT_EQ(late.fired_, 1u);
+
+	ASSERT_EQ(wheel.Advance(far.deadline_ - 1), 0u);
+	ASSERT_EQ(wheel.Advance(far.deadline_ + 9), 1u);
+	ASSERT_EQ(far.fired_, 1u);
+
+	/*
+	 * Round up to the resolution
+	 */
+	ASSERT_GE(far.firedms_, far.deadline_);
+
+	ASSERT_EQ(wheel.Advance(farther.deadline_ - 1), 0u);
+	ASSERT_EQ(farther.fired_, 0u);
+	ASSERT_EQ(wheel.Advance(farther.deadline_ + 9), 1u);
+	ASSERT_EQ(farther.fired_, 1u);
+}
+
+TEST_F(TimerWheelTest, testCancel)
+{
+	TimerWheel wheel;
+	const uint64_t start = wheel.NowInMilliSec();
+
+	vector<MyTimer> timers(1000);
+	for (size_t i = 0; i < timers.size(); ++i) Add(wheel, timers[i], i * 7);
+
+	/*
+	 * Cancel the odd ones, push the ones divisible by 10 out
+	 */
+	for (size_t i = 0; i < timers.size(); ++i) {
+		if (i % 2) {
+			wheel.Cancel(&timers[i]);
+			ASSERT_FALSE(timers[i].IsPending());
+		} else if (i % 10 == 0) {
+			Add(wheel, timers[i], 10 * 1000);
+		}
+	}
+
+	ASSERT_EQ(wheel.Size(), timers.size() / 2);
+
+	wheel.Advance(start + 7 * timers.size());
+
+	for (size_t i = 0; i < timers.size(); ++i) {
+		ASSERT_EQ(timers[i].fired_, i % 2 || i % 10 == 0 ? 0u : 1u);
+	}
+
+	wheel.Advance(start + 10 * 1000);
+
+	for (size_t i = 0; i < timers.size(); i += 10) {
+		ASSERT_EQ(timers[i].fired_, 1u);
+	}
+
+	ASSERT_EQ(wheel.Size(), 0u);
+}
+
+TEST_F(TimerWheelTest, testFromExpired)
+{
+	TimerWheel wheel;
+	const uint64_t start = wheel.NowInMilliSec();
+
+	/*
+	 * Periodic, re-adds itself and cancels the victim when it fires
+	 */
+	struct Periodic : Timer
+	{
+		void Expired() override
+		{
+			++n_;
+			wheel_->Add(this, /*delayms=*/ 0);
+			wheel_->Cancel(victim_);
+		}
+
+		TimerWheel * wheel_;
+		Timer * victim_;
+		uint32_t n_;
+	};
+
+	MyTimer victim;
+	Add(wheel, victim, 5);
+
+	Periodic p;
+	p.wheel_ = &wheel;
+	p.victim_ = &victim;
+	p.n_ = 0;
+	wheel.Add(&p, 5);
+
+	/*
+	 * Both due at the same tick, the victim may go first. The periodic timer runs once per
+	 * tick.
+	 */
+	ASSERT_LE(wheel.Advance(start + 5), 2u);
+	ASSERT_EQ(p.n_, 1u);
+
+	for (uint64_t now = start + 6; now <= start + 10; ++now) {
+		ASSERT_EQ(wheel.Advance(now), 1u);
+	}
+
+	ASSERT_EQ(p.n_, 6u);
+	ASSERT_FALSE(victim.IsPending());
+
+	wheel.Cancel(&p);
+	ASSERT_EQ(wheel.Size(), 0u);
+}
+
+TEST_F(TimerWheelTest, testMillions)
+{
+	static const size_t NTIMERS = 1000 * 1000;
+	static const uint64_t SPAN_MS = 100 * 1000;
+
+	TimerWheel wheel;
+	const uint64_t start = wheel.NowInMilliSec();
+
+	srand(1);
+
+	vector<MyTimer> timers(NTIMERS);
+
+	const uint64_t addStart = Rdtsc::rdtsc();
+	for (auto & t : timers) Add(wheel, t, rand() % SPAN_MS);
+	const uint64_t addCycles = Rdtsc::rdtsc() - addStart;
+
+	/*
+	 * Half of them see activity and are pushed out, half of those then closed
+	 */
+	for (size_t i = 0; i < NTIMERS; i += 2) {
+		Add(wheel, timers[i], SPAN_MS + rand() % SPAN_MS);
+		if (i % 4 == 0) wheel.Cancel(&timers[i]);
+	}
+
+	const uint64_t runStart = Rdtsc::rdtsc();
+	size_t fired = 0;
+	for (uint64_t now = start; now <= start + 2 * SPAN_MS; now += 1) {
+		fired += wheel.Advance(now);
+	}
+	const uint64_t runCycles = Rdtsc::rdtsc() - runStart;
+
+	INFO(log_) << "add " << Rdtsc::ToNanoSec(addCycles) / NTIMERS << " ns/timer, run "
+		   << Rdtsc::ToNanoSec(runCycles) / NTIMERS << " ns/timer";
+
+	ASSERT_EQ(fired, NTIMERS - NTIMERS / 4);
+	ASSERT_EQ(wheel.Size(), 0u);
+
+	for (size_t i = 0; i < NTIMERS; ++i) {
+		ASSERT_EQ(timers[i].fired_, i % 4 == 0 ? 0u : 1u);
+		if (timers[i].fired_) {
+			ASSERT_EQ(timers[i].firedms_, timers[i].deadline_);
+		}
+	}
+}
+
+TEST_F(TimerWheelTest, testFd)
+{
+	TimerWheel wheel;
+
+	pollfd pfd;
+	pfd.fd = wheel.Fd();
+	pfd.events = POLLIN;
+
+	/*
+	 * Disarmed while empty
+	 */
+	ASSERT_EQ(poll(&pfd, 1, /*timeout=*/ 20), 0);
+
+	MyTimer t1, t2;
+	Add(wheel, t1, 20);
+	Add(wheel, t2, 50);
+
+	while (t2.fired_ == 0) {
+		ASSERT_EQ(poll(&pfd, 1, /*timeout=*/ 1000), 1);
+		wheel.OnFdReadable();
+
+		/*
+		 * Never before the deadline on the clock
+		 */
+		if (t1.fired_) {
+			ASSERT_GE(t1.firedms_, t1.deadline_);
+		}
+	}
+
+	ASSERT_EQ(t1.fired_, 1u);
+	ASSERT_GE(t2.firedms_, t2.deadline_);
+	ASSERT_EQ(poll(&pfd, 1, /*timeout=*/ 20), 0);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
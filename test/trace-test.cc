@@ -0,0 +1,276 @@
+#include <unistd.h>
+#include <fstream>
+#include <list>
+#include <sstream>
+
+#include "unit-test.h"
+#include "thread.h"
+#include "inlist.hpp"
+#include "lock.h"
+#include "trace.h"
+
+using namespace std;
+using namespace bblocks;
+
+class TraceTest : public UnitTest
+{
+public:
+
+	TraceTest() : UnitTest("/tracetest") {}
+
+protected:
+
+	enum
+	{
+		REQUEST = TRACE_USER,
+		BYTES,
+	};
+
+	void SetUp() override
+	{
+		UnitTest::SetUp();
+
+		Trace::SetName(REQUEST, "request");
+		Trace::SetName(BYTES, "bytes");
+		Trace::Enable(/*nevents=*/ 1024);
+		Trace::Clear();
+	}
+
+	void TearDown() override
+	{
+		Trace::Disable();
+		unlink(Path().c_str());
+
+		UnitTest::TearDown();
+	}
+
+	static string Path()
+	{
+		return "/tmp/trace-test." + STR(getpid());
+	}
+
+	/*
+	 * Dump and convert the trace
+	 */
+	static string ToJson()
+	{
+		if (Trace::Dump(Path()) < 0) return string();
+
+		ifstream in(Path().c_str(), ios::binary);
+		ostringstream out;
+		const string err = TraceFile::ToChromeJson(in, out);
+		return err.empty() ? out.str() : err;
+	}
+
+	static size_t Count(const string & s, const string & what)
+	{
+		size_t n = 0;
+		for (size_t pos = s.find(what); pos != string::npos; pos = s.find(what, pos + 1)) {
+			++n;
+		}
+
+		return n;
+	}
+};
+
+TEST_F(TraceTest, testEvents)
+{
+	{
+		TraceScope scope(REQUEST, /*arg0=*/ 42);
+		Trace::Instant(TRACE_IO, /*arg0=*/ 7, /*arg1=*/ 8);
+		Trace::Counter(BYTES, /*val=*/ 4096);
+	}
+
+	const string json = ToJson();
+
+	ASSERT_EQ(json.find("{\"traceEvents\":["), 0u);
+	ASSERT_NE(json.find("{\"name\":\"request\",\"cat\":\"iocore\",\"ph\":\"B\""), string::npos);
+	ASSERT_NE(json.find("\"args\":{\"arg0\":42,\"arg1\":0}"), string::npos);
+	ASSERT_NE(json.find("{\"name\":\"io\",\"cat\":\"iocore\",\"ph\":\"i\""), string::npos);
+	ASSERT_NE(json.find("\"s\":\"t\",\"args\":{\"arg0\":7,\"arg1\":8}"), string::npos);
+	ASSERT_NE(json.find("{\"name\":\"bytes\",\"cat\":\"iocore\",\"ph\":\"C\""), string::npos);
+	ASSERT_NE(json.find("\"args\":{\"value\":4096}"), string::npos);
+	ASSERT_EQ(Count(json, "\"ph\":\"E\""), 1u);
+	ASSERT_NE(json.find("\"displayTimeUnit\":\"ns\"}"), string::npos);
+}
+
+TEST_F(TraceTest, testDisabled)
+{
+	Trace::Disable();
+	Trace::Instant(REQUEST);
+
+	/*
+	 * A scope begun while enabled is ended regardless
+	 */
+	Trace::Enable(/*nevents=*/ 1024);
+	{
+		TraceScope scope(REQUEST);
+		Trace::Disable();
+	}
+
+	const string json = ToJson();
+	ASSERT_EQ(Count(json, "\"name\":\"request\""), 2u);
+	ASSERT_EQ(Count(json, "\"ph\":\"i\""), 0u);
+}
+
+TEST_F(TraceTest, testRingWrap)
+{
+	/*
+	 * The ring keeps the latest events. The oldest slot of a full ring is the one its owner
+	 * writes next, Dump leaves it out
+	 */
+	for (uint64_t i = 0; i < 5000; ++i) {
+		Trace::Instant(REQUEST, /*arg0=*/ i);
+	}
+
+	const string json = ToJson();
+	ASSERT_EQ(Count(json, "\"ph\":\"i\""), 1023u);
+	ASSERT_NE(json.find("\"arg0\":4999,"), string::npos);
+	ASSERT_NE(json.find("\"arg0\":3977,"), string::npos);
+	ASSERT_EQ(json.find("\"arg0\":3976,"), string::npos);
+}
+
+TEST_F(TraceTest, testThreads)
+{
+	struct Msg : InListElement<Msg> {};
+
+	InQueue<Msg> q("/tracetest");
+	Msg msg;
+
+	/*
+	 * The consumer is in the queue wait when the producer pushes
+	 */
+	Run([&q, &msg]() {
+		static atomic<int> n(0);
+		if (n++ == 0) {
+			q.Pop();
+		} else {
+			usleep(50 * 1000);
+			TraceScope scope(REQUEST);
+			q.Push(&msg);
+		}
+	}, /*nthreads=*/ 2);
+
+	const string json = ToJson();
+
+	ASSERT_EQ(Count(json, "{\"name\":\"thread_name\",\"ph\":\"M\""), Count(json, "/tracetest"));
+	ASSERT_GE(Count(json, "\"args\":{\"name\":\"/tracetest\"}"), 2u);
+	ASSERT_EQ(Count(json, "\"name\":\"thread\",\"cat\":\"iocore\",\"ph\":\"B\""), 2u);
+	ASSERT_EQ(Count(json, "\"name\":\"thread\",\"cat\":\"iocore\",\"ph\":\"E\""), 2u);
+	ASSERT_GE(Count(json, "\"name\":\"queue-wait\",\"cat\":\"iocore\",\"ph\":\"B\""), 1u);
+	ASSERT_EQ(Count(json, "\"name\":\"request\",\"cat\":\"iocore\",\"ph\":\"B\""), 1u);
+
+	/*
+	 * Depth after the push and after the pop, as a counter of its own queue
+	 */
+	ASSERT_EQ(Count(json, "\"name\":\"queue-depth\",\"cat\":\"iocore\",\"ph\":\"C\""), 2u);
+	ostringstream id;
+	id << "\"id\":\"" << hex << (uint64_t) &q << "\"";
+	ASSERT_EQ(Count(json, id.str()), 2u);
+	ASSERT_EQ(Count(json, "\"args\":{\"value\":1}"), 1u);
+	ASSERT_EQ(Count(json, "\"args\":{\"value\":0}"), 1u);
+}
+
+TEST_F(TraceTest, testLockWait)
+{
+	PThreadMutex mutex, timed;
+	SpinMutex spin;
+	PThreadRWLock rwlock;
+	atomic<bool> held(false), done(false);
+
+	/*
+	 * The holder lets go of the locks one by one while we wait on them, the timed one never
+	 */
+	list<Thread *> holder;
+	StartThreads(holder, [&]() {
+		mutex.Lock();
+		timed.Lock();
+		spin.Lock();
+		rwlock.WriteLock();
+		held = true;
+
+		usleep(10 * 1000);
+		mutex.Unlock();
+		usleep(10 * 1000);
+		spin.Unlock();
+		usleep(10 * 1000);
+		rwlock.Unlock();
+
+		while (!done) {
+			usleep(1000);
+		}
+
+		timed.Unlock();
+	});
+
+	while (!held) {
+		sched_yield();
+	}
+
+	mutex.Lock();
+	mutex.Unlock();
+	spin.Lock();
+	spin.Unlock();
+	rwlock.ReadLock();
+	rwlock.Unlock();
+	ASSERT_FALSE(timed.Lock(/*ms=*/ 1));
+
+	done = true;
+	JoinThreads(holder);
+
+	const string json = ToJson();
+	const size_t nbegin = Count(json, "\"name\":\"lock-wait\",\"cat\":\"iocore\",\"ph\":\"B\"");
+	ASSERT_GE(nbegin, 4u);
+	ASSERT_EQ(Count(json, "\"name\":\"lock-wait\",\"cat\":\"iocore\",\"ph\":\"E\""), nbegin);
+}
+
+TEST_F(TraceTest, testDumpWhileRecording)
+{
+	/*
+	 * The rings wrap many times over while they are dumped
+	 */
+	atomic<bool> done(false);
+	atomic<size_t> ndumps(0);
+
+	list<Thread *> dumper;
+	StartThreads(dumper, [&done, &ndumps]() {
+		while (!done.load()) {
+			if (Trace::Dump(Path()) >= 0) ++ndumps;
+		}
+	});
+
+	Run([]() {
+		for (uint64_t i = 0; i < 100 * 1000; ++i) {
+			Trace::Instant(REQUEST, /*arg0=*/ i);
+		}
+	}, /*nthreads=*/ 4);
+
+	done.store(true);
+	JoinThreads(dumper);
+
+	ASSERT_GE(ndumps.load(), 1u);
+	ASSERT_GE(Count(ToJson(), "\"ph\":\"i\""), 4u * 1000);
+}
+
+TEST_F(TraceTest, testThreadName)
+{
+	Trace::SetThreadName("main\t\"1\"");
+	Trace::Instant(REQUEST);
+
+	const string json = ToJson();
+	ASSERT_NE(json.find("\"args\":{\"name\":\"main\\u0009\\\"1\\\"\"}"), string::npos);
+}
+
+TEST_F(TraceTest, testBadFile)
+{
+	istringstream in("garbage");
+	ostringstream out;
+	ASSERT_EQ(TraceFile::ToChromeJson(in, out), "not a trace file");
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
@@ -0,0 +1,196 @@
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "unit-test.h"
+#include "inlist.hpp"
+#include "usdt.h"
+
+using namespace std;
+using namespace bblocks;
+
+class UsdtTest : public UnitTest
+{
+public:
+
+	UsdtTest() {}
+
+protected:
+
+	struct Probe
+	{
+		string provider_;
+		string name_;
+		uint64_t location_;
+		string args_;
+	};
+
+	struct Msg : InListElement<Msg>
+	{
+	};
+
+	/*
+	 * The probes of an ELF file, as readelf -n prints them:
+	 *
+	 *	Provider: iocore
+	 *	Name: queue_push
+	 *	Location: 0x..., Base: 0x..., Semaphore: 0x...
+	 *	Arguments: 8@%rdi 8@%rsi 8@%rax
+	 */
+	static vector<Probe> ReadProbes(const string & path)
+	{
+		vector<Probe> probes;
+
+		FILE * f = popen(("readelf -n " + path + " 2>/dev/null").c_str(), "r");
+		if (!f) return probes;
+
+		char buf[4096];
+		while (fgets(buf, sizeof(buf), f)) {
+			string line(buf);
+			line = line.substr(line.find_first_not_of(" \t"));
+			line = line.substr(0, line.find_last_not_of("\n") + 1);
+
+			if (line.find("Provider: ") == 0) {
+				probes.push_back(Probe{line.substr(10), "", 0, ""});
+			} else if (probes.empty()) {
+				continue;
+			} else if (line.find("Name: ") == 0) {
+				probes.back().name_ = line.substr(6);
+			} else if (line.find("Location: ") == 0) {
+				probes.back().location_ = strtoull(line.c_str() + 10, NULL, 16);
+			} else if (line.find("Arguments: ") == 0) {
+				probes.back().args_ = line.substr(11);
+			}
+		}
+
+		pclose(f);
+		return probes;
+	}
+
+	static set<string> Names(const vector<Probe> & probes)
+	{
+		set<string> names;
+		for (auto & p : probes) {
+			if (p.provider_ == "iocore") names.insert(p.name_);
+		}
+		return names;
+	}
+
+	/*
+	 * Not /proc/self, readelf would read itself
+	 */
+	static string SelfExe()
+	{
+		return "/proc/" + to_string(getpid()) + "/exe";
+	}
+
+	static bool HasReadelf()
+	{
+		return system("readelf --version > /dev/null 2>&1") == 0;
+	}
+
+	static int LoadBias(dl_phdr_info * info, size_t, void * data)
+	{
+		/*
+		 * The executable comes first
+		 */
+		*(uint64_t *) data = info->dlpi_addr;
+		return 1;
+	}
+
+	/*
+	 * The probes of this binary, in the queues instantiated below
+	 */
+	static void UseQueues()
+	{
+		InQueue<Msg> q("usdttest");
+		Msg msg;
+		q.Push(&msg);
+		ASSERT_EQ(q.Pop(/*ms=*/ 1), &msg);
+
+		Queue<int> q2("usdttest2");
+		q2.Push(1);
+		ASSERT_EQ(q2.Pop(), 1);
+	}
+};
+
+TEST_F(UsdtTest, testCoreNotes)
+{
+	if (!HasReadelf()) return;
+
+	const auto probes = ReadProbes(CORE_LIB);
+	const auto names = Names(probes);
+
+	ASSERT_TRUE(names.count("thread_start"));
+	ASSERT_TRUE(names.count("thread_exit"));
+	ASSERT_TRUE(names.count("lock_contended"));
+	ASSERT_TRUE(names.count("lock_acquired"));
+	ASSERT_TRUE(names.count("log_flush"));
+
+	for (auto & p : probes) {
+		if (p.provider_ != "iocore") continue;
+
+		ASSERT_TRUE(p.location_);
+
+		/*
+		 * Every argument is 8 bytes
+		 */
+		size_t nargs = 0;
+		for (size_t pos = p.args_.find("8@"); pos != string::npos;
+		     pos = p.args_.find("8@", pos + 2)) {
+			++nargs;
+		}
+
+		if (p.name_ == "thread_start") {
+			ASSERT_EQ(nargs, 1u);
+		} else if (p.name_ == "log_flush") {
+			ASSERT_EQ(nargs, 2u);
+		}
+	}
+}
+
+TEST_F(UsdtTest, testQueueNotes)
+{
+	UseQueues();
+
+	if (!HasReadelf()) return;
+
+	const auto names = Names(ReadProbes(SelfExe()));
+
+	ASSERT_TRUE(names.count("queue_push"));
+	ASSERT_TRUE(names.count("queue_pop"));
+	ASSERT_TRUE(names.count("queue_wait_start"));
+	ASSERT_TRUE(names.count("queue_wait_end"));
+}
+
+TEST_F(UsdtTest, testProbeIsNop)
+{
+	if (!HasReadelf()) return;
+
+	uint64_t bias = 0;
+	dl_iterate_phdr(LoadBias, &bias);
+
+	size_t n = 0;
+	for (auto & p : ReadProbes(SelfExe())) {
+		if (p.provider_ != "iocore") continue;
+
+		/*
+		 * Unattached, the probe is the nop we put there
+		 */
+		ASSERT_EQ(*(const uint8_t *) (bias + p.location_), 0x90);
+		++n;
+	}
+
+	ASSERT_GT(n, 0u);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
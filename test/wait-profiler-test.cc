@@ -0,0 +1,230 @@
+#include <unistd.h>
+#include <list>
+#include <sstream>
+
+#include "unit-test.h"
+#include "thread.h"
+#include "lock.h"
+#include "inlist.hpp"
+
+using namespace std;
+using namespace bblocks;
+
+class WaitProfilerTest : public UnitTest
+{
+public:
+
+	WaitProfilerTest() : UnitTest("/waitprofilertest") {}
+
+protected:
+
+	/*
+	 * Threads block for this long, the profiler must see at least most of it
+	 */
+	static const uint32_t WAIT_MS = 50;
+	static const uint64_t MIN_WAIT_US = 40 * 1000;
+
+	struct Msg : InListElement<Msg>
+	{
+	};
+
+	void SetUp() override
+	{
+		UnitTest::SetUp();
+
+		WaitProfiler::SetThreadName("/waitprofilertest/main");
+		WaitProfiler::Enable();
+	}
+
+	void TearDown() override
+	{
+		WaitProfiler::Disable();
+		WaitProfiler::Reset();
+
+		UnitTest::TearDown();
+	}
+
+	/*
+	 * Run fn on a thread while the caller runs wait, then join
+	 */
+	template<class Fn, class Wait>
+	void Run(const Fn & fn, const Wait & wait)
+	{
+		list<Thread *> threads;
+		StartThreads(threads, fn);
+		wait();
+		JoinThreads(threads);
+	}
+
+	static void Sleep()
+	{
+		usleep(WAIT_MS * 1000);
+	}
+};
+
+TEST_F(WaitProfilerTest, testDisabled)
+{
+	WaitProfiler::Disable();
+
+	InQueue<Msg> q("waitprofilertest/disabled");
+	Msg msg;
+
+	Run([&q, &msg]() { Sleep(); q.Push(&msg); }, [&q]() { q.Pop(); });
+
+	ASSERT_EQ(WaitProfiler::GetHistogram(WAIT_QUEUE).Count(), 0u);
+}
+
+TEST_F(WaitProfilerTest, testQueueWait)
+{
+	InQueue<Msg> inq("waitprofilertest/inqueue");
+	Queue<int> q("waitprofilertest/queue");
+	Msg msg;
+
+	Run([&inq, &msg]() { Sleep(); inq.Push(&msg); }, [&inq]() { inq.Pop(); });
+	Run([&q]() { Sleep(); q.Push(/*t=*/ 1); }, [&q]() { q.Pop(); });
+
+	const Histogram inqh = WaitProfiler::GetHistogram(WAIT_QUEUE, "/q/waitprofilertest/inqueue");
+	ASSERT_GE(inqh.Count(), 1u);
+	ASSERT_GE(inqh.Sum(), uint64_t(MIN_WAIT_US));
+
+	const Histogram qh = WaitProfiler::GetHistogram(WAIT_QUEUE, "/q/waitprofilertest/queue");
+	ASSERT_GE(qh.Count(), 1u);
+	ASSERT_GE(qh.Sum(), uint64_t(MIN_WAIT_US));
+
+	/*
+	 * Nothing else was blocked on
+	 */
+	ASSERT_EQ(WaitProfiler::GetHistogram(WAIT_COND).Count(), 0u);
+	ASSERT_EQ(WaitProfiler::GetHistogram(WAIT_IO).Count(), 0u);
+}
+
+TEST_F(WaitProfilerTest, testLockWait)
+{
+	FutexMutex futex("/waitprofilertest");
+	PThreadMutex mutex;
+	mutex.SetName("/waitprofilertest/pthread");
+
+	for (Mutex * m : { (Mutex *) &futex, (Mutex *) &mutex }) {
+		atomic<bool> locked(false);
+
+		Run([m, &locked]() {
+			m->Lock();
+			locked = true;
+			Sleep();
+			m->Unlock();
+		}, [m, &locked]() {
+			while (!locked) usleep(1000);
+			m->Lock();
+			m->Unlock();
+		});
+	}
+
+	const Histogram fh = WaitProfiler::GetHistogram(WAIT_LOCK, "/futexmutex/waitprofilertest",
+							"/waitprofilertest/main");
+	ASSERT_EQ(fh.Count(), 1u);
+	ASSERT_GE(fh.Sum(), uint64_t(MIN_WAIT_US));
+
+	const Histogram ph = WaitProfiler::GetHistogram(WAIT_LOCK, "/waitprofilertest/pthread");
+	ASSERT_EQ(ph.Count(), 1u);
+	ASSERT_GE(ph.Sum(), uint64_t(MIN_WAIT_US));
+
+	/*
+	 * The lock holders never waited
+	 */
+	ASSERT_EQ(WaitProfiler::GetHistogram(WAIT_LOCK, "", "/waitprofilertest").Count(), 0u);
+}
+
+TEST_F(WaitProfilerTest, testCondWait)
+{
+	PThreadMutex mutex(/*isRecursive=*/ false);
+	mutex.SetName("/waitprofilertest/cond");
+	WaitCondition cond;
+	bool done = false;
+
+	Run([&]() {
+		Sleep();
+		mutex.Lock();
+		done = true;
+		cond.Signal();
+		mutex.Unlock();
+	}, [&]() {
+		mutex.Lock();
+		while (!done) cond.Wait(&mutex);
+		mutex.Unlock();
+	});
+
+	const Histogram h = WaitProfiler::GetHistogram(WAIT_COND, "/waitprofilertest/cond");
+	ASSERT_GE(h.Count(), 1u);
+	ASSERT_GE(h.Sum(), uint64_t(MIN_WAIT_US));
+}
+
+TEST_F(WaitProfilerTest, testIoWait)
+{
+	const string name("/waitprofilertest/pipe");
+
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+
+	Run([&fds]() {
+		Sleep();
+		ASSERT_EQ(write(fds[1], "x", 1), 1);
+	}, [&fds, &name]() {
+		char c;
+		WaitScope _(WAIT_IO, name);
+		ASSERT_EQ(read(fds[0], &c, 1), 1);
+	});
+
+	close(fds[0]);
+	close(fds[1]);
+
+	const Histogram h = WaitProfiler::GetHistogram(WAIT_IO, name);
+	ASSERT_EQ(h.Count(), 1u);
+	ASSERT_GE(h.Sum(), uint64_t(MIN_WAIT_US));
+}
+
+TEST_F(WaitProfilerTest, testReport)
+{
+	InQueue<Msg> q("waitprofilertest/report");
+	FutexMutex mutex("/waitprofilertest/report");
+	Msg msg;
+	atomic<bool> locked(false);
+
+	/*
+	 * The thread waits on the queue, main waits on the lock the thread holds
+	 */
+	Run([&]() {
+		q.Pop();
+		mutex.Lock();
+		locked = true;
+		Sleep();
+		mutex.Unlock();
+	}, [&]() {
+		Sleep();
+		q.Push(&msg);
+		while (!locked) usleep(1000);
+		mutex.Lock();
+		mutex.Unlock();
+	});
+
+	ASSERT_GE(WaitProfiler::GetHistogram(WAIT_QUEUE, "", "/waitprofilertest").Sum(),
+		  uint64_t(MIN_WAIT_US));
+	ASSERT_GE(WaitProfiler::GetHistogram(WAIT_LOCK, "", "/waitprofilertest/main").Sum(),
+		  uint64_t(MIN_WAIT_US));
+
+	ostringstream os;
+	WaitProfiler::Dump(os);
+	INFO("/waitprofilertest") << os.str();
+
+	ASSERT_NE(os.str().find("Blocked time by kind"), string::npos);
+	ASSERT_NE(os.str().find("queue /q/waitprofilertest/report"), string::npos);
+	ASSERT_NE(os.str().find("lock /futexmutex/waitprofilertest/report"), string::npos);
+	ASSERT_NE(os.str().find("/waitprofilertest["), string::npos);
+	ASSERT_NE(os.str().find("/waitprofilertest/main["), string::npos);
+}
+
+int
+main(int argc, char ** argv)
+{
+	::testing::InitGoogleTest(&argc, argv);
+	return RUN_ALL_TESTS();
+}
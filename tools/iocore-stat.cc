@@ -0,0 +1,211 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "stats-segment.h"
+
+/*
+ * iocore-stat reads the PerfCounters of a running process from its shared memory stats segment
+ * (IOCORE_STATS_SHM=<name>, or StatsSegment::Open) and prints them in the manner of vmstat. The
+ * first report is since the process started, the following ones are for the last interval.
+ */
+
+using namespace std;
+using namespace bblocks;
+
+namespace {
+
+struct Options
+{
+	Options() : intervalms_(1000), count_(0), all_(false) {}
+
+	string name_;
+	string filter_;
+	uint64_t intervalms_;
+	uint64_t count_;
+	bool all_;
+};
+
+typedef StatsSegmentReader::Counter counter_t;
+
+void
+Usage(const char * prog)
+{
+	fprintf(stderr,
+		"usage: %s [-i interval-ms] [-n count] [-f filter] [-a] <segment>\n"
+		"  -i  report interval in milliseconds (default 1000)\n"
+		"  -n  number of reports, 0 for ever (default 0)\n"
+		"  -f  only counters whose name contains the filter\n"
+		"  -a  also report counters with no updates in the interval\n",
+		prog);
+}
+
+uint64_t
+NowMs()
+{
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+}
+
+/*
+ * Upper bound of the bucket holding the q-th percentile, from the power of two buckets
+ */
+uint64_t
+Percentile(const uint64_t * bucket, const uint64_t count, const double q)
+{
+	if (!count) return 0;
+
+	const uint64_t target = (uint64_t) (count * q / 100.0 + 0.5) ?: 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < StatCell::NBUCKETS; ++i) {
+		seen += bucket[i];
+		if (seen >= target) return 1ULL << (i + 1);
+	}
+
+	return 1ULL << StatCell::NBUCKETS;
+}
+
+string
+Human(const double val)
+{
+	char buf[32];
+
+	if (val >= 1e9) {
+		snprintf(buf, sizeof(buf), "%.1fG", val / 1e9);
+	} else if (val >= 1e6) {
+		snprintf(buf, sizeof(buf), "%.1fM", val / 1e6);
+	} else if (val >= 1e4) {
+		snprintf(buf, sizeof(buf), "%.1fK", val / 1e3);
+	} else if (val == (uint64_t) val) {
+		snprintf(buf, sizeof(buf), "%" PRIu64, (uint64_t) val);
+	} else {
+		snprintf(buf, sizeof(buf), "%.1f", val);
+	}
+
+	return buf;
+}
+
+void
+PrintHeader()
+{
+	printf("%-40s %10s %10s %-10s %10s %10s %10s\n",
+	       "counter", "ops/s", "value/s", "units", "avg", "p99<", "max");
+}
+
+/*
+ * Print the difference between the two reads of a counter over sec seconds. prev is NULL for
+ * the first report, or if the slot was reused by another counter since
+ */
+void
+PrintDelta(const counter_t & cur, const counter_t * prev, const double sec, const bool all)
+{
+	const uint64_t count = cur.count_ - (prev ? prev->count_ : 0);
+	const uint64_t val = cur.val_ - (prev ? prev->val_ : 0);
+
+	if (!count && !all) return;
+
+	uint64_t bucket[StatCell::NBUCKETS];
+	for (int i = 0; i < StatCell::NBUCKETS; ++i) {
+		bucket[i] = cur.bucket_[i] - (prev ? prev->bucket_[i] : 0);
+	}
+
+	string name = cur.name_;
+	if (name.size() > 40) name = "..." + name.substr(name.size() - 37);
+
+	printf("%-40s %10s %10s %-10s %10s %10s %10s\n",
+	       name.c_str(), Human(count / sec).c_str(), Human(val / sec).c_str(),
+	       cur.units_.c_str(), Human(count ? val / (double) count : 0).c_str(),
+	       Human(Percentile(bucket, count, 99)).c_str(),
+	       Human(count ? cur.max_ : 0).c_str());
+}
+
+}
+
+int
+main(int argc, char ** argv)
+{
+	Options opts;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:n:f:ah")) != -1) {
+		switch (opt) {
+		case 'i':
+			opts.intervalms_ = strtoull(optarg, NULL, 10);
+			break;
+		case 'n':
+			opts.count_ = strtoull(optarg, NULL, 10);
+			break;
+		case 'f':
+			opts.filter_ = optarg;
+			break;
+		case 'a':
+			opts.all_ = true;
+			break;
+		default:
+			Usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (optind != argc - 1 || !opts.intervalms_) {
+		Usage(argv[0]);
+		return 1;
+	}
+
+	opts.name_ = argv[optind];
+	if (opts.name_[0] != '/') opts.name_ = "/" + opts.name_;
+
+	StatsSegmentReader reader;
+	const string err = reader.Open(opts.name_);
+	if (!err.empty()) {
+		fprintf(stderr, "%s: %s\n", argv[0], err.c_str());
+		return 1;
+	}
+
+	printf("pid %" PRIu64 ", segment %s\n", reader.Header()->pid_, opts.name_.c_str());
+
+	/*
+	 * Previous read by slot, the generation tells whether the slot still holds the same counter
+	 */
+	map<uint32_t, counter_t> prev;
+	uint64_t lastms = reader.Header()->startms_;
+
+	for (uint64_t n = 0; !opts.count_ || n < opts.count_; ++n) {
+		if (n) usleep(opts.intervalms_ * 1000);
+
+		const uint64_t nowms = NowMs();
+		const double sec = (nowms > lastms ? nowms - lastms : 1) / 1000.0;
+		lastms = nowms;
+
+		const vector<counter_t> counters = reader.Read();
+
+		PrintHeader();
+
+		map<uint32_t, counter_t> cur;
+		for (auto & c : counters) {
+			if (!opts.filter_.empty() && c.name_.find(opts.filter_) == string::npos) {
+				continue;
+			}
+
+			auto it = prev.find(c.slot_);
+			const bool same = it != prev.end() && it->second.gen_ == c.gen_;
+			PrintDelta(c, same ? &it->second : NULL, sec, opts.all_);
+
+			cur[c.slot_] = c;
+		}
+
+		prev.swap(cur);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	return 0;
+}
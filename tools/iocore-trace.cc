@@ -0,0 +1,46 @@
+#include <stdio.h>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "trace.h"
+
+/*
+ * iocore-trace converts a binary trace file written by Trace::Dump to Chrome trace_event JSON,
+ * for chrome://tracing or ui.perfetto.dev.
+ */
+
+using namespace std;
+using namespace bblocks;
+
+int
+main(int argc, char ** argv)
+{
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "usage: %s <trace-file> [json-file]\n", argv[0]);
+		return 1;
+	}
+
+	ifstream in(argv[1], ios::binary);
+	if (!in) {
+		fprintf(stderr, "%s: unable to open %s\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	ofstream file;
+	if (argc == 3) {
+		file.open(argv[2], ios::trunc);
+		if (!file) {
+			fprintf(stderr, "%s: unable to open %s\n", argv[0], argv[2]);
+			return 1;
+		}
+	}
+
+	const string err = TraceFile::ToChromeJson(in, argc == 3 ? file : cout);
+	if (!err.empty()) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], argv[1], err.c_str());
+		return 1;
+	}
+
+	return 0;
+}
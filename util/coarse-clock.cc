@@ -0,0 +1,184 @@
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include "coarse-clock.h"
+
+using namespace bblocks;
+
+namespace {
+
+/*
+ * Ticker state, under the lock
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t ticker;
+static bool running = false;
+
+static uint32_t resolutionms = CoarseClock::DEFAULT_RESOLUTION_MS;
+static atomic<bool> stop(false);
+
+}
+
+//
+// CoarseClock
+//
+
+CoarseClock::Slot CoarseClock::slot_;
+
+bool
+CoarseClock::Start(const uint32_t ms)
+{
+	INVARIANT(ms);
+
+	pthread_mutex_lock(&lock);
+
+	if (running) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+
+	resolutionms = ms;
+	stop.store(false);
+
+	/*
+	 * Readers get the ticker's values from here on
+	 */
+	time_t lastsec = 0;
+	Publish(lastsec);
+
+	const int status = pthread_create(&ticker, /*attr=*/ NULL, Tick, (void *) lastsec);
+	INVARIANT(!status);
+
+	running = true;
+	pthread_mutex_unlock(&lock);
+
+	return true;
+}
+
+void
+CoarseClock::Stop()
+{
+	pthread_mutex_lock(&lock);
+
+	if (!running) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	stop.store(true);
+	pthread_join(ticker, /*ret=*/ NULL);
+
+	/*
+	 * Back to reading the clocks
+	 */
+	slot_.ms_.store(0);
+	slot_.wallms_.store(0);
+
+	running = false;
+	pthread_mutex_unlock(&lock);
+}
+
+void *
+CoarseClock::Tick(void * arg)
+{
+	time_t lastsec = (time_t) arg;
+
+	timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!stop.load(memory_order_relaxed)) {
+		next.tv_nsec += resolutionms * 1000 * 1000;
+		next.tv_sec += next.tv_nsec / (1000 * 1000 * 1000);
+		next.tv_nsec %= 1000 * 1000 * 1000;
+
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR) {}
+
+		Publish(lastsec);
+	}
+
+	return NULL;
+}
+
+void
+CoarseClock::Publish(time_t & lastsec)
+{
+	const uint64_t wallms = ReadWallInMilliSec();
+	const time_t sec = wallms / 1000;
+
+	if (sec != lastsec) {
+		/*
+		 * The string only changes with the second
+		 */
+		char buf[STAMP_WORDS * sizeof(uint64_t)];
+		memset(buf, 0, sizeof(buf));
+
+		const string stamp = FormatTimestamp(sec);
+		strncpy(buf, stamp.c_str(), sizeof(buf) - 1);
+
+		uint64_t words[STAMP_WORDS];
+		memcpy(words, buf, sizeof(words));
+
+		slot_.seq_.store(slot_.seq_.load(memory_order_relaxed) + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+
+		for (size_t i = 0; i < STAMP_WORDS; ++i) {
+			slot_.stamp_[i].store(words[i], memory_order_relaxed);
+		}
+
+		slot_.seq_.store(slot_.seq_.load(memory_order_relaxed) + 1, memory_order_release);
+
+		lastsec = sec;
+	}
+
+	slot_.wallms_.store(wallms, memory_order_relaxed);
+
+	/*
+	 * Released after the first stamp, readers that see a time see a stamp
+	 */
+	slot_.ms_.store(Time::NowInMilliSec(), memory_order_release);
+}
+
+uint64_t
+CoarseClock::ReadWallInMilliSec()
+{
+	timespec t;
+	int status = clock_gettime(CLOCK_REALTIME, &t);
+	INVARIANT(status == 0);
+
+	return SEC_TO_MSEC((uint64_t) t.tv_sec) + t.tv_nsec / (1000 * 1000);
+}
+
+string
+CoarseClock::Timestamp()
+{
+	if (!slot_.ms_.load(memory_order_acquire)) return FormatTimestamp(time(NULL));
+
+	uint64_t words[STAMP_WORDS + 1];
+
+	for (;;) {
+		const uint64_t seq = slot_.seq_.load(memory_order_acquire);
+		if (seq & 1) continue;
+
+		for (size_t i = 0; i < STAMP_WORDS; ++i) {
+			words[i] = slot_.stamp_[i].load(memory_order_relaxed);
+		}
+
+		atomic_thread_fence(memory_order_acquire);
+		if (slot_.seq_.load(memory_order_relaxed) == seq) break;
+	}
+
+	words[STAMP_WORDS] = 0;
+	return string((const char *) words);
+}
+
+string
+CoarseClock::FormatTimestamp(const time_t t)
+{
+	tm brokenTime;
+	localtime_r(&t, &brokenTime);
+
+	char buf[80];
+	strftime(buf, sizeof(buf), " %d/%m/%y %T ", &brokenTime);
+	return string(buf);
+}
@@ -0,0 +1,142 @@
+#include "epoch.h"
+
+using namespace bblocks;
+
+//
+// Epoch
+//
+
+__thread EpochRecord * Epoch::rec_;
+atomic<uint64_t> Epoch::epoch_(/*epoch=*/ 1);
+
+string Epoch::log_("/epoch");
+PerfCounter Epoch::statAdvance_("/epoch/advance", "advances", PerfCounter::COUNTER);
+PerfCounter Epoch::statLimbo_("/epoch/limbo", "objects", PerfCounter::COUNTER,
+			      PerfCounter::SHARDED);
+
+void
+Epoch::Register()
+{
+	INVARIANT(!rec_);
+
+	rec_ = records_t::Acquire();
+
+	DEBUG(log_) << "Acquired epoch record " << rec_;
+}
+
+void
+Epoch::Unregister()
+{
+	EpochRecord * rec = rec_;
+
+	INVARIANT(rec);
+
+	/*
+	 * A thread cancelled inside a critical region never gets to Exit, leave it here or the
+	 * epoch cannot advance past it
+	 */
+	if (rec->depth_) {
+		rec->depth_ = 0;
+		rec->state_.store(rec->state_.load(memory_order_relaxed) & ~ACTIVE,
+				  memory_order_release);
+	}
+
+	Reclaim(rec, epoch_.load());
+
+	records_t::Release(rec);
+	rec_ = NULL;
+}
+
+void
+Epoch::Retire(void * ptr, EpochRecord::deleter_t deleter)
+{
+	EpochRecord * rec = rec_;
+	INVARIANT(rec);
+
+	/*
+	 * The caller has already unlinked ptr. Readers can only have found it if they entered at
+	 * or before the current epoch.
+	 */
+	const uint64_t epoch = epoch_.load();
+	const int idx = epoch % EpochRecord::NLIMBO;
+
+	if (rec->limboEpoch_[idx] != epoch) {
+		/*
+		 * The slot holds garbage from epoch - 3 or older, which is safe to free
+		 */
+		Free(rec, idx);
+		rec->limboEpoch_[idx] = epoch;
+	}
+
+	rec->limbo_[idx].push_back(EpochRecord::Garbage{ptr, deleter});
+	++rec->size_;
+
+	if (++rec->nretired_ % RECLAIM_INTERVAL == 0) {
+		TryAdvance();
+		Reclaim(rec, epoch_.load());
+		statLimbo_.Update(rec->size_);
+	}
+}
+
+bool
+Epoch::TryAdvance()
+{
+	uint64_t epoch = epoch_.load();
+
+	for (EpochRecord * rec = records_t::Head(); rec; rec = rec->next_) {
+		if (!rec->inuse_.load(memory_order_acquire)) continue;
+
+		const uint64_t state = rec->state_.load(memory_order_acquire);
+		if ((state & ACTIVE) && (state >> 1) != epoch) {
+			/*
+			 * Straggler in an older epoch
+			 */
+			return false;
+		}
+	}
+
+	if (epoch_.compare_exchange_strong(epoch, epoch + 1)) {
+		statAdvance_.Update(/*val=*/ 1);
+	}
+
+	return true;
+}
+
+size_t
+Epoch::Reclaim()
+{
+	INVARIANT(rec_);
+	return Reclaim(rec_, epoch_.load());
+}
+
+size_t
+Epoch::Reclaim(EpochRecord * rec, const uint64_t epoch)
+{
+	size_t count = 0;
+
+	for (int i = 0; i < EpochRecord::NLIMBO; ++i) {
+		if (rec->limboEpoch_[i] + 2 <= epoch) {
+			count += Free(rec, i);
+		}
+	}
+
+	return count;
+}
+
+size_t
+Epoch::Free(EpochRecord * rec, const int idx)
+{
+	vector<EpochRecord::Garbage> & limbo = rec->limbo_[idx];
+	const size_t count = limbo.size();
+
+	for (auto & g : limbo) {
+		g.deleter_(g.ptr_);
+	}
+
+	limbo.clear();
+
+	ASSERT(rec->size_ >= count);
+	rec->size_ -= count;
+
+	return count;
+}
@@ -0,0 +1,100 @@
+#include <algorithm>
+
+#include "hazard.h"
+
+using namespace bblocks;
+
+//
+// Hazard
+//
+
+__thread HazardRecord * Hazard::rec_;
+
+string Hazard::log_("/hazard");
+PerfCounter Hazard::statScan_("/hazard/scan", "objects", PerfCounter::COUNTER,
+			      PerfCounter::SHARDED);
+PerfCounter Hazard::statRetired_("/hazard/retired", "objects", PerfCounter::COUNTER,
+				 PerfCounter::SHARDED);
+
+void
+Hazard::Register()
+{
+	INVARIANT(!rec_);
+
+	rec_ = records_t::Acquire();
+
+	DEBUG(log_) << "Acquired hazard record " << rec_;
+}
+
+void
+Hazard::Unregister()
+{
+	HazardRecord * rec = rec_;
+	INVARIANT(rec);
+
+	for (int i = 0; i < NSLOTS; ++i) {
+		rec->slots_[i].store(NULL, memory_order_relaxed);
+	}
+
+	Scan();
+
+	records_t::Release(rec);
+	rec_ = NULL;
+}
+
+void
+Hazard::Retire(void * ptr, HazardRecord::deleter_t deleter)
+{
+	HazardRecord * rec = rec_;
+	INVARIANT(rec);
+
+	rec->retired_.push_back(HazardRecord::Garbage{ptr, deleter});
+
+	if (rec->retired_.size() >= ScanThreshold()) {
+		Scan();
+	}
+}
+
+size_t
+Hazard::Scan()
+{
+	HazardRecord * rec = rec_;
+	INVARIANT(rec);
+
+	atomic_thread_fence(memory_order_seq_cst);
+
+	/*
+	 * Snapshot every published hazard. Released records have their slots cleared, so there
+	 * is no need to filter on inuse_
+	 */
+	vector<void *> hazards;
+	hazards.reserve(NSLOTS * records_t::Size());
+
+	for (HazardRecord * r = records_t::Head(); r; r = r->next_) {
+		for (int i = 0; i < NSLOTS; ++i) {
+			void * ptr = r->slots_[i].load(memory_order_acquire);
+			if (ptr) hazards.push_back(ptr);
+		}
+	}
+
+	sort(hazards.begin(), hazards.end());
+
+	vector<HazardRecord::Garbage> retired;
+	retired.swap(rec->retired_);
+
+	size_t count = 0;
+	for (auto & g : retired) {
+		if (binary_search(hazards.begin(), hazards.end(), g.ptr_)) {
+			rec->retired_.push_back(g);
+			continue;
+		}
+
+		g.deleter_(g.ptr_);
+		++count;
+	}
+
+	statScan_.Update(count);
+	statRetired_.Update(rec->retired_.size());
+
+	return count;
+}
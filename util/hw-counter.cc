@@ -0,0 +1,336 @@
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "hw-counter.h"
+
+using namespace bblocks;
+
+namespace {
+
+struct Event
+{
+	uint32_t type_;
+	uint64_t config_;
+	const char * name_;
+	const char * units_;
+};
+
+static const Event events[][HwCounters::NEVENTS] = {
+	/* HARDWARE */ {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles", "cycles" },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions", "instructions" },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses", "misses" },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses", "misses" },
+	},
+	/* SOFTWARE */ {
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock", "ns" },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults", "faults" },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches", "switches" },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "cpu-migrations", "migrations" },
+	},
+};
+
+static const Event &
+GetEvent(const HwCounters::Mode mode, const int event)
+{
+	return events[mode == HwCounters::HARDWARE ? 0 : 1][event];
+}
+
+static inline uint64_t
+rdpmc(const uint32_t counter)
+{
+	uint32_t lo, hi;
+	__asm__ __volatile__ ("rdpmc" : "=a"(lo), "=d"(hi) : "c"(counter));
+	return lo | ((uint64_t) hi << 32);
+}
+
+}
+
+//
+// HwCounters
+//
+
+HwCounters::HwCounters(const Mode mode)
+	: mode_(NONE)
+	, rdpmc_(false)
+{
+	for (int i = 0; i < NEVENTS; ++i) {
+		fd_[i] = -1;
+		page_[i] = NULL;
+	}
+
+	if (mode != NONE) Open(mode);
+}
+
+HwCounters::~HwCounters()
+{
+	Close();
+}
+
+HwCounters &
+HwCounters::Get()
+{
+	static thread_local HwCounters counters(GetMode());
+	return counters;
+}
+
+HwCounters::Mode
+HwCounters::GetMode()
+{
+	static const Mode mode = []() {
+		if (HwCounters(HARDWARE).mode_ == HARDWARE) return HARDWARE;
+		if (HwCounters(SOFTWARE).mode_ == SOFTWARE) return SOFTWARE;
+		return NONE;
+	}();
+
+	return mode;
+}
+
+const char *
+HwCounters::EventName(const Mode mode, const int event)
+{
+	return GetEvent(mode, event).name_;
+}
+
+const char *
+HwCounters::EventUnits(const Mode mode, const int event)
+{
+	return GetEvent(mode, event).units_;
+}
+
+bool
+HwCounters::Open(const Mode mode)
+{
+	/*
+	 * Software events are recorded with the kernel's registers, excluding the kernel would
+	 * leave the context switches and migrations at zero. User only if that is all we get.
+	 */
+	if (!OpenGroup(mode, /*excludeKernel=*/ mode == HARDWARE)
+	    && (mode == HARDWARE || !OpenGroup(mode, /*excludeKernel=*/ true))) {
+		return false;
+	}
+
+	mode_ = mode;
+
+	if (mode != HARDWARE) return true;
+
+	/*
+	 * The first page of the mapping tells whether and how the counter can be read from user
+	 * space
+	 */
+	rdpmc_ = true;
+	for (int i = 0; i < NEVENTS; ++i) {
+		void * page = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd_[i],
+				   /*offset=*/ 0);
+		if (page == MAP_FAILED) {
+			rdpmc_ = false;
+			break;
+		}
+
+		page_[i] = (perf_event_mmap_page *) page;
+		rdpmc_ = rdpmc_ && page_[i]->cap_user_rdpmc;
+	}
+
+	return true;
+}
+
+bool
+HwCounters::OpenGroup(const Mode mode, const bool excludeKernel)
+{
+	for (int i = 0; i < NEVENTS; ++i) {
+		const Event & event = GetEvent(mode, i);
+
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = event.type_;
+		attr.config = event.config_;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.disabled = i == 0;
+		attr.exclude_kernel = excludeKernel;
+		attr.exclude_hv = 1;
+
+		/*
+		 * Calling thread, any cpu, the first event leads the group
+		 */
+		fd_[i] = syscall(__NR_perf_event_open, &attr, /*pid=*/ 0, /*cpu=*/ -1,
+				 /*group_fd=*/ i ? fd_[0] : -1, /*flags=*/ 0);
+		if (fd_[i] < 0) {
+			Close();
+			return false;
+		}
+	}
+
+	if (ioctl(fd_[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP)) {
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void
+HwCounters::Close()
+{
+	for (int i = 0; i < NEVENTS; ++i) {
+		if (page_[i]) munmap(page_[i], sysconf(_SC_PAGESIZE));
+		page_[i] = NULL;
+	}
+
+	/*
+	 * Members before the leader
+	 */
+	for (int i = NEVENTS - 1; i >= 0; --i) {
+		if (fd_[i] >= 0) close(fd_[i]);
+		fd_[i] = -1;
+	}
+
+	mode_ = NONE;
+	rdpmc_ = false;
+}
+
+bool
+HwCounters::Read(Values & values)
+{
+	values = Values();
+
+	/*
+	 * Nothing to count, zero is the right value
+	 */
+	if (mode_ == NONE) return true;
+
+	if (rdpmc_ && ReadRdpmc(values)) return true;
+
+	if (ReadGroup(values)) return true;
+
+	values = Values();
+	return false;
+}
+
+bool
+HwCounters::ReadRdpmc(Values & values)
+{
+	for (int i = 0; i < NEVENTS; ++i) {
+		volatile perf_event_mmap_page * page = page_[i];
+
+		/*
+		 * The kernel updates the page under a sequence count, as described in
+		 * linux/perf_event.h
+		 */
+		uint32_t seq;
+		uint64_t count;
+
+		do {
+			seq = page->lock;
+			__asm__ __volatile__ ("" ::: "memory");
+
+			const uint32_t idx = page->index;
+			if (!page->cap_user_rdpmc || !idx) {
+				/*
+				 * Not scheduled on the PMU right now
+				 */
+				return false;
+			}
+
+			const int shift = 64 - page->pmc_width;
+			int64_t pmc = rdpmc(idx - 1);
+			pmc <<= shift;
+			pmc >>= shift;
+
+			count = page->offset + pmc;
+
+			__asm__ __volatile__ ("" ::: "memory");
+		} while (page->lock != seq);
+
+		values.v_[i] = count;
+	}
+
+	return true;
+}
+
+bool
+HwCounters::ReadGroup(Values & values)
+{
+	struct
+	{
+		uint64_t nr_;
+		uint64_t values_[NEVENTS];
+	} buf;
+
+	const ssize_t size = read(fd_[0], &buf, sizeof(buf));
+	if (size != sizeof(buf) || buf.nr_ != NEVENTS) return false;
+
+	for (int i = 0; i < NEVENTS; ++i) {
+		values.v_[i] = buf.values_[i];
+	}
+
+	return true;
+}
+
+//
+// HwRegion
+//
+
+HwRegion::HwRegion(const string & name, const uint32_t flags)
+	: name_(name)
+	, mode_(HwCounters::GetMode())
+	, nsaturated_(0)
+{
+	for (int i = 0; i < HwCounters::NEVENTS; ++i) {
+		const string units = HwCounters::EventUnits(mode_, i);
+		counters_[i].reset(new PerfCounter(name + "/" + HwCounters::EventName(mode_, i), units,
+						   units == "ns" ? PerfCounter::TIME
+								 : PerfCounter::COUNTER,
+						   flags));
+	}
+}
+
+void
+HwRegion::Update(const HwCounters::Values & delta)
+{
+	for (int i = 0; i < HwCounters::NEVENTS; ++i) {
+		if (delta.v_[i] >= UINT32_MAX) {
+			nsaturated_.fetch_add(/*val=*/ 1, memory_order_relaxed);
+			counters_[i]->Update(UINT32_MAX);
+			continue;
+		}
+
+		counters_[i]->Update(delta.v_[i]);
+	}
+}
+
+namespace bblocks {
+
+ostream &
+operator<<(ostream & os, const HwRegion & region)
+{
+	static const char * modes[] = { "none", "software", "hardware" };
+
+	os << "HwRegion: " << region.name_ << " (" << modes[region.mode_] << " events)" << endl;
+
+	for (int i = 0; i < HwCounters::NEVENTS; ++i) {
+		os << *region.counters_[i];
+	}
+
+	if (region.Saturated()) os << " saturated " << region.Saturated() << endl;
+
+	if (region.mode_ != HwCounters::HARDWARE) return os;
+
+	const double cycles = region.counters_[0]->Value();
+	const double instructions = region.counters_[1]->Value();
+
+	if (!cycles || !instructions) return os;
+
+	os << " instructions-per-cycle " << instructions / cycles << endl
+	   << " cache-misses-per-1k-instructions "
+	   << region.counters_[2]->Value() * 1000 / instructions << endl
+	   << " branch-misses-per-1k-instructions "
+	   << region.counters_[3]->Value() * 1000 / instructions << endl;
+
+	return os;
+}
+
+}
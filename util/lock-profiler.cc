@@ -0,0 +1,236 @@
+#include <execinfo.h>
+#include <cxxabi.h>
+#include <pthread.h>
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <unordered_map>
+
+#include "lock-profiler.h"
+
+using namespace bblocks;
+
+namespace {
+
+struct SiteKey
+{
+	bool operator==(const SiteKey & rhs) const
+	{
+		return id_ == rhs.id_ && site_ == rhs.site_;
+	}
+
+	uint64_t id_;
+	void * site_;
+};
+
+struct SiteKeyHash
+{
+	size_t operator()(const SiteKey & key) const
+	{
+		return hash<uint64_t>()(key.id_ * 31 + (uintptr_t) key.site_);
+	}
+};
+
+struct CacheEntry
+{
+	LockStat * stat_;
+	uint32_t gen_;		// of the lock when cached
+};
+
+typedef unordered_map<SiteKey, CacheEntry, SiteKeyHash> cache_t;
+typedef map<pair<string, void *>, LockStat *> registry_t;
+
+/*
+ * Stale entries of destroyed locks are never hit again, drop them once in a while
+ */
+static const size_t MAX_CACHE_SIZE = 4096;
+
+static thread_local cache_t cache;
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+static registry_t & Registry()
+{
+	/*
+	 * Never destroyed, locks can be used from static destructors
+	 */
+	static registry_t * registry = new registry_t();
+	return *registry;
+}
+
+static double ToMicroSec(const uint64_t cycles)
+{
+	return cycles / (System::GetHz() / double(1000 * 1000));
+}
+
+}
+
+//
+// LockProfile
+//
+
+atomic<uint64_t> LockProfile::nextId_(/*id=*/ 1);
+
+//
+// LockProfiler
+//
+
+atomic<bool> LockProfiler::enabled_(/*enabled=*/ false);
+
+void
+LockProfiler::Summary::Add(const LockStat & stat)
+{
+	nacquired_ += stat.nacquired_.load();
+	ncontended_ += stat.ncontended_.load();
+	waitCycles_ += stat.waitCycles_.load();
+	maxWaitCycles_ = max(maxWaitCycles_, stat.maxWaitCycles_.load());
+	holdCycles_ += stat.holdCycles_.load();
+}
+
+LockStat *
+LockProfiler::Get(const LockProfile & profile, void * site)
+{
+	const SiteKey key{profile.Id(), site};
+	const uint32_t gen = profile.Gen();
+
+	/*
+	 * An entry cached before the lock was renamed points at the statistics of the old name
+	 */
+	auto it = cache.find(key);
+	if (it != cache.end() && it->second.gen_ == gen) return it->second.stat_;
+
+	if (cache.size() >= MAX_CACHE_SIZE) cache.clear();
+
+	pthread_mutex_lock(&registryLock);
+
+	LockStat *& stat = Registry()[make_pair(profile.Name(), site)];
+	if (!stat) stat = new LockStat(profile.Name(), site);
+
+	pthread_mutex_unlock(&registryLock);
+
+	cache[key] = CacheEntry{stat, gen};
+	return stat;
+}
+
+vector<LockStat *>
+LockProfiler::Snapshot()
+{
+	vector<LockStat *> stats;
+
+	pthread_mutex_lock(&registryLock);
+	for (auto & kv : Registry()) {
+		stats.push_back(kv.second);
+	}
+	pthread_mutex_unlock(&registryLock);
+
+	return stats;
+}
+
+LockProfiler::Summary
+LockProfiler::GetSummary(const string & name)
+{
+	Summary summary(name);
+
+	for (auto stat : Snapshot()) {
+		if (stat->name_ == name) summary.Add(*stat);
+	}
+
+	return summary;
+}
+
+void
+LockProfiler::Reset()
+{
+	for (auto stat : Snapshot()) {
+		stat->Reset();
+	}
+}
+
+string
+LockProfiler::SiteName(void * site)
+{
+	char ** symbols = backtrace_symbols(&site, /*size=*/ 1);
+	if (!symbols) return STR(site);
+
+	/*
+	 * Format is binary(mangled+offset) [address]
+	 */
+	string name(symbols[0]);
+	free(symbols);
+
+	const size_t begin = name.find('(');
+	const size_t end = name.find('+', begin);
+	if (begin == string::npos || end == string::npos || end == begin + 1) return name;
+
+	const string mangled = name.substr(begin + 1, end - begin - 1);
+	const size_t close = name.find(')', end);
+	const string offset = name.substr(end, close - end);
+
+	int status;
+	char * demangled = abi::__cxa_demangle(mangled.c_str(), NULL, NULL, &status);
+	if (status || !demangled) return mangled + offset;
+
+	const string ret = string(demangled) + offset;
+	free(demangled);
+
+	return ret;
+}
+
+void
+LockProfiler::Dump(ostream & os, const size_t top)
+{
+	vector<Summary> sites;
+	map<string, Summary> names;
+
+	for (auto stat : Snapshot()) {
+		if (!stat->nacquired_.load()) continue;
+
+		Summary s(stat->name_, stat->site_);
+		s.Add(*stat);
+		sites.push_back(s);
+
+		auto it = names.find(stat->name_);
+		if (it == names.end()) {
+			it = names.insert(make_pair(stat->name_, Summary(stat->name_))).first;
+		}
+
+		it->second.Add(*stat);
+	}
+
+	vector<Summary> locks;
+	for (auto & kv : names) {
+		locks.push_back(kv.second);
+	}
+
+	auto byWait = [](const Summary & lhs, const Summary & rhs) {
+		return lhs.waitCycles_ > rhs.waitCycles_;
+	};
+
+	sort(locks.begin(), locks.end(), byWait);
+	sort(sites.begin(), sites.end(), byWait);
+
+	auto print = [&os](const vector<Summary> & summaries, const size_t top, const bool site) {
+		os << setw(40) << left << (site ? "site" : "lock")
+		   << setw(12) << right << "acquired"
+		   << setw(12) << "contended"
+		   << setw(14) << "wait-us"
+		   << setw(14) << "max-wait-us"
+		   << setw(14) << "hold-us" << endl;
+
+		for (size_t i = 0; i < summaries.size() && i < top; ++i) {
+			const Summary & s = summaries[i];
+			os << setw(40) << left << (site ? s.name_ + " " + SiteName(s.site_) : s.name_)
+			   << setw(12) << right << s.nacquired_
+			   << setw(12) << s.ncontended_
+			   << setw(14) << uint64_t(ToMicroSec(s.waitCycles_))
+			   << setw(14) << uint64_t(ToMicroSec(s.maxWaitCycles_))
+			   << setw(14) << uint64_t(ToMicroSec(s.holdCycles_)) << endl;
+		}
+	};
+
+	os << "Lock contention by name (top " << top << ")" << endl;
+	print(locks, top, /*site=*/ false);
+
+	os << "Lock contention by call site (top " << top << ")" << endl;
+	print(sites, top, /*site=*/ true);
+}
@@ -0,0 +1,101 @@
+#include <pthread.h>
+#include <sched.h>
+#include <map>
+#include <vector>
+
+#include "perfcounter.h"
+
+using namespace bblocks;
+
+namespace {
+
+typedef multimap<string, PerfCounter *> registry_t;
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+static registry_t & Registry()
+{
+	/*
+	 * Never destroyed, static counters unregister from static destructors
+	 */
+	static registry_t * registry = new registry_t();
+	return *registry;
+}
+
+}
+
+//
+// PerfCounterRegistry
+//
+
+void
+PerfCounterRegistry::Register(PerfCounter * pc)
+{
+	pthread_mutex_lock(&registryLock);
+	Registry().insert(make_pair(pc->Name(), pc));
+	pthread_mutex_unlock(&registryLock);
+}
+
+void
+PerfCounterRegistry::Unregister(PerfCounter * pc)
+{
+	pthread_mutex_lock(&registryLock);
+
+	auto range = Registry().equal_range(pc->Name());
+	for (auto it = range.first; it != range.second; ++it) {
+		if (it->second == pc) {
+			Registry().erase(it);
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&registryLock);
+
+	/*
+	 * ForEach may still be reading it outside the lock
+	 */
+	while (pc->readers_.load(memory_order_acquire)) {
+		sched_yield();
+	}
+}
+
+void
+PerfCounterRegistry::ForEach(const function<void (const PerfCounter &)> & fn)
+{
+	vector<PerfCounter *> pcs;
+
+	pthread_mutex_lock(&registryLock);
+
+	pcs.reserve(Registry().size());
+	for (auto & kv : Registry()) {
+		kv.second->readers_.fetch_add(/*val=*/ 1, memory_order_relaxed);
+		pcs.push_back(kv.second);
+	}
+
+	pthread_mutex_unlock(&registryLock);
+
+	/*
+	 * Read outside the lock, counters are created and destroyed meanwhile. The reference keeps
+	 * the ones we hold from being destroyed under us.
+	 */
+	for (auto pc : pcs) {
+		fn(*pc);
+		pc->readers_.fetch_sub(/*val=*/ 1, memory_order_release);
+	}
+}
+
+size_t
+PerfCounterRegistry::Size()
+{
+	pthread_mutex_lock(&registryLock);
+	const size_t size = Registry().size();
+	pthread_mutex_unlock(&registryLock);
+
+	return size;
+}
+
+//
+// ScopedPhaseBase
+//
+
+__thread ScopedPhaseBase * ScopedPhaseBase::current_ = NULL;
@@ -0,0 +1,28 @@
+#include "queue-stats.h"
+
+using namespace bblocks;
+
+//
+// QueueStats
+//
+
+atomic<bool> QueueStats::enabled_(/*enabled=*/ false);
+
+void
+QueueStats::Enable()
+{
+	/*
+	 * Load hz now rather than on the first pop
+	 */
+	System::GetHz();
+	enabled_.store(true);
+}
+
+QueueStats::QueueStats(const string & name)
+	: push_(name + "/push", "ops", PerfCounter::COUNTER, PerfCounter::WINDOWED)
+	, pop_(name + "/pop", "ops", PerfCounter::COUNTER, PerfCounter::WINDOWED)
+	, depth_(name + "/depth", "elements", PerfCounter::COUNTER)
+	, sojourn_(name + "/sojourn", "microsec", PerfCounter::TIME,
+		   PerfCounter::HISTOGRAM | PerfCounter::WINDOWED)
+{
+}
@@ -0,0 +1,201 @@
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+#include "rcu.h"
+
+using namespace bblocks;
+
+//
+// Rcu
+//
+
+__thread RcuRecord * Rcu::rec_;
+atomic<uint64_t> Rcu::gp_(/*gp=*/ 1);
+
+PThreadMutex Rcu::lock_(/*isRecursive=*/ false);
+list<Rcu::Deferred> Rcu::pending_;
+list<Rcu::Deferred> Rcu::deferred_;
+
+string Rcu::log_("/rcu");
+PerfCounter Rcu::statSync_("/rcu/sync", "microsec", PerfCounter::TIME);
+PerfCounter Rcu::statDeferred_("/rcu/deferred", "objects", PerfCounter::COUNTER);
+
+void
+Rcu::Register()
+{
+	INVARIANT(!rec_);
+
+	/*
+	 * Offline until the thread says otherwise, a recycled record may be left online
+	 */
+	rec_ = records_t::Acquire();
+	rec_->ctr_.store(/*ctr=*/ 0, memory_order_release);
+
+	DEBUG(log_) << "Acquired rcu record " << rec_;
+}
+
+void
+Rcu::Unregister()
+{
+	INVARIANT(rec_);
+
+	Offline();
+	records_t::Release(rec_);
+	rec_ = NULL;
+}
+
+bool
+Rcu::InitMembarrier()
+{
+	const long cmds = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, /*flags=*/ 0);
+
+	if (cmds < 0 || !(cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED)) {
+		INFO(log_) << "membarrier not supported, using memory fences";
+		return false;
+	}
+
+	if (syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, /*flags=*/ 0)) {
+		INFO(log_) << "membarrier registration failed, using memory fences";
+		return false;
+	}
+
+	return true;
+}
+
+void
+Rcu::Barrier()
+{
+	if (UseMembarrier()) {
+		/*
+		 * Forces a full memory barrier on every running thread of the process
+		 */
+		long status = syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED,
+				      /*flags=*/ 0);
+		INVARIANT(!status);
+	} else {
+		atomic_thread_fence(memory_order_seq_cst);
+	}
+}
+
+void
+Rcu::Synchronize()
+{
+	const uint64_t startInMicroSec = Rdtsc::NowInMicroSec();
+
+	lock_.Lock();
+	const uint64_t target = StartGracePeriod();
+	lock_.Unlock();
+
+	Barrier();
+
+	for (RcuRecord * rec = records_t::Head(); rec; rec = rec->next_) {
+		if (rec == rec_) {
+			/*
+			 * We are by definition in a quiescent state
+			 */
+			continue;
+		}
+
+		while (rec->inuse_.load(memory_order_acquire)) {
+			const uint64_t ctr = rec->ctr_.load(memory_order_acquire);
+			if (!ctr || ctr >= target) break;
+			sched_yield();
+		}
+	}
+
+	statSync_.Update(Rdtsc::ElapsedInMicroSec(startInMicroSec));
+
+	list<Deferred> done;
+
+	lock_.Lock();
+	Collect(target, done);
+	lock_.Unlock();
+
+	Destroy(done);
+}
+
+void
+Rcu::Defer(void * ptr, deleter_t deleter)
+{
+	lock_.Lock();
+	pending_.push_back(Deferred{/*gp=*/ 0, ptr, deleter});
+	const bool isFull = pending_.size() >= BATCH_SIZE;
+	lock_.Unlock();
+
+	if (isFull) Reclaim();
+}
+
+size_t
+Rcu::Reclaim()
+{
+	list<Deferred> done;
+
+	lock_.Lock();
+
+	if (!pending_.empty()) StartGracePeriod();
+	Collect(MinOnlineCounter(), done);
+
+	lock_.Unlock();
+
+	return Destroy(done);
+}
+
+uint64_t
+Rcu::StartGracePeriod()
+{
+	/*
+	 * The pending objects are unreachable by now, any reader that still holds one has not
+	 * declared the new grace period yet
+	 */
+	const uint64_t gp = gp_.fetch_add(/*val=*/ 1) + 1;
+
+	for (auto & d : pending_) {
+		d.gp_ = gp;
+	}
+
+	deferred_.splice(deferred_.end(), pending_);
+	return gp;
+}
+
+void
+Rcu::Collect(const uint64_t gp, list<Deferred> & done)
+{
+	for (auto it = deferred_.begin(); it != deferred_.end();) {
+		auto tmp = it++;
+		if (tmp->gp_ <= gp) {
+			done.splice(done.end(), deferred_, tmp);
+		}
+	}
+
+	statDeferred_.Update(pending_.size() + deferred_.size());
+}
+
+size_t
+Rcu::Destroy(list<Deferred> & done)
+{
+	/*
+	 * Run the destructors outside the lock, they are free to defer more objects
+	 */
+	for (auto & d : done) {
+		d.deleter_(d.ptr_);
+	}
+
+	return done.size();
+}
+
+uint64_t
+Rcu::MinOnlineCounter()
+{
+	Barrier();
+
+	uint64_t min = UINT64_MAX;
+	for (RcuRecord * rec = records_t::Head(); rec; rec = rec->next_) {
+		if (!rec->inuse_.load(memory_order_acquire)) continue;
+
+		const uint64_t ctr = rec->ctr_.load(memory_order_acquire);
+		if (ctr && ctr < min) min = ctr;
+	}
+
+	return min;
+}
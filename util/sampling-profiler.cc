@@ -0,0 +1,417 @@
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <cxxabi.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "sampling-profiler.h"
+#include "defs.h"
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+using namespace bblocks;
+
+namespace {
+
+struct Sample
+{
+	uint32_t depth_;
+	void * pcs_[SamplingProfiler::MAX_DEPTH];
+};
+
+/*
+ * Written by the signal handler of the owning thread, drained by the collector
+ */
+struct SampleRing
+{
+	SampleRing() : head_(0), tail_(0) {}
+
+	atomic<uint64_t> head_;
+	atomic<uint64_t> tail_;
+	Sample samples_[SamplingProfiler::NSAMPLES];
+};
+
+struct ThreadEntry
+{
+	ThreadEntry()
+		: self_(pthread_self())
+		, tid_(syscall(SYS_gettid))
+		, timer_(NULL)
+		, hasTimer_(false)
+		, ring_(NULL)
+		, busy_(0)
+	{}
+
+	const pthread_t self_;
+	const pid_t tid_;
+	timer_t timer_;
+	bool hasTimer_;
+	atomic<SampleRing *> ring_;
+	atomic<int> busy_;		// the handler is using the ring
+};
+
+typedef map<vector<void *>, uint64_t> stacks_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic<bool> running(false);
+static atomic<uint64_t> dropped(0);
+static uint32_t rate = SamplingProfiler::DEFAULT_HZ;
+static bool installed = false;
+
+static __thread ThreadEntry * self;
+
+/*
+ * Under the lock, never destroyed as threads unregister from thread exit
+ */
+static list<ThreadEntry *> & Threads()
+{
+	static list<ThreadEntry *> * threads = new list<ThreadEntry *>();
+	return *threads;
+}
+
+static stacks_t & Stacks()
+{
+	static stacks_t * stacks = new stacks_t();
+	return *stacks;
+}
+
+/*
+ * Frames of the handler and of the signal trampoline
+ */
+static const int SKIP_FRAMES = 2;
+
+static void Handler(int, siginfo_t *, void *)
+{
+	const int err = errno;
+
+	ThreadEntry * entry = self;
+	if (!entry) return;
+
+	/*
+	 * Announce ourselves before looking at the ring, Stop takes the ring away first and then
+	 * waits for us
+	 */
+	entry->busy_.store(1);
+
+	SampleRing * ring = entry->ring_.load();
+	if (ring) {
+		const uint64_t head = ring->head_.load(memory_order_relaxed);
+		if (head - ring->tail_.load(memory_order_acquire) < SamplingProfiler::NSAMPLES) {
+			Sample & s = ring->samples_[head % SamplingProfiler::NSAMPLES];
+			const int depth = backtrace(s.pcs_, SamplingProfiler::MAX_DEPTH);
+			s.depth_ = depth > 0 ? depth : 0;
+			ring->head_.store(head + 1, memory_order_release);
+		} else {
+			dropped.fetch_add(/*val=*/ 1, memory_order_relaxed);
+		}
+	}
+
+	entry->busy_.store(0, memory_order_release);
+
+	errno = err;
+}
+
+/*
+ * Move the samples of the ring to the aggregate, under the lock
+ */
+static void Drain(SampleRing * ring)
+{
+	const uint64_t head = ring->head_.load(memory_order_acquire);
+	uint64_t tail = ring->tail_.load(memory_order_relaxed);
+
+	for (; tail < head; ++tail) {
+		const Sample & s = ring->samples_[tail % SamplingProfiler::NSAMPLES];
+		if (s.depth_ <= (uint32_t) SKIP_FRAMES) continue;
+
+		/*
+		 * Root first
+		 */
+		vector<void *> stack(s.pcs_ + SKIP_FRAMES, s.pcs_ + s.depth_);
+		reverse(stack.begin(), stack.end());
+		++Stacks()[stack];
+	}
+
+	ring->tail_.store(tail, memory_order_release);
+}
+
+/*
+ * Arm a CPU time timer on the thread, under the lock
+ */
+static bool Arm(ThreadEntry * entry)
+{
+	clockid_t clock;
+	if (pthread_getcpuclockid(entry->self_, &clock)) return false;
+
+	sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_notify = SIGEV_THREAD_ID;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_notify_thread_id = entry->tid_;
+
+	if (timer_create(clock, &sev, &entry->timer_)) return false;
+
+	entry->ring_.store(new SampleRing());
+	entry->hasTimer_ = true;
+
+	const long ns = 1000L * 1000 * 1000 / rate;
+
+	itimerspec its;
+	its.it_interval.tv_sec = ns / (1000L * 1000 * 1000);
+	its.it_interval.tv_nsec = ns % (1000L * 1000 * 1000);
+	its.it_value = its.it_interval;
+
+	return !timer_settime(entry->timer_, /*flags=*/ 0, &its, NULL);
+}
+
+/*
+ * Stop the timer of the thread and collect its ring, under the lock
+ */
+static void Disarm(ThreadEntry * entry)
+{
+	if (entry->hasTimer_) {
+		timer_delete(entry->timer_);
+		entry->hasTimer_ = false;
+	}
+
+	SampleRing * ring = entry->ring_.exchange(NULL);
+	if (!ring) return;
+
+	/*
+	 * A signal delivered before the timer went away may still be in the handler
+	 */
+	while (entry->busy_.load()) {
+		__builtin_ia32_pause();
+	}
+
+	Drain(ring);
+	delete ring;
+}
+
+static string Symbol(void * pc, const bool leaf, map<void *, string> & cache)
+{
+	auto it = cache.find(pc);
+	if (it != cache.end()) return it->second;
+
+	/*
+	 * Return addresses point past the call
+	 */
+	void * addr = leaf ? pc : (void *) ((uintptr_t) pc - 1);
+
+	string name;
+
+	Dl_info info;
+	if (dladdr(addr, &info) && info.dli_sname) {
+		int status;
+		char * demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+		name = status == 0 && demangled ? demangled : info.dli_sname;
+		free(demangled);
+	} else if (info.dli_fname) {
+		const char * base = strrchr(info.dli_fname, '/');
+		ostringstream os;
+		os << (base ? base + 1 : info.dli_fname) << "+0x" << hex
+		   << ((uintptr_t) addr - (uintptr_t) info.dli_fbase);
+		name = os.str();
+	} else {
+		ostringstream os;
+		os << "0x" << hex << (uintptr_t) addr;
+		name = os.str();
+	}
+
+	/*
+	 * ';' separates the frames of a folded stack
+	 */
+	replace(name.begin(), name.end(), ';', ':');
+
+	cache[pc] = name;
+	return name;
+}
+
+}
+
+//
+// SamplingProfiler
+//
+
+bool
+SamplingProfiler::Start(const uint32_t hz)
+{
+	INVARIANT(hz);
+
+	pthread_mutex_lock(&lock);
+
+	if (running.load()) {
+		pthread_mutex_unlock(&lock);
+		return false;
+	}
+
+	if (!installed) {
+		/*
+		 * backtrace loads the unwinder on first use, which is not safe in a signal
+		 * handler
+		 */
+		void * pcs[1];
+		backtrace(pcs, /*size=*/ 1);
+
+		/*
+		 * The handler stays, a SIGPROF still pending after Stop must not kill us
+		 */
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_sigaction = Handler;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		INVARIANT(!sigaction(SIGPROF, &sa, NULL));
+
+		installed = true;
+	}
+
+	rate = hz;
+	running.store(true);
+
+	bool ok = true;
+	for (auto entry : Threads()) {
+		ok = Arm(entry) && ok;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	return ok;
+}
+
+void
+SamplingProfiler::Stop()
+{
+	pthread_mutex_lock(&lock);
+
+	running.store(false);
+
+	for (auto entry : Threads()) {
+		Disarm(entry);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+bool
+SamplingProfiler::IsRunning()
+{
+	return running.load();
+}
+
+void
+SamplingProfiler::RegisterThread()
+{
+	if (self) return;
+
+	ThreadEntry * entry = new ThreadEntry();
+
+	pthread_mutex_lock(&lock);
+
+	Threads().push_back(entry);
+	self = entry;
+
+	if (running.load()) Arm(entry);
+
+	pthread_mutex_unlock(&lock);
+}
+
+void
+SamplingProfiler::UnregisterThread()
+{
+	ThreadEntry * entry = self;
+	if (!entry) return;
+
+	pthread_mutex_lock(&lock);
+
+	Disarm(entry);
+	Threads().remove(entry);
+	self = NULL;
+
+	pthread_mutex_unlock(&lock);
+
+	delete entry;
+}
+
+size_t
+SamplingProfiler::NumThreads()
+{
+	pthread_mutex_lock(&lock);
+	const size_t n = Threads().size();
+	pthread_mutex_unlock(&lock);
+
+	return n;
+}
+
+void
+SamplingProfiler::Collect()
+{
+	pthread_mutex_lock(&lock);
+
+	for (auto entry : Threads()) {
+		/*
+		 * Rings go away in Disarm, under the same lock
+		 */
+		SampleRing * ring = entry->ring_.load();
+		if (ring) Drain(ring);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+uint64_t
+SamplingProfiler::WriteFolded(ostream & os)
+{
+	Collect();
+
+	stacks_t stacks;
+
+	pthread_mutex_lock(&lock);
+	stacks.swap(Stacks());
+	pthread_mutex_unlock(&lock);
+
+	/*
+	 * Stacks differing only in the addresses within the functions fold into one
+	 */
+	map<void *, string> cache;
+	map<string, uint64_t> folded;
+
+	for (auto & kv : stacks) {
+		const vector<void *> & stack = kv.first;
+
+		string line;
+		for (size_t i = 0; i < stack.size(); ++i) {
+			if (i) line += ";";
+			line += Symbol(stack[i], /*leaf=*/ i + 1 == stack.size(), cache);
+		}
+
+		folded[line] += kv.second;
+	}
+
+	uint64_t nsamples = 0;
+	for (auto & kv : folded) {
+		os << kv.first << " " << kv.second << "\n";
+		nsamples += kv.second;
+	}
+
+	return nsamples;
+}
+
+uint64_t
+SamplingProfiler::NumDropped()
+{
+	return dropped.load();
+}
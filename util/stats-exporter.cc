@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <vector>
+
+#include "stats-exporter.h"
+#include "thread-stats.h"
+#include "rcu.h"
+
+using namespace bblocks;
+
+namespace {
+
+/*
+ * Counters of the same name merged together
+ */
+struct Entry
+{
+	Entry() : hasRates_(false) {}
+
+	string units_;
+	PerfCounter::Snapshot snap_;
+	bool hasRates_;
+	RateCounter::Rates rates_;
+};
+
+typedef map<string, Entry> entries_t;
+
+static const char * WINDOWS[RateCounter::NWINDOWS] = { "1m", "5m", "15m" };
+
+static const pair<const char *, double> QUANTILES[] = {
+	{ "0.5", 50 }, { "0.9", 90 }, { "0.99", 99 }, { "0.999", 99.9 },
+};
+
+static entries_t Collect()
+{
+	entries_t entries;
+
+	PerfCounterRegistry::ForEach([&entries](const PerfCounter & pc) {
+		Entry & e = entries[pc.Name()];
+		e.units_ = pc.Units();
+		e.snap_.Merge(pc.Read());
+
+		if (!pc.HasRates()) return;
+
+		e.rates_.Merge(pc.GetRates());
+		e.hasRates_ = true;
+	});
+
+	return entries;
+}
+
+/*
+ * /threadctx/gc is exported as iocore_threadctx_gc
+ */
+static string MetricName(const string & name)
+{
+	string metric("iocore");
+	if (name.empty() || name[0] != '/') metric += "_";
+
+	for (auto c : name) {
+		metric += isalnum(c) ? c : '_';
+	}
+
+	return metric;
+}
+
+/*
+ * Label set of a sample, the name label tells apart the counters sharing a metric
+ */
+static string Labels(const string & name, const bool isShared, const char * key = NULL,
+		     const char * val = NULL)
+{
+	string labels;
+
+	if (isShared) {
+		labels = "name=\"";
+		for (auto c : name) {
+			if (c == '\\' || c == '"') {
+				labels += '\\';
+				labels += c;
+			} else if (c == '\n') {
+				labels += "\\n";
+			} else {
+				labels += c;
+			}
+		}
+		labels += "\"";
+	}
+
+	if (key) {
+		labels += (labels.empty() ? "" : ",") + string(key) + "=\"" + val + "\"";
+	}
+
+	return labels.empty() ? labels : "{" + labels + "}";
+}
+
+static uint64_t Min(const PerfCounter::Snapshot & snap)
+{
+	return snap.count_ ? snap.min_ : 0;
+}
+
+}
+
+//
+// StatsExporter
+//
+
+void
+StatsExporter::WritePrometheus(ostream & os)
+{
+	const entries_t entries = Collect();
+
+	/*
+	 * Names that map to the same metric, like /q/a-b and /q/a_b, are one metric family whose
+	 * samples carry the counter name as a label. A family must not be declared twice.
+	 */
+	map<string, vector<const entries_t::value_type *>> families;
+	for (auto & kv : entries) {
+		families[MetricName(kv.first)].push_back(&kv);
+	}
+
+	for (auto & f : families) {
+		const string & metric = f.first;
+		const bool isShared = f.second.size() > 1;
+
+		os << "# HELP " << metric;
+		for (size_t i = 0; i < f.second.size(); ++i) {
+			os << (i ? ", " : " ") << f.second[i]->first << " ("
+			   << f.second[i]->second.units_ << ")";
+		}
+		os << endl << "# TYPE " << metric << " summary" << endl;
+
+		bool hasRates = false;
+		for (auto kv : f.second) {
+			const string & name = kv->first;
+			const Entry & e = kv->second;
+
+			if (e.snap_.hist_) {
+				for (auto & q : QUANTILES) {
+					os << metric << Labels(name, isShared, "quantile", q.first)
+					   << " " << e.snap_.hist_->Percentile(q.second) << endl;
+				}
+			}
+
+			const string labels = Labels(name, isShared);
+			os << metric << "_sum" << labels << " " << e.snap_.val_ << endl
+			   << metric << "_count" << labels << " " << e.snap_.count_ << endl;
+
+			hasRates |= e.hasRates_;
+		}
+
+		os << "# TYPE " << metric << "_min gauge" << endl;
+		for (auto kv : f.second) {
+			os << metric << "_min" << Labels(kv->first, isShared) << " "
+			   << Min(kv->second.snap_) << endl;
+		}
+
+		os << "# TYPE " << metric << "_max gauge" << endl;
+		for (auto kv : f.second) {
+			os << metric << "_max" << Labels(kv->first, isShared) << " "
+			   << kv->second.snap_.max_ << endl;
+		}
+
+		if (!hasRates) continue;
+
+		os << "# TYPE " << metric << "_ops_rate gauge" << endl;
+		for (auto kv : f.second) {
+			if (!kv->second.hasRates_) continue;
+
+			for (int i = 0; i < RateCounter::NWINDOWS; ++i) {
+				os << metric << "_ops_rate"
+				   << Labels(kv->first, isShared, "window", WINDOWS[i]) << " "
+				   << kv->second.rates_.ops_[i] << endl;
+			}
+		}
+
+		os << "# TYPE " << metric << "_value_rate gauge" << endl;
+		for (auto kv : f.second) {
+			if (!kv->second.hasRates_) continue;
+
+			for (int i = 0; i < RateCounter::NWINDOWS; ++i) {
+				os << metric << "_value_rate"
+				   << Labels(kv->first, isShared, "window", WINDOWS[i]) << " "
+				   << kv->second.rates_.vals_[i] << endl;
+			}
+		}
+	}
+}
+
+void
+StatsExporter::WriteJson(ostream & os)
+{
+	os << "{\"timestamp_ms\":" << Time::NowInMilliSec() << ",\"counters\":[";
+
+	bool first = true;
+	for (auto & kv : Collect()) {
+		const Entry & e = kv.second;
+
+		os << (first ? "" : ",")
+		   << "{\"name\":" << Json::Quote(kv.first)
+		   << ",\"units\":" << Json::Quote(e.units_)
+		   << ",\"count\":" << e.snap_.count_
+		   << ",\"sum\":" << e.snap_.val_
+		   << ",\"min\":" << Min(e.snap_)
+		   << ",\"max\":" << e.snap_.max_;
+
+		if (e.snap_.hist_) {
+			os << ",\"quantiles\":{";
+			for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); ++i) {
+				os << (i ? "," : "") << "\"" << QUANTILES[i].first << "\":"
+				   << e.snap_.hist_->Percentile(QUANTILES[i].second);
+			}
+			os << "}";
+		}
+
+		if (e.hasRates_) {
+			os << ",\"ops_rate\":{";
+			for (int i = 0; i < RateCounter::NWINDOWS; ++i) {
+				os << (i ? "," : "") << "\"" << WINDOWS[i] << "\":" << e.rates_.ops_[i];
+			}
+
+			os << "},\"value_rate\":{";
+			for (int i = 0; i < RateCounter::NWINDOWS; ++i) {
+				os << (i ? "," : "") << "\"" << WINDOWS[i] << "\":" << e.rates_.vals_[i];
+			}
+			os << "}";
+		}
+
+		os << "}";
+		first = false;
+	}
+
+	os << "]}" << endl;
+}
+
+bool
+StatsExporter::Export()
+{
+	/*
+	 * Bring the thread counters up to date
+	 */
+	ThreadStats::SampleAll();
+
+	ostringstream os;
+
+	if (format_ == PROMETHEUS) {
+		WritePrometheus(os);
+	} else {
+		WriteJson(os);
+	}
+
+	static const string UNIX_PREFIX("unix:");
+
+	const bool ok = target_.compare(0, UNIX_PREFIX.size(), UNIX_PREFIX)
+			? WriteFile(target_, os.str())
+			: WriteSocket(target_.substr(UNIX_PREFIX.size()), os.str());
+
+	if (ok) ++nexports_;
+
+	return ok;
+}
+
+bool
+StatsExporter::WriteFile(const string & path, const string & data)
+{
+	const string tmp = path + ".tmp";
+
+	{
+		ofstream out(tmp.c_str(), ios::trunc);
+		out << data;
+		out.close();
+
+		if (!out) {
+			ERROR(log_) << "Unable to write " << tmp;
+			return false;
+		}
+	}
+
+	if (rename(tmp.c_str(), path.c_str())) {
+		ERROR(log_) << "Unable to rename " << tmp << " to " << path << " " << strerror(errno);
+		return false;
+	}
+
+	return true;
+}
+
+bool
+StatsExporter::WriteSocket(const string & path, const string & data)
+{
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		ERROR(log_) << "Socket path too long " << path;
+		return false;
+	}
+
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	fd_t fd = socket(AF_UNIX, SOCK_STREAM, /*protocol=*/ 0);
+	if (fd < 0) {
+		ERROR(log_) << "Unable to create socket " << strerror(errno);
+		return false;
+	}
+
+	if (connect(fd, (sockaddr *) &addr, sizeof(addr))) {
+		/*
+		 * Nobody listening right now, try again next interval
+		 */
+		DEBUG(log_) << "Unable to connect to " << path << " " << strerror(errno);
+		close(fd);
+		return false;
+	}
+
+	size_t off = 0;
+	while (off < data.size()) {
+		const ssize_t n = send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR) continue;
+
+		if (n <= 0) {
+			ERROR(log_) << "Unable to write to " << path << " " << strerror(errno);
+			close(fd);
+			return false;
+		}
+
+		off += n;
+	}
+
+	close(fd);
+	return true;
+}
+
+void *
+StatsExporter::ThreadMain()
+{
+	INFO(log_) << "Exporting stats to " << target_ << " every " << intervalms_ << " ms";
+
+	while (!stop_.load()) {
+		Export();
+
+		const EventCount::key_t key = wakeup_.PrepareWait();
+		if (stop_.load()) {
+			wakeup_.CancelWait();
+			break;
+		}
+
+		RcuOfflineScope offline;
+		wakeup_.CommitWait(key, intervalms_);
+	}
+
+	/*
+	 * Leave the final values behind
+	 */
+	Export();
+
+	return nullptr;
+}
+
+void
+StatsExporter::Stop()
+{
+	/*
+	 * Never started, or stopped already
+	 */
+	if (tid_ == (pthread_t) -1) return;
+
+	stop_.store(true);
+	wakeup_.NotifyAll();
+
+	Join();
+	tid_ = (pthread_t) -1;
+}
@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "defs.h"
+#include "stats-segment.h"
+
+using namespace bblocks;
+
+namespace {
+
+/*
+ * Serializes Open and Close, one caller creates the segment
+ */
+static pthread_mutex_t openLock = PTHREAD_MUTEX_INITIALIZER;
+
+}
+
+//
+// StatsSegment
+//
+
+atomic<StatsSegment *> StatsSegment::instance_(NULL);
+
+bool
+StatsSegment::Open(const string & name, const uint32_t nslots, const uint32_t ncells)
+{
+	pthread_mutex_lock(&openLock);
+	const bool ok = Create(name, nslots, ncells);
+	pthread_mutex_unlock(&openLock);
+
+	return ok;
+}
+
+bool
+StatsSegment::Create(const string & name, const uint32_t nslots, const uint32_t ncells)
+{
+	/*
+	 * Checked under the lock, so the name is never unlinked from under the segment that won
+	 */
+	if (instance_.load()) {
+		errno = EEXIST;
+		return false;
+	}
+
+	const size_t headerSize = 4096;
+	const size_t slotsSize = (size_t) nslots * sizeof(StatSlot);
+	const size_t size = headerSize + slotsSize + (size_t) ncells * sizeof(StatCell);
+
+	/*
+	 * A segment left behind by a previous run of the same name is replaced, readers holding
+	 * the old one see it go stale
+	 */
+	shm_unlink(name.c_str());
+
+	const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, /*mode=*/ 0644);
+	if (fd < 0) return false;
+
+	if (ftruncate(fd, size)) {
+		close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	void * base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, /*off=*/ 0);
+	close(fd);
+
+	if (base == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	StatsSegment * seg = new StatsSegment(name, (uint8_t *) base, size);
+
+	/*
+	 * The memory is zero filled, which is a FREE slot. Only the cell minimums need setting
+	 */
+	StatHeader * h = seg->Header();
+	h->version_ = STAT_VERSION;
+	h->headerSize_ = headerSize;
+	h->slotSize_ = sizeof(StatSlot);
+	h->cellSize_ = sizeof(StatCell);
+	h->nslots_ = nslots;
+	h->ncells_ = ncells;
+	h->slotsOffset_ = headerSize;
+	h->cellsOffset_ = headerSize + slotsSize;
+	h->size_ = size;
+	h->pid_ = getpid();
+
+	timeval tv;
+	gettimeofday(&tv, NULL);
+	h->startms_ = tv.tv_sec * 1000ULL + tv.tv_usec / 1000;
+
+	for (uint32_t i = 0; i < nslots; ++i) {
+		seg->Slots()[i].cell_.Init();
+	}
+
+	h->magic_.store(STAT_MAGIC, memory_order_release);
+
+	instance_.store(seg, memory_order_release);
+
+	return true;
+}
+
+void
+StatsSegment::Close()
+{
+	pthread_mutex_lock(&openLock);
+
+	/*
+	 * The mapping stays, counters created with the segment keep updating it. Only the name
+	 * goes away
+	 */
+	StatsSegment * seg = instance_.exchange(NULL);
+	if (seg) shm_unlink(seg->name_.c_str());
+
+	pthread_mutex_unlock(&openLock);
+}
+
+StatsSegment *
+StatsSegment::OpenFromEnv()
+{
+	static const bool opened = []() {
+		const char * name = getenv("IOCORE_STATS_SHM");
+		return name && *name && Open(name);
+	}();
+
+	return opened ? instance_.load(memory_order_acquire) : NULL;
+}
+
+StatSlot *
+StatsSegment::AllocSlot(const string & name, const string & units, const uint32_t type)
+{
+	StatHeader * h = Header();
+
+	for (uint32_t i = 0; i < h->nslots_; ++i) {
+		StatSlot & slot = Slots()[i];
+
+		uint32_t state = slot.state_.load(memory_order_relaxed);
+		if (state != StatSlot::FREE) continue;
+
+		if (!slot.state_.compare_exchange_strong(state, StatSlot::BUSY)) continue;
+
+		slot.gen_.fetch_add(/*val=*/ 1, memory_order_release);
+
+		slot.type_ = type;
+		slot.shards_.store(0, memory_order_relaxed);
+		strncpy(slot.name_, name.c_str(), StatSlot::NAME_SIZE);
+		strncpy(slot.units_, units.c_str(), StatSlot::UNITS_SIZE);
+		slot.cell_.Init();
+
+		uint32_t used = h->nslotsUsed_.load();
+		while (used < i + 1 && !h->nslotsUsed_.compare_exchange_weak(used, i + 1));
+
+		slot.state_.store(StatSlot::LIVE, memory_order_release);
+		return &slot;
+	}
+
+	/*
+	 * Segment full, the counter keeps its values in the process only
+	 */
+	return NULL;
+}
+
+void
+StatsSegment::FreeSlot(StatSlot * slot)
+{
+	INVARIANT(slot->state_.load() == StatSlot::LIVE);
+
+	slot->gen_.fetch_add(/*val=*/ 1, memory_order_release);
+	slot->state_.store(StatSlot::FREE, memory_order_release);
+
+	/*
+	 * The owner is gone, nobody writes the cells any more. Readers still walking the chain see
+	 * the generation change and drop what they read.
+	 */
+	uint32_t next = slot->shards_.exchange(0, memory_order_relaxed);
+
+	if (!next) return;
+
+	pthread_mutex_lock(&lock_);
+
+	for (uint32_t n = 0; next && n < Header()->ncells_; ++n) {
+		freeCells_.push_back(next - 1);
+		next = Cells()[next - 1].next_.load(memory_order_relaxed);
+	}
+
+	pthread_mutex_unlock(&lock_);
+}
+
+StatCell *
+StatsSegment::AllocCell(StatSlot * slot)
+{
+	StatHeader * h = Header();
+
+	uint32_t idx = UINT32_MAX;
+
+	pthread_mutex_lock(&lock_);
+
+	if (!freeCells_.empty()) {
+		idx = freeCells_.back();
+		freeCells_.pop_back();
+	}
+
+	pthread_mutex_unlock(&lock_);
+
+	if (idx == UINT32_MAX) {
+		idx = h->ncellsUsed_.fetch_add(/*val=*/ 1);
+		if (idx >= h->ncells_) {
+			h->ncellsUsed_.fetch_sub(/*val=*/ 1);
+			return NULL;
+		}
+	}
+
+	StatCell * cell = &Cells()[idx];
+	cell->Init();
+
+	uint32_t next = slot->shards_.load(memory_order_relaxed);
+	do {
+		cell->next_.store(next, memory_order_relaxed);
+	} while (!slot->shards_.compare_exchange_weak(next, idx + 1, memory_order_release));
+
+	return cell;
+}
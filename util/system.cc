@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <utility>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+#include "util.h"
+
+using namespace bblocks;
+
+namespace {
+
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+static uint64_t RawNanoSec()
+{
+	timespec t;
+	int status = clock_gettime(CLOCK_MONOTONIC_RAW, &t);
+	INVARIANT(status == 0);
+
+	return t.tv_sec * 1000ULL * 1000 * 1000 + t.tv_nsec;
+}
+
+static bool HasInvariantTsc()
+{
+	unsigned eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+		return false;
+	}
+
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return edx & (1 << 8);
+}
+
+/*
+ * Read the TSC and the raw clock together. Take the tightest of a few brackets, the clock read
+ * sits halfway between its TSC reads.
+ */
+static void ReadPair(uint64_t & tsc, uint64_t & ns)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int i = 0; i < 8; ++i) {
+		const uint64_t before = Rdtsc::rdtsc();
+		const uint64_t now = RawNanoSec();
+		const uint64_t after = Rdtsc::rdtsc();
+
+		if (after > before && after - before < best) {
+			best = after - before;
+			tsc = before + (after - before) / 2;
+			ns = now;
+		}
+	}
+}
+
+/*
+ * Zero if the TSC did not move
+ */
+static uint64_t CalibrateTsc()
+{
+	uint64_t tsc0 = 0, ns0 = 0, tsc1 = 0, ns1 = 0;
+	ReadPair(tsc0, ns0);
+
+	timespec t = {0, Rdtsc::CALIBRATION_MS * 1000 * 1000};
+	while (nanosleep(&t, &t)) {}
+
+	ReadPair(tsc1, ns1);
+
+	if (tsc1 <= tsc0 || ns1 <= ns0) return 0;
+
+	return ((unsigned __int128) (tsc1 - tsc0) * 1000 * 1000 * 1000) / (ns1 - ns0);
+}
+
+static string Trim(const string & s)
+{
+	const size_t begin = s.find_first_not_of(" \t");
+	if (begin == string::npos) return "";
+
+	return s.substr(begin, s.find_last_not_of(" \t\n") - begin + 1);
+}
+
+/*
+ * "key : value" lines of /proc/cpuinfo, one block per logical CPU
+ */
+static void ReadCpuInfo(SystemInfo & info)
+{
+	ifstream file("/proc/cpuinfo");
+	if (!file.is_open()) return;
+
+	set<uint32_t> sockets;
+	set<pair<uint32_t, uint32_t> > cores;
+	uint32_t socket = 0;
+
+	string line;
+	while (getline(file, line)) {
+		const size_t colon = line.find(':');
+		if (colon == string::npos) continue;
+
+		const string key = Trim(line.substr(0, colon));
+		const string value = Trim(line.substr(colon + 1));
+
+		if (key == "processor") {
+			++info.ncpus_;
+		} else if (key == "cpu MHz" && !info.cpuHz_) {
+			info.cpuHz_ = strtod(value.c_str(), NULL) * 1000 * 1000;
+		} else if (key == "physical id") {
+			socket = strtoul(value.c_str(), NULL, 10);
+			sockets.insert(socket);
+		} else if (key == "core id") {
+			/*
+			 * physical id comes first in a block
+			 */
+			cores.insert(make_pair(socket, (uint32_t) strtoul(value.c_str(), NULL, 10)));
+		}
+	}
+
+	info.nsockets_ = sockets.size();
+	info.ncores_ = cores.size();
+}
+
+static string ReadLine(const string & path)
+{
+	ifstream file(path);
+	string line;
+	if (file.is_open()) getline(file, line);
+
+	return Trim(line);
+}
+
+/*
+ * Sizes as sysfs writes them, 32K, 2048K or 16M
+ */
+static uint64_t ParseSize(const string & s)
+{
+	char * end = NULL;
+	uint64_t size = strtoull(s.c_str(), &end, 10);
+
+	if (end && *end == 'K') size *= 1024;
+	if (end && *end == 'M') size *= 1024 * 1024;
+
+	return size;
+}
+
+static void ReadCaches(SystemInfo & info)
+{
+	const string dir = "/sys/devices/system/cpu/cpu0/cache/";
+
+	for (int i = 0; ; ++i) {
+		const string index = dir + "index" + to_string(i) + "/";
+
+		const string level = ReadLine(index + "level");
+		if (level.empty()) break;
+
+		const string type = ReadLine(index + "type");
+		const uint64_t size = ParseSize(ReadLine(index + "size"));
+
+		if (level == "1" && type == "Data") info.l1d_ = size;
+		if (level == "1" && type == "Instruction") info.l1i_ = size;
+		if (level == "2") info.l2_ = size;
+		if (level == "3") info.l3_ = size;
+
+		if (!info.cacheLine_) {
+			info.cacheLine_ = strtoul(ReadLine(index + "coherency_line_size").c_str(),
+						  NULL, 10);
+		}
+	}
+
+	/*
+	 * glibc knows them from cpuid where sysfs has no cache entries
+	 */
+	if (!info.l1d_) info.l1d_ = sysconf(_SC_LEVEL1_DCACHE_SIZE) > 0
+				    ? sysconf(_SC_LEVEL1_DCACHE_SIZE) : 0;
+	if (!info.l2_) info.l2_ = sysconf(_SC_LEVEL2_CACHE_SIZE) > 0
+				  ? sysconf(_SC_LEVEL2_CACHE_SIZE) : 0;
+	if (!info.l3_) info.l3_ = sysconf(_SC_LEVEL3_CACHE_SIZE) > 0
+				  ? sysconf(_SC_LEVEL3_CACHE_SIZE) : 0;
+	if (!info.cacheLine_) info.cacheLine_ = 64;
+}
+
+static string BootId()
+{
+	return ReadLine("/proc/sys/kernel/random/boot_id");
+}
+
+}
+
+//
+// System
+//
+
+const SystemInfo &
+System::Info()
+{
+	/*
+	 * Thread safe one time initialization, others wait for the first caller
+	 */
+	static const SystemInfo info = []() {
+		const char * path = getenv("IOCORE_SYSTEM_SNAPSHOT");
+
+		SystemInfo info;
+		if (path && *path && LoadSnapshot(path, info)) return info;
+
+		info = Probe();
+		if (path && *path) SaveSnapshot(path, info);
+
+		return info;
+	}();
+
+	return info;
+}
+
+SystemInfo
+System::Probe()
+{
+	SystemInfo info;
+	memset(&info, 0, sizeof(info));
+
+	ReadCpuInfo(info);
+	ReadCaches(info);
+
+	if (!info.ncpus_) info.ncpus_ = sysconf(_SC_NPROCESSORS_ONLN);
+	if (!info.nsockets_) info.nsockets_ = 1;
+	if (!info.ncores_) info.ncores_ = info.ncpus_;
+
+	info.invariantTsc_ = HasInvariantTsc();
+	info.tscHz_ = CalibrateTsc();
+
+	if (!info.tscHz_) {
+		/*
+		 * The TSC did not move, trust neither it nor the measurement
+		 */
+		info.invariantTsc_ = false;
+		info.tscHz_ = info.cpuHz_;
+	}
+
+	INVARIANT(info.tscHz_);
+
+	return info;
+}
+
+bool
+System::LoadSnapshot(const string & path, SystemInfo & info)
+{
+	ifstream file(path);
+	if (!file.is_open()) return false;
+
+	SystemInfo tmp;
+	memset(&tmp, 0, sizeof(tmp));
+
+	uint32_t version = 0;
+	string bootId;
+
+	string line;
+	while (getline(file, line)) {
+		istringstream is(line);
+		string key;
+		is >> key;
+
+		if (key == "version") is >> version;
+		else if (key == "boot_id") is >> bootId;
+		else if (key == "tsc_hz") is >> tmp.tscHz_;
+		else if (key == "invariant_tsc") is >> tmp.invariantTsc_;
+		else if (key == "cpu_hz") is >> tmp.cpuHz_;
+		else if (key == "cpus") is >> tmp.ncpus_;
+		else if (key == "cores") is >> tmp.ncores_;
+		else if (key == "sockets") is >> tmp.nsockets_;
+		else if (key == "cache_line") is >> tmp.cacheLine_;
+		else if (key == "l1d") is >> tmp.l1d_;
+		else if (key == "l1i") is >> tmp.l1i_;
+		else if (key == "l2") is >> tmp.l2_;
+		else if (key == "l3") is >> tmp.l3_;
+	}
+
+	/*
+	 * The TSC rate can differ after a reboot, on another kernel or machine
+	 */
+	if (version != SNAPSHOT_VERSION || bootId.empty() || bootId != BootId()) return false;
+	if (!tmp.tscHz_ || !tmp.ncpus_) return false;
+
+	info = tmp;
+	return true;
+}
+
+bool
+System::SaveSnapshot(const string & path, const SystemInfo & info)
+{
+	/*
+	 * Processes starting together must not read a half written file
+	 */
+	const string tmp = path + "." + to_string(getpid());
+
+	{
+		ofstream file(tmp);
+		if (!file.is_open()) return false;
+
+		file << "version " << SNAPSHOT_VERSION << endl
+		     << "boot_id " << BootId() << endl
+		     << "tsc_hz " << info.tscHz_ << endl
+		     << "invariant_tsc " << info.invariantTsc_ << endl
+		     << "cpu_hz " << info.cpuHz_ << endl
+		     << "cpus " << info.ncpus_ << endl
+		     << "cores " << info.ncores_ << endl
+		     << "sockets " << info.nsockets_ << endl
+		     << "cache_line " << info.cacheLine_ << endl
+		     << "l1d " << info.l1d_ << endl
+		     << "l1i " << info.l1i_ << endl
+		     << "l2 " << info.l2_ << endl
+		     << "l3 " << info.l3_ << endl;
+
+		if (!file.good()) {
+			unlink(tmp.c_str());
+			return false;
+		}
+	}
+
+	if (rename(tmp.c_str(), path.c_str())) {
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	return true;
+}
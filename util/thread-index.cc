@@ -0,0 +1,80 @@
+#include <pthread.h>
+#include <bitset>
+
+#include "thread-index.h"
+
+using namespace bblocks;
+
+namespace {
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static bitset<ThreadIndex::MAX_THREADS> inuse;
+
+}
+
+//
+// ThreadIndex
+//
+
+__thread uint32_t ThreadIndex::index_;
+__thread uint64_t ThreadIndex::serial_;
+atomic<uint32_t> ThreadIndex::highWater_(/*val=*/ 0);
+atomic<uint64_t> ThreadIndex::nextSerial_(/*val=*/ 1);
+
+ThreadIndex::Holder::Holder()
+	: idx_(MAX_THREADS)
+	, serial_(0)
+{
+	pthread_mutex_lock(&lock);
+
+	for (uint32_t i = 0; i < MAX_THREADS; ++i) {
+		if (!inuse[i]) {
+			inuse[i] = true;
+			idx_ = i;
+			serial_ = nextSerial_.fetch_add(/*val=*/ 1);
+			break;
+		}
+	}
+
+	if (idx_ != MAX_THREADS && idx_ >= highWater_.load()) {
+		highWater_.store(idx_ + 1, memory_order_release);
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+ThreadIndex::Holder::~Holder()
+{
+	/*
+	 * Destructors of other thread locals may still update per thread slots, send them to
+	 * the shared slot from here on
+	 */
+	index_ = MAX_THREADS + 1;
+	serial_ = 0;
+
+	if (idx_ == MAX_THREADS) return;
+
+	pthread_mutex_lock(&lock);
+	inuse[idx_] = false;
+	pthread_mutex_unlock(&lock);
+}
+
+uint32_t
+ThreadIndex::Assign()
+{
+	static thread_local Holder holder;
+
+	index_ = holder.idx_ + 1;
+	serial_ = holder.serial_;
+	return holder.idx_;
+}
+
+uint32_t
+ThreadIndex::Count()
+{
+	pthread_mutex_lock(&lock);
+	const uint32_t count = inuse.count();
+	pthread_mutex_unlock(&lock);
+
+	return count;
+}
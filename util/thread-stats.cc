@@ -0,0 +1,266 @@
+#include <pthread.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <list>
+
+#include "thread-stats.h"
+
+using namespace bblocks;
+
+namespace {
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Under the lock, never destroyed as threads can be destroyed from static destructors
+ */
+static list<ThreadStats *> & All()
+{
+	static list<ThreadStats *> * all = new list<ThreadStats *>();
+	return *all;
+}
+
+static uint64_t ToMicroSec(const uint64_t cycles)
+{
+	return Rdtsc::ToMicroSec(cycles);
+}
+
+static uint32_t Delta(const uint64_t now, const uint64_t last)
+{
+	if (now <= last) return 0;
+	return now - last > UINT32_MAX ? UINT32_MAX : now - last;
+}
+
+}
+
+//
+// ThreadStats
+//
+
+__thread ThreadStats * ThreadStats::current_ = NULL;
+
+ThreadStats::ThreadStats(const string & name, const uint32_t windowms)
+	: name_(name)
+	, windowCycles_(System::GetHz() / 1000 * windowms)
+	, rusageCycles_(System::GetHz() / 1000 * RUSAGE_INTERVAL_MS)
+	, seq_(0)
+	, startTsc_(0)
+	, exitTsc_(0)
+	, idleCycles_(0)
+	, idleSince_(0)
+	, nvcsw_(0)
+	, nivcsw_(0)
+	, exitCpuUs_(0)
+	, lastRusage_(0)
+	, hasClock_(false)
+	, npoints_(0)
+	, utilization_(0)
+	, busyTime_(name + "/busy-time", "microsec", PerfCounter::TIME, PerfCounter::WINDOWED)
+	, idleTime_(name + "/idle-time", "microsec", PerfCounter::TIME, PerfCounter::WINDOWED)
+	, cpuTime_(name + "/cpu-time", "microsec", PerfCounter::TIME, PerfCounter::WINDOWED)
+	, voluntary_(name + "/ctx-switches/voluntary", "switches", PerfCounter::COUNTER)
+	, involuntary_(name + "/ctx-switches/involuntary", "switches", PerfCounter::COUNTER)
+	, utilizationStat_(name + "/utilization", "percent", PerfCounter::COUNTER,
+			   PerfCounter::HISTOGRAM | PerfCounter::WINDOWED)
+{
+	memset(&last_, 0, sizeof(last_));
+
+	pthread_mutex_lock(&lock);
+	All().push_back(this);
+	pthread_mutex_unlock(&lock);
+}
+
+ThreadStats::~ThreadStats()
+{
+	pthread_mutex_lock(&lock);
+	All().remove(this);
+	pthread_mutex_unlock(&lock);
+
+	if (current_ == this) current_ = NULL;
+}
+
+void
+ThreadStats::Attach()
+{
+	const uint64_t now = Rdtsc::rdtsc();
+
+	pthread_mutex_lock(&lock);
+	hasClock_ = !pthread_getcpuclockid(pthread_self(), &clock_);
+	pthread_mutex_unlock(&lock);
+
+	BeginUpdate();
+	startTsc_.store(now, memory_order_relaxed);
+	EndUpdate();
+
+	ReadRusage(now);
+	current_ = this;
+}
+
+void
+ThreadStats::Detach()
+{
+	INVARIANT(current_ == this);
+
+	const uint64_t now = Rdtsc::rdtsc();
+	ReadRusage(now);
+
+	timespec t;
+	const int status = clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	INVARIANT(!status);
+
+	/*
+	 * The clock goes away with the thread, samplers use the last reading from here on
+	 */
+	pthread_mutex_lock(&lock);
+	exitCpuUs_.store(t.tv_sec * 1000 * 1000 + t.tv_nsec / 1000);
+	hasClock_ = false;
+	pthread_mutex_unlock(&lock);
+
+	BeginUpdate();
+	exitTsc_.store(now, memory_order_relaxed);
+	EndUpdate();
+
+	current_ = NULL;
+}
+
+void
+ThreadStats::ReadRusage(const uint64_t now)
+{
+	rusage ru;
+	if (getrusage(RUSAGE_THREAD, &ru)) return;
+
+	nvcsw_.store(ru.ru_nvcsw, memory_order_relaxed);
+	nivcsw_.store(ru.ru_nivcsw, memory_order_relaxed);
+	lastRusage_ = now;
+}
+
+ThreadStats::Times
+ThreadStats::DoRead(const uint64_t now, uint64_t & end, uint64_t & busy) const
+{
+	uint64_t start, exit, idle, since;
+
+	for (;;) {
+		const uint64_t seq = seq_.load(memory_order_acquire);
+		if (seq & 1) continue;
+
+		start = startTsc_.load(memory_order_relaxed);
+		exit = exitTsc_.load(memory_order_relaxed);
+		idle = idleCycles_.load(memory_order_relaxed);
+		since = idleSince_.load(memory_order_relaxed);
+
+		atomic_thread_fence(memory_order_acquire);
+		if (seq_.load(memory_order_relaxed) == seq) break;
+	}
+
+	Times t;
+	memset(&t, 0, sizeof(t));
+
+	end = busy = 0;
+	if (!start) return t;
+
+	end = exit ? exit : now;
+
+	/*
+	 * The TSCs of the cores can be slightly apart
+	 */
+	if (since && end > since) idle += end - since;
+
+	const uint64_t wall = end > start ? end - start : 0;
+	busy = wall > idle ? wall - idle : 0;
+
+	t.busyus_ = ToMicroSec(busy);
+	t.idleus_ = ToMicroSec(wall - busy);
+	t.nvcsw_ = nvcsw_.load(memory_order_relaxed);
+	t.nivcsw_ = nivcsw_.load(memory_order_relaxed);
+
+	timespec ts;
+	if (hasClock_ && !clock_gettime(clock_, &ts)) {
+		t.cpuus_ = ts.tv_sec * 1000 * 1000 + ts.tv_nsec / 1000;
+	} else {
+		t.cpuus_ = exitCpuUs_.load();
+	}
+
+	return t;
+}
+
+ThreadStats::Times
+ThreadStats::Read() const
+{
+	uint64_t end, busy;
+
+	pthread_mutex_lock(&lock);
+	const Times t = DoRead(Rdtsc::rdtsc(), end, busy);
+	pthread_mutex_unlock(&lock);
+
+	return t;
+}
+
+void
+ThreadStats::DoSample()
+{
+	/*
+	 * The thread itself can read its context switches now
+	 */
+	if (current_ == this) ReadRusage(Rdtsc::rdtsc());
+
+	uint64_t end, busy;
+	const Times t = DoRead(Rdtsc::rdtsc(), end, busy);
+	if (!end) return;
+
+	busyTime_.Update(Delta(t.busyus_, last_.busyus_));
+	idleTime_.Update(Delta(t.idleus_, last_.idleus_));
+	cpuTime_.Update(Delta(t.cpuus_, last_.cpuus_));
+	voluntary_.Update(Delta(t.nvcsw_, last_.nvcsw_));
+	involuntary_.Update(Delta(t.nivcsw_, last_.nivcsw_));
+
+	last_ = t;
+
+	/*
+	 * Utilization since the newest sample at least a window old. If there is none, since the
+	 * start of the thread, or the oldest sample kept.
+	 */
+	Point from = { startTsc_.load(memory_order_relaxed), /*busy=*/ 0 };
+
+	const uint64_t n = npoints_ < NSAMPLES ? npoints_ : NSAMPLES;
+	for (uint64_t i = 1; i <= n; ++i) {
+		const Point & p = points_[(npoints_ - i) % NSAMPLES];
+		if (p.tsc_ + windowCycles_ <= end || (i == n && n == NSAMPLES)) {
+			from = p;
+			break;
+		}
+	}
+
+	points_[npoints_++ % NSAMPLES] = Point{end, busy};
+
+	if (end > from.tsc_ && busy >= from.busy_) {
+		const double pct = 100.0 * (busy - from.busy_) / (end - from.tsc_);
+		utilization_.store(uint64_t(pct * 100 + 0.5));
+		utilizationStat_.Update(uint32_t(pct + 0.5));
+	}
+}
+
+void
+ThreadStats::Sample()
+{
+	pthread_mutex_lock(&lock);
+	DoSample();
+	pthread_mutex_unlock(&lock);
+}
+
+void
+ThreadStats::SampleAll()
+{
+	pthread_mutex_lock(&lock);
+
+	for (auto stats : All()) {
+		stats->DoSample();
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+double
+ThreadStats::Utilization() const
+{
+	return utilization_.load() / 100.0;
+}
@@ -1,5 +1,10 @@
 #include "thread.h"
 #include "thread-ctx.h"
+#include "trace.h"
+#include "sampling-profiler.h"
+#include "wait-profiler.h"
+#include "thread-stats.h"
+#include "usdt.h"
 
 using namespace bblocks;
 
@@ -8,6 +13,17 @@ Thread::~Thread()
 	Destroy();
 }
 
+void
+Thread::Start()
+{
+	if (!stats_) stats_ = new ThreadStats(log_);
+
+	int ok = pthread_create(&tid_, /*attr=*/ NULL, ThFn, (void *)this);
+	INVARIANT(!ok);
+
+	INFO(log_) << "Thread " << tid_ << " created.";
+}
+
 void
 Thread::Destroy()
 {
@@ -23,9 +39,27 @@ Thread::Destroy()
 		ctx_pool_ = NULL;
 	}
 
+	delete stats_;
+	stats_ = NULL;
+
 	INFO(log_) << "Thread " << tid_ << " destroyed.";
 }
 
+void
+Thread::Exiting(void * args)
+{
+	/*
+	 * Whatever other threads look at must be let go of here, a cancelled thread does not get to
+	 * ThreadCtx::Cleanup
+	 */
+	((Thread *) args)->stats_->Detach();
+	SamplingProfiler::UnregisterThread();
+
+	if (Rcu::IsRegistered()) Rcu::Unregister();
+	if (Hazard::IsRegistered()) Hazard::Unregister();
+	if (Epoch::IsRegistered()) Epoch::Unregister();
+}
+
 void *
 Thread::ThFn(void * args)
 {
@@ -37,13 +71,33 @@ Thread::ThFn(void * args)
 	th->DisableThreadCancellation();
 
 	ThreadCtx::Init(th);
+	Trace::SetThreadName(th->log_);
+	WaitProfiler::SetThreadName(th->log_);
+	SamplingProfiler::RegisterThread();
+	th->stats_->Attach();
+
+	IOCORE_PROBE1(thread_start, th);
 
 	th->EnableThreadCancellation();
 
-	void * thstatus = th->ThreadMain();
+	void * thstatus;
+
+	/*
+	 * The stats and the profiler must let go of the thread's CPU clock, and the thread of its
+	 * reclamation records, even if the thread is cancelled
+	 */
+	pthread_cleanup_push(Exiting, th);
+
+	Trace::Begin(TRACE_THREAD);
+	thstatus = th->ThreadMain();
+	Trace::End(TRACE_THREAD);
+
+	pthread_cleanup_pop(/*execute=*/ 1);
 
 	th->DisableThreadCancellation();
 
+	IOCORE_PROBE1(thread_exit, th);
+
 	ThreadCtx::Cleanup();
 
 	th->EnableThreadCancellation();
@@ -0,0 +1,227 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "timer-wheel.h"
+#include "coarse-clock.h"
+
+using namespace bblocks;
+
+//
+// TimerWheel
+//
+
+TimerWheel::TimerWheel(const uint32_t resolutionms)
+	: resolutionms_(resolutionms)
+	, nowms_(Time::NowInMilliSec())
+	, next_(nowms_ / resolutionms)
+	, size_(0)
+	, running_(false)
+	, fd_(-1)
+	, armed_(NONE)
+{
+	INVARIANT(resolutionms);
+
+	memset(occupied_, 0, sizeof(occupied_));
+}
+
+TimerWheel::~TimerWheel()
+{
+	/*
+	 * Timers outlive the wheel unlinked
+	 */
+	for (uint32_t level = 0; level < NLEVELS; ++level) {
+		for (uint32_t slot = 0; slot < NSLOTS; ++slot) {
+			InList<Timer> & list = slots_[level][slot];
+			while (!list.IsEmpty()) list.Pop()->list_ = NULL;
+		}
+	}
+
+	if (fd_ >= 0) close(fd_);
+}
+
+size_t
+TimerWheel::Advance(const uint64_t nowms)
+{
+	/*
+	 * Timers run from here may not advance the wheel under us
+	 */
+	INVARIANT(!running_);
+
+	if (nowms > nowms_) nowms_ = nowms;
+
+	const uint64_t target = nowms_ / resolutionms_;
+	size_t n = 0;
+
+	while (next_ <= target) {
+		if (!size_) {
+			next_ = target + 1;
+			break;
+		}
+
+		/*
+		 * Skip the empty slots, up to the next round of level 0 at most
+		 */
+		const uint64_t tick = NextTick();
+		if (tick > target) {
+			next_ = target + 1;
+			break;
+		}
+
+		next_ = tick;
+		n += RunTick();
+	}
+
+	return n;
+}
+
+size_t
+TimerWheel::Advance()
+{
+	return Advance(CoarseClock::NowInMilliSec());
+}
+
+uint64_t
+TimerWheel::NextTick() const
+{
+	const uint64_t round = next_ & ~uint64_t(NSLOTS - 1);
+	const uint32_t from = next_ & (NSLOTS - 1);
+
+	/*
+	 * The first tick of a round brings down the levels above, it cannot be skipped
+	 */
+	if (!from) return next_;
+
+	for (uint32_t i = from / 64; i < NSLOTS / 64; ++i) {
+		uint64_t bits = occupied_[i];
+		if (i == from / 64) bits &= ~0ULL << (from % 64);
+
+		if (bits) return round + i * 64 + __builtin_ctzll(bits);
+	}
+
+	return round + NSLOTS;
+}
+
+uint64_t
+TimerWheel::NextExpiry() const
+{
+	if (!size_) return NONE;
+
+	return NextTick() * resolutionms_;
+}
+
+size_t
+TimerWheel::RunTick()
+{
+	const uint32_t slot = next_ & (NSLOTS - 1);
+
+	/*
+	 * A new round of level 0, bring down the next slot of level 1, and of the levels above
+	 * when their round starts too
+	 */
+	if (!slot) {
+		for (uint32_t level = 1; level < NLEVELS && !Cascade(level); ++level) {}
+	}
+
+	/*
+	 * Take the slot aside before running it, timers added from Expired for this tick go to
+	 * the next
+	 */
+	InList<Timer> & list = slots_[0][slot];
+	InList<Timer> expired;
+
+	while (!list.IsEmpty()) {
+		Timer * t = list.Pop();
+		t->list_ = &expired;
+		expired.Push(t);
+	}
+
+	occupied_[slot / 64] &= ~(1ULL << (slot % 64));
+	++next_;
+
+	size_t n = 0;
+
+	running_ = true;
+
+	while (!expired.IsEmpty()) {
+		Timer * t = expired.Pop();
+		t->list_ = NULL;
+		--size_;
+		++n;
+
+		t->Expired();
+	}
+
+	running_ = false;
+
+	return n;
+}
+
+uint32_t
+TimerWheel::Cascade(const uint32_t level)
+{
+	const uint32_t slot = (next_ >> (LEVEL_BITS * level)) & (NSLOTS - 1);
+
+	InList<Timer> & list = slots_[level][slot];
+	while (!list.IsEmpty()) {
+		Timer * t = list.Pop();
+		t->list_ = NULL;
+		Place(t);
+	}
+
+	return slot;
+}
+
+int
+TimerWheel::Fd()
+{
+	if (fd_ >= 0) return fd_;
+
+	fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	INVARIANT(fd_ >= 0);
+
+	Arm();
+
+	return fd_;
+}
+
+void
+TimerWheel::Arm()
+{
+	ASSERT(fd_ >= 0);
+
+	itimerspec its;
+	memset(&its, 0, sizeof(its));
+
+	armed_ = size_ ? NextTick() : NONE;
+
+	/*
+	 * A zero time disarms
+	 */
+	if (armed_ != NONE) {
+		const uint64_t ms = armed_ * resolutionms_;
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000 * 1000;
+	}
+
+	const int status = timerfd_settime(fd_, TFD_TIMER_ABSTIME, &its, /*old=*/ NULL);
+	INVARIANT(!status);
+}
+
+size_t
+TimerWheel::OnFdReadable()
+{
+	ASSERT(fd_ >= 0);
+
+	uint64_t expirations;
+	while (read(fd_, &expirations, sizeof(expirations)) < 0 && errno == EINTR) {}
+
+	/*
+	 * The fd fired for a tick, the coarse clock may not have seen it yet
+	 */
+	const size_t n = Advance(Time::NowInMilliSec());
+	Arm();
+
+	return n;
+}
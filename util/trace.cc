@@ -0,0 +1,388 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "trace.h"
+
+using namespace bblocks;
+
+//
+// Trace::Ring
+//
+
+struct Trace::Ring
+{
+	Ring(const uint32_t nevents)
+		: mask_(nevents - 1)
+		, head_(0)
+		, tail_(0)
+		, events_(new TraceEvent[nevents])
+	{}
+
+	const uint64_t mask_;
+	atomic<uint64_t> head_;		// next event to write
+	atomic<uint64_t> tail_;		// events before it are cleared
+	unique_ptr<TraceEvent[]> events_;
+};
+
+namespace {
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic<uint32_t> nevents(Trace::DEFAULT_NEVENTS);
+
+static __thread uint32_t tid;
+
+/*
+ * Names of the application events and of the threads, by id, under the lock
+ */
+static map<uint16_t, string> & EventNames()
+{
+	static map<uint16_t, string> * names = new map<uint16_t, string>();
+	return *names;
+}
+
+static map<uint32_t, string> & ThreadNames()
+{
+	static map<uint32_t, string> * names = new map<uint32_t, string>();
+	return *names;
+}
+
+static uint32_t GetTid()
+{
+	if (!tid) tid = syscall(SYS_gettid);
+	return tid;
+}
+
+static const char * BuiltinName(const uint16_t id)
+{
+	#define IOCORE_TRACE_NAME(eid, name) if (id == eid) return name;
+	IOCORE_TRACE_EVENTS(IOCORE_TRACE_NAME)
+	#undef IOCORE_TRACE_NAME
+
+	return NULL;
+}
+
+/*
+ * The owner overwrites events while Dump copies them, both sides go field by field with relaxed
+ * atomics. On x86 these are the same plain moves.
+ */
+static void StoreEvent(TraceEvent & e, const TraceEvent & from)
+{
+	__atomic_store_n(&e.tsc_, from.tsc_, __ATOMIC_RELAXED);
+	__atomic_store_n(&e.tid_, from.tid_, __ATOMIC_RELAXED);
+	__atomic_store_n(&e.id_, from.id_, __ATOMIC_RELAXED);
+	__atomic_store_n(&e.type_, from.type_, __ATOMIC_RELAXED);
+	__atomic_store_n(&e.pad_, from.pad_, __ATOMIC_RELAXED);
+	__atomic_store_n(&e.args_[0], from.args_[0], __ATOMIC_RELAXED);
+	__atomic_store_n(&e.args_[1], from.args_[1], __ATOMIC_RELAXED);
+}
+
+static TraceEvent LoadEvent(const TraceEvent & e)
+{
+	TraceEvent to;
+	to.tsc_ = __atomic_load_n(&e.tsc_, __ATOMIC_RELAXED);
+	to.tid_ = __atomic_load_n(&e.tid_, __ATOMIC_RELAXED);
+	to.id_ = __atomic_load_n(&e.id_, __ATOMIC_RELAXED);
+	to.type_ = __atomic_load_n(&e.type_, __ATOMIC_RELAXED);
+	to.pad_ = __atomic_load_n(&e.pad_, __ATOMIC_RELAXED);
+	to.args_[0] = __atomic_load_n(&e.args_[0], __ATOMIC_RELAXED);
+	to.args_[1] = __atomic_load_n(&e.args_[1], __ATOMIC_RELAXED);
+	return to;
+}
+
+template<class T>
+static bool ReadRecord(istream & in, T & t)
+{
+	return (bool) in.read((char *) &t, sizeof(T));
+}
+
+template<class T>
+static void CopyName(T & record, const string & name)
+{
+	memset(record.name_, 0, sizeof(record.name_));
+	strncpy(record.name_, name.c_str(), sizeof(record.name_) - 1);
+}
+
+}
+
+//
+// Trace
+//
+
+atomic<bool> Trace::enabled_(false);
+atomic<Trace::Ring *> Trace::rings_[ThreadIndex::MAX_THREADS];
+
+void
+Trace::Enable(const uint32_t n)
+{
+	INVARIANT(n && !(n & (n - 1)));
+
+	nevents.store(n);
+	enabled_.store(true);
+}
+
+void
+Trace::Disable()
+{
+	enabled_.store(false);
+}
+
+void
+Trace::Record(const uint8_t type, const uint16_t id, const uint64_t arg0, const uint64_t arg1)
+{
+	const uint32_t idx = ThreadIndex::Get();
+	if (idx >= ThreadIndex::MAX_THREADS) return;
+
+	Ring * ring = rings_[idx].load(memory_order_acquire);
+	if (!ring) ring = Attach(idx);
+
+	/*
+	 * Only this thread writes to the ring, the head is published after the event
+	 */
+	const uint64_t head = ring->head_.load(memory_order_relaxed);
+	TraceEvent e;
+	e.tsc_ = Rdtsc::rdtsc();
+	e.tid_ = GetTid();
+	e.id_ = id;
+	e.type_ = type;
+	e.pad_ = 0;
+	e.args_[0] = arg0;
+	e.args_[1] = arg1;
+
+	StoreEvent(ring->events_[head & ring->mask_], e);
+
+	ring->head_.store(head + 1, memory_order_release);
+}
+
+Trace::Ring *
+Trace::Attach(const uint32_t idx)
+{
+	/*
+	 * The index is ours alone, nobody else can be installing a ring for it
+	 */
+	Ring * ring = new Ring(nevents.load());
+	rings_[idx].store(ring, memory_order_release);
+	return ring;
+}
+
+void
+Trace::SetName(const uint16_t id, const string & name)
+{
+	INVARIANT(id >= TRACE_USER && id < TRACE_MAX_ID);
+
+	pthread_mutex_lock(&lock);
+	EventNames()[id] = name;
+	pthread_mutex_unlock(&lock);
+}
+
+string
+Trace::GetName(const uint16_t id)
+{
+	const char * builtin = BuiltinName(id);
+	if (builtin) return builtin;
+
+	pthread_mutex_lock(&lock);
+	auto it = EventNames().find(id);
+	const string name = it != EventNames().end() ? it->second : "event-" + STR(id);
+	pthread_mutex_unlock(&lock);
+
+	return name;
+}
+
+void
+Trace::SetThreadName(const string & name)
+{
+	pthread_mutex_lock(&lock);
+	ThreadNames()[GetTid()] = name;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+Trace::Clear()
+{
+	for (uint32_t i = 0; i < ThreadIndex::MAX_THREADS; ++i) {
+		Ring * ring = rings_[i].load(memory_order_acquire);
+		if (ring) ring->tail_.store(ring->head_.load(memory_order_acquire));
+	}
+}
+
+int64_t
+Trace::Dump(const string & path)
+{
+	vector<TraceEvent> events;
+
+	for (uint32_t i = 0; i < ThreadIndex::MAX_THREADS; ++i) {
+		const Ring * ring = rings_[i].load(memory_order_acquire);
+		if (!ring) continue;
+
+		const uint64_t size = ring->mask_ + 1;
+		const uint64_t head = ring->head_.load(memory_order_acquire);
+		const uint64_t tail = ring->tail_.load();
+
+		uint64_t start = head > size ? head - size : 0;
+		if (start < tail) start = tail;
+
+		const size_t first = events.size();
+		for (uint64_t seq = start; seq < head; ++seq) {
+			events.push_back(LoadEvent(ring->events_[seq & ring->mask_]));
+		}
+
+		/*
+		 * The owner may have lapped us while we copied, drop what it overwrote and the
+		 * slot it may be writing
+		 */
+		const uint64_t now = ring->head_.load(memory_order_acquire);
+		const uint64_t valid = now + 1 > size ? now + 1 - size : 0;
+		if (valid > start) {
+			const uint64_t drop = min(valid - start, (uint64_t) (events.size() - first));
+			events.erase(events.begin() + first, events.begin() + first + drop);
+		}
+	}
+
+	vector<TraceFile::EventName> names;
+	vector<TraceFile::ThreadName> threads;
+
+	for (uint16_t id = 1; id < TRACE_USER; ++id) {
+		const char * name = BuiltinName(id);
+		if (!name) continue;
+
+		TraceFile::EventName n;
+		n.id_ = id;
+		CopyName(n, name);
+		names.push_back(n);
+	}
+
+	pthread_mutex_lock(&lock);
+
+	for (auto & kv : EventNames()) {
+		TraceFile::EventName n;
+		n.id_ = kv.first;
+		CopyName(n, kv.second);
+		names.push_back(n);
+	}
+
+	for (auto & kv : ThreadNames()) {
+		TraceFile::ThreadName t;
+		t.tid_ = kv.first;
+		CopyName(t, kv.second);
+		threads.push_back(t);
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	TraceFile::Header h;
+	memset(&h, 0, sizeof(h));
+	h.magic_ = TraceFile::MAGIC;
+	h.version_ = TraceFile::VERSION;
+	h.eventSize_ = sizeof(TraceEvent);
+	h.hz_ = System::GetHz();
+	h.pid_ = getpid();
+	h.nnames_ = names.size();
+	h.nthreads_ = threads.size();
+	h.nevents_ = events.size();
+
+	ofstream out(path.c_str(), ios::binary | ios::trunc);
+	out.write((const char *) &h, sizeof(h));
+	out.write((const char *) names.data(), names.size() * sizeof(TraceFile::EventName));
+	out.write((const char *) threads.data(), threads.size() * sizeof(TraceFile::ThreadName));
+	out.write((const char *) events.data(), events.size() * sizeof(TraceEvent));
+	out.close();
+
+	return out ? (int64_t) events.size() : -1;
+}
+
+//
+// TraceFile
+//
+
+string
+TraceFile::ToChromeJson(istream & in, ostream & out)
+{
+	Header h;
+	if (!ReadRecord(in, h) || h.magic_ != MAGIC) return "not a trace file";
+
+	if (h.version_ != VERSION || h.eventSize_ != sizeof(TraceEvent) || !h.hz_) {
+		return "unsupported trace file version";
+	}
+
+	map<uint32_t, string> names;
+	for (uint32_t i = 0; i < h.nnames_; ++i) {
+		EventName n;
+		if (!ReadRecord(in, n)) return "truncated trace file";
+		names[n.id_] = string(n.name_, strnlen(n.name_, sizeof(n.name_)));
+	}
+
+	vector<ThreadName> threads(h.nthreads_);
+	for (auto & t : threads) {
+		if (!ReadRecord(in, t)) return "truncated trace file";
+	}
+
+	vector<TraceEvent> events(h.nevents_);
+	for (auto & e : events) {
+		if (!ReadRecord(in, e)) return "truncated trace file";
+	}
+
+	/*
+	 * Each thread's events are in order already, the viewers want them in time order
+	 */
+	stable_sort(events.begin(), events.end(),
+		    [](const TraceEvent & a, const TraceEvent & b) { return a.tsc_ < b.tsc_; });
+
+	const uint64_t base = events.empty() ? 0 : events.front().tsc_;
+	const double cyclesPerUs = h.hz_ / 1e6;
+
+	out << "{\"traceEvents\":[";
+
+	bool first = true;
+	for (auto & t : threads) {
+		out << (first ? "" : ",") << "\n"
+		    << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << h.pid_
+		    << ",\"tid\":" << t.tid_
+		    << ",\"args\":{\"name\":"
+		    << Json::Quote(string(t.name_, strnlen(t.name_, sizeof(t.name_)))) << "}}";
+		first = false;
+	}
+
+	static const char * phases[] = { "B", "E", "i", "C" };
+
+	out << fixed << setprecision(3);
+
+	for (auto & e : events) {
+		if (e.type_ > TraceEvent::COUNTER) continue;
+
+		auto it = names.find(e.id_);
+		const string name = it != names.end() ? it->second : "event-" + STR(e.id_);
+
+		out << (first ? "" : ",") << "\n"
+		    << "{\"name\":" << Json::Quote(name)
+		    << ",\"cat\":\"iocore\",\"ph\":\"" << phases[e.type_] << "\""
+		    << ",\"ts\":" << (e.tsc_ - base) / cyclesPerUs
+		    << ",\"pid\":" << h.pid_ << ",\"tid\":" << e.tid_;
+
+		if (e.type_ == TraceEvent::INSTANT) out << ",\"s\":\"t\"";
+
+		if (e.type_ == TraceEvent::COUNTER) {
+			/*
+			 * Counters of different sources, queues for one, are told apart by id
+			 */
+			if (e.args_[1]) out << ",\"id\":\"" << hex << e.args_[1] << dec << "\"";
+			out << ",\"args\":{\"value\":" << e.args_[0] << "}";
+		} else if (e.args_[0] || e.args_[1]) {
+			out << ",\"args\":{\"arg0\":" << e.args_[0]
+			    << ",\"arg1\":" << e.args_[1] << "}";
+		}
+
+		out << "}";
+		first = false;
+	}
+
+	out << "\n],\"displayTimeUnit\":\"ns\"}\n";
+
+	return out ? string() : "write error";
+}
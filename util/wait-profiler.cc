@@ -0,0 +1,292 @@
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <tuple>
+#include <unordered_map>
+
+#include "wait-profiler.h"
+#include "lock-profiler.h"
+
+using namespace bblocks;
+
+namespace {
+
+struct SiteKey
+{
+	bool operator==(const SiteKey & rhs) const
+	{
+		return kind_ == rhs.kind_ && name_ == rhs.name_ && site_ == rhs.site_;
+	}
+
+	int kind_;
+	const string * name_;
+	void * site_;
+};
+
+struct SiteKeyHash
+{
+	size_t operator()(const SiteKey & key) const
+	{
+		return hash<uint64_t>()(((uintptr_t) key.name_ * 31 + (uintptr_t) key.site_) * 31
+					+ key.kind_);
+	}
+};
+
+typedef unordered_map<SiteKey, WaitStat *, SiteKeyHash> cache_t;
+typedef tuple<int, string, void *, uint32_t, string> key_t;
+typedef map<key_t, WaitStat *> registry_t;
+
+/*
+ * Stale entries of destroyed queues and locks are never hit again, drop them once in a while
+ */
+static const size_t MAX_CACHE_SIZE = 4096;
+
+struct ThreadState
+{
+	ThreadState() : tid_(syscall(SYS_gettid)) {}
+
+	const uint32_t tid_;
+	string name_;
+	cache_t cache_;
+};
+
+static thread_local ThreadState state;
+
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+static registry_t & Registry()
+{
+	/*
+	 * Never destroyed, waits can happen in static destructors
+	 */
+	static registry_t * registry = new registry_t();
+	return *registry;
+}
+
+static double ToMicroSec(const uint64_t cycles)
+{
+	return cycles / (System::GetHz() / double(1000 * 1000));
+}
+
+static const char * kindNames[WAIT_NKINDS] = { "queue", "lock", "cond", "io", "other" };
+
+/*
+ * Histograms of the stats grouped by a label, and the per kind totals of each group
+ */
+struct Group
+{
+	Group() : hist_(WaitStat::DIGITS)
+	{
+		for (int i = 0; i < WAIT_NKINDS; ++i) {
+			us_[i] = 0;
+		}
+	}
+
+	void Add(const WaitStat & stat)
+	{
+		hist_.Merge(stat.hist_);
+		us_[stat.kind_] += stat.hist_.Sum();
+	}
+
+	string label_;
+	Histogram hist_;
+	uint64_t us_[WAIT_NKINDS];
+};
+
+}
+
+//
+// WaitProfiler
+//
+
+atomic<bool> WaitProfiler::enabled_(/*enabled=*/ false);
+
+void
+WaitProfiler::Enable()
+{
+	/*
+	 * Load hz now rather than on the first wait
+	 */
+	System::GetHz();
+	enabled_.store(true);
+}
+
+const char *
+WaitProfiler::KindName(const WaitKind kind)
+{
+	INVARIANT(kind < WAIT_NKINDS);
+	return kindNames[kind];
+}
+
+void
+WaitProfiler::SetThreadName(const string & name)
+{
+	state.name_ = name;
+	state.cache_.clear();
+}
+
+void
+WaitProfiler::Add(const WaitKind kind, const string & name, void * site, const uint64_t cycles)
+{
+	const SiteKey key{kind, &name, site};
+
+	WaitStat * stat;
+
+	auto it = state.cache_.find(key);
+	if (it != state.cache_.end() && it->second->name_ == name) {
+		stat = it->second;
+	} else {
+		if (state.cache_.size() >= MAX_CACHE_SIZE) state.cache_.clear();
+
+		pthread_mutex_lock(&registryLock);
+
+		WaitStat *& s = Registry()[make_tuple(int(kind), name, site, state.tid_, state.name_)];
+		if (!s) s = new WaitStat(kind, name, site, state.tid_, state.name_);
+		stat = s;
+
+		pthread_mutex_unlock(&registryLock);
+
+		state.cache_[key] = stat;
+	}
+
+	stat->hist_.Record(ToMicroSec(cycles));
+}
+
+vector<WaitStat *>
+WaitProfiler::Snapshot()
+{
+	vector<WaitStat *> stats;
+
+	pthread_mutex_lock(&registryLock);
+	for (auto & kv : Registry()) {
+		stats.push_back(kv.second);
+	}
+	pthread_mutex_unlock(&registryLock);
+
+	return stats;
+}
+
+Histogram
+WaitProfiler::GetHistogram(const WaitKind kind, const string & name, const string & thread)
+{
+	Histogram hist(WaitStat::DIGITS);
+
+	for (auto stat : Snapshot()) {
+		if (stat->kind_ != kind) continue;
+		if (!name.empty() && stat->name_ != name) continue;
+		if (!thread.empty() && stat->thread_ != thread) continue;
+
+		hist.Merge(stat->hist_);
+	}
+
+	return hist;
+}
+
+void
+WaitProfiler::Reset()
+{
+	for (auto stat : Snapshot()) {
+		stat->hist_.Reset();
+	}
+}
+
+void
+WaitProfiler::Dump(ostream & os, const size_t top)
+{
+	map<int, Group> kinds;
+	map<tuple<int, string, void *>, Group> sites;
+	map<pair<uint32_t, string>, Group> threads;
+
+	for (auto stat : Snapshot()) {
+		if (!stat->hist_.Count()) continue;
+
+		kinds[stat->kind_].Add(*stat);
+
+		Group & site = sites[make_tuple(int(stat->kind_), stat->name_, stat->site_)];
+		if (site.label_.empty()) {
+			site.label_ = string(KindName(stat->kind_)) + " " + stat->name_ + " "
+				      + LockProfiler::SiteName(stat->site_);
+		}
+		site.Add(*stat);
+
+		Group & thread = threads[make_pair(stat->tid_, stat->thread_)];
+		if (thread.label_.empty()) {
+			thread.label_ = (stat->thread_.empty() ? "thread" : stat->thread_)
+					+ "[" + STR(stat->tid_) + "]";
+		}
+		thread.Add(*stat);
+	}
+
+	auto byTotal = [](const Group * lhs, const Group * rhs) {
+		return lhs->hist_.Sum() > rhs->hist_.Sum();
+	};
+
+	auto print = [&os](const vector<const Group *> & groups, const size_t top,
+			   const char * title) {
+		os << setw(48) << left << title
+		   << setw(10) << right << "waits"
+		   << setw(14) << "total-us"
+		   << setw(12) << "mean-us"
+		   << setw(12) << "p50-us"
+		   << setw(12) << "p99-us"
+		   << setw(12) << "max-us" << endl;
+
+		for (size_t i = 0; i < groups.size() && i < top; ++i) {
+			const Histogram & h = groups[i]->hist_;
+			os << setw(48) << left << groups[i]->label_
+			   << setw(10) << right << h.Count()
+			   << setw(14) << h.Sum()
+			   << setw(12) << uint64_t(h.Mean())
+			   << setw(12) << h.Percentile(50)
+			   << setw(12) << h.Percentile(99)
+			   << setw(12) << h.Max() << endl;
+		}
+	};
+
+	vector<const Group *> byKind;
+	for (auto & kv : kinds) {
+		kv.second.label_ = KindName(WaitKind(kv.first));
+		byKind.push_back(&kv.second);
+	}
+
+	vector<const Group *> bySite;
+	for (auto & kv : sites) {
+		bySite.push_back(&kv.second);
+	}
+
+	vector<const Group *> byThread;
+	for (auto & kv : threads) {
+		byThread.push_back(&kv.second);
+	}
+
+	sort(byKind.begin(), byKind.end(), byTotal);
+	sort(bySite.begin(), bySite.end(), byTotal);
+	sort(byThread.begin(), byThread.end(), byTotal);
+
+	os << "Blocked time by kind" << endl;
+	print(byKind, WAIT_NKINDS, "kind");
+
+	os << "Blocked time by wait site (top " << top << ")" << endl;
+	print(bySite, top, "site");
+
+	/*
+	 * Per thread, where the blocked time went
+	 */
+	os << "Blocked time by thread (top " << top << ")" << endl;
+	os << setw(48) << left << "thread" << right;
+	for (int i = 0; i < WAIT_NKINDS; ++i) {
+		os << setw(12) << string(kindNames[i]) + "-us";
+	}
+	os << setw(14) << "total-us" << endl;
+
+	for (size_t i = 0; i < byThread.size() && i < top; ++i) {
+		os << setw(48) << left << byThread[i]->label_ << right;
+		for (int k = 0; k < WAIT_NKINDS; ++k) {
+			os << setw(12) << byThread[i]->us_[k];
+		}
+		os << setw(14) << byThread[i]->hist_.Sum() << endl;
+	}
+}